@@ -0,0 +1,244 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/bitstring.h>
+#include <sys/ioctl.h>
+
+#include <dev/evdev/input.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evdev-caps.h"
+
+/*
+ * bitstr_t implementation must be identical to one found in EVIOCG*
+ * libevdev ioctls. Our bitstring(3) API is compatible since r299090.
+ */
+_Static_assert(sizeof(bitstr_t) == sizeof(unsigned long),
+    "bitstr_t size mismatch");
+
+static bitstr_t *
+caps_bits(struct evdev_caps *caps, u_int type, size_t *nbits)
+{
+	switch (type) {
+	case EV_KEY:
+		*nbits = KEY_CNT;
+		return (caps->key_bits);
+	case EV_REL:
+		*nbits = REL_CNT;
+		return (caps->rel_bits);
+	case EV_ABS:
+		*nbits = ABS_CNT;
+		return (caps->abs_bits);
+	default:
+		return (NULL);
+	}
+}
+
+int
+evdev_caps_fetch(int fd, struct evdev_caps *caps)
+{
+	int code;
+
+	memset(caps, 0, sizeof(*caps));
+
+	if (ioctl(fd, EVIOCGBIT(EV_REL, sizeof(caps->rel_bits)),
+	    caps->rel_bits) < 0 ||
+	    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(caps->abs_bits)),
+	    caps->abs_bits) < 0 ||
+	    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(caps->key_bits)),
+	    caps->key_bits) < 0 ||
+	    ioctl(fd, EVIOCGPROP(sizeof(caps->prop_bits)),
+	    caps->prop_bits) < 0)
+		return (errno);
+	if (ioctl(fd, EVIOCGNAME(sizeof(caps->name) - 1), caps->name) < 0)
+		return (errno);
+	if (ioctl(fd, EVIOCGID, &caps->id) < 0)
+		return (errno);
+	(void)ioctl(fd, EVIOCGUNIQ(sizeof(caps->uniq) - 1), caps->uniq);
+
+	/* An axis without limits leaves its absinfo zeroed, not the device */
+	for (code = 0; code < ABS_CNT; code++) {
+		if (!bit_test(caps->abs_bits, code))
+			continue;
+		if (ioctl(fd, EVIOCGABS(code), &caps->absinfo[code]) < 0)
+			memset(&caps->absinfo[code], 0,
+			    sizeof(caps->absinfo[code]));
+	}
+
+	return (0);
+}
+
+/* Dump bitmap as evemu-style lines with up to 8 bytes per line */
+static void
+caps_write_bits(FILE *fp, const char *tag, int type, const bitstr_t *bits,
+    size_t nbits)
+{
+	size_t byte, bit;
+	u_int val;
+
+	for (byte = 0; byte < howmany(nbits, 8); byte++) {
+		if (byte % 8 == 0) {
+			if (type >= 0)
+				fprintf(fp, "%s: %02x", tag, type);
+			else
+				fprintf(fp, "%s:", tag);
+		}
+		val = 0;
+		for (bit = 0; bit < 8 && byte * 8 + bit < nbits; bit++)
+			if (bit_test(bits, byte * 8 + bit))
+				val |= 1 << bit;
+		fprintf(fp, " %02x", val);
+		if (byte % 8 == 7 || byte == howmany(nbits, 8) - 1)
+			fputc('\n', fp);
+	}
+}
+
+int
+evdev_caps_write(FILE *fp, const struct evdev_caps *caps)
+{
+	const struct input_absinfo *ai;
+	int code;
+
+	fprintf(fp, "# moused device capabilities\n");
+	fprintf(fp, "N: %s\n", caps->name);
+	fprintf(fp, "U: %s\n", caps->uniq);
+	fprintf(fp, "I: %04x %04x %04x %04x\n", caps->id.bustype,
+	    caps->id.vendor, caps->id.product, caps->id.version);
+	caps_write_bits(fp, "P", -1, caps->prop_bits, INPUT_PROP_CNT);
+	caps_write_bits(fp, "B", EV_KEY, caps->key_bits, KEY_CNT);
+	caps_write_bits(fp, "B", EV_REL, caps->rel_bits, REL_CNT);
+	caps_write_bits(fp, "B", EV_ABS, caps->abs_bits, ABS_CNT);
+	for (code = 0; code < ABS_CNT; code++) {
+		if (!bit_test(caps->abs_bits, code))
+			continue;
+		ai = &caps->absinfo[code];
+		fprintf(fp, "A: %02x %d %d %d %d %d\n", code, ai->minimum,
+		    ai->maximum, ai->fuzz, ai->flat, ai->resolution);
+	}
+
+	return (ferror(fp) ? EIO : 0);
+}
+
+/* Parse up to 8 hex bytes and merge them into bitmap at given offset */
+static void
+caps_read_bits(const char *s, bitstr_t *bits, size_t nbits, size_t *offset)
+{
+	char *end;
+	u_long val;
+	size_t bit;
+
+	for (;;) {
+		val = strtoul(s, &end, 16);
+		if (end == s)
+			break;
+		for (bit = 0; bit < 8; bit++)
+			if ((val & (1 << bit)) != 0 && *offset + bit < nbits)
+				bit_set(bits, *offset + bit);
+		*offset += 8;
+		s = end;
+	}
+}
+
+/*
+ * Read snapshot written by evdev_caps_write().  Reading stops at the
+ * first line which is not part of device description, e.g. an event.
+ */
+int
+evdev_caps_read(FILE *fp, struct evdev_caps *caps)
+{
+	char line[256];
+	struct input_absinfo ai;
+	size_t offset[EV_CNT], prop_offset, nbits;
+	bitstr_t *bits;
+	u_int type, code;
+	u_int bus, vendor, product, version;
+	int n, c;
+
+	memset(caps, 0, sizeof(*caps));
+	memset(offset, 0, sizeof(offset));
+	prop_offset = 0;
+
+	while ((c = fgetc(fp)) != EOF) {
+		ungetc(c, fp);
+		if (c != '#' && c != 'N' && c != 'U' && c != 'I' &&
+		    c != 'P' && c != 'B' && c != 'A')
+			break;
+		if (fgets(line, sizeof(line), fp) == NULL)
+			break;
+		line[strcspn(line, "\n")] = '\0';
+
+		switch (line[0]) {
+		case 'N':
+			if (line[1] == ':' && line[2] == ' ')
+				strlcpy(caps->name, line + 3,
+				    sizeof(caps->name));
+			break;
+		case 'U':
+			if (line[1] == ':' && line[2] == ' ')
+				strlcpy(caps->uniq, line + 3,
+				    sizeof(caps->uniq));
+			break;
+		case 'I':
+			if (sscanf(line, "I: %x %x %x %x", &bus, &vendor,
+			    &product, &version) != 4)
+				return (EFTYPE);
+			caps->id.bustype = bus;
+			caps->id.vendor = vendor;
+			caps->id.product = product;
+			caps->id.version = version;
+			break;
+		case 'P':
+			caps_read_bits(line + 2, caps->prop_bits,
+			    INPUT_PROP_CNT, &prop_offset);
+			break;
+		case 'B':
+			if (sscanf(line, "B: %x%n", &type, &n) != 1 ||
+			    type >= EV_CNT)
+				return (EFTYPE);
+			bits = caps_bits(caps, type, &nbits);
+			if (bits != NULL)
+				caps_read_bits(line + n, bits, nbits,
+				    &offset[type]);
+			break;
+		case 'A':
+			memset(&ai, 0, sizeof(ai));
+			if (sscanf(line, "A: %x %d %d %d %d %d", &code,
+			    &ai.minimum, &ai.maximum, &ai.fuzz, &ai.flat,
+			    &ai.resolution) < 5 || code >= ABS_CNT)
+				return (EFTYPE);
+			caps->absinfo[code] = ai;
+			break;
+		}
+	}
+
+	return (ferror(fp) ? EIO : 0);
+}
@@ -0,0 +1,60 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef EVDEV_CAPS_H
+#define EVDEV_CAPS_H
+
+#include <sys/types.h>
+#include <sys/bitstring.h>
+
+#include <dev/evdev/input.h>
+
+#include <stdio.h>
+
+/*
+ * Snapshot of evdev device capabilities.  It is filled once per open
+ * and used for identification, quirk matching and initialization.
+ * The snapshot can be written to and read back from a text stream in
+ * a format derived from evemu(1) device descriptions, so recordings
+ * and offline tools do not need the real device.
+ */
+struct evdev_caps {
+	char	name[80];
+	char	uniq[80];
+	struct input_id id;
+	bitstr_t bit_decl(key_bits, KEY_CNT);
+	bitstr_t bit_decl(rel_bits, REL_CNT);
+	bitstr_t bit_decl(abs_bits, ABS_CNT);
+	bitstr_t bit_decl(prop_bits, INPUT_PROP_CNT);
+	struct input_absinfo absinfo[ABS_CNT];
+};
+
+int	evdev_caps_fetch(int fd, struct evdev_caps *caps);
+int	evdev_caps_write(FILE *fp, const struct evdev_caps *caps);
+int	evdev_caps_read(FILE *fp, struct evdev_caps *caps);
+
+#endif
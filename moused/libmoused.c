@@ -0,0 +1,3532 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 1997-2000 Kazutaka YOKOTA <yokota@FreeBSD.org>
+ * Copyright (c) 2004-2008 Philip Paeps <philip@FreeBSD.org>
+ * Copyright (c) 2008 Jean-Sebastien Pedron <dumbbell@FreeBSD.org>
+ * Copyright (c) 2021,2024 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * LIBMOUSED.C
+ *
+ * Event processing pipeline of moused, see libmoused.h.
+ */
+
+#include <sys/param.h>
+#include <sys/bitstring.h>
+#include <sys/mouse.h>
+#include <sys/time.h>
+
+#include <dev/evdev/input.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "util.h"
+#include "util-time.h"
+#include "evdev-caps.h"
+#include "quirks.h"
+#include "libmoused.h"
+#include "trace.h"
+
+#define DFLT_CLICKTHRESHOLD	 500	/* 0.5 second */
+#define DFLT_BUTTON2TIMEOUT	 100	/* 0.1 second */
+#define DFLT_SCROLLTHRESHOLD	   3	/* 3 pixels */
+#define DFLT_SCROLLSPEED	   2	/* 2 pixels */
+#define	DFLT_MOUSE_RESOLUTION	   8	/* dpmm, == 200dpi */
+#define	DFLT_TPAD_RESOLUTION	  40	/* dpmm, typical X res for Synaptics */
+#define	DFLT_LINEHEIGHT		  10	/* pixels per line */
+#define	DFLT_DEBOUNCE_TIME	  25	/* ms */
+
+/* Abort 3-button emulation delay after this many movement events. */
+#define BUTTON2_MAXMOVE	3
+
+#define MOUSE_XAXIS	(-1)
+#define MOUSE_YAXIS	(-2)
+
+#define	MAX_FINGERS	10
+
+#define	WHEEL_DETENT	120	/* hi-res wheel units per detent */
+
+#define	JITTER_DCUTOFF	1.0	/* Hz, cutoff of 1-euro speed estimate */
+#define	JITTER_MAXDT	0.1	/* s, frame interval taken after a pause */
+/* 1-euro filter smoothing factor for cutoff fc in Hz and interval dt in s */
+#define	ALPHA(fc, dt)	(1.0 / (1.0 + 1.0 / (2 * M_PI * (fc) * (dt))))
+
+#define	E3B_POLL	20	/* ms between 3 button emulation checks */
+
+#define	PHANTOM_CLICK_WINDOW	50	/* ms after lift to drop clickpad presses */
+
+#define	STICK_CLICK_TIME	200	/* ms to release middle for a click */
+
+#define	KINETIC_HISTORY	8	/* scroll samples to estimate velocity */
+#define	KINETIC_PERIOD	16	/* ms between kinetic scroll steps */
+#define	DFLT_KINETIC_FRICTION	4.0	/* 1/s */
+#define	DFLT_KINETIC_MIN_SPEED	2.0	/* wheel units per second */
+#define	DFLT_KINETIC_WINDOW	100	/* ms */
+
+#define debug(...) do {						\
+	if (log_debug)						\
+		r_log(LOG_DEBUG, __VA_ARGS__);			\
+} while (0)
+
+/* structures */
+
+enum gesture {
+	GEST_IGNORE,
+	GEST_ACCUMULATE,
+	GEST_MOVE,
+	GEST_VSCROLL,
+	GEST_HSCROLL,
+};
+
+/* state machine for touchpad gestures */
+
+enum tpgest_state {
+	G_IDLE,		/* no touch */
+	G_TOUCH,	/* touch, pointer motion or tap */
+	G_VSCROLL,	/* touch, vertical scrolling */
+	G_HSCROLL,	/* touch, horizontal scrolling */
+	G_TAPPED,	/* tap button held after a tap until deadline */
+	G_DRAG,		/* touch, tap button held */
+	G_DOUBLETAP,	/* tap button released by second tap, press again */
+};
+
+enum tpgest_event {
+	GE_TOUCH,	/* touch, not scrolling */
+	GE_VSCROLL,	/* touch scrolls vertically */
+	GE_HSCROLL,	/* touch scrolls horizontally */
+	GE_TAP,		/* touch ended as a tap */
+	GE_LIFT,	/* touch ended otherwise, or no touch */
+	GE_TIMEOUT,	/* deadline passed */
+	GE_CNT,
+};
+
+/*
+ * Next state per event.  A state with touch set starts an action when
+ * entered from one without, hold adds the tap button to the packets of
+ * the state and gest is what the pointer movement of a touch turns into.
+ * Entering G_TAPPED sets the tap-hold deadline, G_DOUBLETAP expires at
+ * once and the other states clear it.
+ */
+static const struct {
+	enum tpgest_state s[GE_CNT];
+	bool touch;
+	bool hold;
+	enum gesture gest;
+} gstates[7] = {
+    /* G_IDLE */
+    { { G_TOUCH, G_VSCROLL, G_HSCROLL, G_IDLE, G_IDLE, G_IDLE },
+      false, false, GEST_IGNORE },
+    /* G_TOUCH */
+    { { G_TOUCH, G_VSCROLL, G_HSCROLL, G_TAPPED, G_IDLE, G_TOUCH },
+      true, false, GEST_MOVE },
+    /* G_VSCROLL */
+    { { G_TOUCH, G_VSCROLL, G_HSCROLL, G_IDLE, G_IDLE, G_VSCROLL },
+      true, false, GEST_VSCROLL },
+    /* G_HSCROLL */
+    { { G_TOUCH, G_VSCROLL, G_HSCROLL, G_IDLE, G_IDLE, G_HSCROLL },
+      true, false, GEST_HSCROLL },
+    /* G_TAPPED */
+    { { G_DRAG, G_DRAG, G_DRAG, G_TAPPED, G_TAPPED, G_IDLE },
+      false, true, GEST_IGNORE },
+    /* G_DRAG */
+    { { G_DRAG, G_DRAG, G_DRAG, G_DOUBLETAP, G_IDLE, G_DRAG },
+      true, true, GEST_MOVE },
+    /* G_DOUBLETAP */
+    { { G_TOUCH, G_TOUCH, G_TOUCH, G_DOUBLETAP, G_DOUBLETAP, G_TAPPED },
+      false, false, GEST_IGNORE },
+};
+
+/* Default phisical to logical button mapping */
+static const u_int default_p2l[MOUSE_MAXBUTTON] = {
+    MOUSE_BUTTON1DOWN, MOUSE_BUTTON2DOWN, MOUSE_BUTTON3DOWN, MOUSE_BUTTON4DOWN,
+    MOUSE_BUTTON5DOWN, MOUSE_BUTTON6DOWN, MOUSE_BUTTON7DOWN, MOUSE_BUTTON8DOWN,
+    0x00000100,        0x00000200,        0x00000400,        0x00000800,
+    0x00001000,        0x00002000,        0x00004000,        0x00008000,
+    0x00010000,        0x00020000,        0x00040000,        0x00080000,
+    0x00100000,        0x00200000,        0x00400000,        0x00800000,
+    0x01000000,        0x02000000,        0x04000000,        0x08000000,
+    0x10000000,        0x20000000,        0x40000000,
+};
+
+struct tpcaps {
+	bool	is_clickpad;
+	bool	is_topbuttonpad;
+	bool	is_mt;
+	bool	cap_touch;
+	bool	cap_pressure;
+	bool	cap_width;
+	int	min_x;
+	int	max_x;
+	int	min_y;
+	int	max_y;
+	int	res_x;	/* dots per mm */
+	int	res_y;	/* dots per mm */
+	int	min_p;
+	int	max_p;
+	int	nslots;	/* multitouch slots reported by hardware */
+	bool	cap_mt_major;	/* per-slot touch size */
+	bool	cap_mt_pressure;/* per-slot pressure */
+};
+
+enum swipe { SWIPE_LEFT, SWIPE_RIGHT, SWIPE_UP, SWIPE_DOWN, SWIPE_CNT };
+enum pinch { PINCH_IN, PINCH_OUT, PINCH_CNT };
+
+struct tpinfo {
+	bool	two_finger_scroll;	/* Enable two finger scrolling */
+	bool	natural_scroll;		/* Enable natural scrolling */
+	double	scroll_scale_x;		/* 1/WHEEL_DETENT lines per unit */
+	double	scroll_scale_y;
+	bool	three_finger_drag;	/* Enable dragging with three fingers */
+	u_int	min_pressure_hi;	/* Min pressure to start an action */
+	u_int	min_pressure_lo;	/* Min pressure to continue an action */
+	u_int	max_pressure;		/* Maximum pressure to detect palm */
+	u_int	max_width;		/* Max finger width to detect palm */
+	int	margin_top;		/* Top margin */
+	int	margin_right;		/* Right margin */
+	int	margin_bottom;		/* Bottom margin */
+	int	margin_left;		/* Left margin */
+	u_int	tap_timeout;		/* */
+	u_int	tap_threshold;		/* Minimum pressure to detect a tap */
+	double	tap_max_delta;		/* Length of segments above which a tap is ignored */
+	u_int	taphold_timeout;	/* Maximum elapsed time between two taps to consider a tap-hold action */
+	double	vscroll_ver_area;	/* Area reserved for vertical virtual scrolling */
+	double	vscroll_hor_area;	/* Area reserved for horizontal virtual scrolling */
+	double	vscroll_min_delta;	/* Minimum movement to consider virtual scrolling */
+	int	softbuttons_y;		/* Vertical size of softbuttons area */
+	int	softbutton2_x;		/* Horizontal offset of 2-nd softbutton left edge */
+	int	softbutton3_x;		/* Horizontal offset of 3-rd softbutton left edge */
+	u_int	swipe_buttons[2][SWIPE_CNT]; /* 3 and 4 finger swipe buttons */
+	u_int	pinch_buttons[PINCH_CNT];	/* Pinch in and out buttons */
+	double	swipe_distance;		/* Centroid movement to detect swipe */
+	double	pinch_distance;		/* Spread change to detect pinch */
+	u_int	palm_size;		/* Slot touch major of a palm, 0 - off */
+	u_int	palm_pressure;		/* Slot pressure of a palm, 0 - off */
+	u_int	thumb_size;		/* Same for a thumb below thumb_y */
+	u_int	thumb_pressure;
+	int	thumb_y;		/* Upper edge of the thumb area */
+	u_int	touch_size_hi;		/* Touch major to begin a touch */
+	u_int	touch_size_lo;		/* ... and to end it, 0 - off */
+	int	hyst_x;			/* Position hysteresis margin */
+	int	hyst_y;
+	bool	smoothing;		/* Enable 1-euro position filter */
+	double	smooth_cutoff;		/* ... its cutoff at rest, Hz */
+	double	smooth_beta_x;		/* ... cutoff rise, Hz per unit/s */
+	double	smooth_beta_y;
+	bool	phantom_clicks;		/* Drop clicks made with no touch */
+	/* Above in device units, precomputed for the per-packet code */
+	int	clip_min_x;		/* Position limits set by margins */
+	int	clip_max_x;
+	int	clip_min_y;
+	int	clip_max_y;
+	int	hscroll_min_y;		/* Start of horizontal edge scrolling */
+	int	hscroll_max_y;
+	int	vscroll_min_x;		/* Start of vertical edge scrolling */
+	int	vscroll_max_x;
+	int	vscroll_min_dx;		/* Minimum scrolling movement */
+	int	vscroll_min_dy;
+	int	tap_max_dx;		/* Maximum tap movement */
+	int	tap_max_dy;
+	int	softbuttons_min_y;	/* Start of softbuttons, exclusive */
+	int	softbuttons_max_y;
+	int	softbutton_x[2];	/* Left edges of right and center ones */
+	int	softbutton_bt[2];	/* ... and their buttons */
+};
+
+struct tpstate {
+	int 		start_x;
+	int 		start_y;
+	int 		prev_x;
+	int 		prev_y;
+	int		prev_nfingers;
+	int		fingers_nb;
+	int		tap_button;
+	enum tpgest_state state;
+	double		scroll_remain;	/* sub-unit scroll movement */
+	int		mt_fingers;	/* finger count of swipe and pinch */
+	int		mt_cx;		/* ... centroid and spread at start */
+	int		mt_cy;
+	int		mt_sx;
+	int		mt_sy;
+	int		mt_button;	/* button held by swipe or pinch */
+	int		start_button;	/* softbutton the action began on */
+	int		start_edges;	/* scroll edges ... 1 - vert, 2 - hor */
+	int		zmax;           /* maximum pressure value */
+	struct timespec	taptimeout;     /* tap timeout for touchpads */
+	struct timespec	deadline;	/* state expiration, 0 - none */
+	struct timespec	last;		/* time of the last packet */
+};
+
+struct tpad {
+	struct tpcaps	hw;	/* touchpad capabilities */
+	struct tpinfo	info;	/* touchpad gesture parameters */
+	struct tpstate	gest;	/* touchpad gesture state */
+};
+
+struct finger {
+	int	x;
+	int	y;
+	int	p;
+	int	w;
+	int	id;	/* id=0 - no touch, id>1 - touch id */
+};
+
+/* Jitter filter state of a touch position */
+struct jitter {
+	int	rx;	/* raw position */
+	int	ry;
+	int	hx;	/* position past hysteresis */
+	int	hy;
+	double	sx;	/* smoothed position */
+	double	sy;
+	double	vx;	/* smoothed speed, units per second */
+	double	vy;
+};
+
+/*
+ * Multitouch slots.  Per-slot values are kept in parallel arrays so the
+ * per-frame pass over them is a few straight loops.
+ */
+struct mtstate {
+	int		slot;			/* slot being updated */
+	u_int		active;			/* bitmap of touched slots */
+	u_int		rest;			/* ... by palms and thumbs */
+	u_int		touch;			/* ... by fingers */
+	u_int		low;			/* ... since in the thumb area */
+	u_int		otouch;			/* ... in the previous frame */
+	int		id[MAX_FINGERS];	/* tracking id */
+	int		x[MAX_FINGERS];
+	int		y[MAX_FINGERS];
+	int		p[MAX_FINGERS];		/* pressure */
+	int		w[MAX_FINGERS];		/* touch major */
+	int		ox[MAX_FINGERS];	/* position in previous frame */
+	int		oy[MAX_FINGERS];
+	int		dx[MAX_FINGERS];	/* movement since previous frame */
+	int		dy[MAX_FINGERS];
+	int		fx[MAX_FINGERS];	/* filtered position */
+	int		fy[MAX_FINGERS];
+	struct jitter	jit[MAX_FINGERS];
+	/* Frame summary */
+	int		nfingers;		/* slots touched by fingers */
+	int		nrest;			/* ... by palms and thumbs */
+	int		cx;			/* centroid of the touches */
+	int		cy;
+	int		sx;			/* mean distance to centroid */
+	int		sy;
+	int		fdx;			/* movement of fastest finger */
+	int		fdy;
+};
+
+struct evstate {
+	int		buttons;
+	/* Relative */
+	int		dx;
+	int		dy;
+	int		acc_dx;
+	int		acc_dy;
+	/* Wheels and scrolling, in 1/WHEEL_DETENT of a detent */
+	int		hr_dz;
+	int		hr_dw;
+	int		acc_dz;		/* sub-detent remainder */
+	int		acc_dw;
+	bool		hires_wheel;	/* REL_WHEEL duplicates hi-res codes */
+	bool		hires_hwheel;
+	/* Absolute single-touch */
+	int		nfingers;
+	struct finger	st;
+	/* Absolute multi-touch */
+	struct mtstate	mt;
+	/* Jitter filter of single-touch position */
+	struct jitter	jit;
+	int		jx;		/* filtered position */
+	int		jy;
+	bool		jtouch;		/* touched in previous frame */
+	struct timespec	jtime;		/* time of previous frame */
+	atomic_ulong	suppressed;	/* frames with movement filtered out */
+	/* Phantom click filter of clickpads */
+	bool		ptouch;		/* touched in previous frame */
+	bool		click;		/* BTN_LEFT down in previous frame */
+	bool		phantom;	/* ... and dropped as phantom */
+	struct timespec	lift;		/* time the last touch lifted */
+	bitstr_t bit_decl(key_ignore, KEY_CNT);
+	bitstr_t bit_decl(rel_ignore, REL_CNT);
+	bitstr_t bit_decl(abs_ignore, ABS_CNT);
+	bitstr_t bit_decl(prop_ignore, INPUT_PROP_CNT);
+};
+
+/* button status */
+struct button_state {
+	int count;	/* 0: up, 1: single click, 2: double click,... */
+	struct timespec ts;	/* timestamp on the last button event */
+};
+
+struct btstate {
+	u_int	wmode;		/* wheel mode button number */
+	u_int 	clickthreshold;	/* double click speed in msec */
+	struct button_state	bstate[MOUSE_MAXBUTTON]; /* button state */
+	struct button_state	*mstate[MOUSE_MAXBUTTON];/* mapped button st.*/
+	u_int	p2l[MOUSE_MAXBUTTON];/* phisical to logical button mapping */
+	/* MOUSE_{X|Y}AXIS or a button number */
+	int	zmap[MOUSED_ZMAP_MAXBUTTON];
+	/* Z/W axis state */
+	struct button_state	zstate[MOUSED_ZMAP_MAXBUTTON];
+};
+
+/* state machine for 3 button emulation */
+
+enum bt3_emul_state {
+	S0,		/* start */
+	S1,		/* button 1 delayed down */
+	S2,		/* button 3 delayed down */
+	S3,		/* both buttons down -> button 2 down */
+	S4,		/* button 1 delayed up */
+	S5,		/* button 1 down */
+	S6,		/* button 3 down */
+	S7,		/* both buttons down */
+	S8,		/* button 3 delayed up */
+	S9,		/* button 1 or 3 up after S3 */
+};
+
+#define A(b1, b3)	(((b1) ? 2 : 0) | ((b3) ? 1 : 0))
+#define A_TIMEOUT	4
+#define S_DELAYED(st)	(states[st].s[A_TIMEOUT] != (st))
+
+static const struct {
+	enum bt3_emul_state s[A_TIMEOUT + 1];
+	int buttons;
+	int mask;
+	bool timeout;
+} states[10] = {
+    /* S0 */
+    { { S0, S2, S1, S3, S0 }, 0, ~(MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN), false },
+    /* S1 */
+    { { S4, S2, S1, S3, S5 }, 0, ~MOUSE_BUTTON1DOWN, false },
+    /* S2 */
+    { { S8, S2, S1, S3, S6 }, 0, ~MOUSE_BUTTON3DOWN, false },
+    /* S3 */
+    { { S0, S9, S9, S3, S3 }, MOUSE_BUTTON2DOWN, ~0, false },
+    /* S4 */
+    { { S0, S2, S1, S3, S0 }, MOUSE_BUTTON1DOWN, ~0, true },
+    /* S5 */
+    { { S0, S2, S5, S7, S5 }, MOUSE_BUTTON1DOWN, ~0, false },
+    /* S6 */
+    { { S0, S6, S1, S7, S6 }, MOUSE_BUTTON3DOWN, ~0, false },
+    /* S7 */
+    { { S0, S6, S5, S7, S7 }, MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN, ~0, false },
+    /* S8 */
+    { { S0, S2, S1, S3, S0 }, MOUSE_BUTTON3DOWN, ~0, true },
+    /* S9 */
+    { { S0, S9, S9, S3, S9 }, 0, ~(MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN), false },
+};
+
+struct e3bstate {
+	bool enabled;
+	u_int button2timeout;	/* 3 button emulation timeout */
+	enum bt3_emul_state	mouse_button_state;
+	struct timespec		mouse_button_state_ts;
+	int			mouse_move_delayed;
+};
+
+enum scroll_state {
+	SCROLL_NOTSCROLLING,
+	SCROLL_PREPARE,
+	SCROLL_SCROLLING,
+};
+
+struct scroll {
+	bool	enable_vert;
+	bool	enable_hor;
+	u_int	threshold;	/* Movement distance before virtual scrolling */
+	u_int	speed;		/* Movement distance to rate of scrolling */
+	enum scroll_state state;
+	int	movement;
+	int	hmovement;
+};
+
+struct kinetic_sample {
+	struct timespec	ts;
+	int		dz;	/* vertical wheel movement */
+	int		dw;	/* horizontal wheel steps */
+};
+
+/*
+ * Kinetic scrolling.  Wheel output of scroll gestures is sampled while
+ * they last, the velocity at release is estimated from the samples of
+ * the last window ms and kept decaying from a periodic timer.
+ */
+struct kinetic {
+	bool	enable;
+	double	friction;	/* velocity decay rate, 1/s */
+	double	min_speed;	/* wheel units per second to keep going */
+	u_int	window;		/* ms of samples used for the velocity */
+	double	decay;		/* velocity multiplier per step */
+	bool	tracking;	/* scroll gesture in progress */
+	bool	running;	/* kinetic scroll in progress */
+	u_int	head;		/* next sample slot */
+	u_int	count;
+	struct kinetic_sample	hist[KINETIC_HISTORY];
+	double	vz;		/* vertical velocity, units per ms */
+	double	vw;		/* horizontal velocity, steps per ms */
+	double	rz;		/* movement not sent yet */
+	double	rw;
+};
+
+struct drift_xy {
+	int x;
+	int y;
+};
+struct drift {
+	u_int		distance;	/* max steps X+Y */
+	u_int		time;		/* ms */
+	struct timespec	time_ts;
+	struct timespec	twotime_ts;	/* 2*drift_time */
+	u_int		after;		/* ms */
+	struct timespec	after_ts;
+	bool		terminate;
+	struct timespec	current_ts;
+	struct timespec	last_activity;
+	struct timespec	since;
+	struct drift_xy	last;		/* steps in last drift_time */
+	struct drift_xy	previous;	/* steps in prev. drift_time */
+};
+
+/*
+ * Button debouncing.  The first edge of a button is passed at once and
+ * opens a window in which further edges of it are taken for contact
+ * chatter.  The level the button settled at is passed when it closes.
+ */
+struct debounce {
+	u_int		time;		/* window, ms, 0 to disable */
+	int		raw;		/* buttons as reported */
+	int		state;		/* buttons passed on */
+	struct timespec	until[MOUSE_MAXBUTTON];	/* end of window */
+};
+
+/*
+ * Pointing stick scrolling.  While the middle button is held the stick
+ * scrolls instead of moving the pointer.  The button is only passed as
+ * a click if released soon without moving.
+ */
+enum stick_state { STICK_IDLE, STICK_HELD, STICK_SCROLL };
+
+struct stick {
+	double		multiplier;	/* AttrTrackpointMultiplier */
+	double		scale;		/* hi-res wheel units per unit */
+	int		threshold;	/* movement to start scrolling */
+	enum stick_state state;
+	int		mx;		/* movement while held */
+	int		my;
+	double		rz;		/* scrolling not sent yet */
+	double		rw;
+	struct timespec	pressed;	/* time middle went down */
+	bool		click;		/* middle click to release */
+};
+
+struct accel {
+	bool is_exponential;	/* Exponential acceleration is enabled */
+	double accelx;		/* Acceleration in the X axis */
+	double accely;		/* Acceleration in the Y axis */
+	double accelz;		/* Acceleration in the wheel axis */
+	double expoaccel;	/* Exponential acceleration */
+	double expoffset;	/* Movement offset for exponential accel. */
+	double remainx;		/* Remainder on X, Y and wheel axis, ... */
+	double remainy;		/*    ...  respectively to compensate */
+	double remainz;		/*    ... for rounding errors. */
+	double lastlength[3];
+};
+
+struct moused_dev {
+	enum moused_device_if iftype;
+	enum moused_device_type type;
+	mousestatus_t action0;	/* original mouse action */
+	mousestatus_t action;	/* interim buffer */
+	mousestatus_t action2;	/* mapped action */
+	struct btstate btstate;	/* button status */
+	struct e3bstate e3b;	/* 3 button emulation state */
+	struct drift drift;
+	struct debounce debounce;/* button debounce state */
+	struct stick stick;	/* pointing stick scroll state */
+	struct accel accel;	/* cursor acceleration state */
+	struct scroll scroll;	/* virtual scroll state */
+	struct kinetic kinetic;	/* kinetic scroll state */
+	struct tpad tp;		/* touchpad info and gesture state */
+	struct evstate ev;	/* event device state */
+	struct trace_ring trace;/* recent pipeline trace points */
+	struct timespec now;	/* time of the event being processed */
+	moused_output_t *output;/* consumer of finished actions */
+	moused_wheel_t *wheel;	/* consumer of wheel movement, optional */
+	void *arg;
+};
+
+/* global variables */
+
+static moused_log_handler *log_handler;
+static bool	log_debug = false;
+
+/* function prototypes */
+
+static void	r_log(int priority, const char *fmt, ...) __printflike(2, 3);
+static void	r_settime(struct moused_dev *md, const struct timespec *now);
+static void	r_feed(struct moused_dev *md, int flags);
+static void	r_action(struct moused_dev *md, int flags);
+static void	linacc(struct accel *, int, int, int, int*, int*, int*);
+static void	expoacc(struct accel *, int, int, int, int*, int*, int*);
+static void	r_init_evstate(const struct evdev_caps *caps, struct quirks *q,
+		    struct evstate *ev);
+static void	r_init_buttons(struct quirks *q, const struct moused_opts *opts,
+		    struct btstate *bt, struct e3bstate *e3b,
+		    const struct timespec *now);
+static void	r_init_touchpad_hw(const struct evdev_caps *caps,
+		    struct quirks *q, struct tpcaps *tphw, struct evstate *ev);
+static void	r_init_gesture_buttons(struct quirks *q, enum quirk quirk,
+		    u_int *buttons, size_t nbuttons);
+static void	r_init_touchpad_info(struct quirks *q, struct tpcaps *tphw,
+		    struct tpinfo *tpinfo);
+static void	r_init_touchpad_regions(struct tpcaps *tphw,
+		    struct tpinfo *tpinfo);
+static void	r_init_touchpad_accel(struct tpcaps *tphw,
+		    struct tpinfo *tpinfo, struct accel *accel);
+static void	r_init_touchpad_gesture(struct tpstate *gest);
+static int	r_init_drift(struct quirks *q, const struct moused_opts *opts,
+		    struct drift *d);
+static void	r_init_debounce(struct quirks *q, struct debounce *db);
+static void	r_init_stick(struct quirks *q, struct scroll *scroll,
+		    struct accel *accel, struct stick *st);
+static void	r_init_accel(struct quirks *q, const struct moused_opts *opts,
+		    struct accel *acc);
+static void	r_init_kinetic(struct quirks *q, struct kinetic *kin);
+static void	r_init_scroll(struct quirks *q, const struct moused_opts *opts,
+		    struct scroll *scroll);
+static int	r_protocol_evdev(enum moused_device_type type,
+		    struct tpad *tp, struct evstate *ev, struct trace_ring *tr,
+		    const struct input_event *ie, mousestatus_t *act);
+static int	r_protocol_sysmouse(const uint8_t *pBuf, mousestatus_t *act);
+static int	r_debounce(struct moused_dev *md, int flags);
+static int	r_stick(struct moused_dev *md, int flags);
+static void	r_stick_flush(struct moused_dev *md);
+static int	r_wheel_detents(int *acc, int hires);
+static int	r_wheel(struct moused_dev *md, int flags);
+static void	r_wheel_flush(struct moused_dev *md);
+static int	r_scroll(struct tpad *tp, int delta, double scale);
+static int	r_evdev(struct moused_dev *md, const struct input_event *ie);
+static void	r_mt_palm(const struct tpad *tp, struct mtstate *mt);
+static void	r_jitter(const struct tpinfo *tpinfo, struct jitter *j,
+		    int x, int y, double dt, bool reset, int *fx, int *fy);
+static bool	r_jitter_frame(const struct tpad *tp, struct evstate *ev,
+		    const struct timespec *time);
+static void	r_mt_frame(struct mtstate *mt);
+static int	r_phantom_click(const struct tpad *tp, struct evstate *ev,
+		    const struct timespec *time);
+static void	r_gesture_trans(struct tpad *tp, enum tpgest_event e,
+		    int x0, int y0, struct timespec *time);
+static void	r_gesture_enter(struct tpad *tp, enum tpgest_state st,
+		    int x0, int y0, struct timespec *time);
+static enum gesture r_gestures(struct tpad *tp, int x0, int y0, int z, int w,
+		    int nfingers, const struct mtstate *mt,
+		    struct timespec *time, mousestatus_t *ms);
+static bool	r_mt_gestures(struct tpad *tp, const struct mtstate *mt,
+		    int nfingers, mousestatus_t *ms);
+static void	r_vscroll_detect(struct moused_dev *md, struct scroll *sc,
+		    mousestatus_t *act);
+static void	r_vscroll(struct scroll *sc, mousestatus_t *act);
+static void	r_kinetic_check(struct moused_dev *md, int flags);
+static void	r_kinetic_sample(struct moused_dev *md, int dz);
+static void	r_kinetic(struct moused_dev *md);
+static bool	r_drift(struct drift *, mousestatus_t *);
+static int	r_statetrans(struct moused_dev *md, mousestatus_t *a1,
+		    mousestatus_t *a2, int trans);
+static void	r_map(mousestatus_t *act1, mousestatus_t *act2,
+		    struct btstate *bt);
+static void	r_timestamp(mousestatus_t *act, struct btstate *bt,
+		    struct e3bstate *e3b, struct drift *drift,
+		    const struct timespec *now);
+static bool	r_timeout(struct e3bstate *e3b, const struct timespec *now);
+static void	r_move(struct moused_dev *md, mousestatus_t *act);
+static void	r_click(struct moused_dev *md, mousestatus_t *act);
+
+/*
+ * Route pipeline messages to the log handler of the application.  Debug
+ * messages are dropped unless asked for, they are issued per packet.
+ */
+void
+moused_log_init(moused_log_handler *handler, bool debug)
+{
+	log_handler = handler;
+	log_debug = debug && handler != NULL;
+}
+
+static void
+r_log(int priority, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (log_handler == NULL)
+		return;
+	va_start(ap, fmt);
+	log_handler(LOG_DAEMON | priority, 0, fmt, ap);
+	va_end(ap);
+}
+
+/* Reset opts to "use quirks for everything" */
+void
+moused_opts_init(struct moused_opts *opts)
+{
+	*opts = (struct moused_opts) {
+		.clickthreshold = -1,
+		.e3b_button2timeout = -1,
+		.drift_distance = 4,
+		.drift_time = 500,
+		.drift_after = 4000,
+		.accelx = 1.0,
+		.accely = 1.0,
+		.expoaccel = 1.0,
+		.expoffset = 1.0,
+		.scroll_speed = -1,
+		.scroll_threshold = -1,
+	};
+}
+
+static inline int
+bit_find(bitstr_t *array, int start, int stop)
+{
+	int res;
+
+	bit_ffs_at(array, start, stop + 1, &res);
+	return (res != -1);
+}
+
+/*
+ * Tell the device type from evdev capabilities.  Derived from EvdevProbe()
+ * function of xf86-input-evdev driver.
+ */
+enum moused_device_type
+moused_identify(struct evdev_caps *caps)
+{
+	enum moused_device_type type;
+	bitstr_t *key_bits = caps->key_bits;
+	bitstr_t *rel_bits = caps->rel_bits;
+	bitstr_t *abs_bits = caps->abs_bits;
+	bitstr_t *prop_bits = caps->prop_bits;
+	bool has_keys, has_buttons, has_lmr, has_rel_axes, has_abs_axes;
+	bool has_mt;
+
+	has_keys = bit_find(key_bits, 0, BTN_MISC - 1);
+	has_buttons = bit_find(key_bits, BTN_MISC, BTN_JOYSTICK - 1);
+	has_lmr = bit_find(key_bits, BTN_LEFT, BTN_MIDDLE);
+	has_rel_axes = bit_find(rel_bits, 0, REL_MAX);
+	has_abs_axes = bit_find(abs_bits, 0, ABS_MAX);
+	has_mt = bit_find(abs_bits, ABS_MT_SLOT, ABS_MAX);
+	type = MOUSED_TYPE_UNKNOWN;
+
+	if (has_abs_axes) {
+		if (has_mt && !has_buttons) {
+			/* TBD:Improve joystick detection */
+			if (bit_test(key_bits, BTN_JOYSTICK)) {
+				return (MOUSED_TYPE_JOYSTICK);
+			} else {
+				has_buttons = true;
+			}
+		}
+
+		if (bit_test(abs_bits, ABS_X) &&
+		    bit_test(abs_bits, ABS_Y)) {
+			if (bit_test(key_bits, BTN_TOOL_PEN) ||
+			    bit_test(key_bits, BTN_STYLUS) ||
+			    bit_test(key_bits, BTN_STYLUS2)) {
+				type = MOUSED_TYPE_TABLET;
+			} else if (bit_test(abs_bits, ABS_PRESSURE) ||
+				   bit_test(key_bits, BTN_TOUCH)) {
+				if (has_lmr ||
+				    bit_test(key_bits, BTN_TOOL_FINGER)) {
+					type = MOUSED_TYPE_TOUCHPAD;
+				} else {
+					type = MOUSED_TYPE_TOUCHSCREEN;
+				}
+			/* some touchscreens use BTN_LEFT rather than BTN_TOUCH */
+			} else if (!(bit_test(rel_bits, REL_X) &&
+				     bit_test(rel_bits, REL_Y)) &&
+				     has_lmr) {
+				type = MOUSED_TYPE_TOUCHSCREEN;
+			}
+		}
+	}
+
+	if (type == MOUSED_TYPE_UNKNOWN) {
+		if (has_rel_axes &&
+		    bit_test(prop_bits, INPUT_PROP_POINTING_STICK))
+			type = MOUSED_TYPE_POINTINGSTICK;
+		else if (has_keys)
+			type = MOUSED_TYPE_KEYBOARD;
+		else if (has_rel_axes || has_buttons)
+			type = MOUSED_TYPE_MOUSE;
+	}
+
+	return (type);
+}
+
+/*
+ * Create pipeline context of a device.  caps is NULL for sysmouse
+ * devices, opts is NULL if there is nothing to override, now is NULL to
+ * read the monotonic clock.  Finished actions are passed to output.
+ */
+struct moused_dev *
+moused_dev_create(const struct moused_device *dev,
+    const struct evdev_caps *caps, struct quirks *q,
+    const struct moused_opts *opts,
+    moused_output_t *output, void *arg, const struct timespec *now)
+{
+	struct moused_opts dflt;
+	struct moused_dev *md;
+	int err;
+
+	if (dev->iftype == MOUSED_IF_EVDEV && caps == NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if (opts == NULL) {
+		moused_opts_init(&dflt);
+		opts = &dflt;
+	}
+	md = calloc(1, sizeof(struct moused_dev));
+	if (md == NULL)
+		return (NULL);
+	md->iftype = dev->iftype;
+	md->type = dev->type;
+	md->output = output;
+	md->arg = arg;
+	r_settime(md, now);
+
+	if (dev->iftype == MOUSED_IF_EVDEV)
+		r_init_evstate(caps, q, &md->ev);
+	r_init_buttons(q, opts, &md->btstate, &md->e3b, &md->now);
+	r_init_scroll(q, opts, &md->scroll);
+	r_init_kinetic(q, &md->kinetic);
+	r_init_accel(q, opts, &md->accel);
+	r_init_touchpad_gesture(&md->tp.gest);
+	err = 0;
+	switch (dev->type) {
+	case MOUSED_TYPE_TOUCHPAD:
+		r_init_touchpad_hw(caps, q, &md->tp.hw, &md->ev);
+		r_init_touchpad_info(q, &md->tp.hw, &md->tp.info);
+		r_init_touchpad_accel(&md->tp.hw, &md->tp.info, &md->accel);
+		break;
+
+	case MOUSED_TYPE_POINTINGSTICK:
+		r_init_stick(q, &md->scroll, &md->accel, &md->stick);
+		/* FALLTHROUGH */
+	case MOUSED_TYPE_MOUSE:
+		err = r_init_drift(q, opts, &md->drift);
+		r_init_debounce(q, &md->debounce);
+		break;
+
+	default:
+		debug("unsupported device type: %d", dev->type);
+		break;
+	}
+	if (err != 0) {
+		free(md);
+		errno = err;
+		return (NULL);
+	}
+
+	return (md);
+}
+
+void
+moused_dev_destroy(struct moused_dev *md)
+{
+	free(md);
+}
+
+/*
+ * Pass wheel movement of an evdev mouse to wheel instead of the console
+ * if the wheel is not remapped.  NULL restores the console.
+ */
+void
+moused_dev_set_wheel(struct moused_dev *md, moused_wheel_t *wheel)
+{
+	md->wheel = wheel;
+}
+
+/* Pipeline clock, the caller may run it on a time of its own */
+static void
+r_settime(struct moused_dev *md, const struct timespec *now)
+{
+	if (now != NULL)
+		md->now = *now;
+	else
+		clock_gettime(CLOCK_MONOTONIC_FAST, &md->now);
+}
+
+/* Feed a single evdev event */
+void
+moused_dev_event(struct moused_dev *md, const struct input_event *ie,
+    const struct timespec *now)
+{
+	r_settime(md, now);
+	r_feed(md, r_evdev(md, ie));
+	r_stick_flush(md);
+	r_wheel_flush(md);
+}
+
+/* Decode evdev event, an assembled report gets its wheel movement */
+static int
+r_evdev(struct moused_dev *md, const struct input_event *ie)
+{
+	int flags;
+
+	flags = r_protocol_evdev(md->type, &md->tp, &md->ev, &md->trace, ie,
+	    &md->action0);
+	if (ie->type == EV_SYN &&
+	    (ie->code == SYN_REPORT || ie->code == SYN_DROPPED)) {
+		flags = r_debounce(md, flags);
+		if (md->type == MOUSED_TYPE_POINTINGSTICK)
+			flags = r_stick(md, flags);
+		flags = r_wheel(md, flags);
+	}
+
+	return (flags);
+}
+
+/* Feed a single sysmouse protocol packet */
+void
+moused_dev_packet(struct moused_dev *md, const uint8_t *packet,
+    const struct timespec *now)
+{
+	int flags;
+
+	r_settime(md, now);
+	flags = r_protocol_sysmouse(packet, &md->action0);
+	/* Out of sync packets leave the buttons alone */
+	if ((packet[0] & MOUSE_SYS_SYNCMASK) == MOUSE_SYS_SYNC)
+		flags = r_debounce(md, flags);
+	r_feed(md, flags);
+}
+
+/*
+ * Tell that a timer requested by moused_dev_timeouts() has expired.
+ * The caller cancels the timers of a device whenever it feeds it.
+ */
+void
+moused_dev_expire(struct moused_dev *md, enum moused_timer timer,
+    const struct timespec *now)
+{
+	mousestatus_t *action0 = &md->action0;	/* original mouse action */
+	mousestatus_t *action = &md->action;	/* interim buffer */
+	struct input_event ie;
+	int flags;
+
+	r_settime(md, now);
+	switch (timer) {
+	case MOUSED_TIMER_E3B:
+		/* assert(rodent.flags & Emulate3Button) */
+		trace(&md->trace, TRACE_TIMER, 0, 0, 0, 0);
+		action0->button = action0->obutton;
+		action0->dx = action0->dy = action0->dz = 0;
+		action0->flags = 0;
+		if (r_timeout(&md->e3b, &md->now) &&
+		    r_statetrans(md, action0, action, A_TIMEOUT)) {
+			trace(&md->trace, TRACE_BUTTONS, action->flags,
+			    action->button, action->obutton, 0);
+			r_action(md, 0);
+		} else
+			action0->obutton = action0->button;
+		break;
+
+	case MOUSED_TIMER_GESTURE:
+		/*
+		 * Gesture deadline expired.  Notify r_gestures by empty
+		 * packet stamped with it, in the clock of the device.
+		 */
+		trace(&md->trace, TRACE_TIMER, 1, 0, 0, 0);
+		if (!timespecisset(&md->tp.gest.deadline))
+			break;
+		TIMESPEC_TO_TIMEVAL(&ie.time, &md->tp.gest.deadline);
+		ie.type = EV_SYN;
+		ie.code = SYN_REPORT;
+		ie.value = 1;
+		r_feed(md, r_evdev(md, &ie));
+		r_wheel_flush(md);
+		break;
+
+	case MOUSED_TIMER_KINETIC:
+		trace(&md->trace, TRACE_TIMER, 2, 0, 0, 0);
+		r_kinetic(md);
+		break;
+
+	case MOUSED_TIMER_DEBOUNCE:
+		/* Pass the buttons which have settled since the last report */
+		trace(&md->trace, TRACE_TIMER, 3, 0, 0, 0);
+		action0->button = md->debounce.raw;
+		action0->dx = action0->dy = action0->dz = 0;
+		action0->flags = 0;
+		flags = r_debounce(md, 0);
+		if (md->type == MOUSED_TYPE_POINTINGSTICK)
+			flags = r_stick(md, flags);
+		r_feed(md, flags);
+		r_stick_flush(md);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Report timeouts in ms the device asks for after being fed, -1 for
+ * timers not to be run and 0 for those expiring right away.
+ */
+void
+moused_dev_timeouts(struct moused_dev *md, int timeout[MOUSED_TIMER_CNT])
+{
+	struct tpstate *gest = &md->tp.gest;
+	struct debounce *db = &md->debounce;
+	struct timespec ts;
+	int i, ms, pending;
+
+	timeout[MOUSED_TIMER_E3B] =
+	    md->e3b.enabled && S_DELAYED(md->e3b.mouse_button_state) ?
+	    E3B_POLL : -1;
+	/* Gesture deadline is in the clock of the device events */
+	timeout[MOUSED_TIMER_GESTURE] = -1;
+	if (timespecisset(&gest->deadline)) {
+		tssub(&gest->deadline, &gest->last, &ts);
+		timeout[MOUSED_TIMER_GESTURE] = ts.tv_sec < 0 ? 0 :
+		    ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000;
+	}
+	timeout[MOUSED_TIMER_KINETIC] = md->kinetic.running ?
+	    KINETIC_PERIOD : -1;
+	/* One timer for the earliest window among buttons held back */
+	timeout[MOUSED_TIMER_DEBOUNCE] = -1;
+	for (pending = db->raw ^ db->state; pending != 0;
+	    pending &= ~(1 << i)) {
+		i = ffs(pending) - 1;
+		tssub(&db->until[i], &md->now, &ts);
+		ms = ts.tv_sec < 0 ? 0 :
+		    ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000;
+		if (timeout[MOUSED_TIMER_DEBOUNCE] == -1 ||
+		    ms < timeout[MOUSED_TIMER_DEBOUNCE])
+			timeout[MOUSED_TIMER_DEBOUNCE] = ms;
+	}
+}
+
+struct trace_ring *
+moused_dev_trace(struct moused_dev *md)
+{
+	return (&md->trace);
+}
+
+/* Count of touchpad frames whose movement was taken for sensor noise */
+u_long
+moused_dev_suppressed(struct moused_dev *md)
+{
+	return (atomic_load_explicit(&md->ev.suppressed,
+	    memory_order_relaxed));
+}
+
+/* Pass a freshly decoded action through 3 button emulation */
+static void
+r_feed(struct moused_dev *md, int flags)
+{
+	mousestatus_t *action0 = &md->action0;	/* original mouse action */
+	mousestatus_t *action = &md->action;	/* interim buffer */
+
+	if (md->kinetic.enable)
+		r_kinetic_check(md, flags);
+
+	if (flags == 0)
+		return;
+
+	if (md->scroll.enable_vert || md->scroll.enable_hor)
+		r_vscroll_detect(md, &md->scroll, action0);
+
+	r_timestamp(action0, &md->btstate, &md->e3b, &md->drift, &md->now);
+	r_statetrans(md, action0, action,
+	    A(action0->button & MOUSE_BUTTON1DOWN,
+	      action0->button & MOUSE_BUTTON3DOWN));
+	trace(&md->trace, TRACE_BUTTONS, action->flags,
+	    action->button, action->obutton, 0);
+	r_action(md, flags);
+}
+
+/*
+ * Map buttons, scroll, terminate drift and accelerate the action, then
+ * pass the results to the output callback.
+ */
+static void
+r_action(struct moused_dev *md, int flags)
+{
+	mousestatus_t *action0 = &md->action0;	/* original mouse action */
+	mousestatus_t *action = &md->action;	/* interim buffer */
+	mousestatus_t *action2 = &md->action2;	/* mapped action */
+
+	action0->obutton = action0->button;
+	flags &= MOUSE_POSCHANGED;
+	flags |= action->obutton ^ action->button;
+	action->flags = flags;
+
+	if (flags == 0)
+		return;
+
+	/* handler detected action */
+	r_map(action, action2, &md->btstate);
+	trace(&md->trace, TRACE_ACTION, action2->button,
+	    action2->dx, action2->dy, action2->dz);
+
+	if (md->scroll.enable_vert || md->scroll.enable_hor) {
+		/*
+		 * If *only* the middle button is pressed AND we are moving
+		 * the stick/trackpoint/nipple, scroll!
+		 */
+		r_vscroll(&md->scroll, action2);
+	}
+
+	if (md->kinetic.tracking && action2->dz != 0)
+		r_kinetic_sample(md, action2->dz);
+
+	if (md->drift.terminate) {
+		if ((flags & MOUSE_POSCHANGED) == 0 ||
+		    action->dz || action2->dz)
+			md->drift.last_activity = md->drift.current_ts;
+		else {
+			if (r_drift (&md->drift, action2))
+				return;
+		}
+	}
+
+	/* Defer clicks until we aren't VirtualScroll'ing. */
+	if (md->scroll.state == SCROLL_NOTSCROLLING)
+		r_click(md, action2);
+
+	if (action2->flags & MOUSE_POSCHANGED)
+		r_move(md, action2);
+
+	/*
+	 * If the Z axis movement is mapped to an imaginary physical
+	 * button, we need to cook up a corresponding button `up' event
+	 * after sending a button `down' event.
+	 */
+	if ((md->btstate.zmap[0] > 0) && (action->dz != 0)) {
+		action->obutton = action->button;
+		action->dx = action->dy = action->dz = 0;
+		r_map(action, action2, &md->btstate);
+		trace(&md->trace, TRACE_ACTION, action2->button,
+		    action2->dx, action2->dy, action2->dz);
+
+		r_click(md, action2);
+	}
+}
+
+/*
+ * Function to calculate linear acceleration.
+ *
+ * If there are any rounding errors, the remainder
+ * is stored in the remainx and remainy variables
+ * and taken into account upon the next movement.
+ */
+
+static void
+linacc(struct accel *acc, int dx, int dy, int dz,
+    int *movex, int *movey, int *movez)
+{
+	double fdx, fdy, fdz;
+
+	if (dx == 0 && dy == 0 && dz == 0) {
+		*movex = *movey = *movez = 0;
+		return;
+	}
+	fdx = dx * acc->accelx + acc->remainx;
+	fdy = dy * acc->accely + acc->remainy;
+	fdz = dz * acc->accelz + acc->remainz;
+	/* Remainders alone do not move an axis, +-0.5 would flip forever */
+	*movex = dx != 0 ? lround(fdx) : 0;
+	*movey = dy != 0 ? lround(fdy) : 0;
+	*movez = dz != 0 ? lround(fdz) : 0;
+	acc->remainx = fdx - *movex;
+	acc->remainy = fdy - *movey;
+	acc->remainz = fdz - *movez;
+}
+
+/*
+ * Function to calculate exponential acceleration.
+ * (Also includes linear acceleration if enabled.)
+ *
+ * In order to give a smoother behaviour, we record the four
+ * most recent non-zero movements and use their average value
+ * to calculate the acceleration.
+ */
+
+static void
+expoacc(struct accel *acc, int dx, int dy, int dz,
+    int *movex, int *movey, int *movez)
+{
+	double fdx, fdy, fdz, length, lbase, accel;
+
+	if (dx == 0 && dy == 0 && dz == 0) {
+		*movex = *movey = *movez = 0;
+		return;
+	}
+	fdx = dx * acc->accelx;
+	fdy = dy * acc->accely;
+	fdz = dz * acc->accelz;
+	length = sqrt((fdx * fdx) + (fdy * fdy));	/* Pythagoras */
+	length = (length + acc->lastlength[0] + acc->lastlength[1] +
+	    acc->lastlength[2]) / 4;
+	lbase = length / acc->expoffset;
+	accel = pow(lbase, acc->expoaccel) / lbase;
+	fdx = fdx * accel + acc->remainx;
+	fdy = fdy * accel + acc->remainy;
+	*movex = dx != 0 ? lround(fdx) : 0;
+	*movey = dy != 0 ? lround(fdy) : 0;
+	*movez = lround(fdz);
+	acc->remainx = fdx - *movex;
+	acc->remainy = fdy - *movey;
+	acc->remainz = fdz - *movez;
+	acc->lastlength[2] = acc->lastlength[1];
+	acc->lastlength[1] = acc->lastlength[0];
+	/* Insert new average, not original length! */
+	acc->lastlength[0] = length;
+}
+
+static void
+r_init_evstate(const struct evdev_caps *caps, struct quirks *q,
+    struct evstate *ev)
+{
+	const struct quirk_tuples *t;
+	bitstr_t *bitstr;
+	size_t maxbit;
+
+	ev->hires_wheel = bit_test(caps->rel_bits, REL_WHEEL_HI_RES);
+	ev->hires_hwheel = bit_test(caps->rel_bits, REL_HWHEEL_HI_RES);
+
+	if (quirks_get_tuples(q, QUIRK_ATTR_EVENT_CODE, &t)) {
+		for (size_t i = 0; i < t->ntuples; i++) {
+			int type = t->tuples[i].first;
+			int code = t->tuples[i].second;
+			bool enable = t->tuples[i].third;
+
+			switch (type) {
+			case EV_KEY:
+				bitstr = (bitstr_t *)&ev->key_ignore;
+				maxbit = KEY_MAX;
+				break;
+			case EV_REL:
+				bitstr = (bitstr_t *)&ev->rel_ignore;
+				maxbit = REL_MAX;
+				break;
+			case EV_ABS:
+				bitstr = (bitstr_t *)&ev->abs_ignore;
+				maxbit = ABS_MAX;
+				break;
+			default:
+				continue;
+			}
+
+			if (code == EVENT_CODE_UNDEFINED) {
+				if (enable)
+					bit_nclear(bitstr, 0, maxbit);
+				else
+					bit_nset(bitstr, 0, maxbit);
+			} else {
+				if (code > maxbit)
+					continue;
+				if (enable)
+					bit_clear(bitstr, code);
+				else
+					bit_set(bitstr, code);
+	                }
+	        }
+	}
+
+	if (quirks_get_tuples(q, QUIRK_ATTR_INPUT_PROP, &t)) {
+		for (size_t idx = 0; idx < t->ntuples; idx++) {
+			unsigned int p = t->tuples[idx].first;
+			bool enable = t->tuples[idx].second;
+
+			if (p > INPUT_PROP_MAX)
+				continue;
+			if (enable)
+				bit_clear(ev->prop_ignore, p);
+			else
+				bit_set(ev->prop_ignore, p);
+                }
+        }
+}
+
+static void
+r_init_buttons(struct quirks *q, const struct moused_opts *opts,
+    struct btstate *bt, struct e3bstate *e3b, const struct timespec *now)
+{
+	int i, j;
+
+	*bt = (struct btstate) {
+		.clickthreshold = DFLT_CLICKTHRESHOLD,
+		.zmap = { 0, 0, 0, 0 },
+	};
+
+	memcpy(bt->p2l, default_p2l, sizeof(bt->p2l));
+	for (i = 0; i < MOUSE_MAXBUTTON; ++i) {
+		j = i;
+		if (opts->p2l[i] != 0)
+			bt->p2l[i] = opts->p2l[i];
+		if (opts->pbutton[i] != 0)
+			j = opts->pbutton[i] - 1;
+		bt->mstate[i] = bt->bstate + j;
+	}
+
+	if (opts->zmap[0] != 0)
+		memcpy(bt->zmap, opts->zmap, sizeof(bt->zmap));
+	if (opts->clickthreshold >= 0)
+		bt->clickthreshold = opts->clickthreshold;
+	else
+		quirks_get_uint32(q, MOUSED_CLICK_THRESHOLD, &bt->clickthreshold);
+	if (opts->wmode != 0)
+		bt->wmode = opts->wmode;
+	else
+		quirks_get_uint32(q, MOUSED_WMODE, &bt->wmode);
+	if (bt->wmode != 0)
+		bt->wmode = 1 << (bt->wmode - 1);
+
+	/* fix Z axis mapping */
+	for (i = 0; i < MOUSED_ZMAP_MAXBUTTON; ++i) {
+		if (bt->zmap[i] <= 0)
+			continue;
+		for (j = 0; j < MOUSE_MAXBUTTON; ++j) {
+			if (bt->mstate[j] == &bt->bstate[bt->zmap[i] - 1])
+				bt->mstate[j] = &bt->zstate[i];
+		}
+		bt->zmap[i] = 1 << (bt->zmap[i] - 1);
+	}
+
+	*e3b = (struct e3bstate) {
+		.enabled = false,
+		.button2timeout = DFLT_BUTTON2TIMEOUT,
+	};
+	e3b->enabled = opts->e3b_enabled;
+	if (!e3b->enabled)
+		quirks_get_bool(q, MOUSED_EMULATE_THIRD_BUTTON, &e3b->enabled);
+	if (opts->e3b_button2timeout >= 0)
+		e3b->button2timeout = opts->e3b_button2timeout;
+	else
+		quirks_get_uint32(q, MOUSED_EMULATE_THIRD_BUTTON_TIMEOUT,
+		    &e3b->button2timeout);
+	e3b->mouse_button_state = S0;
+	e3b->mouse_button_state_ts = *now;
+	e3b->mouse_move_delayed = 0;
+
+	for (i = 0; i < MOUSE_MAXBUTTON; ++i) {
+		bt->bstate[i].count = 0;
+		bt->bstate[i].ts = *now;
+	}
+	for (i = 0; i < MOUSED_ZMAP_MAXBUTTON; ++i) {
+		bt->zstate[i].count = 0;
+		bt->zstate[i].ts = *now;
+	}
+}
+
+static void
+r_init_touchpad_hw(const struct evdev_caps *caps, struct quirks *q,
+    struct tpcaps *tphw, struct evstate *ev)
+{
+	const struct input_absinfo *ai;
+	const bitstr_t *key_bits = caps->key_bits;
+	const bitstr_t *abs_bits = caps->abs_bits;
+	const bitstr_t *prop_bits = caps->prop_bits;
+	struct quirk_range r;
+	struct quirk_dimensions dim;
+	u_int u;
+
+	if (!bit_test(ev->abs_ignore, ABS_X) &&
+	     bit_test(abs_bits, ABS_X)) {
+		ai = &caps->absinfo[ABS_X];
+		tphw->min_x = (ai->maximum > ai->minimum) ? ai->minimum : INT_MIN;
+		tphw->max_x = (ai->maximum > ai->minimum) ? ai->maximum : INT_MAX;
+		tphw->res_x = ai->resolution == 0 ?
+		    DFLT_TPAD_RESOLUTION : ai->resolution;
+	}
+	if (!bit_test(ev->abs_ignore, ABS_Y) &&
+	     bit_test(abs_bits, ABS_Y)) {
+		ai = &caps->absinfo[ABS_Y];
+		tphw->min_y = (ai->maximum > ai->minimum) ? ai->minimum : INT_MIN;
+		tphw->max_y = (ai->maximum > ai->minimum) ? ai->maximum : INT_MAX;
+		tphw->res_y = ai->resolution == 0 ?
+		    DFLT_TPAD_RESOLUTION : ai->resolution;
+	}
+	if (quirks_get_dimensions(q, QUIRK_ATTR_RESOLUTION_HINT, &dim)) {
+		tphw->res_x = dim.x;
+		tphw->res_y = dim.y;
+	} else if (tphw->max_x != INT_MAX && tphw->max_y != INT_MAX &&
+		   quirks_get_dimensions(q, QUIRK_ATTR_SIZE_HINT, &dim)) {
+		tphw->res_x = (tphw->max_x - tphw->min_x) / dim.x;
+		tphw->res_y = (tphw->max_y - tphw->min_y) / dim.y;
+	}
+	if (!bit_test(ev->key_ignore, BTN_TOUCH) &&
+	     bit_test(key_bits, BTN_TOUCH))
+		tphw->cap_touch = true;
+	/*
+	 * XXX: libinput uses ABS_MT_PRESSURE where available
+	 * Limits of zero mean the pressure axis could not be queried.
+	 */
+	ai = &caps->absinfo[ABS_PRESSURE];
+	if (!bit_test(ev->abs_ignore, ABS_PRESSURE) &&
+	     bit_test(abs_bits, ABS_PRESSURE) &&
+	     ai->maximum > ai->minimum) {
+		tphw->cap_pressure = true;
+		tphw->min_p = ai->minimum;
+		tphw->max_p = ai->maximum;
+	}
+	if (tphw->cap_pressure &&
+	    quirks_get_range(q, QUIRK_ATTR_PRESSURE_RANGE, &r)) {
+		if (r.upper == 0 && r.lower == 0) {
+			debug("pressure-based touch detection disabled");
+			tphw->cap_pressure = false;
+		} else if (r.upper > tphw->max_p || r.upper < tphw->min_p ||
+			   r.lower > tphw->max_p || r.lower < tphw->min_p) {
+			debug("discarding out-of-bounds pressure range %d:%d",
+			    r.lower, r.upper);
+			tphw->cap_pressure = false;
+		}
+	}
+	/* Multitouch touches are checked for palms by ABS_MT_TOUCH_MAJOR */
+	if (!bit_test(ev->abs_ignore, ABS_TOOL_WIDTH) &&
+	     bit_test(abs_bits, ABS_TOOL_WIDTH) &&
+	     quirks_get_uint32(q, QUIRK_ATTR_PALM_SIZE_THRESHOLD, &u) &&
+	     u != 0)
+		tphw->cap_width = true;
+	if (!bit_test(ev->abs_ignore, ABS_MT_SLOT) &&
+	     bit_test(abs_bits, ABS_MT_SLOT) &&
+	    !bit_test(ev->abs_ignore, ABS_MT_TRACKING_ID) &&
+	     bit_test(abs_bits, ABS_MT_TRACKING_ID) &&
+	    !bit_test(ev->abs_ignore, ABS_MT_POSITION_X) &&
+	     bit_test(abs_bits, ABS_MT_POSITION_X) &&
+	    !bit_test(ev->abs_ignore, ABS_MT_POSITION_Y) &&
+	     bit_test(abs_bits, ABS_MT_POSITION_Y)) {
+		tphw->is_mt = true;
+		tphw->nslots = MIN(caps->absinfo[ABS_MT_SLOT].maximum + 1,
+		    MAX_FINGERS);
+		tphw->cap_mt_major =
+		    !bit_test(ev->abs_ignore, ABS_MT_TOUCH_MAJOR) &&
+		     bit_test(abs_bits, ABS_MT_TOUCH_MAJOR);
+		tphw->cap_mt_pressure =
+		    !bit_test(ev->abs_ignore, ABS_MT_PRESSURE) &&
+		     bit_test(abs_bits, ABS_MT_PRESSURE);
+	}
+	if (!bit_test(ev->prop_ignore, INPUT_PROP_BUTTONPAD) &&
+	     bit_test(prop_bits, INPUT_PROP_BUTTONPAD))
+		tphw->is_clickpad = true;
+	if ( tphw->is_clickpad &&
+	    !bit_test(ev->prop_ignore, INPUT_PROP_TOPBUTTONPAD) &&
+	     bit_test(prop_bits, INPUT_PROP_TOPBUTTONPAD))
+		tphw->is_topbuttonpad = true;
+}
+
+/* Read 1-based button numbers of a gesture quirk, 0 stands for none */
+static void
+r_init_gesture_buttons(struct quirks *q, enum quirk quirk, u_int *buttons,
+    size_t nbuttons)
+{
+	const uint32_t *array;
+	size_t i, n;
+
+	if (!quirks_get_uint32_array(q, quirk, &array, &n))
+		return;
+	for (i = 0; i < n && i < nbuttons; i++) {
+		if (array[i] > MOUSE_MAXBUTTON) {
+			debug("invalid %s button %u", quirk_get_name(quirk),
+			    array[i]);
+			continue;
+		}
+		buttons[i] = array[i] != 0 ? 1 << (array[i] - 1) : 0;
+	}
+}
+
+static void
+r_init_touchpad_info(struct quirks *q, struct tpcaps *tphw,
+    struct tpinfo *tpinfo)
+{
+	struct quirk_range r;
+	int i;
+	u_int u;
+	int sz_x, sz_y;
+
+	*tpinfo = (struct tpinfo) {
+		.two_finger_scroll = true,
+		.natural_scroll = false,
+		.three_finger_drag = false,
+		.min_pressure_hi = 1,
+		.min_pressure_lo = 1,
+		.max_pressure = 130,
+		.max_width = 16,
+		.tap_timeout = 180,		/* ms */
+		.tap_threshold = 0,
+		.tap_max_delta = 1.3,		/* mm */
+		.taphold_timeout = 300,		/* ms */
+		.vscroll_min_delta = 1.25,	/* mm */
+		.vscroll_hor_area = 0.0,	/* mm */
+		.vscroll_ver_area = -15.0,	/* mm */
+		.swipe_distance = 10.0,		/* mm */
+		.pinch_distance = 8.0,		/* mm */
+		.smooth_cutoff = 1.0,		/* Hz */
+	};
+	double hyst = 0.25;			/* mm */
+	double beta = 0.5;			/* Hz per mm/s */
+	bool b;
+
+	quirks_get_bool(q, MOUSED_TWO_FINGER_SCROLL, &tpinfo->two_finger_scroll);
+	quirks_get_bool(q, MOUSED_NATURAL_SCROLL, &tpinfo->natural_scroll);
+	quirks_get_bool(q, MOUSED_THREE_FINGER_DRAG, &tpinfo->three_finger_drag);
+	quirks_get_uint32(q, MOUSED_TAP_TIMEOUT, &tpinfo->tap_timeout);
+	quirks_get_double(q, MOUSED_TAP_MAX_DELTA, &tpinfo->tap_max_delta);
+	quirks_get_uint32(q, MOUSED_TAPHOLD_TIMEOUT, &tpinfo->taphold_timeout);
+	quirks_get_double(q, MOUSED_VSCROLL_MIN_DELTA, &tpinfo->vscroll_min_delta);
+	quirks_get_double(q, MOUSED_VSCROLL_HOR_AREA, &tpinfo->vscroll_hor_area);
+	quirks_get_double(q, MOUSED_VSCROLL_VER_AREA, &tpinfo->vscroll_ver_area);
+	r_init_gesture_buttons(q, MOUSED_SWIPE3_BUTTONS,
+	    tpinfo->swipe_buttons[0], SWIPE_CNT);
+	r_init_gesture_buttons(q, MOUSED_SWIPE4_BUTTONS,
+	    tpinfo->swipe_buttons[1], SWIPE_CNT);
+	r_init_gesture_buttons(q, MOUSED_PINCH_BUTTONS,
+	    tpinfo->pinch_buttons, PINCH_CNT);
+	quirks_get_double(q, MOUSED_SWIPE_DISTANCE, &tpinfo->swipe_distance);
+	quirks_get_double(q, MOUSED_PINCH_DISTANCE, &tpinfo->pinch_distance);
+	quirks_get_double(q, MOUSED_HYSTERESIS, &hyst);
+	quirks_get_double(q, MOUSED_SMOOTHING_CUTOFF, &tpinfo->smooth_cutoff);
+	quirks_get_double(q, MOUSED_SMOOTHING_BETA, &beta);
+
+	/* Filter sensor noise in device units */
+	tpinfo->hyst_x = MAX(hyst, 0) * tphw->res_x;
+	tpinfo->hyst_y = MAX(hyst, 0) * tphw->res_y;
+	if ((quirks_get_bool(q, QUIRK_ATTR_TABLET_SMOOTHING, &b) && b) ||
+	    (quirks_get_bool(q, QUIRK_ATTR_USE_VELOCITY_AVERAGING, &b) && b))
+		tpinfo->smoothing = tpinfo->smooth_cutoff > 0;
+	tpinfo->smooth_beta_x = beta / tphw->res_x;
+	tpinfo->smooth_beta_y = beta / tphw->res_y;
+	if (tphw->is_clickpad &&
+	    quirks_get_bool(q, QUIRK_MODEL_TOUCHPAD_PHANTOM_CLICKS, &b))
+		tpinfo->phantom_clicks = b;
+
+	if (tphw->cap_pressure &&
+	    quirks_get_range(q, QUIRK_ATTR_PRESSURE_RANGE, &r)) {
+		tpinfo->min_pressure_lo = r.lower;
+		tpinfo->min_pressure_hi = r.upper;
+		quirks_get_uint32(q, QUIRK_ATTR_PALM_PRESSURE_THRESHOLD,
+		    &tpinfo->max_pressure);
+		quirks_get_uint32(q, MOUSED_TAP_PRESSURE_THRESHOLD,
+		    &tpinfo->tap_threshold);
+	}
+	if (tphw->cap_width)
+		quirks_get_uint32(q, QUIRK_ATTR_PALM_SIZE_THRESHOLD,
+		     &tpinfo->max_width);
+	/* Per-slot palm and thumb detection, thumbs rest in bottom 15% */
+	tpinfo->thumb_y = tphw->max_y - (tphw->max_y - tphw->min_y) * 15 / 100;
+	if (tphw->cap_mt_major) {
+		quirks_get_uint32(q, QUIRK_ATTR_PALM_SIZE_THRESHOLD,
+		    &tpinfo->palm_size);
+		quirks_get_uint32(q, QUIRK_ATTR_THUMB_SIZE_THRESHOLD,
+		    &tpinfo->thumb_size);
+		if (quirks_get_range(q, QUIRK_ATTR_TOUCH_SIZE_RANGE, &r) &&
+		    r.upper > r.lower && r.lower > 0) {
+			tpinfo->touch_size_hi = r.upper;
+			tpinfo->touch_size_lo = r.lower;
+		}
+	}
+	if (tphw->cap_mt_pressure) {
+		quirks_get_uint32(q, QUIRK_ATTR_PALM_PRESSURE_THRESHOLD,
+		    &tpinfo->palm_pressure);
+		quirks_get_uint32(q, QUIRK_ATTR_THUMB_PRESSURE_THRESHOLD,
+		    &tpinfo->thumb_pressure);
+	}
+	/* Set bottom quarter as 42% - 16% - 42% sized softbuttons */
+	if (tphw->is_clickpad) {
+		sz_x = tphw->max_x - tphw->min_x;
+		sz_y = tphw->max_y - tphw->min_y;
+		i = 25;
+		if (tphw->is_topbuttonpad)
+			i = -i;
+		quirks_get_int32(q, MOUSED_SOFTBUTTONS_Y, &i);
+		tpinfo->softbuttons_y = sz_y * i / 100;
+		u = 42;
+		quirks_get_uint32(q, MOUSED_SOFTBUTTON2_X, &u);
+		tpinfo->softbutton2_x = sz_x * u / 100;
+		u = 58;
+		quirks_get_uint32(q, MOUSED_SOFTBUTTON3_X, &u);
+		tpinfo->softbutton3_x = sz_x * u / 100;
+	}
+	r_init_touchpad_regions(tphw, tpinfo);
+}
+
+/*
+ * Turn margins, scroll edges, softbuttons and movement limits into bounds
+ * in device units, so classifying a packet takes a few integer compares.
+ * Empty ranges are set as min > max.
+ */
+static void
+r_init_touchpad_regions(struct tpcaps *tphw, struct tpinfo *tpinfo)
+{
+	int area, center_x, right_x;
+
+	tpinfo->clip_min_x = tpinfo->margin_left != 0 ?
+	    tphw->min_x + tpinfo->margin_left : INT_MIN;
+	tpinfo->clip_max_x = tpinfo->margin_right != 0 ?
+	    tphw->max_x - tpinfo->margin_right : INT_MAX;
+	tpinfo->clip_min_y = tpinfo->margin_bottom != 0 ?
+	    tphw->min_y + tpinfo->margin_bottom : INT_MIN;
+	tpinfo->clip_max_y = tpinfo->margin_top != 0 ?
+	    tphw->max_y - tpinfo->margin_top : INT_MAX;
+
+	/* Positive areas are measured from minimum, negative from maximum */
+	area = tpinfo->vscroll_hor_area * tphw->res_x;
+	tpinfo->hscroll_min_y = area < 0 ? tphw->max_y + area :
+	    area > 0 ? INT_MIN : INT_MAX;
+	tpinfo->hscroll_max_y = area > 0 ? tphw->min_y + area :
+	    area < 0 ? INT_MAX : INT_MIN;
+	area = tpinfo->vscroll_ver_area * tphw->res_y;
+	tpinfo->vscroll_min_x = area < 0 ? tphw->max_x + area :
+	    area > 0 ? INT_MIN : INT_MAX;
+	tpinfo->vscroll_max_x = area > 0 ? tphw->min_x + area :
+	    area < 0 ? INT_MAX : INT_MIN;
+
+	tpinfo->vscroll_min_dx = ceil(tpinfo->vscroll_min_delta * tphw->res_x);
+	tpinfo->vscroll_min_dy = ceil(tpinfo->vscroll_min_delta * tphw->res_y);
+	tpinfo->tap_max_dx = tpinfo->tap_max_delta * tphw->res_x;
+	tpinfo->tap_max_dy = tpinfo->tap_max_delta * tphw->res_y;
+
+	/* Softbuttons, the right one is checked first */
+	tpinfo->softbuttons_min_y = INT_MAX;
+	tpinfo->softbuttons_max_y = INT_MIN;
+	if (!tphw->is_clickpad)
+		return;
+	if (tpinfo->softbuttons_y < 0) {
+		tpinfo->softbuttons_min_y = INT_MIN;
+		tpinfo->softbuttons_max_y = tphw->min_y - tpinfo->softbuttons_y;
+	} else {
+		tpinfo->softbuttons_min_y = tphw->max_y - tpinfo->softbuttons_y;
+		tpinfo->softbuttons_max_y = INT_MAX;
+	}
+	center_x = tphw->min_x + tpinfo->softbutton2_x;
+	right_x = tphw->min_x + tpinfo->softbutton3_x;
+	tpinfo->softbutton_bt[0] = MOUSE_BUTTON3DOWN;
+	tpinfo->softbutton_bt[1] = MOUSE_BUTTON2DOWN;
+	if (center_x > 0 && right_x > 0 && center_x > right_x) {
+		center_x = tphw->min_x + tpinfo->softbutton3_x;
+		right_x = tphw->min_x + tpinfo->softbutton2_x;
+		tpinfo->softbutton_bt[0] = MOUSE_BUTTON2DOWN;
+		tpinfo->softbutton_bt[1] = MOUSE_BUTTON3DOWN;
+	}
+	tpinfo->softbutton_x[0] = right_x > 0 ? right_x : INT_MAX;
+	tpinfo->softbutton_x[1] = center_x > 0 ? center_x : INT_MAX;
+}
+
+static void
+r_init_touchpad_accel(struct tpcaps *tphw, struct tpinfo *tpinfo,
+    struct accel *accel)
+{
+	/* Normalize pointer movement to match 200dpi mouse */
+	accel->accelx *= DFLT_MOUSE_RESOLUTION;
+	accel->accelx /= tphw->res_x;
+	accel->accely *= DFLT_MOUSE_RESOLUTION;
+	accel->accely /= tphw->res_y;
+	/*
+	 * Scrolling is scaled to lines in the gesture stage and leaves it in
+	 * 1/WHEEL_DETENT of a line, which then is not accelerated again.
+	 */
+	tpinfo->scroll_scale_x = accel->accelz * WHEEL_DETENT *
+	    DFLT_MOUSE_RESOLUTION / (tphw->res_x * DFLT_LINEHEIGHT);
+	tpinfo->scroll_scale_y = accel->accelz * WHEEL_DETENT *
+	    DFLT_MOUSE_RESOLUTION / (tphw->res_y * DFLT_LINEHEIGHT);
+	accel->accelz = 1.0;
+}
+
+static void
+r_init_touchpad_gesture(struct tpstate *gest)
+{
+	gest->state = G_IDLE;
+	tsclr(&gest->deadline);
+}
+
+static int
+r_init_drift(struct quirks *q, const struct moused_opts *opts,
+    struct drift *d)
+{
+	if (opts->drift_terminate) {
+		d->terminate = true;
+		d->distance = opts->drift_distance;
+		d->time = opts->drift_time;
+		d->after = opts->drift_after;
+	} else if (quirks_get_bool(q, MOUSED_DRIFT_TERMINATE, &d->terminate) &&
+		   d->terminate) {
+		quirks_get_uint32(q, MOUSED_DRIFT_DISTANCE, &d->distance);
+		quirks_get_uint32(q, MOUSED_DRIFT_TIME, &d->time);
+		quirks_get_uint32(q, MOUSED_DRIFT_AFTER, &d->after);
+	} else
+		return (0);
+
+	if (d->distance == 0 || d->time == 0 || d->after == 0) {
+		r_log(LOG_ERR, "invalid drift parameter");
+		return (EINVAL);
+	}
+
+	debug("terminate drift: distance %d, time %d, after %d",
+	    d->distance, d->time, d->after);
+
+	d->time_ts = msec2ts(d->time);
+	d->twotime_ts = msec2ts(d->time * 2);
+	d->after_ts = msec2ts(d->after);
+
+	return (0);
+}
+
+static void
+r_init_debounce(struct quirks *q, struct debounce *db)
+{
+	bool bouncing = false;
+
+	*db = (struct debounce) {
+		.time = DFLT_DEBOUNCE_TIME,
+	};
+	quirks_get_uint32(q, MOUSED_DEBOUNCE_TIME, &db->time);
+	/*
+	 * As in libinput, the model quirk marks devices which emit quick
+	 * button sequences on purpose, like emulated mice.
+	 */
+	quirks_get_bool(q, QUIRK_MODEL_BOUNCING_KEYS, &bouncing);
+	if (bouncing) {
+		debug("debouncing disabled by model quirk");
+		db->time = 0;
+	}
+}
+
+/* Run after r_init_scroll() and r_init_accel(), it adjusts both */
+static void
+r_init_stick(struct quirks *q, struct scroll *scroll, struct accel *accel,
+    struct stick *st)
+{
+	double mult = 1.0;
+
+	quirks_get_double(q, QUIRK_ATTR_TRACKPOINT_MULTIPLIER, &mult);
+	if (mult <= 0) {
+		debug("invalid trackpoint multiplier, ignored");
+		mult = 1.0;
+	}
+	/* Scale stick movement the way libinput does, before the curve */
+	accel->accelx *= mult;
+	accel->accely *= mult;
+
+	*st = (struct stick) {
+		.multiplier = mult,
+		.scale = mult * WHEEL_DETENT / MAX(scroll->speed, 1),
+		.threshold = scroll->threshold,
+	};
+	/* Middle button scrolling is done by r_stick() */
+	scroll->enable_vert = scroll->enable_hor = false;
+}
+
+static void
+r_init_accel(struct quirks *q, const struct moused_opts *opts,
+    struct accel *acc)
+{
+	bool r1, r2;
+
+	acc->accelx = opts->accelx;
+	if (opts->accelx == 1.0)
+		 quirks_get_double(q, MOUSED_LINEAR_ACCEL_X, &acc->accelx);
+	acc->accely = opts->accely;
+	if (opts->accely == 1.0)
+		 quirks_get_double(q, MOUSED_LINEAR_ACCEL_Y, &acc->accely);
+	if (!quirks_get_double(q, MOUSED_LINEAR_ACCEL_Z, &acc->accelz))
+		acc->accelz = 1.0;
+	acc->lastlength[0] = acc->lastlength[1] = acc->lastlength[2] = 0.0;
+	if (opts->exp_accel) {
+		acc->is_exponential = true;
+		acc->expoaccel = opts->expoaccel;
+		acc->expoffset = opts->expoffset;
+		return;
+	}
+	acc->expoaccel = acc->expoffset = 1.0;
+	r1 = quirks_get_double(q, MOUSED_EXPONENTIAL_ACCEL, &acc->expoaccel);
+	r2 = quirks_get_double(q, MOUSED_EXPONENTIAL_OFFSET, &acc->expoffset);
+	if (r1 || r2)
+		acc->is_exponential = true;
+}
+
+static void
+r_init_scroll(struct quirks *q, const struct moused_opts *opts,
+    struct scroll *scroll)
+{
+	*scroll = (struct scroll) {
+		.threshold = DFLT_SCROLLTHRESHOLD,
+		.speed = DFLT_SCROLLSPEED,
+		.state = SCROLL_NOTSCROLLING,
+	};
+	scroll->enable_vert = opts->virtual_scroll;
+	if (!opts->virtual_scroll)
+		quirks_get_bool(q, MOUSED_VIRTUAL_SCROLL_ENABLE, &scroll->enable_vert);
+	scroll->enable_hor = opts->hvirtual_scroll;
+	if (!opts->hvirtual_scroll)
+		quirks_get_bool(q, MOUSED_HOR_VIRTUAL_SCROLL_ENABLE, &scroll->enable_hor);
+	if (opts->scroll_speed >= 0)
+		scroll->speed = opts->scroll_speed;
+	else
+		quirks_get_uint32(q, MOUSED_VIRTUAL_SCROLL_SPEED, &scroll->speed);
+	if (opts->scroll_threshold >= 0)
+		scroll->threshold = opts->scroll_threshold;
+	else
+		quirks_get_uint32(q, MOUSED_VIRTUAL_SCROLL_THRESHOLD, &scroll->threshold);
+}
+
+static void
+r_init_kinetic(struct quirks *q, struct kinetic *kin)
+{
+	*kin = (struct kinetic) {
+		.friction = DFLT_KINETIC_FRICTION,
+		.min_speed = DFLT_KINETIC_MIN_SPEED,
+		.window = DFLT_KINETIC_WINDOW,
+	};
+	quirks_get_bool(q, MOUSED_KINETIC_SCROLL, &kin->enable);
+	quirks_get_double(q, MOUSED_KINETIC_SCROLL_FRICTION, &kin->friction);
+	quirks_get_double(q, MOUSED_KINETIC_SCROLL_MIN_SPEED, &kin->min_speed);
+	quirks_get_uint32(q, MOUSED_KINETIC_SCROLL_WINDOW, &kin->window);
+	if (kin->friction <= 0 || kin->min_speed <= 0 || kin->window == 0) {
+		debug("invalid kinetic scroll parameters, disabled");
+		kin->enable = false;
+	}
+	kin->decay = exp(-kin->friction * KINETIC_PERIOD / 1000.0);
+}
+
+/*
+ * Debounce the buttons of an assembled report.  An edge of a button
+ * within the window of its previous one is held back, the button then
+ * goes on at its passed level until the window closes.
+ */
+static int
+r_debounce(struct moused_dev *md, int flags)
+{
+	struct debounce *db = &md->debounce;
+	mousestatus_t *action0 = &md->action0;	/* original mouse action */
+	int changed, i;
+
+	if (db->time == 0)
+		return (flags);
+
+	db->raw = action0->button;
+	for (changed = db->raw ^ db->state; changed != 0;
+	    changed &= ~(1 << i)) {
+		i = ffs(changed) - 1;
+		if (tscmp(&md->now, &db->until[i], <))
+			continue;
+		db->state ^= 1 << i;
+		db->until[i] = tsaddms(&md->now, db->time);
+	}
+	action0->button = db->state;
+	action0->flags = (flags & MOUSE_POSCHANGED) |
+	    (action0->obutton ^ action0->button);
+
+	return (action0->flags);
+}
+
+/*
+ * Scroll with a pointing stick while the middle button is held.  The
+ * button is held back, if the stick does not move before it is released
+ * within STICK_CLICK_TIME, r_stick_flush() makes a click of it.
+ */
+static int
+r_stick(struct moused_dev *md, int flags)
+{
+	struct stick *st = &md->stick;
+	struct evstate *ev = &md->ev;
+	mousestatus_t *action0 = &md->action0;	/* original mouse action */
+	struct timespec ts;
+	double fz, fw;
+	bool middle;
+
+	middle = (action0->button & MOUSE_BUTTON2DOWN) != 0;
+	if (st->state == STICK_IDLE) {
+		if (!middle)
+			return (flags);
+		st->state = STICK_HELD;
+		st->mx = st->my = 0;
+		st->pressed = md->now;
+	} else if (!middle) {
+		ts = tsaddms(&st->pressed, STICK_CLICK_TIME);
+		if (st->state == STICK_HELD && tscmp(&md->now, &ts, <)) {
+			action0->button |= MOUSE_BUTTON2DOWN;
+			st->click = true;
+		}
+		st->state = STICK_IDLE;
+		action0->flags = (flags & MOUSE_POSCHANGED) |
+		    (action0->obutton ^ action0->button);
+		return (action0->flags);
+	}
+
+	if (st->state == STICK_HELD) {
+		st->mx += action0->dx;
+		st->my += action0->dy;
+		if (abs(st->mx) * st->multiplier > st->threshold ||
+		    abs(st->my) * st->multiplier > st->threshold) {
+			debug("pointing stick scrolling");
+			st->state = STICK_SCROLL;
+			st->rz = st->rw = 0;
+		}
+	}
+	if (st->state == STICK_SCROLL) {
+		fz = action0->dy * st->scale + st->rz;
+		fw = action0->dx * st->scale + st->rw;
+		ev->hr_dz += lround(fz);
+		ev->hr_dw += lround(fw);
+		st->rz = fz - lround(fz);
+		st->rw = fw - lround(fw);
+	}
+
+	action0->dx = action0->dy = 0;
+	action0->button &= ~MOUSE_BUTTON2DOWN;
+	action0->flags = action0->obutton ^ action0->button;
+
+	return (action0->flags);
+}
+
+/* Release the middle button clicked by r_stick() in a packet of its own */
+static void
+r_stick_flush(struct moused_dev *md)
+{
+	mousestatus_t *act = &md->action0;
+
+	if (!md->stick.click)
+		return;
+	md->stick.click = false;
+	act->obutton = act->button;
+	act->button &= ~MOUSE_BUTTON2DOWN;
+	act->dx = act->dy = act->dz = 0;
+	act->flags = act->obutton ^ act->button;
+	r_feed(md, act->flags);
+}
+
+/*
+ * Add hi-res wheel movement to the remainder and take whole detents out
+ * of it.  A turn in the opposite direction drops the remainder.
+ */
+static int
+r_wheel_detents(int *acc, int hires)
+{
+	int detents;
+
+	if ((hires > 0 && *acc < 0) || (hires < 0 && *acc > 0))
+		*acc = 0;
+	*acc += hires;
+	detents = *acc / WHEEL_DETENT;
+	*acc -= detents * WHEEL_DETENT;
+
+	return (detents);
+}
+
+/*
+ * Finish wheel movement of an assembled report.  It is handed over to the
+ * wheel consumer if there is one, otherwise whole detents are added to
+ * the action.  sysmouse carries the horizontal wheel as dz = +-2, one
+ * step per packet and only if the vertical one is still, the rest is
+ * kept for r_wheel_flush().
+ */
+static int
+r_wheel(struct moused_dev *md, int flags)
+{
+	struct evstate *ev = &md->ev;
+	mousestatus_t *act = &md->action0;
+	struct moused_wheel mw;
+	int dw;
+
+	if (md->wheel != NULL && md->btstate.zmap[0] == 0) {
+		if (ev->hr_dz == 0 && ev->hr_dw == 0)
+			return (flags);
+		mw.hires_dz = ev->hr_dz;
+		mw.hires_dw = ev->hr_dw;
+		mw.dz = r_wheel_detents(&ev->acc_dz, ev->hr_dz);
+		mw.dw = r_wheel_detents(&ev->acc_dw, ev->hr_dw);
+		ev->hr_dz = ev->hr_dw = 0;
+		trace(&md->trace, TRACE_WHEEL, mw.dz, mw.dw, mw.hires_dz,
+		    mw.hires_dw);
+		md->wheel(md->arg, &mw);
+		return (flags);
+	}
+
+	act->dz = r_wheel_detents(&ev->acc_dz, ev->hr_dz);
+	dw = r_wheel_detents(&ev->acc_dw, ev->hr_dw);
+	ev->hr_dz = ev->hr_dw = 0;
+	if (act->dz == 0 && dw != 0) {
+		act->dz = dw > 0 ? 2 : -2;
+		dw -= act->dz / 2;
+	}
+	ev->acc_dw += dw * WHEEL_DETENT;
+	if (act->dz != 0)
+		act->flags |= MOUSE_POSCHANGED;
+
+	return (act->flags);
+}
+
+/* Pass horizontal detents left by r_wheel() in packets of their own */
+static void
+r_wheel_flush(struct moused_dev *md)
+{
+	mousestatus_t *act = &md->action0;
+
+	while (md->ev.acc_dw / WHEEL_DETENT != 0) {
+		act->obutton = act->button;
+		act->dx = act->dy = 0;
+		act->dz = md->ev.acc_dw > 0 ? 2 : -2;
+		md->ev.acc_dw -= act->dz / 2 * WHEEL_DETENT;
+		act->flags = MOUSE_POSCHANGED;
+		r_feed(md, act->flags);
+	}
+}
+
+/* Scale touchpad scrolling to 1/WHEEL_DETENT of a line */
+static int
+r_scroll(struct tpad *tp, int delta, double scale)
+{
+	double fdelta;
+	int move;
+
+	fdelta = delta * scale + tp->gest.scroll_remain;
+	move = lround(fdelta);
+	tp->gest.scroll_remain = fdelta - move;
+
+	return (move);
+}
+
+static int
+r_protocol_evdev(enum moused_device_type type, struct tpad *tp,
+    struct evstate *ev, struct trace_ring *tr, const struct input_event *ie,
+    mousestatus_t *act)
+{
+	const struct tpcaps *tphw = &tp->hw;
+	const struct tpinfo *tpinfo = &tp->info;
+	struct mtstate *mt = &ev->mt;
+
+	static const int butmapev[8] = {	/* evdev */
+	    0,
+	    MOUSE_BUTTON1DOWN,
+	    MOUSE_BUTTON3DOWN,
+	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN,
+	    MOUSE_BUTTON2DOWN,
+	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN,
+	    MOUSE_BUTTON2DOWN | MOUSE_BUTTON3DOWN,
+	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN | MOUSE_BUTTON3DOWN
+	};
+	struct timespec ietime;
+	enum gesture gest;
+	int buttons, nfingers, x, y, z, i;
+
+	/* Drop ignored codes */
+	switch (ie->type) {
+	case EV_REL:
+		if (bit_test(ev->rel_ignore, ie->code))
+			return (0);
+	case EV_ABS:
+		if (bit_test(ev->abs_ignore, ie->code))
+			return (0);
+	case EV_KEY:
+		if (bit_test(ev->key_ignore, ie->code))
+			return (0);
+	}
+
+	switch (ie->type) {
+	case EV_REL:
+		switch (ie->code) {
+		case REL_X:
+			ev->dx += ie->value;
+			break;
+		case REL_Y:
+			ev->dy += ie->value;
+			break;
+		case REL_WHEEL:
+			if (!ev->hires_wheel)
+				ev->hr_dz += ie->value * WHEEL_DETENT;
+			break;
+		case REL_HWHEEL:
+			if (!ev->hires_hwheel)
+				ev->hr_dw += ie->value * WHEEL_DETENT;
+			break;
+		case REL_WHEEL_HI_RES:
+			ev->hr_dz += ie->value;
+			break;
+		case REL_HWHEEL_HI_RES:
+			ev->hr_dw += ie->value;
+			break;
+		}
+		break;
+	case EV_ABS:
+		switch (ie->code) {
+		case ABS_X:
+			if (!tphw->is_mt)
+				ev->dx += ie->value - ev->st.x;
+			ev->st.x = ie->value;
+			break;
+		case ABS_Y:
+			if (!tphw->is_mt)
+				ev->dy += ie->value - ev->st.y;
+			ev->st.y = ie->value;
+			break;
+		case ABS_PRESSURE:
+			ev->st.p = ie->value;
+			break;
+		case ABS_TOOL_WIDTH:
+			ev->st.w = ie->value;
+			break;
+		case ABS_MT_SLOT:
+			if (tphw->is_mt)
+				mt->slot = ie->value;
+			break;
+		case ABS_MT_TRACKING_ID:
+			if (!tphw->is_mt ||
+			    mt->slot < 0 || mt->slot >= MAX_FINGERS)
+				break;
+			if (ie->value == -1) {
+				mt->active &= ~(1 << mt->slot);
+				mt->rest &= ~(1 << mt->slot);
+				mt->touch &= ~(1 << mt->slot);
+				mt->low &= ~(1 << mt->slot);
+				break;
+			}
+			if (mt->active & (1 << mt->slot) &&
+			    ie->value != mt->id[mt->slot]) {
+				debug("tracking id changed %d->%d",
+				    mt->id[mt->slot], ie->value);
+				/* New touch, do not take it as movement */
+				mt->otouch &= ~(1 << mt->slot);
+				mt->rest &= ~(1 << mt->slot);
+				mt->low &= ~(1 << mt->slot);
+			}
+			mt->id[mt->slot] = ie->value;
+			mt->active |= 1 << mt->slot;
+			break;
+		case ABS_MT_POSITION_X:
+			if (tphw->is_mt &&
+			    mt->slot >= 0 && mt->slot < MAX_FINGERS)
+				mt->x[mt->slot] = ie->value;
+			break;
+		case ABS_MT_POSITION_Y:
+			if (tphw->is_mt &&
+			    mt->slot >= 0 && mt->slot < MAX_FINGERS)
+				mt->y[mt->slot] = ie->value;
+			break;
+		case ABS_MT_PRESSURE:
+			if (tphw->is_mt &&
+			    mt->slot >= 0 && mt->slot < MAX_FINGERS)
+				mt->p[mt->slot] = ie->value;
+			break;
+		case ABS_MT_TOUCH_MAJOR:
+			if (tphw->is_mt &&
+			    mt->slot >= 0 && mt->slot < MAX_FINGERS)
+				mt->w[mt->slot] = ie->value;
+			break;
+		}
+		break;
+	case EV_KEY:
+		switch (ie->code) {
+		case BTN_TOUCH:
+			ev->st.id = ie->value != 0 ? 1 : 0;
+			break;
+		case BTN_TOOL_FINGER:
+			ev->nfingers = ie->value != 0 ? 1 : ev->nfingers;
+			break;
+		case BTN_TOOL_DOUBLETAP:
+			ev->nfingers = ie->value != 0 ? 2 : ev->nfingers;
+			break;
+		case BTN_TOOL_TRIPLETAP:
+			ev->nfingers = ie->value != 0 ? 3 : ev->nfingers;
+			break;
+		case BTN_TOOL_QUADTAP:
+			ev->nfingers = ie->value != 0 ? 4 : ev->nfingers;
+			break;
+		case BTN_TOOL_QUINTTAP:
+			ev->nfingers = ie->value != 0 ? 5 : ev->nfingers;
+			break;
+		case BTN_LEFT ... BTN_LEFT + 7:
+			ev->buttons &= ~(1 << (ie->code - BTN_LEFT));
+			ev->buttons |= ((!!ie->value) << (ie->code - BTN_LEFT));
+			break;
+		}
+		break;
+	}
+
+	if ( ie->type != EV_SYN ||
+	    (ie->code != SYN_REPORT && ie->code != SYN_DROPPED))
+		return (0);
+
+	/*
+	 * assembly full package
+	 */
+
+	ietime.tv_sec = ie->time.tv_sec;
+	ietime.tv_nsec = ie->time.tv_usec * 1000;
+
+	if (!tphw->cap_pressure && ev->st.id != 0)
+		ev->st.p = MAX(tpinfo->min_pressure_hi, tpinfo->tap_threshold);
+	if (tphw->cap_touch && ev->st.id == 0)
+		ev->st.p = 0;
+
+	buttons = ev->buttons;
+	if (type == MOUSED_TYPE_TOUCHPAD && tpinfo->phantom_clicks)
+		buttons &= ~r_phantom_click(tp, ev, &ietime);
+
+	act->obutton = act->button;
+	act->button = butmapev[buttons & MOUSE_SYS_STDBUTTONS];
+	act->button |= (buttons & ~MOUSE_SYS_STDBUTTONS);
+
+	if (type == MOUSED_TYPE_TOUCHPAD) {
+		/*
+		 * Count fingers by slots unless the device reports more of
+		 * them than it can track.  Pointer follows the fastest one.
+		 */
+		nfingers = ev->nfingers;
+		z = ev->st.p;
+		if (tphw->is_mt)
+			r_mt_palm(tp, mt);
+		if (r_jitter_frame(tp, ev, &ietime))
+			atomic_fetch_add_explicit(&ev->suppressed, 1,
+			    memory_order_relaxed);
+		x = ev->jx;
+		y = ev->jy;
+		if (tphw->is_mt) {
+			r_mt_frame(mt);
+			if (nfingers <= tphw->nslots)
+				nfingers = mt->nfingers;
+			else
+				nfingers -= mt->nrest;
+			ev->dx = mt->fdx;
+			ev->dy = mt->fdy;
+		}
+		/* Single-touch emulation may follow a palm, take a finger */
+		if (tphw->is_mt && (mt->active & ~mt->touch) != 0) {
+			if (mt->touch != 0) {
+				i = ffs(mt->touch) - 1;
+				x = mt->fx[i];
+				y = mt->fy[i];
+				if (tphw->cap_mt_pressure)
+					z = mt->p[i];
+			} else
+				z = 0;
+		}
+		trace(tr, TRACE_ABS, x, y, z, ev->st.w);
+		gest = r_gestures(tp, x, y, z, ev->st.w,
+		    nfingers, tphw->is_mt ? mt : NULL, &ietime, act);
+		switch (gest) {
+		case GEST_IGNORE:
+			ev->dx = 0;
+			ev->dy = 0;
+			ev->hr_dz = ev->hr_dw = 0;
+			ev->acc_dx = ev->acc_dy = 0;
+			break;
+		case GEST_ACCUMULATE:	/* Revertable pointer movement. */
+			ev->acc_dx += ev->dx;
+			ev->acc_dy += ev->dy;
+			ev->dx = 0;
+			ev->dy = 0;
+			break;
+		case GEST_MOVE:		/* Pointer movement. */
+			ev->dx += ev->acc_dx;
+			ev->dy += ev->acc_dy;
+			ev->acc_dx = ev->acc_dy = 0;
+			break;
+		case GEST_VSCROLL:	/* Vertical scrolling. */
+			ev->hr_dz += r_scroll(tp, tpinfo->natural_scroll ?
+			    -ev->dy : ev->dy, tpinfo->scroll_scale_y);
+			ev->dx = -ev->acc_dx;
+			ev->dy = -ev->acc_dy;
+			ev->acc_dx = ev->acc_dy = 0;
+			break;
+		case GEST_HSCROLL:	/* Horizontal scrolling. */
+			ev->hr_dw += r_scroll(tp, tpinfo->natural_scroll ?
+			    -ev->dx : ev->dx, tpinfo->scroll_scale_x);
+			ev->dx = -ev->acc_dx;
+			ev->dy = -ev->acc_dy;
+			ev->acc_dx = ev->acc_dy = 0;
+			break;
+		}
+		trace(tr, TRACE_GESTURE, gest, ev->dx, ev->dy,
+		    gest == GEST_HSCROLL ? ev->hr_dw : ev->hr_dz);
+	}
+
+	/* Wheel movement is added by r_wheel() */
+	act->dx = ev->dx;
+	act->dy = ev->dy;
+	act->dz = 0;
+	ev->dx = ev->dy = 0;
+
+	/* has something changed? */
+	act->flags = ((act->dx || act->dy || act->dz) ? MOUSE_POSCHANGED : 0)
+	    | (act->obutton ^ act->button);
+
+	return (act->flags);
+}
+
+static int
+r_protocol_sysmouse(const uint8_t *pBuf, mousestatus_t *act)
+{
+	static const int butmapmsc[8] = { /* sysmouse */
+	    0,
+	    MOUSE_BUTTON3DOWN,
+	    MOUSE_BUTTON2DOWN,
+	    MOUSE_BUTTON2DOWN | MOUSE_BUTTON3DOWN,
+	    MOUSE_BUTTON1DOWN,
+	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN,
+	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN,
+	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN | MOUSE_BUTTON3DOWN
+	};
+
+	if ((pBuf[0] & MOUSE_SYS_SYNCMASK) != MOUSE_SYS_SYNC)
+		return (0);
+
+	act->button = butmapmsc[(~pBuf[0]) & MOUSE_SYS_STDBUTTONS];
+	act->dx =    (signed char)(pBuf[1]) + (signed char)(pBuf[3]);
+	act->dy = - ((signed char)(pBuf[2]) + (signed char)(pBuf[4]));
+	act->dz = ((signed char)(pBuf[5] << 1) + (signed char)(pBuf[6] << 1)) >> 1;
+	act->button |= ((~pBuf[7] & MOUSE_SYS_EXTBUTTONS) << 3);
+
+	/* has something changed? */
+	act->flags = ((act->dx || act->dy || act->dz) ? MOUSE_POSCHANGED : 0)
+	    | (act->obutton ^ act->button);
+
+	return (act->flags);
+}
+
+/*
+ * Tell fingers from palms and resting thumbs.  A slot is classified as
+ * soon as its touch looks like one and keeps the class until the touch
+ * is lifted.  Only touches which began in the thumb area can be thumbs.
+ * Touch size hysteresis, if configured, decides when a finger touches.
+ */
+static void
+r_mt_palm(const struct tpad *tp, struct mtstate *mt)
+{
+	const struct tpinfo *tpinfo = &tp->info;
+	u_int fresh = mt->active & ~mt->rest & ~mt->touch;
+	u_int bit;
+	int i;
+
+	for (i = 0; i < MAX_FINGERS; i++) {
+		bit = 1 << i;
+		if ((mt->active & ~mt->rest & bit) == 0)
+			continue;
+		if ((fresh & bit) != 0 && mt->y[i] > tpinfo->thumb_y)
+			mt->low |= bit;
+		if ((tpinfo->palm_size != 0 &&
+		     (u_int)mt->w[i] > tpinfo->palm_size) ||
+		    (tpinfo->palm_pressure != 0 &&
+		     (u_int)mt->p[i] > tpinfo->palm_pressure) ||
+		    ((mt->low & bit) != 0 &&
+		     ((tpinfo->thumb_size != 0 &&
+		       (u_int)mt->w[i] > tpinfo->thumb_size) ||
+		      (tpinfo->thumb_pressure != 0 &&
+		       (u_int)mt->p[i] > tpinfo->thumb_pressure)))) {
+			debug("slot %d: palm or thumb, size %d pressure %d",
+			    i, mt->w[i], mt->p[i]);
+			mt->rest |= bit;
+			mt->touch &= ~bit;
+			continue;
+		}
+		if (tpinfo->touch_size_lo == 0 ||
+		    (u_int)mt->w[i] >= tpinfo->touch_size_hi)
+			mt->touch |= bit;
+		else if ((u_int)mt->w[i] < tpinfo->touch_size_lo)
+			mt->touch &= ~bit;
+	}
+}
+
+/*
+ * Filter sensor noise out of a touch position.  The position sticks until
+ * the touch moves past the hysteresis margin and then trails it by the
+ * margin.  The 1-euro filter, if enabled, smooths the result with a cutoff
+ * rising with speed, so a slow touch is steady and a fast one does not
+ * lag.  A reset starts over at the raw position.
+ */
+static void
+r_jitter(const struct tpinfo *tpinfo, struct jitter *j, int x, int y,
+    double dt, bool reset, int *fx, int *fy)
+{
+	j->rx = x;
+	j->ry = y;
+	if (reset) {
+		j->hx = x;
+		j->hy = y;
+		j->sx = x;
+		j->sy = y;
+		j->vx = j->vy = 0;
+	} else {
+		if (x > j->hx + tpinfo->hyst_x)
+			j->hx = x - tpinfo->hyst_x;
+		else if (x < j->hx - tpinfo->hyst_x)
+			j->hx = x + tpinfo->hyst_x;
+		if (y > j->hy + tpinfo->hyst_y)
+			j->hy = y - tpinfo->hyst_y;
+		else if (y < j->hy - tpinfo->hyst_y)
+			j->hy = y + tpinfo->hyst_y;
+	}
+	if (!tpinfo->smoothing) {
+		*fx = j->hx;
+		*fy = j->hy;
+		return;
+	}
+	if (!reset) {
+		j->vx += ALPHA(JITTER_DCUTOFF, dt) *
+		    ((j->hx - j->sx) / dt - j->vx);
+		j->vy += ALPHA(JITTER_DCUTOFF, dt) *
+		    ((j->hy - j->sy) / dt - j->vy);
+		j->sx += ALPHA(tpinfo->smooth_cutoff +
+		    tpinfo->smooth_beta_x * fabs(j->vx), dt) * (j->hx - j->sx);
+		j->sy += ALPHA(tpinfo->smooth_cutoff +
+		    tpinfo->smooth_beta_y * fabs(j->vy), dt) * (j->hy - j->sy);
+	}
+	*fx = lround(j->sx);
+	*fy = lround(j->sy);
+}
+
+/*
+ * Tell clickpad presses made by the hardware on its own.  Some clickpads
+ * report BTN_LEFT with nothing on the surface or just after the last
+ * finger lifted.  Such a press is dropped until it is released.  Returns
+ * the evdev buttons to leave out of the frame.
+ */
+static int
+r_phantom_click(const struct tpad *tp, struct evstate *ev,
+    const struct timespec *time)
+{
+	struct timespec window;
+	bool touch, down;
+
+	touch = ev->st.p != 0 || (tp->hw.is_mt && ev->mt.active != 0);
+	if (!touch && ev->ptouch)
+		ev->lift = *time;
+	ev->ptouch = touch;
+
+	down = (ev->buttons & 1) != 0;
+	if (down && !ev->click) {
+		window = tsaddms(&ev->lift, PHANTOM_CLICK_WINDOW);
+		ev->phantom = !touch || tscmp(time, &window, <);
+		if (ev->phantom)
+			debug("phantom click dropped");
+	}
+	ev->click = down;
+
+	return (ev->click && ev->phantom ? 1 : 0);
+}
+
+/*
+ * Pass touch positions of a frame through the jitter filter.  Touches
+ * starting in the frame are not filtered.  Single-touch movement is
+ * taken from the filtered position.  Returns true if the filter held
+ * back all the movement of the frame.
+ */
+static bool
+r_jitter_frame(const struct tpad *tp, struct evstate *ev,
+    const struct timespec *time)
+{
+	const struct tpinfo *tpinfo = &tp->info;
+	struct mtstate *mt = &ev->mt;
+	bool held, moved = false, kept = true;
+	double dt;
+	int i, ox, oy;
+
+	dt = (time->tv_sec - ev->jtime.tv_sec) +
+	    (time->tv_nsec - ev->jtime.tv_nsec) / 1e9;
+	if (dt <= 0 || dt > JITTER_MAXDT)
+		dt = JITTER_MAXDT;
+	ev->jtime = *time;
+
+	if (tp->hw.is_mt) {
+		for (i = 0; i < MAX_FINGERS; i++) {
+			if ((mt->touch & (1 << i)) == 0)
+				continue;
+			held = (mt->otouch & (1 << i)) != 0;
+			moved |= held && (mt->x[i] != mt->jit[i].rx ||
+			    mt->y[i] != mt->jit[i].ry);
+			ox = mt->fx[i];
+			oy = mt->fy[i];
+			r_jitter(tpinfo, &mt->jit[i], mt->x[i], mt->y[i], dt,
+			    !held, &mt->fx[i], &mt->fy[i]);
+			kept &= !held || (mt->fx[i] == ox && mt->fy[i] == oy);
+		}
+	}
+
+	/* Single-touch position is used by gestures on multitouch too */
+	held = ev->jtouch;
+	ev->jtouch = ev->st.p != 0;
+	if (!ev->jtouch)
+		return (moved && kept);
+	if (!tp->hw.is_mt)
+		moved = held &&
+		    (ev->st.x != ev->jit.rx || ev->st.y != ev->jit.ry);
+	ox = ev->jx;
+	oy = ev->jy;
+	r_jitter(tpinfo, &ev->jit, ev->st.x, ev->st.y, dt, !held,
+	    &ev->jx, &ev->jy);
+	if (!tp->hw.is_mt && held) {
+		ev->dx = ev->jx - ox;
+		ev->dy = ev->jy - oy;
+		kept = ev->dx == 0 && ev->dy == 0;
+	}
+
+	return (moved && kept);
+}
+
+/*
+ * Close multitouch frame: take movement of the slots touched in both
+ * frames, count touches and find their centroid and the fastest one.
+ */
+static void
+r_mt_frame(struct mtstate *mt)
+{
+	u_int held = mt->touch & mt->otouch;
+	int i, on, n, sx, sy;
+
+	for (i = 0; i < MAX_FINGERS; i++) {
+		on = (held >> i) & 1;
+		mt->dx[i] = (mt->fx[i] - mt->ox[i]) * on;
+		mt->dy[i] = (mt->fy[i] - mt->oy[i]) * on;
+		mt->ox[i] = mt->fx[i];
+		mt->oy[i] = mt->fy[i];
+	}
+
+	n = sx = sy = 0;
+	for (i = 0; i < MAX_FINGERS; i++) {
+		on = (mt->touch >> i) & 1;
+		n += on;
+		sx += mt->fx[i] * on;
+		sy += mt->fy[i] * on;
+	}
+	mt->nfingers = n;
+	mt->cx = n != 0 ? sx / n : 0;
+	mt->cy = n != 0 ? sy / n : 0;
+
+	sx = sy = 0;
+	for (i = 0; i < MAX_FINGERS; i++) {
+		on = (mt->touch >> i) & 1;
+		sx += abs(mt->fx[i] - mt->cx) * on;
+		sy += abs(mt->fy[i] - mt->cy) * on;
+	}
+	mt->sx = n != 0 ? sx / n : 0;
+	mt->sy = n != 0 ? sy / n : 0;
+
+	mt->fdx = mt->fdy = 0;
+	for (i = 0; i < MAX_FINGERS; i++) {
+		if (abs(mt->dx[i]) > abs(mt->fdx))
+			mt->fdx = mt->dx[i];
+		if (abs(mt->dy[i]) > abs(mt->fdy))
+			mt->fdy = mt->dy[i];
+	}
+	mt->nrest = 0;
+	for (i = 0; i < MAX_FINGERS; i++)
+		mt->nrest += (mt->rest >> i) & 1;
+	mt->otouch = mt->touch;
+}
+
+/*
+ * Recognize swipes of 3 and 4 fingers and pinches.  Movement of the
+ * centroid and change of the spread of the touches are measured from the
+ * frame the finger count settled in.  A recognized gesture holds its
+ * button until all fingers are lifted.  Returns true if the packet
+ * belongs to such a gesture, possibly not recognized yet.
+ */
+static bool
+r_mt_gestures(struct tpad *tp, const struct mtstate *mt, int nfingers,
+    mousestatus_t *ms)
+{
+	struct tpstate *gest = &tp->gest;
+	const struct tpcaps *tphw = &tp->hw;
+	const struct tpinfo *tpinfo = &tp->info;
+	const u_int *swipe = NULL;
+	double dx, dy, ds;
+	bool pinch;
+	u_int button = 0;
+
+	if (gest->mt_button != 0) {
+		ms->button |= gest->mt_button;
+		return (true);
+	}
+	if ((nfingers == 3 && !tpinfo->three_finger_drag) || nfingers == 4)
+		swipe = tpinfo->swipe_buttons[nfingers - 3];
+	if (swipe != NULL && (swipe[SWIPE_LEFT] | swipe[SWIPE_RIGHT] |
+	    swipe[SWIPE_UP] | swipe[SWIPE_DOWN]) == 0)
+		swipe = NULL;
+
+	if (nfingers != gest->mt_fingers) {
+		gest->mt_fingers = nfingers;
+		gest->mt_cx = mt->cx;
+		gest->mt_cy = mt->cy;
+		gest->mt_sx = mt->sx;
+		gest->mt_sy = mt->sy;
+		return (swipe != NULL);
+	}
+
+	dx = (double)(mt->cx - gest->mt_cx) / tphw->res_x;
+	dy = (double)(mt->cy - gest->mt_cy) / tphw->res_y;
+	ds = (double)(mt->sx - gest->mt_sx) / tphw->res_x +
+	    (double)(mt->sy - gest->mt_sy) / tphw->res_y;
+
+	/* Fingers spreading faster than moving hold other gestures back */
+	pinch = (tpinfo->pinch_buttons[PINCH_IN] |
+	    tpinfo->pinch_buttons[PINCH_OUT]) != 0 &&
+	    fabs(ds) > fmax(fabs(dx), fabs(dy));
+
+	if (pinch && fabs(ds) >= tpinfo->pinch_distance)
+		button = tpinfo->pinch_buttons[ds < 0 ? PINCH_IN : PINCH_OUT];
+	else if (swipe != NULL && fmax(fabs(dx), fabs(dy)) >=
+	    tpinfo->swipe_distance)
+		button = swipe[fabs(dx) > fabs(dy) ?
+		    (dx < 0 ? SWIPE_LEFT : SWIPE_RIGHT) :
+		    (dy < 0 ? SWIPE_UP : SWIPE_DOWN)];
+	if (button == 0)
+		return (swipe != NULL || pinch);
+
+	debug("%s of %d fingers: button %08x", pinch ? "pinch" : "swipe",
+	    nfingers, button);
+	gest->mt_button = button;
+	ms->button |= button;
+
+	return (true);
+}
+
+/* Move the gesture state machine by an event */
+static void
+r_gesture_trans(struct tpad *tp, enum tpgest_event e, int x0, int y0,
+    struct timespec *time)
+{
+	enum tpgest_state st = gstates[tp->gest.state].s[e];
+
+	if (st != tp->gest.state)
+		r_gesture_enter(tp, st, x0, y0, time);
+}
+
+/*
+ * Enter a new gesture state.  Entering a touch state from a state
+ * without touch starts an action at x0, y0, entering other states sets
+ * their deadline.
+ */
+static void
+r_gesture_enter(struct tpad *tp, enum tpgest_state st, int x0, int y0,
+    struct timespec *time)
+{
+	struct tpstate *gest = &tp->gest;
+	const struct tpinfo *tpinfo = &tp->info;
+
+	if (!gstates[gest->state].touch && gstates[st].touch) {
+		debug("----");
+
+		/* Reset pressure peak. */
+		gest->zmax = 0;
+
+		/* Reset fingers count. */
+		gest->fingers_nb = 0;
+
+		/* Reset swipe and pinch state. */
+		gest->mt_fingers = 0;
+		gest->mt_button = 0;
+
+		/* Compute tap timeout. */
+		if (tpinfo->tap_timeout != 0)
+			gest->taptimeout = tsaddms(time, tpinfo->tap_timeout);
+		else
+			tsclr(&gest->taptimeout);
+
+		gest->start_x = x0;
+		gest->start_y = y0;
+
+		/* Classify the start for softbuttons and scrolling */
+		gest->start_button = 0;
+		if (y0 > tpinfo->softbuttons_min_y &&
+		    y0 < tpinfo->softbuttons_max_y) {
+			if (x0 > tpinfo->softbutton_x[0])
+				gest->start_button = tpinfo->softbutton_bt[0];
+			else if (x0 > tpinfo->softbutton_x[1])
+				gest->start_button = tpinfo->softbutton_bt[1];
+		}
+		gest->start_edges =
+		    (y0 >= tpinfo->hscroll_min_y &&
+		     y0 <= tpinfo->hscroll_max_y ? 2 : 0) |
+		    (x0 >= tpinfo->vscroll_min_x &&
+		     x0 <= tpinfo->vscroll_max_x ? 1 : 0);
+	}
+
+	switch (st) {
+	case G_TAPPED:
+		/* Hold the button until the next action or timeout */
+		switch (gest->fingers_nb) {
+		case 3:
+			gest->tap_button = MOUSE_BUTTON2DOWN;
+			break;
+		case 2:
+			gest->tap_button = MOUSE_BUTTON3DOWN;
+			break;
+		default:
+			gest->tap_button = MOUSE_BUTTON1DOWN;
+		}
+		gest->deadline = tsaddms(time, tpinfo->taphold_timeout);
+		break;
+	case G_DOUBLETAP:
+		/* Release now, press on the next packet */
+		gest->deadline = *time;
+		break;
+	default:
+		tsclr(&gest->deadline);
+	}
+
+	if (gstates[gest->state].hold != gstates[st].hold)
+		debug("button %s: %d", gstates[st].hold ? "PRESS" : "RELEASE",
+		    gest->tap_button);
+	gest->state = st;
+}
+
+static enum gesture
+r_gestures(struct tpad *tp, int x0, int y0, int z, int w, int nfingers,
+    const struct mtstate *mt, struct timespec *time, mousestatus_t *ms)
+{
+	struct tpstate *gest = &tp->gest;
+	const struct tpcaps *tphw = &tp->hw;
+	const struct tpinfo *tpinfo = &tp->info;
+	enum tpgest_event e;
+
+	/* Packets past the deadline expire the state first */
+	gest->last = *time;
+	if (timespecisset(&gest->deadline) &&
+	    tscmp(time, &gest->deadline, >=))
+		r_gesture_trans(tp, GE_TIMEOUT, x0, y0, time);
+
+	/*
+	 * Check pressure to detect a real wanted action on the
+	 * touchpad.
+	 */
+	if (z >= tpinfo->min_pressure_hi ||
+	    (gstates[gest->state].touch && z >= tpinfo->min_pressure_lo)) {
+		/* XXX Verify values? */
+		bool two_finger_scroll = tpinfo->two_finger_scroll;
+		bool three_finger_drag = tpinfo->three_finger_drag;
+		int max_width = tpinfo->max_width;
+		int max_pressure = tpinfo->max_pressure;
+
+		int dx, dy;
+		int start_x, start_y;
+		int prev_nfingers;
+
+		/* Palm detection. */
+		if (nfingers == 1 &&
+		    ((tphw->cap_width && w > max_width) ||
+		     (tphw->cap_pressure && z > max_pressure))) {
+			/*
+			 * We consider the packet irrelevant for the current
+			 * action when:
+			 *  - there is a single active touch
+			 *  - the width isn't comprised in:
+			 *    [0; max_width]
+			 *  - the pressure isn't comprised in:
+			 *    [min_pressure; max_pressure]
+			 *
+			 *  Note that this doesn't terminate the current action.
+			 */
+			debug("palm detected! (%d)", z);
+			return(GEST_IGNORE);
+		}
+
+		/*
+		 * Limit the coordinates to the specified margins because
+		 * this area isn't very reliable.
+		 */
+		if (x0 <= tpinfo->clip_min_x)
+			x0 = tpinfo->clip_min_x;
+		else if (x0 >= tpinfo->clip_max_x)
+			x0 = tpinfo->clip_max_x;
+		if (y0 <= tpinfo->clip_min_y)
+			y0 = tpinfo->clip_min_y;
+		else if (y0 >= tpinfo->clip_max_y)
+			y0 = tpinfo->clip_max_y;
+
+		/* If the action is just beginning, start it. */
+		if (!gstates[gest->state].touch)
+			r_gesture_trans(tp, GE_TOUCH, x0, y0, time);
+
+		prev_nfingers = gest->prev_nfingers;
+
+		gest->prev_x = x0;
+		gest->prev_y = y0;
+		gest->prev_nfingers = nfingers;
+
+		/* Swipe and pinch, one-finger actions skip it */
+		if (mt != NULL && (nfingers >= 2 || gest->mt_button != 0) &&
+		    r_mt_gestures(tp, mt, nfingers, ms)) {
+			/* A recognized one stops scrolling */
+			if (gest->mt_button != 0)
+				r_gesture_trans(tp, GE_TOUCH, x0, y0, time);
+			return (GEST_IGNORE);
+		}
+
+		start_x = gest->start_x;
+		start_y = gest->start_y;
+
+		/* Process ClickPad softbuttons */
+		if (gest->start_button != 0 && ms->button & MOUSE_BUTTON1DOWN)
+			ms->button = (ms->button & ~MOUSE_BUTTON1DOWN) |
+			    gest->start_button;
+
+		/* If in tap-hold or three fingers, add the recorded button. */
+		if (gstates[gest->state].hold ||
+		    (nfingers == 3 && three_finger_drag))
+			ms->button |= gest->tap_button;
+
+		/*
+		 * For tap, we keep the maximum number of fingers and the
+		 * pressure peak.
+		 */
+		gest->fingers_nb = MAX(nfingers, gest->fingers_nb);
+		gest->zmax = MAX(z, gest->zmax);
+
+		dx = abs(x0 - start_x);
+		dy = abs(y0 - start_y);
+
+		/*
+		 * A scrolling action must not conflict with a tap action.
+		 * Here are the conditions to consider a scrolling action:
+		 *  - the action in a configurable area
+		 *  - one of the following:
+		 *     . the distance between the last packet and the
+		 *       first should be above a configurable minimum
+		 *     . tap timed out
+		 */
+		e = gest->state == G_VSCROLL ? GE_VSCROLL :
+		    gest->state == G_HSCROLL ? GE_HSCROLL : GE_TOUCH;
+		if (!gstates[gest->state].hold && !ms->button &&
+		    (e == GE_TOUCH || two_finger_scroll) &&
+		    (tscmp(time, &gest->taptimeout, >) ||
+		    ((gest->fingers_nb == 2 || !two_finger_scroll) &&
+		    (dx >= tpinfo->vscroll_min_dx ||
+		     dy >= tpinfo->vscroll_min_dy)))) {
+			/*
+			 * Handle two finger scrolling.
+			 * Note that we don't rely on fingers_nb
+			 * as that keeps the maximum number of fingers.
+			 * Scroll along the dominant axis, also if the
+			 * action started on both scrolling edges.
+			 */
+			if (two_finger_scroll) {
+				if (nfingers == 2 && (dx != 0 || dy != 0))
+					e = dx > dy ? GE_HSCROLL : GE_VSCROLL;
+			} else if (gest->start_edges == 3)
+				e = dx > dy ? GE_HSCROLL : GE_VSCROLL;
+			else if (gest->start_edges == 2)
+				e = GE_HSCROLL;
+			else if (gest->start_edges == 1)
+				e = GE_VSCROLL;
+		}
+		/*
+		 * Reset two finger scrolling when the number of fingers
+		 * is different from two or any button is pressed.
+		 */
+		if (two_finger_scroll && e != GE_TOUCH &&
+		    (nfingers != 2 || ms->button))
+			e = GE_TOUCH;
+		r_gesture_trans(tp, e, x0, y0, time);
+
+		/* Workaround cursor jump on finger set changes */
+		if (prev_nfingers != nfingers)
+			return (GEST_IGNORE);
+
+		if (gstates[gest->state].gest != GEST_MOVE)
+			return (gstates[gest->state].gest);
+
+		/* Max delta is disabled for multi-fingers tap. */
+		if (gest->fingers_nb == 1 &&
+		    tscmp(time, &gest->taptimeout, <=)) {
+			if (dx > tpinfo->tap_max_dx || dy > tpinfo->tap_max_dy) {
+				debug("not a tap: dx=%d, dy=%d", dx, dy);
+				tsclr(&gest->taptimeout);
+			}
+		}
+
+		if (tscmp(time, &gest->taptimeout, <=))
+			return (gest->fingers_nb > 1 ?
+			    GEST_IGNORE : GEST_ACCUMULATE);
+		else
+			return (GEST_MOVE);
+	}
+
+	/*
+	 * Handle a case when clickpad pressure drops before than
+	 * button up event when surface is released after click.
+	 * It interferes with softbuttons.
+	 */
+	if (tphw->is_clickpad && tpinfo->softbuttons_y != 0)
+		ms->button &= ~MOUSE_BUTTON1DOWN;
+
+	gest->prev_nfingers = 0;
+
+	if (gstates[gest->state].touch) {
+		/*
+		 * An action is currently taking place but the pressure
+		 * dropped under the minimum, putting an end to it.
+		 *
+		 * We have a tap if:
+		 *   - the action was not a scrolling, swipe or pinch
+		 *   - the maximum pressure went over tap_threshold
+		 *   - the action ended before tap_timeout
+		 *
+		 * The first tap holds the button until tap-hold timeout,
+		 * the second one ending a tap-hold releases and presses
+		 * it again to make a double click.  Other actions ending
+		 * a tap-hold release it.
+		 */
+		debug("zmax=%d fingers=%d", gest->zmax, gest->fingers_nb);
+		e = gest->mt_button == 0 &&
+		    gest->zmax >= (int)tpinfo->tap_threshold &&
+		    tscmp(time, &gest->taptimeout, <=) ? GE_TAP : GE_LIFT;
+		r_gesture_trans(tp, e, x0, y0, time);
+	}
+
+	/*
+	 * For a tap-hold to work, the button must remain down at least
+	 * until timeout or during the next action.
+	 */
+	if (gstates[gest->state].hold)
+		ms->button |= gest->tap_button;
+
+	return (GEST_IGNORE);
+}
+
+static void
+r_vscroll_detect(struct moused_dev *md, struct scroll *sc,
+    mousestatus_t *act)
+{
+	mousestatus_t newaction;
+
+	/* Allow middle button drags to scroll up and down */
+	if (act->button == MOUSE_BUTTON2DOWN) {
+		if (sc->state == SCROLL_NOTSCROLLING) {
+			sc->state = SCROLL_PREPARE;
+			sc->movement = sc->hmovement = 0;
+			debug("PREPARING TO SCROLL");
+		}
+		return;
+	}
+
+	/* This isn't a middle button down... move along... */
+	switch (sc->state) {
+	case SCROLL_SCROLLING:
+		/*
+		 * We were scrolling, someone let go of button 2.
+		 * Now turn autoscroll off.
+		 */
+		sc->state = SCROLL_NOTSCROLLING;
+		debug("DONE WITH SCROLLING / %d", sc->state);
+		break;
+	case SCROLL_PREPARE:
+		newaction = *act;
+
+		/* We were preparing to scroll, but we never moved... */
+		r_timestamp(act, &md->btstate, &md->e3b, &md->drift, &md->now);
+		r_statetrans(md, act, &newaction,
+			     A(newaction.button & MOUSE_BUTTON1DOWN,
+			       act->button & MOUSE_BUTTON3DOWN));
+
+		/* Send middle down */
+		newaction.button = MOUSE_BUTTON2DOWN;
+		r_click(md, &newaction);
+
+		/* Send middle up */
+		r_timestamp(&newaction, &md->btstate, &md->e3b, &md->drift,
+		    &md->now);
+		newaction.obutton = newaction.button;
+		newaction.button = act->button;
+		r_click(md, &newaction);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+r_vscroll(struct scroll *sc, mousestatus_t *act)
+{
+	switch (sc->state) {
+	case SCROLL_PREPARE:
+		/* Middle button down, waiting for movement threshold */
+		if (act->dy == 0 && act->dx == 0)
+			break;
+		if (sc->enable_vert) {
+			sc->movement += act->dy;
+			if (sc->movement < -sc->threshold) {
+				sc->state = SCROLL_SCROLLING;
+			} else if (sc->movement > sc->threshold) {
+				sc->state = SCROLL_SCROLLING;
+			}
+		}
+		if (sc->enable_hor) {
+			sc->hmovement += act->dx;
+			if (sc->hmovement < -sc->threshold) {
+				sc->state = SCROLL_SCROLLING;
+			} else if (sc->hmovement > sc->threshold) {
+				sc->state = SCROLL_SCROLLING;
+			}
+		}
+		if (sc->state == SCROLL_SCROLLING)
+			sc->movement = sc->hmovement = 0;
+		break;
+	case SCROLL_SCROLLING:
+		if (sc->enable_vert) {
+			sc->movement += act->dy;
+			if (sc->movement < -sc->speed) {
+				/* Scroll down */
+				act->dz = -1;
+				sc->movement = 0;
+			}
+			else if (sc->movement > sc->speed) {
+				/* Scroll up */
+				act->dz = 1;
+				sc->movement = 0;
+			}
+		}
+		if (sc->enable_hor) {
+			sc->hmovement += act->dx;
+			if (sc->hmovement < -sc->speed) {
+				act->dz = -2;
+				sc->hmovement = 0;
+			}
+			else if (sc->hmovement > sc->speed) {
+				act->dz = 2;
+				sc->hmovement = 0;
+			}
+		}
+
+		/* Don't move while scrolling */
+		act->dx = act->dy = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Follow scroll gestures of the device: middle button virtual scrolling
+ * and touchpad scrolling.  Kinetic scroll is started when a gesture ends
+ * with all fingers lifted and is stopped by any other input.  Fingers
+ * leaving the touchpad one by one do not end the gesture until the rest
+ * of them moves.
+ */
+static void
+r_kinetic_check(struct moused_dev *md, int flags)
+{
+	struct kinetic *kin = &md->kinetic;
+	struct kinetic_sample *ks;
+	struct timespec ts, since;
+	double sz, sw, span;
+	bool scrolling, touch;
+	u_int i;
+
+	touch = gstates[md->tp.gest.state].touch;
+	scrolling = (md->scroll.state == SCROLL_SCROLLING &&
+	    md->action0.button == MOUSE_BUTTON2DOWN) ||
+	    (touch && (gstates[md->tp.gest.state].gest != GEST_MOVE ||
+	    (kin->tracking && flags == 0)));
+
+	if (kin->running && (flags != 0 || scrolling || touch)) {
+		debug("kinetic scroll stopped");
+		kin->running = false;
+	}
+
+	if (kin->tracking && !scrolling && !touch && kin->count != 0) {
+		/* Average the samples of the last window ms */
+		since = tssubms(&md->now, kin->window);
+		sz = sw = 0;
+		ts = md->now;
+		for (i = 0; i < kin->count; i++) {
+			ks = &kin->hist[(kin->head - i - 1) % KINETIC_HISTORY];
+			if (tscmp(&ks->ts, &since, <))
+				break;
+			sz += ks->dz;
+			sw += ks->dw;
+			ts = ks->ts;
+		}
+		tssub(&md->now, &ts, &ts);
+		span = MAX(ts.tv_sec * 1000 + ts.tv_nsec / 1000000.0,
+		    KINETIC_PERIOD);
+		kin->vz = sz / span;
+		kin->vw = sw / span;
+		kin->rz = kin->rw = 0;
+		kin->running = fabs(kin->vz) * 1000 >= kin->min_speed ||
+		    fabs(kin->vw) * 1000 >= kin->min_speed;
+		if (kin->running)
+			debug("kinetic scroll started: %.3f %.3f",
+			    kin->vz * 1000, kin->vw * 1000);
+	}
+	if (!kin->tracking)
+		kin->head = kin->count = 0;
+	kin->tracking = scrolling;
+}
+
+/* Remember wheel output of a scroll gesture */
+static void
+r_kinetic_sample(struct moused_dev *md, int dz)
+{
+	struct kinetic *kin = &md->kinetic;
+	struct kinetic_sample *ks;
+
+	ks = &kin->hist[kin->head++ % KINETIC_HISTORY];
+	ks->ts = md->now;
+	/* Horizontal virtual scrolling reports steps as dz = +-2 */
+	if (md->scroll.state == SCROLL_SCROLLING && abs(dz) == 2) {
+		ks->dz = 0;
+		ks->dw = dz / 2;
+	} else {
+		ks->dz = dz;
+		ks->dw = 0;
+	}
+	kin->count = MIN(kin->count + 1, KINETIC_HISTORY);
+}
+
+/* Kinetic scroll timer, emit a step and slow down */
+static void
+r_kinetic(struct moused_dev *md)
+{
+	struct kinetic *kin = &md->kinetic;
+	mousestatus_t act;
+	int dz, dw;
+
+	if (!kin->running)
+		return;
+
+	kin->rz += kin->vz * KINETIC_PERIOD;
+	kin->rw += kin->vw * KINETIC_PERIOD;
+	dz = kin->rz;
+	dw = kin->rw;
+	kin->rz -= dz;
+	kin->rw -= dw;
+	kin->vz *= kin->decay;
+	kin->vw *= kin->decay;
+	if (fabs(kin->vz) * 1000 < kin->min_speed &&
+	    fabs(kin->vw) * 1000 < kin->min_speed) {
+		debug("kinetic scroll finished");
+		kin->running = false;
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.button = act.obutton = md->action2.button;
+	act.flags = MOUSE_POSCHANGED;
+	/* dz = +-2 stands for horizontal scrolling, split it */
+	while (dz != 0) {
+		act.dz = abs(dz) == 2 ? dz / 2 : dz;
+		dz -= act.dz;
+		r_move(md, &act);
+	}
+	for (; dw != 0; dw -= dw > 0 ? 1 : -1) {
+		act.dz = dw > 0 ? 2 : -2;
+		r_move(md, &act);
+	}
+}
+
+static bool
+r_drift (struct drift *drift, mousestatus_t *act)
+{
+	struct timespec tmp;
+
+	/* X or/and Y movement only - possibly drift */
+	tssub(&drift->current_ts, &drift->last_activity, &tmp);
+	if (tscmp(&tmp, &drift->after_ts, >)) {
+		tssub(&drift->current_ts, &drift->since, &tmp);
+		if (tscmp(&tmp, &drift->time_ts, <)) {
+			drift->last.x += act->dx;
+			drift->last.y += act->dy;
+		} else {
+			/* discard old accumulated steps (drift) */
+			if (tscmp(&tmp, &drift->twotime_ts, >))
+				drift->previous.x = drift->previous.y = 0;
+			else
+				drift->previous = drift->last;
+			drift->last.x = act->dx;
+			drift->last.y = act->dy;
+			drift->since = drift->current_ts;
+		}
+		if (abs(drift->last.x) + abs(drift->last.y) > drift->distance){
+			/* real movement, pass all accumulated steps */
+			act->dx = drift->previous.x + drift->last.x;
+			act->dy = drift->previous.y + drift->last.y;
+			/* and reset accumulators */
+			tsclr(&drift->since);
+			drift->last.x = drift->last.y = 0;
+			/* drift_previous will be cleared at next movement*/
+			drift->last_activity = drift->current_ts;
+		} else {
+			return (true);	/* don't pass current movement to
+					 * console driver */
+		}
+	}
+	return (false);
+}
+
+static int
+r_statetrans(struct moused_dev *md, mousestatus_t *a1, mousestatus_t *a2,
+    int trans)
+{
+	struct e3bstate *e3b = &md->e3b;
+	bool changed;
+	int flags;
+
+	a2->dx = a1->dx;
+	a2->dy = a1->dy;
+	a2->dz = a1->dz;
+	a2->obutton = a2->button;
+	a2->button = a1->button;
+	a2->flags = a1->flags;
+	changed = false;
+
+	if (!e3b->enabled)
+		return (false);
+
+	trace(&md->trace, TRACE_E3B, e3b->mouse_button_state, trans,
+	    states[e3b->mouse_button_state].s[trans], 0);
+	/*
+	 * Avoid re-ordering button and movement events. While a button
+	 * event is deferred, throw away up to BUTTON2_MAXMOVE movement
+	 * events to allow for mouse jitter. If more movement events
+	 * occur, then complete the deferred button events immediately.
+	 */
+	if ((a2->dx != 0 || a2->dy != 0) &&
+	    S_DELAYED(states[e3b->mouse_button_state].s[trans])) {
+		if (++e3b->mouse_move_delayed > BUTTON2_MAXMOVE) {
+			e3b->mouse_move_delayed = 0;
+			e3b->mouse_button_state =
+			    states[e3b->mouse_button_state].s[A_TIMEOUT];
+			changed = true;
+		} else
+			a2->dx = a2->dy = 0;
+	} else
+		e3b->mouse_move_delayed = 0;
+	if (e3b->mouse_button_state != states[e3b->mouse_button_state].s[trans])
+		changed = true;
+	if (changed)
+		e3b->mouse_button_state_ts = md->now;
+	e3b->mouse_button_state = states[e3b->mouse_button_state].s[trans];
+	a2->button &= ~(MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN |
+	    MOUSE_BUTTON3DOWN);
+	a2->button &= states[e3b->mouse_button_state].mask;
+	a2->button |= states[e3b->mouse_button_state].buttons;
+	flags = a2->flags & MOUSE_POSCHANGED;
+	flags |= a2->obutton ^ a2->button;
+	if (flags & MOUSE_BUTTON2DOWN) {
+		a2->flags = flags & MOUSE_BUTTON2DOWN;
+		r_timestamp(a2, &md->btstate, e3b, &md->drift, &md->now);
+	}
+	a2->flags = flags;
+
+	return (changed);
+}
+
+static char *
+skipspace(char *s)
+{
+	while(isspace(*s))
+		++s;
+	return (s);
+}
+
+/* Parse a "logical=physical" button mapping of the -m option */
+bool
+moused_opts_map(struct moused_opts *opts, char *arg)
+{
+	u_long pbutton;
+	u_long lbutton;
+	char *s;
+
+	while (*arg) {
+		arg = skipspace(arg);
+		s = arg;
+		while (isdigit(*arg))
+			++arg;
+		arg = skipspace(arg);
+		if ((arg <= s) || (*arg != '='))
+			return (false);
+		lbutton = strtoul(s, NULL, 10);
+
+		arg = skipspace(++arg);
+		s = arg;
+		while (isdigit(*arg))
+			++arg;
+		if ((arg <= s) || (!isspace(*arg) && (*arg != '\0')))
+			return (false);
+		pbutton = strtoul(s, NULL, 10);
+
+		if (lbutton == 0 || lbutton > MOUSE_MAXBUTTON)
+			return (false);
+		if (pbutton == 0 || pbutton > MOUSE_MAXBUTTON)
+			return (false);
+		opts->p2l[pbutton - 1] = 1 << (lbutton - 1);
+		opts->pbutton[lbutton - 1] = pbutton;
+	}
+
+	return (true);
+}
+
+/* Parse Z axis mapping of the -z option, returns allocated error string */
+char *
+moused_opts_zmap(struct moused_opts *opts, char **argv, int argc, int *idx)
+{
+	char *arg, *errstr;
+	u_long i, j;
+
+	arg = argv[*idx];
+	++*idx;
+	if (strcmp(arg, "x") == 0) {
+		opts->zmap[0] = MOUSE_XAXIS;
+		return (NULL);
+	}
+	if (strcmp(arg, "y") == 0) {
+		opts->zmap[0] = MOUSE_YAXIS;
+		return (NULL);
+	}
+	i = strtoul(arg, NULL, 10);
+	/*
+	 * Use button i for negative Z axis movement and
+	 * button (i + 1) for positive Z axis movement.
+	 */
+	if (i == 0 || i >= MOUSE_MAXBUTTON) {
+		asprintf(&errstr, "invalid argument `%s'", arg);
+		return (errstr);
+	}
+	opts->zmap[0] = i;
+	opts->zmap[1] = i + 1;
+	debug("optind: %d, optarg: '%s'", *idx, arg);
+	for (j = 1; j < MOUSED_ZMAP_MAXBUTTON; ++j) {
+		if ((*idx >= argc) || !isdigit(*argv[*idx]))
+			break;
+		i = strtoul(argv[*idx], NULL, 10);
+		if (i == 0 || i >= MOUSE_MAXBUTTON) {
+			asprintf(&errstr, "invalid argument `%s'", argv[*idx]);
+			return (errstr);
+		}
+		opts->zmap[j] = i;
+		++*idx;
+	}
+	if ((opts->zmap[2] != 0) && (opts->zmap[3] == 0))
+		opts->zmap[3] = opts->zmap[2] + 1;
+
+	return (NULL);
+}
+
+static void
+r_map(mousestatus_t *act1, mousestatus_t *act2, struct btstate *bt)
+{
+	int pb;
+	int pbuttons;
+	int lbuttons;
+
+	pbuttons = act1->button;
+	lbuttons = 0;
+
+	act2->obutton = act2->button;
+	if (pbuttons & bt->wmode) {
+		pbuttons &= ~bt->wmode;
+		act1->dz = act1->dy;
+		act1->dx = 0;
+		act1->dy = 0;
+	}
+	act2->dx = act1->dx;
+	act2->dy = act1->dy;
+	act2->dz = act1->dz;
+
+	switch (bt->zmap[0]) {
+	case 0:	/* do nothing */
+		break;
+	case MOUSE_XAXIS:
+		if (act1->dz != 0) {
+			act2->dx = act1->dz;
+			act2->dz = 0;
+		}
+		break;
+	case MOUSE_YAXIS:
+		if (act1->dz != 0) {
+			act2->dy = act1->dz;
+			act2->dz = 0;
+		}
+		break;
+	default:	/* buttons */
+		pbuttons &= ~(bt->zmap[0] | bt->zmap[1]
+			    | bt->zmap[2] | bt->zmap[3]);
+		if ((act1->dz < -1) && bt->zmap[2]) {
+			pbuttons |= bt->zmap[2];
+			bt->zstate[2].count = 1;
+		} else if (act1->dz < 0) {
+			pbuttons |= bt->zmap[0];
+			bt->zstate[0].count = 1;
+		} else if ((act1->dz > 1) && bt->zmap[3]) {
+			pbuttons |= bt->zmap[3];
+			bt->zstate[3].count = 1;
+		} else if (act1->dz > 0) {
+			pbuttons |= bt->zmap[1];
+			bt->zstate[1].count = 1;
+		}
+		act2->dz = 0;
+		break;
+	}
+
+	for (pb = 0; (pb < MOUSE_MAXBUTTON) && (pbuttons != 0); ++pb) {
+		lbuttons |= (pbuttons & 1) ? bt->p2l[pb] : 0;
+		pbuttons >>= 1;
+	}
+	act2->button = lbuttons;
+
+	act2->flags =
+	    ((act2->dx || act2->dy || act2->dz) ? MOUSE_POSCHANGED : 0)
+	    | (act2->obutton ^ act2->button);
+}
+
+static void
+r_timestamp(mousestatus_t *act, struct btstate *bt, struct e3bstate *e3b,
+    struct drift *drift, const struct timespec *now)
+{
+	struct timespec ts;
+	struct timespec ts1;
+	struct timespec ts2;
+	int button;
+	int mask;
+	int i;
+
+	mask = act->flags & MOUSE_BUTTONS;
+#if 0
+	if (mask == 0)
+		return;
+#endif
+
+	ts1 = *now;
+	drift->current_ts = ts1;
+
+	/* double click threshold */
+	ts = tssubms(&ts1, bt->clickthreshold);
+
+	/* 3 button emulation timeout */
+	ts2 = tssubms(&ts1, e3b->button2timeout);
+
+	button = MOUSE_BUTTON1DOWN;
+	for (i = 0; (i < MOUSE_MAXBUTTON) && (mask != 0); ++i) {
+		if (mask & 1) {
+			if (act->button & button) {
+				/* the button is down */
+				if (tscmp(&ts, &bt->bstate[i].ts, >)) {
+					bt->bstate[i].count = 1;
+				} else {
+					++bt->bstate[i].count;
+				}
+				bt->bstate[i].ts = ts1;
+			} else {
+				/* the button is up */
+				bt->bstate[i].ts = ts1;
+			}
+		} else {
+			if (act->button & button) {
+				/* the button has been down */
+				if (tscmp(&ts2, &bt->bstate[i].ts, >)) {
+					bt->bstate[i].count = 1;
+					bt->bstate[i].ts = ts1;
+					act->flags |= button;
+					debug("button %d timeout", i + 1);
+				}
+			} else {
+				/* the button has been up */
+			}
+		}
+		button <<= 1;
+		mask >>= 1;
+	}
+}
+
+static bool
+r_timeout(struct e3bstate *e3b, const struct timespec *now)
+{
+	struct timespec ts;
+	struct timespec ts1;
+
+	if (states[e3b->mouse_button_state].timeout)
+		return (true);
+	ts1 = *now;
+	ts = tssubms(&ts1, e3b->button2timeout);
+	return (tscmp(&ts, &e3b->mouse_button_state_ts, >));
+}
+
+static void
+r_move(struct moused_dev *md, mousestatus_t *act)
+{
+	struct accel *acc = &md->accel;
+	struct mouse_info mouse;
+
+	bzero(&mouse, sizeof(mouse));
+	if (acc->is_exponential) {
+		expoacc(acc, act->dx, act->dy, act->dz,
+		    &mouse.u.data.x, &mouse.u.data.y, &mouse.u.data.z);
+	} else {
+		linacc(acc, act->dx, act->dy, act->dz,
+		    &mouse.u.data.x, &mouse.u.data.y, &mouse.u.data.z);
+	}
+	mouse.operation = MOUSE_MOTION_EVENT;
+	mouse.u.data.buttons = act->button;
+	trace(&md->trace, TRACE_MOTION, mouse.u.data.x, mouse.u.data.y,
+	    mouse.u.data.z, mouse.u.data.buttons);
+	md->output(md->arg, &mouse);
+}
+
+static void
+r_click(struct moused_dev *md, mousestatus_t *act)
+{
+	struct btstate *bt = &md->btstate;
+	struct mouse_info mouse;
+	int button;
+	int mask;
+	int i;
+
+	mask = act->flags & MOUSE_BUTTONS;
+	if (mask == 0)
+		return;
+
+	button = MOUSE_BUTTON1DOWN;
+	for (i = 0; (i < MOUSE_MAXBUTTON) && (mask != 0); ++i) {
+		if (mask & 1) {
+			if (act->button & button) {
+				/* the button is down */
+				mouse.u.event.value = bt->mstate[i]->count;
+			} else {
+				/* the button is up */
+				mouse.u.event.value = 0;
+			}
+			mouse.operation = MOUSE_BUTTON_EVENT;
+			mouse.u.event.id = button;
+			trace(&md->trace, TRACE_CLICK, button,
+			    mouse.u.event.value, 0, 0);
+			md->output(md->arg, &mouse);
+		}
+		button <<= 1;
+		mask >>= 1;
+	}
+}
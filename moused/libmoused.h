@@ -0,0 +1,180 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 1997-2000 Kazutaka YOKOTA <yokota@FreeBSD.org>
+ * Copyright (c) 2004-2008 Philip Paeps <philip@FreeBSD.org>
+ * Copyright (c) 2008 Jean-Sebastien Pedron <dumbbell@FreeBSD.org>
+ * Copyright (c) 2021,2024 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Event processing pipeline of moused: device protocol decoding, touchpad
+ * gestures, third button emulation, button mapping, virtual scrolling,
+ * drift termination and acceleration.  A context is created per device
+ * from its description, evdev capabilities and quirks, fed with device
+ * events and hands finished console actions to a callback.  It does no
+ * I/O, timers are run by the caller.  The only global state is the log
+ * handler installed by moused_log_init(), which is shared by all contexts
+ * of the process and must be set before the first one is created.
+ */
+
+#ifndef LIBMOUSED_H
+#define LIBMOUSED_H
+
+#include <sys/types.h>
+#include <sys/consio.h>
+#include <sys/mouse.h>
+#include <sys/time.h>
+
+#include <dev/evdev/input.h>
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define	MOUSED_ZMAP_MAXBUTTON	4	/* Number of zmap items */
+
+/* Supported device interfaces */
+enum moused_device_if {
+	MOUSED_IF_UNKNOWN = -1,
+	MOUSED_IF_EVDEV = 0,
+	MOUSED_IF_SYSMOUSE,
+};
+
+/* Recognized device types */
+enum moused_device_type {
+	MOUSED_TYPE_UNKNOWN = -1,
+	MOUSED_TYPE_MOUSE = 0,
+	MOUSED_TYPE_POINTINGSTICK,
+	MOUSED_TYPE_TOUCHPAD,
+	MOUSED_TYPE_TOUCHSCREEN,
+	MOUSED_TYPE_TABLET,
+	MOUSED_TYPE_TABLET_PAD,
+	MOUSED_TYPE_KEYBOARD,
+	MOUSED_TYPE_JOYSTICK,
+};
+
+/* Device description, also matched against quirks */
+struct moused_device {
+	char path[80];
+	enum moused_device_if iftype;
+	enum moused_device_type type;
+	char name[80];
+	char uniq[80];
+	struct input_id id;
+	mousemode_t mode;
+};
+
+/**
+ * Log handler type for custom logging.
+ *
+ * @param priority The priority of the current message
+ * @param format Message format in printf-style
+ * @param args Message arguments
+ */
+typedef void moused_log_handler(int priority, int errnum,
+				const char *format, va_list args);
+
+/* Companion modules, see evdev-caps.h, quirks.h and trace.h */
+struct evdev_caps;
+struct quirks;
+struct trace_ring;
+
+/*
+ * Timers of a device context, run by the caller.  The kinetic scroll
+ * timer is periodic: it is started once and kept running for as long as
+ * the device reports its period, input does not cancel it.
+ */
+enum moused_timer {
+	MOUSED_TIMER_E3B,	/* 3 button emulation decision */
+	MOUSED_TIMER_GESTURE,	/* touchpad tap-hold expiration */
+	MOUSED_TIMER_KINETIC,	/* kinetic scroll step, periodic */
+	MOUSED_TIMER_DEBOUNCE,	/* mouse button settled after chatter */
+	MOUSED_TIMER_CNT,
+};
+#define	MOUSED_TIMER_PERIODIC(t)	((t) == MOUSED_TIMER_KINETIC)
+
+/* Settings overriding the quirks of every device, from command line */
+struct moused_opts {
+	u_int	wmode;
+	int	clickthreshold;
+	bool	e3b_enabled;
+	int	e3b_button2timeout;
+	u_int	p2l[MOUSE_MAXBUTTON];	/* physical to logical mapping */
+	u_int	pbutton[MOUSE_MAXBUTTON];/* physical button, 1-based */
+	int	zmap[MOUSED_ZMAP_MAXBUTTON];
+	bool	drift_terminate;
+	u_int	drift_distance;		/* max steps X+Y */
+	u_int	drift_time;		/* ms */
+	u_int	drift_after;		/* ms */
+	double	accelx;
+	double	accely;
+	bool	exp_accel;
+	double	expoaccel;
+	double	expoffset;
+	bool	virtual_scroll;
+	bool	hvirtual_scroll;
+	int	scroll_speed;
+	int	scroll_threshold;
+};
+
+struct moused_dev;
+
+/* Wheel movement in evdev sense, whole detents and 1/120 of a detent */
+struct moused_wheel {
+	int	dz;
+	int	dw;
+	int	hires_dz;
+	int	hires_dw;
+};
+
+typedef void moused_output_t(void *arg, const struct mouse_info *mi);
+typedef void moused_wheel_t(void *arg, const struct moused_wheel *mw);
+
+void	moused_log_init(moused_log_handler *handler, bool debug);
+void	moused_opts_init(struct moused_opts *opts);
+bool	moused_opts_map(struct moused_opts *opts, char *arg);
+char *	moused_opts_zmap(struct moused_opts *opts, char **argv, int argc,
+	    int *idx);
+enum moused_device_type moused_identify(struct evdev_caps *caps);
+
+struct moused_dev *moused_dev_create(const struct moused_device *dev,
+	    const struct evdev_caps *caps, struct quirks *q,
+	    const struct moused_opts *opts, moused_output_t *output, void *arg,
+	    const struct timespec *now);
+void	moused_dev_destroy(struct moused_dev *md);
+void	moused_dev_set_wheel(struct moused_dev *md, moused_wheel_t *wheel);
+void	moused_dev_event(struct moused_dev *md, const struct input_event *ie,
+	    const struct timespec *now);
+void	moused_dev_packet(struct moused_dev *md, const uint8_t *packet,
+	    const struct timespec *now);
+void	moused_dev_expire(struct moused_dev *md, enum moused_timer timer,
+	    const struct timespec *now);
+void	moused_dev_timeouts(struct moused_dev *md,
+	    int timeout[MOUSED_TIMER_CNT]);
+struct trace_ring *moused_dev_trace(struct moused_dev *md);
+u_long	moused_dev_suppressed(struct moused_dev *md);
+
+#endif
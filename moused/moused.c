@@ -39,25 +39,30 @@
 #include <sys/param.h>
 #include <sys/bitstring.h>
 #include <sys/consio.h>
+#include <sys/endian.h>
 #include <sys/event.h>
+#include <sys/fnv_hash.h>
 #include <sys/mouse.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/un.h>
 
 #include <dev/evdev/input.h>
+#include <dev/evdev/uinput.h>
 
-#include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <libutil.h>
-#include <math.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -68,33 +73,46 @@
 #include <unistd.h>
 
 #include "util.h"
+#include "evdev-caps.h"
 #include "quirks.h"
-
-/*
- * bitstr_t implementation must be identical to one found in EVIOCG*
- * libevdev ioctls. Our bitstring(3) API is compatible since r299090.
- */
-_Static_assert(sizeof(bitstr_t) == sizeof(unsigned long),
-    "bitstr_t size mismatch");
+#include "libmoused.h"
+#include "record.h"
+#include "replay.h"
+#include "state.h"
+#include "trace.h"
 
 #define MAX_CLICKTHRESHOLD	2000	/* 2 seconds */
 #define MAX_BUTTON2TIMEOUT	2000	/* 2 seconds */
-#define DFLT_CLICKTHRESHOLD	 500	/* 0.5 second */
-#define DFLT_BUTTON2TIMEOUT	 100	/* 0.1 second */
-#define DFLT_SCROLLTHRESHOLD	   3	/* 3 pixels */
-#define DFLT_SCROLLSPEED	   2	/* 2 pixels */
-#define	DFLT_MOUSE_RESOLUTION	   8	/* dpmm, == 200dpi */
-#define	DFLT_TPAD_RESOLUTION	  40	/* dpmm, typical X res for Synaptics */
-#define	DFLT_LINEHEIGHT		  10	/* pixels per line */
 
-/* Abort 3-button emulation delay after this many movement events. */
-#define BUTTON2_MAXMOVE	3
+#define	RODENT_HASHSIZE	64	/* Must be a power of 2 */
+
+#define	DEVD_SOCKET	"/var/run/devd.seqpacket.pipe"
+#define	DEVD_SOCKET_DIR	"/var/run"
+#define	DEVD_RETRY_MIN	1000	/* 1 second */
+#define	DEVD_RETRY_MAX	64000	/* ~1 minute */
+#define	DEVD_TIMER_ID	UINTPTR_MAX
 
-#define MOUSE_XAXIS	(-1)
-#define MOUSE_YAXIS	(-2)
+#define	MAX_PROBE_THREADS	8
 
-#define	ZMAP_MAXBUTTON	4	/* Number of zmap items */
-#define	MAX_FINGERS	10
+#define	CTL_SOCKET	"/var/run/moused.ctl"
+#define	CTL_TIMEOUT	1000	/* ms without progress on a connection */
+/* Connection timeout ident, maps a timer ident back to the fd as well */
+#define	CTL_TIMER_ID(fd)	(DEVD_TIMER_ID - 1 - (fd))
+#define	INPUT_SOCKET	"/var/run/moused.input"
+#define	INPUT_BATCH	64	/* events taken from input socket at once */
+#define	WHEEL_NAME	"moused hi-res wheel"	/* uinput wheel device */
+#define	TRACE_FILE	"/var/run/moused.trace"
+#define	RECORD_FILE	"/var/run/moused-%s.rec"
+#define	RECORD_INTERVAL	60	/* seconds between anomaly triggered saves */
+
+#define	OUTPUT_RING_SIZE	64	/* Must be a power of 2 */
+
+#define	TIMER_IDENT(r, t)	((r)->mfd << 2 | (t))	/* Pipeline timers */
+#define	TIMER_ID(ident)		((ident) & 3)
+_Static_assert(MOUSED_TIMER_CNT <= 4, "TIMER_IDENT has 2 bits of timer");
+
+#define	WORKER_STOP	0	/* Worker user events */
+#define	WORKER_RESUME	1
 
 #define ID_NONE		0
 #define ID_PORT		1
@@ -103,36 +121,6 @@ _Static_assert(sizeof(bitstr_t) == sizeof(unsigned long),
 #define ID_MODEL	8
 #define ID_ALL		(ID_PORT | ID_IF | ID_TYPE | ID_MODEL)
 
-/* Operations on timespecs */
-#define	tsclr(tvp)		timespecclear(tvp)
-#define	tscmp(tvp, uvp, cmp)	timespeccmp(tvp, uvp, cmp)
-#define	tssub(tvp, uvp, vvp)	timespecsub(tvp, uvp, vvp)
-#define	msec2ts(msec)	(struct timespec) {			\
-	.tv_sec = (msec) / 1000,				\
-	.tv_nsec = (msec) % 1000 * 1000000,			\
-}
-static inline struct timespec
-tsaddms(struct timespec* tsp, u_int ms)
-{
-	struct timespec ret;
-
-	ret = msec2ts(ms);
-	timespecadd(tsp, &ret, &ret);
-
-	return (ret);
-};
-
-static inline struct timespec
-tssubms(struct timespec* tsp, u_int ms)
-{
-	struct timespec ret;
-
-	ret = msec2ts(ms);
-	timespecsub(tsp, &ret, &ret);
-
-	return (ret);
-};
-
 #define debug(...) do {						\
 	if (debug && nodaemon)					\
 		warnx(__VA_ARGS__);				\
@@ -156,286 +144,155 @@ tssubms(struct timespec* tsp, u_int ms)
 
 /* structures */
 
-enum gesture {
-	GEST_IGNORE,
-	GEST_ACCUMULATE,
-	GEST_MOVE,
-	GEST_VSCROLL,
-	GEST_HSCROLL,
-};
-
-/* interfaces (the table must be ordered by DEVICE_IF_XXX in util.h) */
+/* interfaces (the table must be ordered by MOUSED_IF_XXX in util.h) */
 static const struct {
 	char *name;
 	size_t p_size;
 } rifs[] = {
-	[DEVICE_IF_EVDEV]	= { "evdev",	sizeof(struct input_event) },
-	[DEVICE_IF_SYSMOUSE]	= { "sysmouse",	MOUSE_SYS_PACKETSIZE },
+	[MOUSED_IF_EVDEV] = { "evdev", sizeof(struct input_event) },
+	[MOUSED_IF_SYSMOUSE] = { "sysmouse", MOUSE_SYS_PACKETSIZE },
 };
 
-/* types (the table must be ordered by DEVICE_TYPE_XXX in util.h) */
+/* types (the table must be ordered by MOUSED_TYPE_XXX in util.h) */
 static const char *rnames[] = {
-	[DEVICE_TYPE_MOUSE]		= "mouse",
-	[DEVICE_TYPE_POINTINGSTICK]	= "pointing stick",
-	[DEVICE_TYPE_TOUCHPAD]		= "touchpad",
-	[DEVICE_TYPE_TOUCHSCREEN]	= "touchscreen",
-	[DEVICE_TYPE_TABLET]		= "tablet",
-	[DEVICE_TYPE_TABLET_PAD]	= "tablet pad",
-	[DEVICE_TYPE_KEYBOARD]		= "keyboard",
-	[DEVICE_TYPE_JOYSTICK]		= "joystick",
-};
-
-/* Default phisical to logical button mapping */
-static const u_int default_p2l[MOUSE_MAXBUTTON] = {
-    MOUSE_BUTTON1DOWN, MOUSE_BUTTON2DOWN, MOUSE_BUTTON3DOWN, MOUSE_BUTTON4DOWN,
-    MOUSE_BUTTON5DOWN, MOUSE_BUTTON6DOWN, MOUSE_BUTTON7DOWN, MOUSE_BUTTON8DOWN,
-    0x00000100,        0x00000200,        0x00000400,        0x00000800,
-    0x00001000,        0x00002000,        0x00004000,        0x00008000,
-    0x00010000,        0x00020000,        0x00040000,        0x00080000,
-    0x00100000,        0x00200000,        0x00400000,        0x00800000,
-    0x01000000,        0x02000000,        0x04000000,        0x08000000,
-    0x10000000,        0x20000000,        0x40000000,
-};
-
-struct tpcaps {
-	bool	is_clickpad;
-	bool	is_topbuttonpad;
-	bool	is_mt;
-	bool	cap_touch;
-	bool	cap_pressure;
-	bool	cap_width;
-	int	min_x;
-	int	max_x;
-	int	min_y;
-	int	max_y;
-	int	res_x;	/* dots per mm */
-	int	res_y;	/* dots per mm */
-	int	min_p;
-	int	max_p;
-};
-
-struct tpinfo {
-	bool	two_finger_scroll;	/* Enable two finger scrolling */
-	bool	natural_scroll;		/* Enable natural scrolling */
-	bool	three_finger_drag;	/* Enable dragging with three fingers */
-	u_int	min_pressure_hi;	/* Min pressure to start an action */
-	u_int	min_pressure_lo;	/* Min pressure to continue an action */
-	u_int	max_pressure;		/* Maximum pressure to detect palm */
-	u_int	max_width;		/* Max finger width to detect palm */
-	int	margin_top;		/* Top margin */
-	int	margin_right;		/* Right margin */
-	int	margin_bottom;		/* Bottom margin */
-	int	margin_left;		/* Left margin */
-	u_int	tap_timeout;		/* */
-	u_int	tap_threshold;		/* Minimum pressure to detect a tap */
-	double	tap_max_delta;		/* Length of segments above which a tap is ignored */
-	u_int	taphold_timeout;	/* Maximum elapsed time between two taps to consider a tap-hold action */
-	double	vscroll_ver_area;	/* Area reserved for vertical virtual scrolling */
-	double	vscroll_hor_area;	/* Area reserved for horizontal virtual scrolling */
-	double	vscroll_min_delta;	/* Minimum movement to consider virtual scrolling */
-	int	softbuttons_y;		/* Vertical size of softbuttons area */
-	int	softbutton2_x;		/* Horizontal offset of 2-nd softbutton left edge */
-	int	softbutton3_x;		/* Horizontal offset of 3-rd softbutton left edge */
-};
-
-struct tpstate {
-	int 		start_x;
-	int 		start_y;
-	int 		prev_x;
-	int 		prev_y;
-	int		prev_nfingers;
-	int		fingers_nb;
-	int		tap_button;
-	bool		fingerdown;
-	bool		in_taphold;
-	int		in_vscroll;
-	int		zmax;           /* maximum pressure value */
-	struct timespec	taptimeout;     /* tap timeout for touchpads */
-	int		idletimeout;
-	bool		timer_armed;
-};
-
-struct tpad {
-	struct tpcaps	hw;	/* touchpad capabilities */
-	struct tpinfo	info;	/* touchpad gesture parameters */
-	struct tpstate	gest;	/* touchpad gesture state */
-};
-
-struct finger {
-	int	x;
-	int	y;
-	int	p;
-	int	w;
-	int	id;	/* id=0 - no touch, id>1 - touch id */
+	[MOUSED_TYPE_MOUSE]		= "mouse",
+	[MOUSED_TYPE_POINTINGSTICK]	= "pointing stick",
+	[MOUSED_TYPE_TOUCHPAD]		= "touchpad",
+	[MOUSED_TYPE_TOUCHSCREEN]	= "touchscreen",
+	[MOUSED_TYPE_TABLET]		= "tablet",
+	[MOUSED_TYPE_TABLET_PAD]	= "tablet pad",
+	[MOUSED_TYPE_KEYBOARD]		= "keyboard",
+	[MOUSED_TYPE_JOYSTICK]		= "joystick",
 };
 
-struct evstate {
-	int		buttons;
-	/* Relative */
-	int		dx;
-	int		dy;
-	int		dz;
-	int		dw;
-	int		acc_dx;
-	int		acc_dy;
-	/* Absolute single-touch */
-	int		nfingers;
-	struct finger	st;
-	/* Absolute multi-touch */
-	int		slot;
-	struct finger	mt[MAX_FINGERS];
-	bitstr_t bit_decl(key_ignore, KEY_CNT);
-	bitstr_t bit_decl(rel_ignore, REL_CNT);
-	bitstr_t bit_decl(abs_ignore, ABS_CNT);
-	bitstr_t bit_decl(prop_ignore, INPUT_PROP_CNT);
+struct devd_event {
+	const char *system;
+	const char *subsystem;
+	const char *type;
+	const char *cdev;
 };
 
-/* button status */
-struct button_state {
-	int count;	/* 0: up, 1: single click, 2: double click,... */
-	struct timespec ts;	/* timestamp on the last button event */
-};
-
-struct btstate {
-	u_int	wmode;		/* wheel mode button number */
-	u_int 	clickthreshold;	/* double click speed in msec */
-	struct button_state	bstate[MOUSE_MAXBUTTON]; /* button state */
-	struct button_state	*mstate[MOUSE_MAXBUTTON];/* mapped button st.*/
-	u_int	p2l[MOUSE_MAXBUTTON];/* phisical to logical button mapping */
-	int	zmap[ZMAP_MAXBUTTON];/* MOUSE_{X|Y}AXIS or a button number */
-	struct button_state	zstate[ZMAP_MAXBUTTON];	 /* Z/W axis state */
-};
-
-/* state machine for 3 button emulation */
-
-enum bt3_emul_state {
-	S0,		/* start */
-	S1,		/* button 1 delayed down */
-	S2,		/* button 3 delayed down */
-	S3,		/* both buttons down -> button 2 down */
-	S4,		/* button 1 delayed up */
-	S5,		/* button 1 down */
-	S6,		/* button 3 down */
-	S7,		/* both buttons down */
-	S8,		/* button 3 delayed up */
-	S9,		/* button 1 or 3 up after S3 */
-};
-
-#define A(b1, b3)	(((b1) ? 2 : 0) | ((b3) ? 1 : 0))
-#define A_TIMEOUT	4
-#define S_DELAYED(st)	(states[st].s[A_TIMEOUT] != (st))
-
-static const struct {
-	enum bt3_emul_state s[A_TIMEOUT + 1];
-	int buttons;
-	int mask;
-	bool timeout;
-} states[10] = {
-    /* S0 */
-    { { S0, S2, S1, S3, S0 }, 0, ~(MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN), false },
-    /* S1 */
-    { { S4, S2, S1, S3, S5 }, 0, ~MOUSE_BUTTON1DOWN, false },
-    /* S2 */
-    { { S8, S2, S1, S3, S6 }, 0, ~MOUSE_BUTTON3DOWN, false },
-    /* S3 */
-    { { S0, S9, S9, S3, S3 }, MOUSE_BUTTON2DOWN, ~0, false },
-    /* S4 */
-    { { S0, S2, S1, S3, S0 }, MOUSE_BUTTON1DOWN, ~0, true },
-    /* S5 */
-    { { S0, S2, S5, S7, S5 }, MOUSE_BUTTON1DOWN, ~0, false },
-    /* S6 */
-    { { S0, S6, S1, S7, S6 }, MOUSE_BUTTON3DOWN, ~0, false },
-    /* S7 */
-    { { S0, S6, S5, S7, S7 }, MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN, ~0, false },
-    /* S8 */
-    { { S0, S2, S1, S3, S0 }, MOUSE_BUTTON3DOWN, ~0, true },
-    /* S9 */
-    { { S0, S9, S9, S3, S9 }, 0, ~(MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN), false },
-};
-
-struct e3bstate {
-	bool enabled;
-	u_int button2timeout;	/* 3 button emulation timeout */
-	enum bt3_emul_state	mouse_button_state;
-	struct timespec		mouse_button_state_ts;
-	int			mouse_move_delayed;
-	bool timer_armed;
+/* Control connection, served from the main kqueue */
+struct ctl_conn {
+	int fd;
+	char *reply;		/* buffered reply, NULL until request is read */
+	size_t len;		/* reply length */
+	size_t off;		/* reply bytes sent */
+	LIST_ENTRY(ctl_conn) next;
 };
 
-enum scroll_state {
-	SCROLL_NOTSCROLLING,
-	SCROLL_PREPARE,
-	SCROLL_SCROLLING,
+struct probe_job {
+	struct dirent **names;	/* device nodes to probe */
+	struct rodent **result;	/* probed devices, NULL on failure */
+	int count;
+	atomic_int next;	/* next node to be taken by a worker */
 };
 
-struct scroll {
-	bool	enable_vert;
-	bool	enable_hor;
-	u_int	threshold;	/* Movement distance before virtual scrolling */
-	u_int	speed;		/* Movement distance to rate of scrolling */
-	enum scroll_state state;
-	int	movement;
-	int	hmovement;
+struct output_stats {
+	atomic_ulong queued;	/* entries passed to the output stage */
+	atomic_ulong coalesced;	/* motions merged on ring overflow */
+	atomic_ulong stalls;	/* waits for room to keep a click */
+	atomic_uint maxdepth;	/* ring depth high-water mark */
 };
 
-struct drift_xy {
-	int x;
-	int y;
-};
-struct drift {
-	u_int		distance;	/* max steps X+Y */
-	u_int		time;		/* ms */
-	struct timespec	time_ts;
-	struct timespec	twotime_ts;	/* 2*drift_time */
-	u_int		after;		/* ms */
-	struct timespec	after_ts;
-	bool		terminate;
-	struct timespec	current_ts;
-	struct timespec	last_activity;
-	struct timespec	since;
-	struct drift_xy	last;		/* steps in last drift_time */
-	struct drift_xy	previous;	/* steps in prev. drift_time */
+/* Console action or report for the uinput wheel device */
+struct output_entry {
+	bool wheel;		/* mw is valid rather than mi */
+	union {
+		struct mouse_info mi;
+		struct moused_wheel mw;
+	};
 };
 
-struct accel {
-	bool is_exponential;	/* Exponential acceleration is enabled */
-	double accelx;		/* Acceleration in the X axis */
-	double accely;		/* Acceleration in the Y axis */
-	double accelz;		/* Acceleration in the wheel axis */
-	double expoaccel;	/* Exponential acceleration */
-	double expoffset;	/* Movement offset for exponential accel. */
-	double remainx;		/* Remainder on X, Y and wheel axis, ... */
-	double remainy;		/*    ...  respectively to compensate */
-	double remainz;		/*    ... for rounding errors. */
-	double lastlength[3];
+/*
+ * Single producer single consumer queue of finished console actions and
+ * wheel reports.  Filled by the device processing code, drained by the
+ * output thread.
+ */
+struct output_ring {
+	atomic_uint head;	/* next slot to fill, owned by producer */
+	atomic_uint tail;	/* next slot to drain, owned by output stage */
+	struct output_entry buf[OUTPUT_RING_SIZE];
+	struct mouse_info stash;/* motion merged while the ring is full */
+	bool stashed;
+	atomic_bool stalled;	/* producer waits for room in the ring */
+	pthread_mutex_t lock;	/* protects sleeping on room */
+	pthread_cond_t room;	/* signalled when the ring is drained */
+	struct output_stats stats;
 };
 
 struct rodent {
-	struct device dev;	/* Device */
+	struct moused_device dev;	/* Device */
 	int mfd;		/* mouse file descriptor */
-	struct btstate btstate;	/* button status */
-	struct e3bstate e3b;	/* 3 button emulation state */
-	struct drift drift;
-	struct accel accel;	/* cursor acceleration state */
-	struct scroll scroll;	/* virtual scroll state */
-	struct tpad tp;		/* touchpad info and gesture state */
-	struct evstate ev;	/* event device state */
-	SLIST_ENTRY(rodent) next;
+	int kq;			/* kqueue delivering device events */
+	struct moused_dev *md;	/* event processing pipeline */
+	int timeout[MOUSED_TIMER_CNT];	/* pipeline timers to run, ms */
+	u_int armed;		/* running timers, 1 << MOUSED_TIMER_* */
+	const struct timespec *clock;	/* replay time, NULL for real */
+	struct evdev_caps caps;	/* evdev capabilities snapshot */
+	struct record_ring rec;	/* flight recorder of raw input */
+	atomic_bool anomaly;	/* input anomaly asks to save recording */
+	time_t rec_last;	/* last anomaly triggered save */
+	dev_t rdev;		/* device number, registry key */
+	bool feed;		/* virtual device fed by an input socket */
+	bool threaded;		/* device is served by its own worker */
+	bool running;		/* worker thread has been started */
+	pthread_t worker;
+	atomic_bool stop;	/* worker is asked to terminate */
+	atomic_bool dead;	/* worker has terminated on device error */
+	atomic_bool notified;	/* main thread is notified of the device */
+	struct output_ring out;	/* entries queued for the output stage */
+	TAILQ_ENTRY(rodent) next;
+	LIST_ENTRY(rodent) rdev_hash;
+	LIST_ENTRY(rodent) path_hash;
 };
 
+TAILQ_HEAD(rodent_list, rodent);
+LIST_HEAD(rodent_hash, rodent);
+
 /* global variables */
 
-static SLIST_HEAD(rodent_list, rodent) rodents = SLIST_HEAD_INITIALIZER();
+/*
+ * Rodent registry. Every opened device is linked into the ordered list
+ * and into two hash tables keyed by device number and by path name, so
+ * hotplug and teardown paths never have to walk the list.
+ */
+static struct rodent_list rodents = TAILQ_HEAD_INITIALIZER(rodents);
+static struct rodent_hash rodents_byrdev[RODENT_HASHSIZE];
+static struct rodent_hash rodents_bypath[RODENT_HASHSIZE];
 
 static int	debug = 0;
 static bool	nodaemon = false;
 static bool	background = false;
-static bool	paused = false;
+static volatile sig_atomic_t paused = 0;
 static bool	opt_grab = false;
+static bool	opt_threads = false;
+static bool	workers_running = false;
+static bool	output_running = false;	/* output stage has its own thread */
+static pthread_t output_thread;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;	/* rodents */
+static atomic_bool output_pending;	/* output stage is kicked */
+static int	okq = -1;	/* output stage kqueue */
+static struct replay *replay;	/* pipeline runs on recorded time */
+static FILE	*replay_out;
+static int	replay_pipe = -1;	/* feeds the replayed device */
 static int	identify = ID_NONE;
 static int	cfd = -1;	/* /dev/consolectl file descriptor */
 static int	kfd = -1;	/* kqueue file descriptor */
 static int	dfd = -1;	/* devd socket descriptor */
+static int	vfd = -1;	/* devd socket directory watch descriptor */
+static u_int	devd_retry = DEVD_RETRY_MIN;	/* reconnect backoff, ms */
+static int	sfd = -1;	/* control socket descriptor */
+static LIST_HEAD(, ctl_conn) ctl_conns = LIST_HEAD_INITIALIZER(ctl_conns);
+static const char *ctlsock = CTL_SOCKET;
+static int	ifd = -1;	/* input socket descriptor */
+static int	wfd = -1;	/* uinput wheel device descriptor */
+static bool	opt_wheel = false;
+static const char *inputsock = INPUT_SOCKET;
+static u_int	input_unit;	/* number of the last input connection */
+static char	*statename = NULL;	/* shared memory state segment */
+static u_int	state_ring = 0;	/* actions kept in the segment */
+static struct state *state;
 static const char *portname = NULL;
 static const char *pidfile = "/var/run/moused.pid";
 static struct pidfh *pfh;
@@ -445,28 +302,7 @@ static struct quirks_context *quirks;
 
 static int	opt_rate = 0;
 static int	opt_resolution = MOUSE_RES_UNKNOWN;
-
-static u_int	opt_wmode = 0;
-static int	opt_clickthreshold = -1;
-static bool	opt_e3b_enabled = false;
-static int	opt_e3b_button2timeout = -1;
-static struct btstate opt_btstate;
-
-static bool	opt_drift_terminate = false;
-static u_int	opt_drift_distance = 4;		/* max steps X+Y */
-static u_int	opt_drift_time = 500;		/* ms */
-static u_int	opt_drift_after = 4000;		/* ms */
-
-static double	opt_accelx = 1.0;
-static double	opt_accely = 1.0;
-static bool	opt_exp_accel = false;
-static double	opt_expoaccel = 1.0;
-static double	opt_expoffset = 1.0;
-
-static bool	opt_virtual_scroll = false;
-static bool	opt_hvirtual_scroll = false;
-static int	opt_scroll_speed = -1;
-static int	opt_scroll_threshold = -1;
+static struct moused_opts opts;	/* pipeline settings of all devices */
 
 static jmp_buf env;
 
@@ -474,64 +310,116 @@ static jmp_buf env;
 
 static moused_log_handler	log_or_warn_va;
 
-static void	linacc(struct accel *, int, int, int, int*, int*, int*);
-static void	expoacc(struct accel *, int, int, int, int*, int*, int*);
 static void	moused(void);
 static void	reset(int sig);
 static void	pause_mouse(int sig);
 static int	connect_devd(void);
+static void	disconnect_devd(void);
+static void	reconnect_devd(bool timeout);
+static bool	parse_devd_event(char *msg, struct devd_event *de);
+static void	process_devd_event(struct devd_event *de);
 static void	fetch_and_parse_devd(void);
+static int	sock_open(const char *path, int type);
+static void	ctl_accept(void);
+static struct ctl_conn *ctl_find(int fd);
+static void	ctl_wait(struct ctl_conn *c, short filter);
+static void	ctl_event(struct ctl_conn *c, const struct kevent *kev);
+static void	ctl_request(struct ctl_conn *c);
+static void	ctl_reply(struct ctl_conn *c);
+static void	ctl_close(struct ctl_conn *c);
+static int	ctl_client(const char *cmd);
+static void	input_accept(void);
+static void	input_caps(int fd);
+static int	wheel_open(void);
+static void	wheel_close(void);
 static void	usage(void);
 static void	log_or_warn(int log_pri, int errnum, const char *fmt, ...)
 		    __printflike(3, 4);
 
 static int	r_daemon(void);
-static enum device_if	r_identify_if(int fd);
-static enum device_type	r_identify_evdev(int fd);
-static enum device_type	r_identify_sysmouse(int fd);
-static const char *r_if(enum device_if type);
-static const char *r_name(enum device_type type);
+static enum moused_device_if	r_identify_if(int fd);
+static enum moused_device_type	r_identify_sysmouse(int fd);
+static int	r_init_dev_evdev(const struct evdev_caps *caps,
+		    struct moused_device *dev);
+static const char *r_if(enum moused_device_if type);
+static const char *r_name(enum moused_device_type type);
+static struct rodent *r_find_by_rdev(dev_t rdev);
+static struct rodent *r_find_by_path(const char *path);
+static void	r_register(struct rodent *r);
+static void	r_unregister(struct rodent *r);
+static struct rodent *r_probe(const char *path);
+static struct rodent *r_alloc(const struct moused_device *dev,
+		    const struct evdev_caps *caps, struct quirks *q,
+		    const struct timespec *now);
+static int	r_attach(struct rodent *r);
+static void	r_free(struct rodent *r);
 static struct rodent *r_init(const char *path);
 static void	r_init_all(void);
 static void	r_deinit(struct rodent *r);
 static void	r_deinit_all(void);
-static int	r_protocol_evdev(enum device_type type, struct tpad *tp,
-		    struct evstate *ev, struct input_event *ie,
-		    mousestatus_t *act);
-static int	r_protocol_sysmouse(uint8_t *pBuf, mousestatus_t *act);
-static void	r_vscroll_detect(struct rodent *r, struct scroll *sc,
-		    mousestatus_t *act);
-static void	r_vscroll(struct scroll *sc, mousestatus_t *act);
-static int	r_statetrans(struct rodent *r, mousestatus_t *a1,
-		    mousestatus_t *a2, int trans);
-static bool	r_installmap(char *arg, struct btstate *bt);
-static char *	r_installzmap(char **argv, int argc, int* idx, struct btstate *bt);
-static void	r_map(mousestatus_t *act1, mousestatus_t *act2,
-		    struct btstate *bt);
-static void	r_timestamp(mousestatus_t *act, struct btstate *bt,
-		    struct e3bstate *e3b, struct drift *drift);
-static bool	r_timeout(struct e3bstate *e3b);
-static void	r_move(mousestatus_t *act, struct accel *acc);
-static void	r_click(mousestatus_t *act, struct btstate *bt);
-static bool	r_drift(struct drift *, mousestatus_t *);
-static enum gesture r_gestures(struct tpad *tp, int x0, int y0, int z, int w,
-		    int nfingers, struct timespec *time, mousestatus_t *ms);
+static int	r_thread_create(pthread_t *thread, void *(*func)(void *),
+		    void *arg);
+static int	r_arm_timers(struct rodent *r, struct kevent *ke);
+static inline bool r_expired(struct rodent *r);
+static int	r_replay_input(void *arg, const struct record_entry *re,
+		    bool evdev);
+static int	r_replay(const char *file);
+static int	r_process(struct rodent *r, const struct kevent *kev);
+static void *	r_worker(void *arg);
+static int	r_start_worker(struct rodent *r);
+static void	r_start_workers(void);
+static void	r_output_write(const struct output_entry *ent);
+static void	r_wheel_write(const struct moused_wheel *mw);
+static bool	r_output_push(struct output_ring *ring,
+		    const struct output_entry *ent);
+static bool	r_output_unstash(struct output_ring *ring);
+static bool	r_output_wait(struct rodent *r);
+static void	r_output_destroy(struct output_ring *ring);
+static void	r_output_queue(struct rodent *r,
+		    const struct output_entry *ent);
+static void	r_output(void *arg, const struct mouse_info *mi);
+static void	r_wheel(void *arg, const struct moused_wheel *mw);
+static void	r_output_kick(struct rodent *r);
+static void	r_output_flush(struct rodent *r);
+static void *	r_output_worker(void *arg);
+static void	r_notify(struct rodent *r);
+static void	r_output_stats(FILE *fp);
+static int	r_trace_dump(FILE *fp);
+static void	r_trace_save(void);
+static void	r_record_anomaly(struct rodent *r);
+static void	r_record_check(struct rodent *r);
+static void	r_record_save(struct rodent *r, FILE *reply);
+static void	r_record_save_all(FILE *reply);
 
 int
 main(int argc, char *argv[])
 {
 	struct rodent *r;
+	struct kevent kev;
+	const char *ctlcmd = NULL;
+	const char *tracefile = NULL;
+	const char *replayfile = NULL;
+	FILE *fp;
 	pid_t mpid;
 	int c;
 	int	i;
 	u_long ul;
-	char *errstr;
+	char *errstr, *sep;
 
-	while ((c = getopt(argc, argv, "3A:C:E:F:HI:L:T:VU:a:dfghi:l:m:p:r:t:q:w:z:")) != -1) {
+	moused_opts_init(&opts);
+	while ((c = getopt(argc, argv, "3A:C:D:E:F:HI:L:MP:R:S:T:VU:Wa:c:dfghi:l:m:p:r:s:t:q:w:z:")) != -1) {
 		switch(c) {
 
 		case '3':
-			opt_e3b_enabled = true;
+			opts.e3b_enabled = true;
+			break;
+
+		case 'D':
+			tracefile = optarg;
+			break;
+
+		case 'R':
+			replayfile = optarg;
 			break;
 
 		case 'E':
@@ -542,31 +430,35 @@ main(int argc, char *argv[])
 				warnx("invalid argument `%s'", optarg);
 				usage();
 			}
-			opt_e3b_button2timeout = ul;
+			opts.e3b_button2timeout = ul;
 			break;
 
 		case 'a':
-			i = sscanf(optarg, "%lf,%lf", &opt_accelx, &opt_accely);
+			i = sscanf(optarg, "%lf,%lf", &opts.accelx, &opts.accely);
 			if (i == 0) {
 				warnx("invalid linear acceleration argument "
 				    "'%s'", optarg);
 				usage();
 			}
 			if (i == 1)
-				opt_accely = opt_accelx;
+				opts.accely = opts.accelx;
 			break;
 
 		case 'A':
-			opt_exp_accel = true;
-			i = sscanf(optarg, "%lf,%lf", &opt_expoaccel,
-			    &opt_expoffset);
+			opts.exp_accel = true;
+			i = sscanf(optarg, "%lf,%lf", &opts.expoaccel,
+			    &opts.expoffset);
 			if (i == 0) {
 				warnx("invalid exponential acceleration "
 				    "argument '%s'", optarg);
 				usage();
 			}
 			if (i == 1)
-				opt_expoffset = 1.0;
+				opts.expoffset = 1.0;
+			break;
+
+		case 'c':
+			ctlcmd = optarg;
 			break;
 
 		case 'd':
@@ -606,12 +498,20 @@ main(int argc, char *argv[])
 			break;
 
 		case 'm':
-			if (!r_installmap(optarg, &opt_btstate)) {
+			if (!moused_opts_map(&opts, optarg)) {
 				warnx("invalid argument `%s'", optarg);
 				usage();
 			}
 			break;
 
+		case 's':
+			ctlsock = optarg;
+			break;
+
+		case 'S':
+			inputsock = optarg;
+			break;
+
 		case 'p':
 			/* "auto" is an alias to no portname */
 			if (strcmp(optarg, "auto") != 0)
@@ -650,12 +550,12 @@ main(int argc, char *argv[])
 				warnx("invalid argument `%s'", optarg);
 				usage();
 			}
-			opt_wmode = ul;
+			opts.wmode = ul;
 			break;
 
 		case 'z':
 			--optind;
-			errstr = r_installzmap(argv, argc, &optind, &opt_btstate);
+			errstr = moused_opts_zmap(&opts, argv, argc, &optind);
 			if (errstr != NULL) {
 				warnx("%s", errstr);
 				free(errstr);
@@ -669,7 +569,7 @@ main(int argc, char *argv[])
 				warnx("invalid argument `%s'", optarg);
 				usage();
 			}
-			opt_clickthreshold = ul;
+			opts.clickthreshold = ul;
 			break;
 
 		case 'F':
@@ -682,13 +582,28 @@ main(int argc, char *argv[])
 			break;
 
 		case 'H':
-			opt_hvirtual_scroll = true;
+			opts.hvirtual_scroll = true;
 			break;
 		
 		case 'I':
 			pidfile = optarg;
 			break;
 
+		case 'P':
+			statename = optarg;
+			if ((sep = strchr(optarg, ',')) == NULL)
+				break;
+			*sep++ = '\0';
+			errno = 0;
+			ul = strtoul(sep, NULL, 10);
+			if ((ul == 0 && errno != 0) || ul > STATE_RING_MAX ||
+			    !powerof2(ul)) {
+				warnx("invalid argument `%s'", sep);
+				usage();
+			}
+			state_ring = ul;
+			break;
+
 		case 'L':
 			errno = 0;
 			ul = strtoul(optarg, NULL, 10);
@@ -696,7 +611,15 @@ main(int argc, char *argv[])
 				warnx("invalid argument `%s'", optarg);
 				usage();
 			}
-			opt_scroll_speed = ul;
+			opts.scroll_speed = ul;
+			break;
+
+		case 'M':
+			opt_threads = true;
+			break;
+
+		case 'W':
+			opt_wheel = true;
 			break;
 
 		case 'q':
@@ -708,19 +631,19 @@ main(int argc, char *argv[])
 			break;
 
 		case 'T':
-			opt_drift_terminate = true;
-			sscanf(optarg, "%u,%u,%u", &opt_drift_distance,
-			    &opt_drift_time, &opt_drift_after);
-			if (opt_drift_distance == 0 ||
-			    opt_drift_time == 0 ||
-			    opt_drift_after == 0) {
+			opts.drift_terminate = true;
+			sscanf(optarg, "%u,%u,%u", &opts.drift_distance,
+			    &opts.drift_time, &opts.drift_after);
+			if (opts.drift_distance == 0 ||
+			    opts.drift_time == 0 ||
+			    opts.drift_after == 0) {
 				warnx("invalid argument `%s'", optarg);
 				usage();
 			}
 			break;
 
 		case 'V':
-			opt_virtual_scroll = true;
+			opts.virtual_scroll = true;
 			break;
 
 		case 'U':
@@ -730,7 +653,7 @@ main(int argc, char *argv[])
 				warnx("invalid argument `%s'", optarg);
 				usage();
 			}
-			opt_scroll_threshold = ul;
+			opts.scroll_threshold = ul;
 			break;
 
 		case 'h':
@@ -740,12 +663,45 @@ main(int argc, char *argv[])
 		}
 	}
 
+	moused_log_init(log_or_warn_va, debug && nodaemon);
+
+	if (ctlcmd != NULL)
+		exit(ctl_client(ctlcmd));
+	if (tracefile != NULL) {
+		fp = strcmp(tracefile, "-") == 0 ?
+		    stdin : fopen(tracefile, "r");
+		if (fp == NULL)
+			err(1, "cannot open %s", tracefile);
+		if (trace_decode(fp, stdout) != 0)
+			err(1, "cannot decode %s", tracefile);
+		exit(0);
+	}
+	if (replayfile != NULL) {
+		quirks = quirks_init_subsystem(quirks_path, config_file,
+		    log_or_warn_va, QLOG_CUSTOM_LOG_PRIORITIES);
+		if (quirks == NULL)
+			logwarnx("cannot open configuration file %s",
+			    config_file);
+		exit(r_replay(replayfile));
+	}
+
 	if ((cfd = open("/dev/consolectl", O_RDWR, 0)) == -1)
 		logerr(1, "cannot open /dev/consolectl");
 	if ((kfd = kqueue()) == -1)
 		logerr(1, "cannot create kqueue");
-	if (portname == NULL && (dfd = connect_devd()) == -1)
+	if (opt_wheel && identify == ID_NONE && (wfd = wheel_open()) == -1)
+		logwarn("cannot create hi-res wheel device");
+	/* Output stage counters on SIGINFO, trace rings on SIGUSR2 */
+	EV_SET(&kev, SIGINFO, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+	if (kevent(kfd, &kev, 1, NULL, 0, NULL) == -1)
+		logwarn("cannot register SIGINFO kevent");
+	EV_SET(&kev, SIGUSR2, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+	if (kevent(kfd, &kev, 1, NULL, 0, NULL) == -1)
+		logwarn("cannot register SIGUSR2 kevent");
+	if (portname == NULL && (dfd = connect_devd()) == -1) {
 		logwarnx("cannot open devd socket");
+		disconnect_devd();
+	}
 
 	switch (setjmp(env)) {
 	case SIGHUP:
@@ -754,12 +710,8 @@ main(int argc, char *argv[])
 		/* FALLTHROUGH */
 	case 0:
 		break;
-	case SIGINT:
-	case SIGQUIT:
-	case SIGTERM:
-		exit(0);
-		/* NOT REACHED */
 	default:
+		/* Stop signals unlink sockets and shared state on the way out */
 		goto out;
 	}
 
@@ -768,6 +720,7 @@ main(int argc, char *argv[])
 	signal(SIGQUIT, reset);
 	signal(SIGTERM, reset);
 	signal(SIGUSR1, pause_mouse);
+	signal(SIGUSR2, SIG_IGN);
 
 	quirks = quirks_init_subsystem(quirks_path, config_file,
 	    log_or_warn_va,
@@ -784,7 +737,7 @@ main(int argc, char *argv[])
 
 	/* print some information */
 	if (identify != ID_NONE) {
-		SLIST_FOREACH(r, &rodents, next) {
+		TAILQ_FOREACH(r, &rodents, next) {
 			if (identify == ID_ALL)
 				printf("%s %s %s %s\n",
 				    r->dev.path, r_if(r->dev.iftype),
@@ -819,319 +772,338 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (sfd == -1 && (sfd = sock_open(ctlsock, SOCK_STREAM)) == -1)
+		logwarn("cannot create control socket %s", ctlsock);
+	if (ifd == -1 && (ifd = sock_open(inputsock, SOCK_SEQPACKET)) == -1)
+		logwarn("cannot create input socket %s", inputsock);
+	if (statename != NULL && state == NULL &&
+	    (state = state_open(statename, state_ring)) == NULL)
+		logwarn("cannot create shared memory state %s", statename);
+	r_start_workers();
 	moused();
 
 out:
+	r_deinit_all();
 	quirks_context_unref(quirks);
 
-	r_deinit_all();
 	if (dfd != -1)
 		close(dfd);
+	if (vfd != -1)
+		close(vfd);
+	if (sfd != -1) {
+		close(sfd);
+		unlink(ctlsock);
+	}
+	if (ifd != -1) {
+		close(ifd);
+		unlink(inputsock);
+	}
+	state_close(state);
+	wheel_close();
 	if (kfd != -1)
 		close(kfd);
 	if (cfd != -1)
 		close(cfd);
+	pidfile_remove(pfh);
 
 	exit(0);
 }
 
-/*
- * Function to calculate linear acceleration.
- *
- * If there are any rounding errors, the remainder
- * is stored in the remainx and remainy variables
- * and taken into account upon the next movement.
- */
-
-static void
-linacc(struct accel *acc, int dx, int dy, int dz,
-    int *movex, int *movey, int *movez)
-{
-	double fdx, fdy, fdz;
-
-	if (dx == 0 && dy == 0 && dz == 0) {
-		*movex = *movey = *movez = 0;
-		return;
-	}
-	fdx = dx * acc->accelx + acc->remainx;
-	fdy = dy * acc->accely + acc->remainy;
-	fdz = dz * acc->accelz + acc->remainz;
-	*movex = lround(fdx);
-	*movey = lround(fdy);
-	*movez = lround(fdz);
-	acc->remainx = fdx - *movex;
-	acc->remainy = fdy - *movey;
-	acc->remainz = fdz - *movez;
-}
-
-/*
- * Function to calculate exponential acceleration.
- * (Also includes linear acceleration if enabled.)
- *
- * In order to give a smoother behaviour, we record the four
- * most recent non-zero movements and use their average value
- * to calculate the acceleration.
- */
-
-static void
-expoacc(struct accel *acc, int dx, int dy, int dz,
-    int *movex, int *movey, int *movez)
-{
-	double fdx, fdy, fdz, length, lbase, accel;
-
-	if (dx == 0 && dy == 0 && dz == 0) {
-		*movex = *movey = *movez = 0;
-		return;
-	}
-	fdx = dx * acc->accelx;
-	fdy = dy * acc->accely;
-	fdz = dz * acc->accelz;
-	length = sqrt((fdx * fdx) + (fdy * fdy));	/* Pythagoras */
-	length = (length + acc->lastlength[0] + acc->lastlength[1] +
-	    acc->lastlength[2]) / 4;
-	lbase = length / acc->expoffset;
-	accel = pow(lbase, acc->expoaccel) / lbase;
-	fdx = fdx * accel + acc->remainx;
-	fdy = fdy * accel + acc->remainy;
-	*movex = lround(fdx);
-	*movey = lround(fdy);
-	*movez = lround(fdz);
-	acc->remainx = fdx - *movex;
-	acc->remainy = fdy - *movey;
-	acc->remainz = fdz - *movez;
-	acc->lastlength[2] = acc->lastlength[1];
-	acc->lastlength[1] = acc->lastlength[0];
-	/* Insert new average, not original length! */
-	acc->lastlength[0] = length;
-}
-
 static void
 moused(void)
 {
 	struct rodent *r = NULL;
-	mousestatus_t action0;		/* original mouse action */
-	mousestatus_t action;		/* interim buffer */
-	mousestatus_t action2;		/* mapped action */
-	struct kevent ke[2];
+	struct ctl_conn *cc;
+	struct kevent ke[MOUSED_TIMER_CNT];
 	int nchanges;
-	union {
-		struct input_event ie;
-		uint8_t se[MOUSE_SYS_PACKETSIZE];
-	} b;
-	size_t b_size;
-	ssize_t r_size;
-	int flags;
 	int c;
 
-	/* clear mouse data */
-	bzero(&action0, sizeof(action0));
-	bzero(&action, sizeof(action));
-	bzero(&action2, sizeof(action2));
 	/* process mouse data */
 	for (;;) {
 
-		if (dfd == -1 && portname == NULL)
-			dfd = connect_devd();
-		nchanges = 0;
-		if (r != NULL && r->e3b.enabled &&
-		    S_DELAYED(r->e3b.mouse_button_state)) {
-			EV_SET(ke + nchanges, r->mfd << 1, EVFILT_TIMER,
-			    EV_ADD | EV_ENABLE | EV_DISPATCH, 0, 20, r);
-			nchanges++;
-			r->e3b.timer_armed = true;
-		}
-		if (r != NULL && r->tp.gest.idletimeout > 0) {
-			EV_SET(ke + nchanges, r->mfd << 1 | 1, EVFILT_TIMER,
-			    EV_ADD | EV_ENABLE | EV_DISPATCH,
-			    0, r->tp.gest.idletimeout, r);
-			nchanges++;
-			r->tp.gest.timer_armed = true;
-		}
-		if (dfd == -1 && nchanges == 0 && portname == NULL) {
-			EV_SET(ke + nchanges, UINTPTR_MAX, EVFILT_TIMER,
-			    EV_ADD | EV_ENABLE | EV_ONESHOT, 0, 1000, NULL);
-			nchanges++;
-		}
+		nchanges = r != NULL ? r_arm_timers(r, ke) : 0;
 
-		if (!(r != NULL && r->tp.gest.idletimeout == 0)) {
+		if (!(r != NULL && r_expired(r))) {
 			c = kevent(kfd, ke, nchanges, ke, 1, NULL);
 			if (c <= 0) {			/* error */
 				logwarn("failed to read from mouse");
 				continue;
 			}
-		} else
+		} else {
+			if (nchanges != 0)
+				kevent(kfd, ke, nchanges, NULL, 0, NULL);
 			c = 0;
+		}
 		/* Devd event */
 		if (c > 0 && ke[0].udata == NULL) {
-			if (ke[0].filter == EVFILT_READ) {
-				if ((ke[0].flags & EV_EOF) != 0) {
-					logwarn("devd connection is closed");
-					close(dfd);
-					dfd = -1;
+			switch (ke[0].filter) {
+			case EVFILT_READ:
+				if (ke[0].ident == (uintptr_t)sfd)
+					ctl_accept();
+				else if (ke[0].ident == (uintptr_t)ifd)
+					input_accept();
+				else if ((cc = ctl_find(ke[0].ident)) != NULL)
+					ctl_event(cc, ke);
+				else if (ke[0].ident != (uintptr_t)dfd)
+					input_caps(ke[0].ident);
+				else if ((ke[0].flags & EV_EOF) != 0) {
+					logwarnx("devd connection is closed");
+					disconnect_devd();
 				} else
 					fetch_and_parse_devd();
-			} else if (ke[0].filter == EVFILT_TIMER) {
-				/* DO NOTHING */
+				break;
+			case EVFILT_WRITE:
+				if ((cc = ctl_find(ke[0].ident)) != NULL)
+					ctl_event(cc, ke);
+				break;
+			case EVFILT_TIMER:
+				if (ke[0].ident == DEVD_TIMER_ID)
+					reconnect_devd(true);
+				else if ((cc = ctl_find(
+				    CTL_TIMER_ID(ke[0].ident))) != NULL)
+					ctl_event(cc, ke);
+				break;
+			case EVFILT_VNODE:
+				reconnect_devd(false);
+				break;
+			case EVFILT_SIGNAL:
+				if (ke[0].ident == SIGUSR2)
+					r_trace_save();
+				else {
+					r_output_stats(NULL);
+					r_record_save_all(NULL);
+				}
+				break;
 			}
+			/* Hotplug may have destroyed the current rodent */
+			r = NULL;
 			continue;
 		}
 		if (c > 0)
 			r = ke[0].udata;
-		/* E3B timeout */
-		if (c > 0 && ke[0].filter == EVFILT_TIMER &&
-		    (ke[0].ident & 1) == 0) {
-			/* assert(rodent.flags & Emulate3Button) */
-			action0.button = action0.obutton;
-			action0.dx = action0.dy = action0.dz = 0;
-			action0.flags = flags = 0;
-			r->e3b.timer_armed = false;
-			if (r_timeout(&r->e3b) &&
-			    r_statetrans(r, &action0, &action, A_TIMEOUT)) {
-				if (debug > 2)
-					debug("flags:%08x buttons:%08x obuttons:%08x",
-					    action.flags, action.button, action.obutton);
-			} else {
-				action0.obutton = action0.button;
-				continue;
-			}
-		} else {
-			/* mouse movement */
-			if (c > 0 && ke[0].filter == EVFILT_READ) {
-				b_size = rifs[r->dev.iftype].p_size;
-				r_size = read(r->mfd, &b, b_size);
-				if (r_size == -1) {
-					if (errno == EWOULDBLOCK)
-						continue;
-					else if (portname == NULL) {
-						r_deinit(r);
-						r = NULL;
-						continue;
-					} else
-						return;
-				}
-				if (r_size != b_size) {
-					logwarn("Short read from mouse: "
-					    "%zd bytes", r_size);
-					continue;
-				}
-				/* Disarm nonexpired timers */
-				nchanges = 0;
-				if (r->e3b.timer_armed) {
-					EV_SET(ke + nchanges, r->mfd << 1,
-					    EVFILT_TIMER, EV_DISABLE, 0, 0, r);
-					nchanges++;
-					r->e3b.timer_armed = false;
-				}
-				if (r->tp.gest.timer_armed) {
-					EV_SET(ke + nchanges, r->mfd << 1 | 1,
-					    EVFILT_TIMER, EV_DISABLE, 0, 0, r);
-					nchanges++;
-					r->tp.gest.timer_armed = false;
-				}
-				if (nchanges != 0)
-					kevent(kfd, ke, nchanges, NULL, 0, NULL);
-			} else {
-				/*
-				 * Gesture timeout expired.
-				 * Notify r_gestures by empty packet.
-				 */
-#ifdef DONE_RIGHT
-				struct timespec ts;
-				clock_gettime(CLOCK_REALTIME, &ts);
-				b.ie.time.tv_sec = ts.tv_sec;
-				b.ie.time.tv_usec = ts.tv_nsec / 1000;
-#else
-				/* Hacky but cheap */
-				b.ie.time.tv_sec =
-				    r->tp.gest.idletimeout == 0 ? 0 : LONG_MAX;
-				b.ie.time.tv_usec = 0;
-#endif
-				b.ie.type = EV_SYN;
-				b.ie.code = SYN_REPORT;
-				b.ie.value = 1;
-				if (c > 0)
-					r->tp.gest.timer_armed = false;
+		/* Notification from a device worker or the output stage */
+		if (c > 0 && ke[0].filter == EVFILT_USER) {
+			atomic_store(&r->notified, false);
+			/* Room in the ring for stashed motion */
+			if (!r->threaded && r_output_unstash(&r->out))
+				r_output_kick(r);
+			r_record_check(r);
+			if (atomic_load(&r->dead)) {
+				if (portname != NULL && !r->feed)
+					return;
+				r_deinit(r);
 			}
-			r->tp.gest.idletimeout = -1;
-			flags = r->dev.iftype == DEVICE_IF_EVDEV ?
-			    r_protocol_evdev(r->dev.type,
-			        &r->tp, &r->ev, &b.ie, &action0) :
-			    r_protocol_sysmouse(b.se, &action0);
-			if (flags == 0)
-				continue;
+			r = NULL;
+			continue;
+		}
+		if (r_process(r, c > 0 ? ke : NULL) != 0) {
+			if (portname != NULL && !r->feed)
+				return;
+			r_deinit(r);
+			r = NULL;
+		} else
+			r_record_check(r);
+	}
+	/* NOT REACHED */
+}
 
-			if (r->scroll.enable_vert || r->scroll.enable_hor) {
-				if (action0.button == MOUSE_BUTTON2DOWN) {
-					debug("[BUTTON2] flags:%08x buttons:%08x obuttons:%08x",
-					    action.flags, action.button, action.obutton);
-				} else {
-					debug("[NOTBUTTON2] flags:%08x buttons:%08x obuttons:%08x",
-					    action.flags, action.button, action.obutton);
-				}
-				r_vscroll_detect(r, &r->scroll, &action0);
+/*
+ * Arm expiration timers of the rodent state machines.  One-shot timers
+ * are armed anew after every event, periodic ones are started once and
+ * run until the pipeline stops asking for them.
+ */
+static int
+r_arm_timers(struct rodent *r, struct kevent *ke)
+{
+	int i, nchanges = 0;
+
+	moused_dev_timeouts(r->md, r->timeout);
+	for (i = 0; i < MOUSED_TIMER_CNT; i++) {
+		if (MOUSED_TIMER_PERIODIC(i)) {
+			if (r->timeout[i] > 0 && (r->armed & (1 << i)) == 0) {
+				EV_SET(ke + nchanges, TIMER_IDENT(r, i),
+				    EVFILT_TIMER, EV_ADD | EV_ENABLE, 0,
+				    r->timeout[i], r);
+				nchanges++;
+				r->armed |= 1 << i;
+			} else if (r->timeout[i] <= 0 &&
+			    (r->armed & (1 << i)) != 0) {
+				EV_SET(ke + nchanges, TIMER_IDENT(r, i),
+				    EVFILT_TIMER, EV_DELETE, 0, 0, r);
+				nchanges++;
+				r->armed &= ~(1 << i);
 			}
-
-			r_timestamp(&action0, &r->btstate, &r->e3b, &r->drift);
-			r_statetrans(r, &action0, &action,
-			    A(action0.button & MOUSE_BUTTON1DOWN,
-			      action0.button & MOUSE_BUTTON3DOWN));
-			debug("flags:%08x buttons:%08x obuttons:%08x", action.flags,
-			    action.button, action.obutton);
+			continue;
 		}
-		action0.obutton = action0.button;
-		flags &= MOUSE_POSCHANGED;
-		flags |= action.obutton ^ action.button;
-		action.flags = flags;
-
-		if (flags == 0)
+		if (r->timeout[i] <= 0)
 			continue;
+		EV_SET(ke + nchanges, TIMER_IDENT(r, i), EVFILT_TIMER,
+		    EV_ADD | EV_ENABLE | EV_DISPATCH, 0, r->timeout[i], r);
+		nchanges++;
+		r->armed |= 1 << i;
+	}
 
-		/* handler detected action */
-		r_map(&action, &action2, &r->btstate);
-		debug("activity : buttons 0x%08x  dx %d  dy %d  dz %d",
-		    action2.button, action2.dx, action2.dy, action2.dz);
-
-		if (r->scroll.enable_vert || r->scroll.enable_hor) {
-			/*
-			 * If *only* the middle button is pressed AND we are moving
-			 * the stick/trackpoint/nipple, scroll!
-			 */
-			r_vscroll(&r->scroll, &action2);
-		}
+	return (nchanges);
+}
 
-		if (r->drift.terminate) {
-			if ((flags & MOUSE_POSCHANGED) == 0 ||
-			    action.dz || action2.dz)
-				r->drift.last_activity = r->drift.current_ts;
-			else {
-				if (r_drift (&r->drift, &action2))
-					continue;
-			}
+/* Check if the rodent asks for a timer which has expired right away */
+static inline bool
+r_expired(struct rodent *r)
+{
+	int i;
+
+	for (i = 0; i < MOUSED_TIMER_CNT; i++)
+		if (r->timeout[i] == 0)
+			return (true);
+	return (false);
+}
+
+/*
+ * Read a single device event and pass it to the processing pipeline,
+ * or tell the pipeline that its timers have expired.  kev is NULL when
+ * a timer has expired immediately.  Input socket connections deliver a
+ * batch of events per message, all of them are processed at once.
+ * Returns -1 if the device has become unreadable and should be destroyed.
+ */
+static int
+r_process(struct rodent *r, const struct kevent *kev)
+{
+	struct kevent ke[MOUSED_TIMER_CNT];
+	int i, nchanges, count;
+	union {
+		struct input_event ie[INPUT_BATCH];
+		uint8_t se[MOUSE_SYS_PACKETSIZE];
+	} b;
+	struct iovec iov;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	size_t b_size;
+	ssize_t r_size;
+
+	if (kev == NULL) {
+		for (i = 0; i < MOUSED_TIMER_CNT; i++)
+			if (r->timeout[i] == 0)
+				moused_dev_expire(r->md, i, r->clock);
+		return (0);
+	}
+	if (kev->filter == EVFILT_TIMER) {
+		i = TIMER_ID(kev->ident);
+		if (!MOUSED_TIMER_PERIODIC(i))
+			r->armed &= ~(1 << i);
+		moused_dev_expire(r->md, i, r->clock);
+		return (0);
+	}
+
+	/* mouse movement */
+	b_size = r->feed ? sizeof(b.ie) : rifs[r->dev.iftype].p_size;
+	if (r->feed) {
+		iov.iov_base = &b;
+		iov.iov_len = b_size;
+		r_size = recvmsg(r->mfd, &msg, 0);
+		if (r_size > 0 && (msg.msg_flags & MSG_TRUNC) != 0) {
+			logwarnx("%s: message exceeds %d events",
+			    r->dev.path, INPUT_BATCH);
+			return (-1);
 		}
+	} else
+		r_size = read(r->mfd, &b, b_size);
+	if (r_size == -1)
+		return (errno == EWOULDBLOCK ? 0 : -1);
+	if (r_size == 0 && r->feed) {
+		debug("%s: connection closed", r->dev.path);
+		return (-1);
+	}
+	if (r->feed ? r_size % sizeof(struct input_event) != 0 :
+	    r_size != b_size) {
+		logwarn("Short read from mouse: %zd bytes", r_size);
+		r_record_anomaly(r);
+		return (0);
+	}
+	count = r->feed ? r_size / sizeof(struct input_event) : 1;
+	if (r->dev.iftype == MOUSED_IF_EVDEV) {
+		for (i = 0; i < count; i++) {
+			record_event(&r->rec, &b.ie[i]);
+			trace(moused_dev_trace(r->md), TRACE_EVENT,
+			    b.ie[i].type, b.ie[i].code, b.ie[i].value, 0);
+			if (b.ie[i].type == EV_SYN &&
+			    b.ie[i].code == SYN_DROPPED)
+				r_record_anomaly(r);
+		}
+	} else {
+		record_packet(&r->rec, b.se);
+		trace(moused_dev_trace(r->md), TRACE_SYSMOUSE, le32dec(b.se),
+		    le32dec(b.se + 4), 0, 0);
+	}
 
-		/* Defer clicks until we aren't VirtualScroll'ing. */
-		if (r->scroll.state == SCROLL_NOTSCROLLING)
-			r_click(&action2, &r->btstate);
+	/* Disarm nonexpired one-shot timers */
+	nchanges = 0;
+	for (i = 0; i < MOUSED_TIMER_CNT; i++) {
+		if ((r->armed & (1 << i)) == 0 || MOUSED_TIMER_PERIODIC(i))
+			continue;
+		EV_SET(ke + nchanges, TIMER_IDENT(r, i), EVFILT_TIMER,
+		    EV_DISABLE, 0, 0, r);
+		nchanges++;
+		r->armed &= ~(1 << i);
+	}
+	if (nchanges != 0)
+		kevent(r->kq, ke, nchanges, NULL, 0, NULL);
 
-		if (action2.flags & MOUSE_POSCHANGED)
-			r_move(&action2, &r->accel);
+	if (r->dev.iftype == MOUSED_IF_EVDEV)
+		for (i = 0; i < count; i++)
+			moused_dev_event(r->md, &b.ie[i], r->clock);
+	else
+		moused_dev_packet(r->md, b.se, r->clock);
 
-		/*
-		 * If the Z axis movement is mapped to an imaginary physical
-		 * button, we need to cook up a corresponding button `up' event
-		 * after sending a button `down' event.
-		 */
-		if ((r->btstate.zmap[0] > 0) && (action.dz != 0)) {
-			action.obutton = action.button;
-			action.dx = action.dy = action.dz = 0;
-			r_map(&action, &action2, &r->btstate);
-			debug("activity : buttons 0x%08x  dx %d  dy %d  dz %d",
-			    action2.button, action2.dx, action2.dy, action2.dz);
-
-			r_click(&action2, &r->btstate);
+	return (0);
+}
+
+/*
+ * Device worker of the threaded mode.  It owns the rodent state while
+ * running, hands its output over through the output ring and talks to the
+ * main thread only through the user event registered on the main kqueue.
+ */
+static void *
+r_worker(void *arg)
+{
+	struct rodent *r = arg;
+	struct kevent ke[MOUSED_TIMER_CNT];
+	int nchanges;
+	int c;
+
+	for (;;) {
+		nchanges = r_arm_timers(r, ke);
+		if (!r_expired(r)) {
+			c = kevent(r->kq, ke, nchanges, ke, 1, NULL);
+			if (c == -1 && errno == EINTR)
+				continue;
+			/* Retrying would spin, give the device up instead */
+			if (c <= 0) {
+				logwarn("%s: failed to read from mouse",
+				    r->dev.path);
+				break;
+			}
+			if (ke[0].filter == EVFILT_USER) {
+				/* Stop request from r_deinit() */
+				if (ke[0].ident == WORKER_STOP)
+					break;
+				/* Room in the ring for stashed motion */
+				if (r_output_unstash(&r->out))
+					r_output_kick(r);
+				continue;
+			}
+		} else {
+			if (nchanges != 0)
+				kevent(r->kq, ke, nchanges, NULL, 0, NULL);
+			c = 0;
 		}
+		if (r_process(r, c > 0 ? ke : NULL) != 0)
+			break;
 	}
-	/* NOT REACHED */
+	if (!atomic_load(&r->stop)) {
+		atomic_store(&r->dead, true);
+		r_notify(r);
+	}
+
+	return (NULL);
 }
 
 static void
@@ -1151,7 +1123,7 @@ connect_devd(void)
 {
 	const static struct sockaddr_un sa = {
 		.sun_family = AF_UNIX,
-		.sun_path = "/var/run/devd.seqpacket.pipe",
+		.sun_path = DEVD_SOCKET,
 	};
 	struct kevent kev;
 	int fd;
@@ -1172,72 +1144,556 @@ connect_devd(void)
 	return (fd);
 }
 
+/*
+ * Close devd connection if any and schedule reconnection.  Attempts are
+ * driven by an exponential backoff timer and by writes to the directory
+ * holding the devd socket, so nothing is polled while devd is down.
+ */
 static void
-fetch_and_parse_devd(void)
+disconnect_devd(void)
 {
-	char ev[1024];
-	char path[22] = "/dev/";
-	char *cdev, *cr;
-	ssize_t len;
+	struct kevent ke[2];
+	int nchanges = 0;
 
-	if ((len = recv(dfd, ev, sizeof(ev), MSG_WAITALL)) <= 0) {
+	if (dfd != -1) {
 		close(dfd);
 		dfd = -1;
-		return;
 	}
 
-	if (ev[0] != '!')
-		return;
-	if (strnstr(ev, "system=DEVFS", len) == NULL)
-		return;
-	if (strnstr(ev, "subsystem=CDEV", len) == NULL)
-		return;
-	if (strnstr(ev, "type=CREATE", len) == NULL)
-		return;
-	if ((cdev = strnstr(ev, "cdev=input/event", len)) == NULL)
-		return;
-	cr = strchr(cdev, '\n');
-	if (cr != NULL)
-		*cr = '\0';
-	cr = strchr(cdev, ' ');
-	if (cr != NULL)
-		*cr = '\0';
-	strncpy(path + 5, cdev + 5, 17);
-	(void)r_init(path);
-	return;
+	if (vfd == -1) {
+		vfd = open(DEVD_SOCKET_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (vfd != -1) {
+			EV_SET(ke + nchanges, vfd, EVFILT_VNODE,
+			    EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+			nchanges++;
+		}
+	}
+
+	EV_SET(ke + nchanges, DEVD_TIMER_ID, EVFILT_TIMER,
+	    EV_ADD | EV_ENABLE | EV_ONESHOT, 0, devd_retry, NULL);
+	nchanges++;
+	debug("devd reconnect in %u ms", devd_retry);
+	devd_retry = MIN(devd_retry * 2, DEVD_RETRY_MAX);
+
+	if (kevent(kfd, ke, nchanges, NULL, 0, NULL) == -1)
+		logwarn("failed to schedule devd reconnect");
 }
 
-/*
- * usage
- *
- * Complain, and free the CPU for more worthy tasks
- */
 static void
-usage(void)
+reconnect_devd(bool timeout)
 {
-	fprintf(stderr, "%s\n%s\n%s\n%s\n%s\n",
-	    "usage: moused [-dfg] [-I file] [-F rate] [-r resolution]",
-	    "              [-VH [-U threshold]] [-a X[,Y]] [-C threshold] [-m N=M] [-w N]",
-	    "              [-z N] [-t <mousetype>] [-l level] [-3 [-E timeout]]",
-	    "              [-T distance[,time[,after]]] -p <port> [-q config] [-Q quirks]",
-	    "       moused [-d] -i <port|if|type|model|all> -p <port>");
-	exit(1);
+	struct kevent ke;
+
+	if (dfd != -1)
+		return;
+
+	dfd = connect_devd();
+	if (dfd == -1) {
+		/* Directory changes do not reset backoff timer */
+		if (timeout)
+			disconnect_devd();
+		return;
+	}
+
+	debug("devd connection is restored");
+	devd_retry = DEVD_RETRY_MIN;
+	if (!timeout) {
+		EV_SET(&ke, DEVD_TIMER_ID, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+		kevent(kfd, &ke, 1, NULL, 0, NULL);
+	}
+	if (vfd != -1) {
+		close(vfd);
+		vfd = -1;
+	}
+	/* Devices might appear while devd was down */
+	r_init_all();
 }
 
 /*
- * Output an error message to syslog or stderr as appropriate. If
- * `errnum' is non-zero, append its string form to the message.
+ * Split devd(8) notification into space separated key=value tokens.
+ * Values may be enclosed in double quotes.  The message is modified
+ * in place, returned pointers refer to it.
  */
-static void
-log_or_warn_va(int log_pri, int errnum, const char *fmt, va_list ap)
+static bool
+parse_devd_event(char *msg, struct devd_event *de)
 {
-	char buf[256];
-	size_t len;
+	char *key, *value, *cp;
 
-	if (debug == 0 && log_pri > LOG_ERR)
-		return;
+	memset(de, 0, sizeof(*de));
+	if (*msg != '!')
+		return (false);
 
-	vsnprintf(buf, sizeof(buf), fmt, ap);
+	cp = msg + 1;
+	for (;;) {
+		while (*cp == ' ' || *cp == '\n')
+			cp++;
+		if (*cp == '\0')
+			break;
+		key = cp;
+		while (*cp != '=' && *cp != ' ' && *cp != '\n' && *cp != '\0')
+			cp++;
+		if (*cp != '=') {
+			/* Keyword without value, skip it */
+			if (*cp != '\0')
+				*cp++ = '\0';
+			continue;
+		}
+		*cp++ = '\0';
+		if (*cp == '"') {
+			value = ++cp;
+			while (*cp != '"' && *cp != '\0')
+				cp++;
+		} else {
+			value = cp;
+			while (*cp != ' ' && *cp != '\n' && *cp != '\0')
+				cp++;
+		}
+		if (*cp != '\0')
+			*cp++ = '\0';
+
+		if (strcmp(key, "system") == 0)
+			de->system = value;
+		else if (strcmp(key, "subsystem") == 0)
+			de->subsystem = value;
+		else if (strcmp(key, "type") == 0)
+			de->type = value;
+		else if (strcmp(key, "cdev") == 0)
+			de->cdev = value;
+	}
+
+	return (true);
+}
+
+static void
+process_devd_event(struct devd_event *de)
+{
+	char path[80];
+	struct rodent *r;
+
+	if (de->system == NULL || strcmp(de->system, "DEVFS") != 0 ||
+	    de->subsystem == NULL || strcmp(de->subsystem, "CDEV") != 0 ||
+	    de->type == NULL || de->cdev == NULL ||
+	    fnmatch("input/event[0-9]*", de->cdev, 0) != 0)
+		return;
+
+	snprintf(path, sizeof(path), "/dev/%s", de->cdev);
+	if (strcmp(de->type, "CREATE") == 0) {
+		(void)r_init(path);
+	} else if (strcmp(de->type, "DESTROY") == 0) {
+		r = r_find_by_path(path);
+		if (r != NULL)
+			r_deinit(r);
+	}
+}
+
+/*
+ * Drain all queued devd notifications.  Each recv() on a seqpacket
+ * socket returns exactly one message, so loop until the queue is empty.
+ */
+static void
+fetch_and_parse_devd(void)
+{
+	char ev[1024];
+	struct devd_event de;
+	ssize_t len;
+
+	for (;;) {
+		len = recv(dfd, ev, sizeof(ev) - 1, MSG_DONTWAIT);
+		if (len == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (len <= 0) {
+			disconnect_devd();
+			return;
+		}
+		ev[len] = '\0';
+		if (parse_devd_event(ev, &de))
+			process_devd_event(&de);
+	}
+}
+
+/* Create control or input socket, it is served from the main loop */
+static int
+sock_open(const char *path, int type)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct kevent kev;
+	mode_t omask;
+	int fd;
+
+	if (strlcpy(sa.sun_path, path, sizeof(sa.sun_path)) >=
+	    sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	fd = socket(AF_UNIX, type | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return (-1);
+	unlink(path);
+	/* Connections are accepted from root only */
+	omask = umask(077);
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		umask(omask);
+		close(fd);
+		return (-1);
+	}
+	umask(omask);
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+	if (listen(fd, 4) < 0 || kevent(kfd, &kev, 1, NULL, 0, NULL) < 0) {
+		close(fd);
+		unlink(path);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Accept a control connection.  Like input connections it is served from
+ * the main kqueue: the request is read when it arrives, the reply is built
+ * in memory and sent as the client takes it, so a slow or stuck client
+ * never blocks the main loop.  A connection which makes no progress for
+ * CTL_TIMEOUT is dropped.
+ */
+static void
+ctl_accept(void)
+{
+	struct ctl_conn *c;
+	int fd, on = 1;
+
+	fd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	if ((c = calloc(1, sizeof(struct ctl_conn))) == NULL) {
+		logwarn("cannot allocate %s connection", ctlsock);
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	LIST_INSERT_HEAD(&ctl_conns, c, next);
+	ctl_wait(c, EVFILT_READ);
+}
+
+static struct ctl_conn *
+ctl_find(int fd)
+{
+	struct ctl_conn *c;
+
+	LIST_FOREACH(c, &ctl_conns, next)
+		if (c->fd == fd)
+			return (c);
+	return (NULL);
+}
+
+/* Wait for the socket to become ready, restarting the timeout */
+static void
+ctl_wait(struct ctl_conn *c, short filter)
+{
+	struct kevent kev[2];
+
+	EV_SET(kev, c->fd, filter, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+	EV_SET(kev + 1, CTL_TIMER_ID(c->fd), EVFILT_TIMER,
+	    EV_ADD | EV_ONESHOT, 0, CTL_TIMEOUT, NULL);
+	if (kevent(kfd, kev, nitems(kev), NULL, 0, NULL) == -1) {
+		logwarn("cannot register %s connection", ctlsock);
+		ctl_close(c);
+	}
+}
+
+static void
+ctl_event(struct ctl_conn *c, const struct kevent *kev)
+{
+	switch (kev->filter) {
+	case EVFILT_READ:
+		ctl_request(c);
+		break;
+	case EVFILT_WRITE:
+		ctl_reply(c);
+		break;
+	default:
+		debug("%s: connection timed out", ctlsock);
+		ctl_close(c);
+	}
+}
+
+/* Read the request and build the whole reply */
+static void
+ctl_request(struct ctl_conn *c)
+{
+	char cmd[32];
+	ssize_t len;
+	FILE *fp;
+
+	len = recv(c->fd, cmd, sizeof(cmd) - 1, 0);
+	if (len == -1 && errno == EWOULDBLOCK) {
+		ctl_wait(c, EVFILT_READ);
+		return;
+	}
+	if (len <= 0 || (fp = open_memstream(&c->reply, &c->len)) == NULL) {
+		ctl_close(c);
+		return;
+	}
+	cmd[len] = '\0';
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+	debug("control request: %s", cmd);
+
+	if (strcmp(cmd, "trace") == 0)
+		r_trace_dump(fp);
+	else if (strcmp(cmd, "stats") == 0)
+		r_output_stats(fp);
+	else if (strcmp(cmd, "record") == 0)
+		r_record_save_all(fp);
+	else
+		fprintf(fp, "unknown command: %s\n", cmd);
+	if (fclose(fp) != 0) {
+		logwarn("cannot build %s reply", ctlsock);
+		ctl_close(c);
+		return;
+	}
+	ctl_reply(c);
+}
+
+/* Send as much of the reply as the socket takes */
+static void
+ctl_reply(struct ctl_conn *c)
+{
+	ssize_t len;
+
+	while (c->off < c->len) {
+		len = send(c->fd, c->reply + c->off, c->len - c->off, 0);
+		if (len == -1 && errno == EWOULDBLOCK) {
+			ctl_wait(c, EVFILT_WRITE);
+			return;
+		}
+		if (len == -1) {
+			debug("%s: cannot send reply: %s", ctlsock,
+			    strerror(errno));
+			break;
+		}
+		c->off += len;
+	}
+	ctl_close(c);
+}
+
+/* Socket events go away on close(2), the timer has to be deleted */
+static void
+ctl_close(struct ctl_conn *c)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, CTL_TIMER_ID(c->fd), EVFILT_TIMER, EV_DELETE, 0, 0,
+	    NULL);
+	kevent(kfd, &kev, 1, NULL, 0, NULL);
+	close(c->fd);
+	LIST_REMOVE(c, next);
+	free(c->reply);
+	free(c);
+}
+
+/* Send command to the running daemon and copy its reply to stdout */
+static int
+ctl_client(const char *cmd)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	char buf[4096];
+	ssize_t len;
+	int fd;
+
+	if (strlcpy(sa.sun_path, ctlsock, sizeof(sa.sun_path)) >=
+	    sizeof(sa.sun_path))
+		errx(1, "socket path is too long: %s", ctlsock);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "cannot create socket");
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+		err(1, "cannot connect to %s", ctlsock);
+	if (send(fd, cmd, strlen(cmd), 0) < 0)
+		err(1, "cannot send command");
+	while ((len = recv(fd, buf, sizeof(buf), 0)) > 0)
+		if (fwrite(buf, 1, len, stdout) != (size_t)len)
+			err(1, "cannot write reply");
+	if (len < 0)
+		err(1, "cannot receive reply");
+	close(fd);
+
+	return (0);
+}
+
+/*
+ * Accept a connection of a local event producer on the input socket.  The
+ * first message carries the device capabilities as struct evdev_caps,
+ * every following message carries a batch of up to INPUT_BATCH struct
+ * input_event.  The connection waits in the kqueue for its capabilities,
+ * so a slow or stuck producer never blocks the main loop.
+ */
+static void
+input_accept(void)
+{
+	struct kevent kev;
+	int fd;
+
+	fd = accept4(ifd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return;
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+	if (kevent(kfd, &kev, 1, NULL, 0, NULL) == -1) {
+		logwarn("cannot register %s connection", inputsock);
+		close(fd);
+	}
+}
+
+/*
+ * Read the capabilities of an accepted input connection and turn it into
+ * a virtual evdev rodent.  Devices are identified and configured from the
+ * capabilities and quirks just like real evdev nodes.
+ */
+static void
+input_caps(int fd)
+{
+	struct evdev_caps caps;
+	struct iovec iov = { .iov_base = &caps, .iov_len = sizeof(caps) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct kevent kev;
+	struct moused_device dev;
+	struct quirks *q;
+	struct rodent *r;
+	ssize_t len;
+	int err;
+	bool ignore;
+
+	len = recvmsg(fd, &msg, 0);
+	if (len == -1 && errno == EWOULDBLOCK) {
+		EV_SET(&kev, fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+		if (kevent(kfd, &kev, 1, NULL, 0, NULL) == 0)
+			return;
+	}
+	if (len != sizeof(caps) || (msg.msg_flags & MSG_TRUNC) != 0) {
+		debug("%s: bad capabilities message", inputsock);
+		close(fd);
+		return;
+	}
+	caps.name[sizeof(caps.name) - 1] = '\0';
+	caps.uniq[sizeof(caps.uniq) - 1] = '\0';
+
+	memset(&dev, 0, sizeof(struct moused_device));
+	snprintf(dev.path, sizeof(dev.path), "%s:%u", inputsock, ++input_unit);
+	dev.iftype = MOUSED_IF_EVDEV;
+	dev.type = moused_identify(&caps);
+	err = r_init_dev_evdev(&caps, &dev);
+	if (err != 0 || (dev.type != MOUSED_TYPE_MOUSE &&
+	    dev.type != MOUSED_TYPE_POINTINGSTICK &&
+	    dev.type != MOUSED_TYPE_TOUCHPAD)) {
+		debug("unsupported device type: %s %s on %s",
+		    r_if(dev.iftype), r_name(dev.type), dev.path);
+		close(fd);
+		return;
+	}
+	debug("port: %s  interface: %s  type: %s  model: %s",
+	    dev.path, r_if(dev.iftype), r_name(dev.type), dev.name);
+
+	q = quirks_fetch_for_device(quirks, &dev);
+	if (quirks_get_bool(q, MOUSED_IGNORE_DEVICE, &ignore) && ignore) {
+		debug("%s: device ignored", dev.path);
+		close(fd);
+		quirks_unref(q);
+		return;
+	}
+	r = r_alloc(&dev, &caps, q, NULL);
+	quirks_unref(q);
+	if (r == NULL) {
+		logwarn("cannot set %s up", dev.path);
+		close(fd);
+		return;
+	}
+	r->mfd = fd;
+	r->rdev = NODEV;
+	r->feed = true;
+	if (r_attach(r) != 0)
+		r_free(r);
+}
+
+/*
+ * Create uinput device passing hi-res wheel movement on to evdev
+ * consumers.  It is only fed when the wheel is not remapped.
+ */
+static int
+wheel_open(void)
+{
+	static const int rel[] = { REL_X, REL_Y, REL_WHEEL, REL_HWHEEL,
+	    REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES };
+	struct uinput_setup us = {
+		.id.bustype = BUS_VIRTUAL,
+		.name = WHEEL_NAME,
+	};
+	int fd;
+	u_int i;
+
+	fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC, 0);
+	if (fd == -1)
+		return (-1);
+	if (ioctl(fd, UI_SET_EVBIT, EV_REL) == -1 ||
+	    ioctl(fd, UI_SET_EVBIT, EV_KEY) == -1 ||
+	    /* A button for consumers to tell the device is a mouse */
+	    ioctl(fd, UI_SET_KEYBIT, BTN_LEFT) == -1)
+		goto fail;
+	for (i = 0; i < nitems(rel); i++)
+		if (ioctl(fd, UI_SET_RELBIT, rel[i]) == -1)
+			goto fail;
+	if (ioctl(fd, UI_DEV_SETUP, &us) == -1 ||
+	    ioctl(fd, UI_DEV_CREATE) == -1)
+		goto fail;
+
+	return (fd);
+fail:
+	close(fd);
+	return (-1);
+}
+
+static void
+wheel_close(void)
+{
+	if (wfd == -1)
+		return;
+	ioctl(wfd, UI_DEV_DESTROY);
+	close(wfd);
+	wfd = -1;
+}
+
+/*
+ * usage
+ *
+ * Complain, and free the CPU for more worthy tasks
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n",
+	    "usage: moused [-dfgMW] [-I file] [-s socket] [-S socket] [-P name[,N]]",
+	    "              [-F rate] [-r resolution] [-VH [-U threshold]] [-a X[,Y]]",
+	    "              [-C threshold] [-m N=M] [-w N] [-z N] [-t <mousetype>]",
+	    "              [-l level] [-3 [-E timeout]] [-T distance[,time[,after]]]",
+	    "              -p <port> [-q config] [-Q quirks]",
+	    "       moused [-d] -i <port|if|type|model|all> -p <port>",
+	    "       moused [-s socket] -c command",
+	    "       moused -D file",
+	    "       moused [-3 [-E timeout]] [-q config] -R file");
+	exit(1);
+}
+
+/*
+ * Output an error message to syslog or stderr as appropriate. If
+ * `errnum' is non-zero, append its string form to the message.
+ */
+static void
+log_or_warn_va(int log_pri, int errnum, const char *fmt, va_list ap)
+{
+	char buf[256];
+	size_t len;
+
+	if (debug == 0 && log_pri > LOG_ERR)
+		return;
+
+	vsnprintf(buf, sizeof(buf), fmt, ap);
 
 	/* Strip trailing line-feed appended by quirk subsystem */
 	len = strlen(buf);
@@ -1318,145 +1774,60 @@ r_daemon(void)
 	return (0);
 }
 
-static inline int
-bit_find(bitstr_t *array, int start, int stop)
-{
-	int res;
-
-	bit_ffs_at(array, start, stop + 1, &res);
-	return (res != -1);
-}
-
-static enum device_if
+static enum moused_device_if
 r_identify_if(int fd)
 {
 	int dummy;
 
 	if (ioctl(fd, EVIOCGVERSION, &dummy) >= 0)
-		return (DEVICE_IF_EVDEV);
+		return (MOUSED_IF_EVDEV);
 	if (ioctl(fd, MOUSE_GETLEVEL, &dummy) >= 0)
-		return (DEVICE_IF_SYSMOUSE);
-	return (DEVICE_IF_UNKNOWN);
-}
-
-/* Derived from EvdevProbe() function of xf86-input-evdev driver */
-static enum device_type
-r_identify_evdev(int fd)
-{
-	enum device_type type;
-	bitstr_t bit_decl(key_bits, KEY_CNT); /* */
-	bitstr_t bit_decl(rel_bits, REL_CNT); /* Evdev capabilities */
-	bitstr_t bit_decl(abs_bits, ABS_CNT); /* */
-	bitstr_t bit_decl(prop_bits, INPUT_PROP_CNT);
-	bool has_keys, has_buttons, has_lmr, has_rel_axes, has_abs_axes;
-	bool has_mt;
-
-	/* maybe this is a evdev mouse... */
-	if (ioctl(fd, EVIOCGBIT(EV_REL, sizeof(rel_bits)), rel_bits) < 0 ||
-	    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits) < 0 ||
-	    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) < 0 ||
-	    ioctl(fd, EVIOCGPROP(sizeof(prop_bits)), prop_bits) < 0) {
-		return (DEVICE_TYPE_UNKNOWN);
-	}
-
-	has_keys = bit_find(key_bits, 0, BTN_MISC - 1);
-	has_buttons = bit_find(key_bits, BTN_MISC, BTN_JOYSTICK - 1);
-	has_lmr = bit_find(key_bits, BTN_LEFT, BTN_MIDDLE);
-	has_rel_axes = bit_find(rel_bits, 0, REL_MAX);
-	has_abs_axes = bit_find(abs_bits, 0, ABS_MAX);
-	has_mt = bit_find(abs_bits, ABS_MT_SLOT, ABS_MAX);
-	type = DEVICE_TYPE_UNKNOWN;
-
-	if (has_abs_axes) {
-		if (has_mt && !has_buttons) {
-			/* TBD:Improve joystick detection */
-			if (bit_test(key_bits, BTN_JOYSTICK)) {
-				return (DEVICE_TYPE_JOYSTICK);
-			} else {
-				has_buttons = true;
-			}
-		}
-
-		if (bit_test(abs_bits, ABS_X) &&
-		    bit_test(abs_bits, ABS_Y)) {
-			if (bit_test(key_bits, BTN_TOOL_PEN) ||
-			    bit_test(key_bits, BTN_STYLUS) ||
-			    bit_test(key_bits, BTN_STYLUS2)) {
-				type = DEVICE_TYPE_TABLET;
-			} else if (bit_test(abs_bits, ABS_PRESSURE) ||
-				   bit_test(key_bits, BTN_TOUCH)) {
-				if (has_lmr ||
-				    bit_test(key_bits, BTN_TOOL_FINGER)) {
-					type = DEVICE_TYPE_TOUCHPAD;
-				} else {
-					type = DEVICE_TYPE_TOUCHSCREEN;
-				}
-			/* some touchscreens use BTN_LEFT rather than BTN_TOUCH */
-			} else if (!(bit_test(rel_bits, REL_X) &&
-				     bit_test(rel_bits, REL_Y)) &&
-				     has_lmr) {
-				type = DEVICE_TYPE_TOUCHSCREEN;
-			}
-		}
-	}
-
-	if (type == DEVICE_TYPE_UNKNOWN) {
-		if (has_keys)
-			type = DEVICE_TYPE_KEYBOARD;
-		else if (has_rel_axes || has_buttons)
-			type = DEVICE_TYPE_MOUSE;
-	}
-
-	return (type);
+		return (MOUSED_IF_SYSMOUSE);
+	return (MOUSED_IF_UNKNOWN);
 }
 
-static enum device_type
+static enum moused_device_type
 r_identify_sysmouse(int fd __unused)
 {
 	/* All sysmouse devices act like mices */
-	return (DEVICE_TYPE_MOUSE);
+	return (MOUSED_TYPE_MOUSE);
 }
 
 static const char *
-r_if(enum device_if type)
+r_if(enum moused_device_if type)
 {
 	const char *unknown = "unknown";
 
-	return (type == DEVICE_IF_UNKNOWN || type >= (int)nitems(rifs) ?
+	return (type == MOUSED_IF_UNKNOWN || type >= (int)nitems(rifs) ?
 	    unknown : rifs[type].name);
 }
 
 static const char *
-r_name(enum device_type type)
+r_name(enum moused_device_type type)
 {
 	const char *unknown = "unknown";
 
-	return (type == DEVICE_TYPE_UNKNOWN || type >= (int)nitems(rnames) ?
+	return (type == MOUSED_TYPE_UNKNOWN || type >= (int)nitems(rnames) ?
 	    unknown : rnames[type]);
 }
 
 static int
-r_init_dev_evdev(int fd, struct device *dev)
+r_init_dev_evdev(const struct evdev_caps *caps, struct moused_device *dev)
 {
-	if (ioctl(fd, EVIOCGNAME(sizeof(dev->name) - 1), dev->name) < 0) {
-		logwarnx("unable to get device %s name", dev->path);
-		return (errno);
-	}
+	strlcpy(dev->name, caps->name, sizeof(dev->name));
 	/* Do not loop events */
-	if (strncmp(dev->name, "System mouse", sizeof(dev->name)) == 0) {
+	if (strncmp(dev->name, "System mouse", sizeof(dev->name)) == 0 ||
+	    strncmp(dev->name, WHEEL_NAME, sizeof(dev->name)) == 0) {
 		return (ENOTSUP);
 	}
-	if (ioctl(fd, EVIOCGID, &dev->id) < 0) {
-		logwarnx("unable to get device %s ID", dev->path);
-		return (errno);
-	}
-	(void)ioctl(fd, EVIOCGUNIQ(sizeof(dev->uniq) - 1), dev->uniq);
+	dev->id = caps->id;
+	strlcpy(dev->uniq, caps->uniq, sizeof(dev->uniq));
 
 	return (0);
 }
 
 static int
-r_init_dev_sysmouse(int fd, struct device *dev)
+r_init_dev_sysmouse(int fd, struct moused_device *dev)
 {
 	mousemode_t *mode = &dev->mode;
 	int level;
@@ -1496,420 +1867,131 @@ r_init_dev_sysmouse(int fd, struct device *dev)
 	return (0);
 }
 
-static void
-r_init_evstate(struct quirks *q, struct evstate *ev)
-{
-	const struct quirk_tuples *t;
-	bitstr_t *bitstr;
-	size_t maxbit;
-
-	if (quirks_get_tuples(q, QUIRK_ATTR_EVENT_CODE, &t)) {
-		for (size_t i = 0; i < t->ntuples; i++) {
-			int type = t->tuples[i].first;
-			int code = t->tuples[i].second;
-			bool enable = t->tuples[i].third;
-
-			switch (type) {
-			case EV_KEY:
-				bitstr = (bitstr_t *)&ev->key_ignore;
-				maxbit = KEY_MAX;
-				break;
-			case EV_REL:
-				bitstr = (bitstr_t *)&ev->rel_ignore;
-				maxbit = REL_MAX;
-				break;
-			case EV_ABS:
-				bitstr = (bitstr_t *)&ev->abs_ignore;
-				maxbit = ABS_MAX;
-				break;
-			default:
-				continue;
-			}
+static inline struct rodent_hash *
+r_rdev_bucket(dev_t rdev)
+{
+	return (&rodents_byrdev[fnv_32_buf(&rdev, sizeof(rdev),
+	    FNV1_32_INIT) & (RODENT_HASHSIZE - 1)]);
+}
 
-			if (code == EVENT_CODE_UNDEFINED) {
-				if (enable)
-					bit_nclear(bitstr, 0, maxbit);
-				else
-					bit_nset(bitstr, 0, maxbit);
-			} else {
-				if (code > maxbit)
-					continue;
-				if (enable)
-					bit_clear(bitstr, code);
-				else
-					bit_set(bitstr, code);
-	                }
-	        }
-	}
-
-	if (quirks_get_tuples(q, QUIRK_ATTR_INPUT_PROP, &t)) {
-		for (size_t idx = 0; idx < t->ntuples; idx++) {
-			unsigned int p = t->tuples[idx].first;
-			bool enable = t->tuples[idx].second;
-
-			if (p > INPUT_PROP_MAX)
-				continue;
-			if (enable)
-				bit_clear(ev->prop_ignore, p);
-			else
-				bit_set(ev->prop_ignore, p);
-                }
-        }
+static inline struct rodent_hash *
+r_path_bucket(const char *path)
+{
+	return (&rodents_bypath[fnv_32_str(path, FNV1_32_INIT) &
+	    (RODENT_HASHSIZE - 1)]);
 }
 
-static void
-r_init_buttons(struct quirks *q, struct btstate *bt, struct e3bstate *e3b)
+static struct rodent *
+r_find_by_rdev(dev_t rdev)
 {
-	struct timespec ts;
-	int i, j;
+	struct rodent *r;
 
-	*bt = (struct btstate) {
-		.clickthreshold = DFLT_CLICKTHRESHOLD,
-		.zmap = { 0, 0, 0, 0 },
-	};
+	LIST_FOREACH(r, r_rdev_bucket(rdev), rdev_hash)
+		if (r->rdev == rdev)
+			return (r);
+	return (NULL);
+}
 
-	memcpy(bt->p2l, default_p2l, sizeof(bt->p2l));
-	for (i = 0; i < MOUSE_MAXBUTTON; ++i) {
-		j = i;
-		if (opt_btstate.p2l[i] != 0)
-			bt->p2l[i] = opt_btstate.p2l[i];
-		if (opt_btstate.mstate[i] != NULL)
-			j = opt_btstate.mstate[i] - opt_btstate.bstate;
-		bt->mstate[i] = bt->bstate + j;
-	}
+static struct rodent *
+r_find_by_path(const char *path)
+{
+	struct rodent *r;
 
-	if (opt_btstate.zmap[0] != 0)
-		memcpy(bt->zmap, opt_btstate.zmap, sizeof(bt->zmap));
-	if (opt_clickthreshold >= 0)
-		bt->clickthreshold = opt_clickthreshold;
-	else
-		quirks_get_uint32(q, MOUSED_CLICK_THRESHOLD, &bt->clickthreshold);
-	if (opt_wmode != 0)
-		bt->wmode = opt_wmode;
-	else
-		quirks_get_uint32(q, MOUSED_WMODE, &bt->wmode);
-	if (bt->wmode != 0)
-		bt->wmode = 1 << (bt->wmode - 1);
-
-	/* fix Z axis mapping */
-	for (i = 0; i < ZMAP_MAXBUTTON; ++i) {
-		if (bt->zmap[i] <= 0)
-			continue;
-		for (j = 0; j < MOUSE_MAXBUTTON; ++j) {
-			if (bt->mstate[j] == &bt->bstate[bt->zmap[i] - 1])
-				bt->mstate[j] = &bt->zstate[i];
-		}
-		bt->zmap[i] = 1 << (bt->zmap[i] - 1);
-	}
-
-	clock_gettime(CLOCK_MONOTONIC_FAST, &ts);
-
-	*e3b = (struct e3bstate) {
-		.enabled = false,
-		.button2timeout = DFLT_BUTTON2TIMEOUT,
-	};
-	e3b->enabled = opt_e3b_enabled;
-	if (!e3b->enabled)
-		quirks_get_bool(q, MOUSED_EMULATE_THIRD_BUTTON, &e3b->enabled);
-	if (opt_e3b_button2timeout >= 0)
-		e3b->button2timeout = opt_e3b_button2timeout;
-	else
-		quirks_get_uint32(q, MOUSED_EMULATE_THIRD_BUTTON_TIMEOUT,
-		    &e3b->button2timeout);
-	e3b->mouse_button_state = S0;
-	e3b->mouse_button_state_ts = ts;
-	e3b->mouse_move_delayed = 0;
-
-	for (i = 0; i < MOUSE_MAXBUTTON; ++i) {
-		bt->bstate[i].count = 0;
-		bt->bstate[i].ts = ts;
-	}
-	for (i = 0; i < ZMAP_MAXBUTTON; ++i) {
-		bt->zstate[i].count = 0;
-		bt->zstate[i].ts = ts;
-	}
-}
-
-static void
-r_init_touchpad_hw(int fd, struct quirks *q, struct tpcaps *tphw,
-     struct evstate *ev)
-{
-	struct input_absinfo ai;
-	bitstr_t bit_decl(key_bits, KEY_CNT);
-	bitstr_t bit_decl(abs_bits, ABS_CNT);
-	bitstr_t bit_decl(prop_bits, INPUT_PROP_CNT);
-	struct quirk_range r;
-	struct quirk_dimensions dim;
-	u_int u;
-
-	ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits);
-	ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits);
-
-	if (!bit_test(ev->abs_ignore, ABS_X) &&
-	     ioctl(fd, EVIOCGABS(ABS_X), &ai) >= 0) {
-		tphw->min_x = (ai.maximum > ai.minimum) ? ai.minimum : INT_MIN;
-		tphw->max_x = (ai.maximum > ai.minimum) ? ai.maximum : INT_MAX;
-		tphw->res_x = ai.resolution == 0 ?
-		    DFLT_TPAD_RESOLUTION : ai.resolution;
-	}
-	if (!bit_test(ev->abs_ignore, ABS_Y) &&
-	     ioctl(fd, EVIOCGABS(ABS_Y), &ai) >= 0) {
-		tphw->min_y = (ai.maximum > ai.minimum) ? ai.minimum : INT_MIN;
-		tphw->max_y = (ai.maximum > ai.minimum) ? ai.maximum : INT_MAX;
-		tphw->res_y = ai.resolution == 0 ?
-		    DFLT_TPAD_RESOLUTION : ai.resolution;
-	}
-	if (quirks_get_dimensions(q, QUIRK_ATTR_RESOLUTION_HINT, &dim)) {
-		tphw->res_x = dim.x;
-		tphw->res_y = dim.y;
-	} else if (tphw->max_x != INT_MAX && tphw->max_y != INT_MAX &&
-		   quirks_get_dimensions(q, QUIRK_ATTR_SIZE_HINT, &dim)) {
-		tphw->res_x = (tphw->max_x - tphw->min_x) / dim.x;
-		tphw->res_y = (tphw->max_y - tphw->min_y) / dim.y;
-	}
-	if (!bit_test(ev->key_ignore, BTN_TOUCH) &&
-	     bit_test(key_bits, BTN_TOUCH))
-		tphw->cap_touch = true;
-	/* XXX: libinput uses ABS_MT_PRESSURE where available */
-	if (!bit_test(ev->abs_ignore, ABS_PRESSURE) &&
-	     bit_test(abs_bits, ABS_PRESSURE) &&
-	     ioctl(fd, EVIOCGABS(ABS_PRESSURE), &ai) >= 0) {
-		tphw->cap_pressure = true;
-		tphw->min_p = ai.minimum;
-		tphw->max_p = ai.maximum;
-	}
-	if (tphw->cap_pressure &&
-	    quirks_get_range(q, QUIRK_ATTR_PRESSURE_RANGE, &r)) {
-		if (r.upper == 0 && r.lower == 0) {
-			debug("pressure-based touch detection disabled");
-			tphw->cap_pressure = false;
-		} else if (r.upper > tphw->max_p || r.upper < tphw->min_p ||
-			   r.lower > tphw->max_p || r.lower < tphw->min_p) {
-			debug("discarding out-of-bounds pressure range %d:%d",
-			    r.lower, r.upper);
-			tphw->cap_pressure = false;
-		}
-	}
-	/* XXX: libinput uses ABS_MT_TOUCH_MAJOR where available */
-	if (!bit_test(ev->abs_ignore, ABS_TOOL_WIDTH) &&
-	     bit_test(abs_bits, ABS_TOOL_WIDTH) &&
-	     quirks_get_uint32(q, QUIRK_ATTR_PALM_SIZE_THRESHOLD, &u) &&
-	     u != 0)
-		tphw->cap_width = true;
-	if (!bit_test(ev->abs_ignore, ABS_MT_SLOT) &&
-	     bit_test(abs_bits, ABS_MT_SLOT) &&
-	    !bit_test(ev->abs_ignore, ABS_MT_TRACKING_ID) &&
-	     bit_test(abs_bits, ABS_MT_TRACKING_ID) &&
-	    !bit_test(ev->abs_ignore, ABS_MT_POSITION_X) &&
-	     bit_test(abs_bits, ABS_MT_POSITION_X) &&
-	    !bit_test(ev->abs_ignore, ABS_MT_POSITION_Y) &&
-	     bit_test(abs_bits, ABS_MT_POSITION_Y))
-		tphw->is_mt = true;
-	if ( ioctl(fd, EVIOCGPROP(sizeof(prop_bits)), prop_bits) >= 0 &&
-	    !bit_test(ev->prop_ignore, INPUT_PROP_BUTTONPAD) &&
-	     bit_test(prop_bits, INPUT_PROP_BUTTONPAD))
-		tphw->is_clickpad = true;
-	if ( tphw->is_clickpad &&
-	    !bit_test(ev->prop_ignore, INPUT_PROP_TOPBUTTONPAD) &&
-	     bit_test(prop_bits, INPUT_PROP_TOPBUTTONPAD))
-		tphw->is_topbuttonpad = true;
-}
-
-static void
-r_init_touchpad_info(struct quirks *q, struct tpcaps *tphw,
-    struct tpinfo *tpinfo)
-{
-	struct quirk_range r;
-	int i;
-	u_int u;
-	int sz_x, sz_y;
-
-	*tpinfo = (struct tpinfo) {
-		.two_finger_scroll = true,
-		.natural_scroll = false,
-		.three_finger_drag = false,
-		.min_pressure_hi = 1,
-		.min_pressure_lo = 1,
-		.max_pressure = 130,
-		.max_width = 16,
-		.tap_timeout = 180,		/* ms */
-		.tap_threshold = 0,
-		.tap_max_delta = 1.3,		/* mm */
-		.taphold_timeout = 300,		/* ms */
-		.vscroll_min_delta = 1.25,	/* mm */
-		.vscroll_hor_area = 0.0,	/* mm */
-		.vscroll_ver_area = -15.0,	/* mm */
-	};
-
-	quirks_get_bool(q, MOUSED_TWO_FINGER_SCROLL, &tpinfo->two_finger_scroll);
-	quirks_get_bool(q, MOUSED_NATURAL_SCROLL, &tpinfo->natural_scroll);
-	quirks_get_bool(q, MOUSED_THREE_FINGER_DRAG, &tpinfo->three_finger_drag);
-	quirks_get_uint32(q, MOUSED_TAP_TIMEOUT, &tpinfo->tap_timeout);
-	quirks_get_double(q, MOUSED_TAP_MAX_DELTA, &tpinfo->tap_max_delta);
-	quirks_get_uint32(q, MOUSED_TAPHOLD_TIMEOUT, &tpinfo->taphold_timeout);
-	quirks_get_double(q, MOUSED_VSCROLL_MIN_DELTA, &tpinfo->vscroll_min_delta);
-	quirks_get_double(q, MOUSED_VSCROLL_HOR_AREA, &tpinfo->vscroll_hor_area);
-	quirks_get_double(q, MOUSED_VSCROLL_VER_AREA, &tpinfo->vscroll_ver_area);
-
-	if (tphw->cap_pressure &&
-	    quirks_get_range(q, QUIRK_ATTR_PRESSURE_RANGE, &r)) {
-		tpinfo->min_pressure_lo = r.lower;
-		tpinfo->min_pressure_hi = r.upper;
-		quirks_get_uint32(q, QUIRK_ATTR_PALM_PRESSURE_THRESHOLD,
-		    &tpinfo->max_pressure);
-		quirks_get_uint32(q, MOUSED_TAP_PRESSURE_THRESHOLD,
-		    &tpinfo->tap_threshold);
-	}
-	if (tphw->cap_width)
-		quirks_get_uint32(q, QUIRK_ATTR_PALM_SIZE_THRESHOLD,
-		     &tpinfo->max_width);
-	/* Set bottom quarter as 42% - 16% - 42% sized softbuttons */
-	if (tphw->is_clickpad) {
-		sz_x = tphw->max_x - tphw->min_x;
-		sz_y = tphw->max_y - tphw->min_y;
-		i = 25;
-		if (tphw->is_topbuttonpad)
-			i = -i;
-		quirks_get_int32(q, MOUSED_SOFTBUTTONS_Y, &i);
-		tpinfo->softbuttons_y = sz_y * i / 100;
-		u = 42;
-		quirks_get_uint32(q, MOUSED_SOFTBUTTON2_X, &u);
-		tpinfo->softbutton2_x = sz_x * u / 100;
-		u = 58;
-		quirks_get_uint32(q, MOUSED_SOFTBUTTON3_X, &u);
-		tpinfo->softbutton3_x = sz_x * u / 100;
-	}
-}
+	LIST_FOREACH(r, r_path_bucket(path), path_hash)
+		if (strcmp(r->dev.path, path) == 0)
+			return (r);
+	return (NULL);
+}
 
+/*
+ * The output thread walks the list too, so it is changed under
+ * output_lock.  The main thread is the only writer and reads it unlocked.
+ */
 static void
-r_init_touchpad_accel(struct tpcaps *tphw, struct accel *accel)
+r_register(struct rodent *r)
 {
-	/* Normalize pointer movement to match 200dpi mouse */
-	accel->accelx *= DFLT_MOUSE_RESOLUTION;
-	accel->accelx /= tphw->res_x;
-	accel->accely *= DFLT_MOUSE_RESOLUTION;
-	accel->accely /= tphw->res_y;
-	accel->accelz *= DFLT_MOUSE_RESOLUTION;
-	accel->accelz /= (tphw->res_x * DFLT_LINEHEIGHT);
+	pthread_mutex_lock(&output_lock);
+	TAILQ_INSERT_TAIL(&rodents, r, next);
+	pthread_mutex_unlock(&output_lock);
+	LIST_INSERT_HEAD(r_rdev_bucket(r->rdev), r, rdev_hash);
+	LIST_INSERT_HEAD(r_path_bucket(r->dev.path), r, path_hash);
 }
 
+/* Pass on what is left in the ring and take the device off the output */
 static void
-r_init_touchpad_gesture(struct tpstate *gest)
+r_unregister(struct rodent *r)
 {
-	gest->idletimeout = -1;
-}
-
-static void
-r_init_drift(struct quirks *q, struct drift *d)
-{
-	if (opt_drift_terminate) {
-		d->terminate = true;
-		d->distance = opt_drift_distance;
-		d->time = opt_drift_time;
-		d->after = opt_drift_after;
-	} else if (quirks_get_bool(q, MOUSED_DRIFT_TERMINATE, &d->terminate) &&
-		   d->terminate) {
-		quirks_get_uint32(q, MOUSED_DRIFT_DISTANCE, &d->distance);
-		quirks_get_uint32(q, MOUSED_DRIFT_TIME, &d->time);
-		quirks_get_uint32(q, MOUSED_DRIFT_AFTER, &d->after);
-	} else
-		return;
-
-	if (d->distance == 0 || d->time == 0 || d->after == 0) {
-		warnx("invalid drift parameter");
-		exit(1);
-	}
-
-	debug("terminate drift: distance %d, time %d, after %d",
-	    d->distance, d->time, d->after);
-
-	d->time_ts = msec2ts(d->time);
-	d->twotime_ts = msec2ts(d->time * 2);
-	d->after_ts = msec2ts(d->after);
-}
-
-static void
-r_init_accel(struct quirks *q, struct accel *acc)
-{
-	bool r1, r2;
-
-	acc->accelx = opt_accelx;
-	if (opt_accelx == 1.0)
-		 quirks_get_double(q, MOUSED_LINEAR_ACCEL_X, &acc->accelx);
-	acc->accely = opt_accely;
-	if (opt_accely == 1.0)
-		 quirks_get_double(q, MOUSED_LINEAR_ACCEL_Y, &acc->accely);
-	if (!quirks_get_double(q, MOUSED_LINEAR_ACCEL_Z, &acc->accelz))
-		acc->accelz = 1.0;
-	acc->lastlength[0] = acc->lastlength[1] = acc->lastlength[2] = 0.0;
-	if (opt_exp_accel) {
-		acc->is_exponential = true;
-		acc->expoaccel = opt_expoaccel;
-		acc->expoffset = opt_expoffset;
-		return;
-	}
-	acc->expoaccel = acc->expoffset = 1.0;
-	r1 = quirks_get_double(q, MOUSED_EXPONENTIAL_ACCEL, &acc->expoaccel);
-	r2 = quirks_get_double(q, MOUSED_EXPONENTIAL_OFFSET, &acc->expoffset);
-	if (r1 || r2)
-		acc->is_exponential = true;
-}
-
-static void
-r_init_scroll(struct quirks *q, struct scroll *scroll)
-{
-	*scroll = (struct scroll) {
-		.threshold = DFLT_SCROLLTHRESHOLD,
-		.speed = DFLT_SCROLLSPEED,
-		.state = SCROLL_NOTSCROLLING,
-	};
-	scroll->enable_vert = opt_virtual_scroll;
-	if (!opt_virtual_scroll)
-		quirks_get_bool(q, MOUSED_VIRTUAL_SCROLL_ENABLE, &scroll->enable_vert);
-	scroll->enable_hor = opt_hvirtual_scroll;
-	if (!opt_hvirtual_scroll)
-		quirks_get_bool(q, MOUSED_HOR_VIRTUAL_SCROLL_ENABLE, &scroll->enable_hor);
-	if (opt_scroll_speed >= 0)
-		scroll->speed = opt_scroll_speed;
-	else
-		quirks_get_uint32(q, MOUSED_VIRTUAL_SCROLL_SPEED, &scroll->speed);
-	if (opt_scroll_threshold >= 0)
-		scroll->threshold = opt_scroll_threshold;
-	else
-		quirks_get_uint32(q, MOUSED_VIRTUAL_SCROLL_THRESHOLD, &scroll->threshold);
+	pthread_mutex_lock(&output_lock);
+	r_output_flush(r);
+	TAILQ_REMOVE(&rodents, r, next);
+	pthread_mutex_unlock(&output_lock);
+	LIST_REMOVE(r, rdev_hash);
+	LIST_REMOVE(r, path_hash);
 }
 
+/*
+ * Open and identify a device and set up its processing state.  This
+ * part does not touch kqueue or the registry, so it may run in several
+ * threads at once.
+ */
 static struct rodent *
-r_init(const char *path)
+r_probe(const char *path)
 {
 	struct rodent *r;
-	struct device dev;
+	struct moused_device dev;
+	struct evdev_caps caps;
 	struct quirks *q;
-	struct kevent kev;
-	enum device_if iftype;
-	enum device_type type;
+	struct stat st;
+	enum moused_device_if iftype;
+	enum moused_device_type type;
 	int fd, err;
 	bool grab;
 	bool ignore;
 	bool qvalid;
 
+	/* Refuse to open the same device twice, it would double events */
+	if (r_find_by_path(path) != NULL) {
+		debug("%s: device already opened", path);
+		errno = EEXIST;
+		return (NULL);
+	}
+
 	fd = open(path, O_RDWR | O_NONBLOCK);
 	if (fd == -1) {
 		logwarnx("unable to open %s", path);
 		return (NULL);
 	}
 
+	if (fstat(fd, &st) == -1) {
+		logwarn("unable to stat %s", path);
+		close(fd);
+		return (NULL);
+	}
+	if (r_find_by_rdev(st.st_rdev) != NULL) {
+		debug("%s: device already opened", path);
+		close(fd);
+		errno = EEXIST;
+		return (NULL);
+	}
+
 	iftype =  r_identify_if(fd);
 	switch (iftype) {
-	case DEVICE_IF_UNKNOWN:
+	case MOUSED_IF_UNKNOWN:
 		debug("cannot determine interface type on %s", path);
 		close(fd);
 		errno = ENOTSUP;
 		return (NULL);
-	case DEVICE_IF_EVDEV:
-		type = r_identify_evdev(fd);
+	case MOUSED_IF_EVDEV:
+		err = evdev_caps_fetch(fd, &caps);
+		if (err != 0) {
+			debug("cannot get capabilities of %s", path);
+			close(fd);
+			errno = err;
+			return (NULL);
+		}
+		type = moused_identify(&caps);
 		break;
-	case DEVICE_IF_SYSMOUSE:
+	case MOUSED_IF_SYSMOUSE:
 		type = r_identify_sysmouse(fd);
 		break;
 	default:
@@ -1921,13 +2003,14 @@ r_init(const char *path)
 	}
 
 	switch (type) {
-	case DEVICE_TYPE_UNKNOWN:
+	case MOUSED_TYPE_UNKNOWN:
 		debug("cannot determine device type on %s", path);
 		close(fd);
 		errno = ENOTSUP;
 		return (NULL);
-	case DEVICE_TYPE_MOUSE:
-	case DEVICE_TYPE_TOUCHPAD:
+	case MOUSED_TYPE_MOUSE:
+	case MOUSED_TYPE_POINTINGSTICK:
+	case MOUSED_TYPE_TOUCHPAD:
 		break;
 	default:
 		debug("unsupported device type: %s on %s",
@@ -1937,15 +2020,15 @@ r_init(const char *path)
 		return (NULL);
 	}
 
-	memset(&dev, 0, sizeof(struct device));
+	memset(&dev, 0, sizeof(struct moused_device));
 	strlcpy(dev.path, path, sizeof(dev.path));
 	dev.iftype = iftype;
 	dev.type = type;
 	switch (iftype) {
-	case DEVICE_IF_EVDEV:
-		err = r_init_dev_evdev(fd, &dev);
+	case MOUSED_IF_EVDEV:
+		err = r_init_dev_evdev(&caps, &dev);
 		break;
-	case DEVICE_IF_SYSMOUSE:
+	case MOUSED_IF_SYSMOUSE:
 		err = r_init_dev_sysmouse(fd, &dev);
 		break;
 	default:
@@ -1976,7 +2059,7 @@ r_init(const char *path)
 	}
 
 	switch (iftype) {
-	case DEVICE_IF_EVDEV:
+	case MOUSED_IF_EVDEV:
 		grab = opt_grab;
 		if (!grab)
 			qvalid = quirks_get_bool(q, MOUSED_GRAB_DEVICE, &grab);
@@ -1985,7 +2068,7 @@ r_init(const char *path)
 			err = errno;
 		}
 		break;
-	case DEVICE_IF_SYSMOUSE:
+	case MOUSED_IF_SYSMOUSE:
 		if (opt_resolution == MOUSE_RES_UNKNOWN && opt_rate == 0)
 			break;
 		if (opt_resolution != MOUSE_RES_UNKNOWN)
@@ -2009,1197 +2092,901 @@ r_init(const char *path)
 		return (NULL);
 	}
 
-	r = calloc(1, sizeof(struct rodent));
-	memcpy(&r->dev, &dev, sizeof(struct device));
-	r->mfd = fd;
-
-	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, r);
-	err = kevent(kfd, &kev, 1, NULL, 0, NULL);
-	if (err == -1) {
-		logwarnx("failed to register kevent on %s", path);
+	r = r_alloc(&dev, iftype == MOUSED_IF_EVDEV ? &caps : NULL, q, NULL);
+	quirks_unref(q);
+	if (r == NULL) {
+		err = errno;
+		logwarn("cannot set %s up", path);
 		close(fd);
-		free(r);
-		quirks_unref(q);
+		errno = err;
 		return (NULL);
 	}
+	r->mfd = fd;
+	r->rdev = st.st_rdev;
 
-	if (iftype == DEVICE_IF_EVDEV)
-		r_init_evstate(q, &r->ev);
-	r_init_buttons(q, &r->btstate, &r->e3b);
-	r_init_scroll(q, &r->scroll);
-	r_init_accel(q, &r->accel);
-	switch (type) {
-	case DEVICE_TYPE_TOUCHPAD:
-		r_init_touchpad_hw(fd, q, &r->tp.hw, &r->ev);
-		r_init_touchpad_info(q, &r->tp.hw, &r->tp.info);
-		r_init_touchpad_accel(&r->tp.hw, &r->accel);
-		r_init_touchpad_gesture(&r->tp.gest);
-		break;
+	return (r);
+}
 
-	case DEVICE_TYPE_MOUSE:
-		r_init_drift(q, &r->drift);
-		break;
+/* Allocate a rodent and set its state machines up from quirks */
+static struct rodent *
+r_alloc(const struct moused_device *dev, const struct evdev_caps *caps,
+    struct quirks *q, const struct timespec *now)
+{
+	struct rodent *r;
 
-	default:
-		debug("unsupported device type: %s", r_name(type));
-		break;
+	r = calloc(1, sizeof(struct rodent));
+	if (r == NULL)
+		return (NULL);
+	memcpy(&r->dev, dev, sizeof(struct moused_device));
+	r->mfd = -1;
+	r->kq = -1;
+	pthread_mutex_init(&r->out.lock, NULL);
+	pthread_cond_init(&r->out.room, NULL);
+	if (caps != NULL)
+		r->caps = *caps;
+	r->md = moused_dev_create(dev, caps, q, &opts, r_output, r, now);
+	if (r->md == NULL) {
+		r_output_destroy(&r->out);
+		free(r);
+		return (NULL);
 	}
-
-	quirks_unref(q);
-
-	SLIST_INSERT_HEAD(&rodents, r, next);
+	if (wfd != -1)
+		moused_dev_set_wheel(r->md, r_wheel);
 
 	return (r);
 }
 
-static void
-r_init_all(void)
+/*
+ * Start event delivery for a probed device and add it to the registry.
+ * In threaded mode device events go to a private kqueue served by its own
+ * worker.  Workers and the output stage report back through a user event
+ * on the main kqueue.  Workers are spawned only after daemonization as
+ * threads do not survive rfork(2), events are left queued in the private
+ * kqueue until then.
+ */
+static int
+r_attach(struct rodent *r)
 {
-	char path[22] = "/dev/input/";
-	DIR *dirp;
-	struct dirent *dp;
+	struct kevent kev[3];
 
-	dirp = opendir("/dev/input");
-	if (dirp == NULL)
-		logerr(1, "Failed to open /dev/input");
+	if (r_find_by_path(r->dev.path) != NULL ||
+	    (r->rdev != NODEV && r_find_by_rdev(r->rdev) != NULL)) {
+		debug("%s: device already opened", r->dev.path);
+		errno = EEXIST;
+		return (-1);
+	}
 
-	while ((dp = readdir(dirp)) != NULL) {
-		if (fnmatch("event[0-9]*", dp->d_name, 0) == 0) {
-			strncpy(path + 11, dp->d_name, 10);
-			(void)r_init(path);
+	if (!opt_threads) {
+		EV_SET(kev, r->mfd, EVFILT_READ, EV_ADD, 0, 0, r);
+		EV_SET(kev + 1, r->mfd, EVFILT_USER, EV_ADD | EV_CLEAR,
+		    0, 0, r);
+		if (kevent(kfd, kev, 2, NULL, 0, NULL) == -1) {
+			logwarnx("failed to register kevent on %s",
+			    r->dev.path);
+			return (-1);
 		}
+		r->kq = kfd;
+		r_register(r);
+		return (0);
 	}
-	(void)closedir(dirp);
 
-	return;
+	if ((r->kq = kqueue()) == -1) {
+		logwarn("cannot create kqueue for %s", r->dev.path);
+		return (-1);
+	}
+	EV_SET(kev, r->mfd, EVFILT_READ, EV_ADD, 0, 0, r);
+	EV_SET(kev + 1, WORKER_STOP, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, r);
+	EV_SET(kev + 2, WORKER_RESUME, EVFILT_USER, EV_ADD | EV_CLEAR,
+	    0, 0, r);
+	if (kevent(r->kq, kev, nitems(kev), NULL, 0, NULL) == -1) {
+		logwarnx("failed to register kevent on %s", r->dev.path);
+		goto fail;
+	}
+	EV_SET(kev, r->mfd, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, r);
+	if (kevent(kfd, kev, 1, NULL, 0, NULL) == -1) {
+		logwarnx("failed to register kevent on %s", r->dev.path);
+		goto fail;
+	}
+	if (workers_running && r_start_worker(r) != 0) {
+		EV_SET(kev, r->mfd, EVFILT_USER, EV_DELETE, 0, 0, r);
+		kevent(kfd, kev, 1, NULL, 0, NULL);
+		goto fail;
+	}
+	r->threaded = true;
+	r_register(r);
+
+	return (0);
+fail:
+	close(r->kq);
+	r->kq = -1;
+	return (-1);
 }
 
-static void
-r_deinit(struct rodent *r)
+static int
+r_start_worker(struct rodent *r)
 {
-	struct kevent ke[3];
+	int error;
 
-	if (r == NULL)
-		return;
-	if (r->mfd != -1) {
-		EV_SET(ke, r->mfd, EVFILT_READ, EV_DELETE, 0, 0, r);
-		EV_SET(ke + 1, r->mfd << 1, EVFILT_TIMER, EV_DELETE, 0, 0, r);
-		EV_SET(ke + 2, r->mfd << 1 | 1,
-		    EVFILT_TIMER, EV_DELETE, 0, 0, r);
-		kevent(kfd, ke, nitems(ke), NULL, 0, NULL);
-		close(r->mfd);
+	error = r_thread_create(&r->worker, r_worker, r);
+	if (error != 0) {
+		errno = error;
+		logwarn("cannot start worker for %s", r->dev.path);
+		return (-1);
 	}
-	SLIST_REMOVE(&rodents, r, rodent, next);
-	debug("destroy device: port: %s  model: %s", r->dev.path, r->dev.name);
-	free(r);
+	r->running = true;
+
+	return (0);
 }
 
+/*
+ * Spawn the output stage and workers of devices attached before
+ * daemonization.  The output stage is kept across SIGHUP restarts.
+ */
 static void
-r_deinit_all(void)
+r_start_workers(void)
 {
-	while (!SLIST_EMPTY(&rodents))
-		r_deinit(SLIST_FIRST(&rodents));
-}
-
-static int
-r_protocol_evdev(enum device_type type, struct tpad *tp, struct evstate *ev,
-    struct input_event *ie, mousestatus_t *act)
-{
-	const struct tpcaps *tphw = &tp->hw;
-	const struct tpinfo *tpinfo = &tp->info;
-
-	static int butmapev[8] = {	/* evdev */
-	    0,
-	    MOUSE_BUTTON1DOWN,
-	    MOUSE_BUTTON3DOWN,
-	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN,
-	    MOUSE_BUTTON2DOWN,
-	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN,
-	    MOUSE_BUTTON2DOWN | MOUSE_BUTTON3DOWN,
-	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN | MOUSE_BUTTON3DOWN
-	};
-	struct timespec ietime;
-
-	/* Drop ignored codes */
-	switch (ie->type) {
-	case EV_REL:
-		if (bit_test(ev->rel_ignore, ie->code))
-			return (0);
-	case EV_ABS:
-		if (bit_test(ev->abs_ignore, ie->code))
-			return (0);
-	case EV_KEY:
-		if (bit_test(ev->key_ignore, ie->code))
-			return (0);
-	}
-
-	if (debug > 1)
-		debug("received event 0x%02x, 0x%04x, %d",
-		    ie->type, ie->code, ie->value);
-
-	switch (ie->type) {
-	case EV_REL:
-		switch (ie->code) {
-		case REL_X:
-			ev->dx += ie->value;
-			break;
-		case REL_Y:
-			ev->dy += ie->value;
-			break;
-		case REL_WHEEL:
-			ev->dz += ie->value;
-			break;
-		case REL_HWHEEL:
-			ev->dw += ie->value;
-			break;
-		}
-		break;
-	case EV_ABS:
-		switch (ie->code) {
-		case ABS_X:
-			if (!tphw->is_mt)
-				ev->dx += ie->value - ev->st.x;
-			ev->st.x = ie->value;
-			break;
-		case ABS_Y:
-			if (!tphw->is_mt)
-				ev->dy += ie->value - ev->st.y;
-			ev->st.y = ie->value;
-			break;
-		case ABS_PRESSURE:
-			ev->st.p = ie->value;
-			break;
-		case ABS_TOOL_WIDTH:
-			ev->st.w = ie->value;
-			break;
-		case ABS_MT_SLOT:
-			if (tphw->is_mt)
-				ev->slot = ie->value;
-			break;
-		case ABS_MT_TRACKING_ID:
-			if (tphw->is_mt &&
-			    ev->slot >= 0 && ev->slot < MAX_FINGERS) {
-				if (ie->value != -1 && ev->mt[ev->slot].id > 0 &&
-				    ie->value + 1 != ev->mt[ev->slot].id) {
-					debug("tracking id changed %d->%d",
-					    ie->value, ev->mt[ev->slot].id - 1);
-					ev->mt[ev->slot].id = 0;
-				} else
-					ev->mt[ev->slot].id = ie->value + 1;
-			}
-			break;
-		case ABS_MT_POSITION_X:
-			if (tphw->is_mt &&
-			    ev->slot >= 0 && ev->slot < MAX_FINGERS) {
-			    	/* Find fastest finger */
-			        int dx = ie->value - ev->mt[ev->slot].x;
-				if (abs(dx) > abs(ev->dx))
-					ev->dx = dx;
-				ev->mt[ev->slot].x = ie->value;
-			}
-			break;
-		case ABS_MT_POSITION_Y:
-			if (tphw->is_mt &&
-			    ev->slot >= 0 && ev->slot < MAX_FINGERS) {
-			    	/* Find fastest finger */
-				int dy = ie->value - ev->mt[ev->slot].y;
-				if (abs(dy) > abs(ev->dy))
-					ev->dy = dy;
-				ev->mt[ev->slot].y = ie->value;
-			}
-			break;
-		}
-		break;
-	case EV_KEY:
-		switch (ie->code) {
-		case BTN_TOUCH:
-			ev->st.id = ie->value != 0 ? 1 : 0;
-			break;
-		case BTN_TOOL_FINGER:
-			ev->nfingers = ie->value != 0 ? 1 : ev->nfingers;
-			break;
-		case BTN_TOOL_DOUBLETAP:
-			ev->nfingers = ie->value != 0 ? 2 : ev->nfingers;
-			break;
-		case BTN_TOOL_TRIPLETAP:
-			ev->nfingers = ie->value != 0 ? 3 : ev->nfingers;
-			break;
-		case BTN_TOOL_QUADTAP:
-			ev->nfingers = ie->value != 0 ? 4 : ev->nfingers;
-			break;
-		case BTN_TOOL_QUINTTAP:
-			ev->nfingers = ie->value != 0 ? 5 : ev->nfingers;
-			break;
-		case BTN_LEFT ... BTN_LEFT + 7:
-			ev->buttons &= ~(1 << (ie->code - BTN_LEFT));
-			ev->buttons |= ((!!ie->value) << (ie->code - BTN_LEFT));
-			break;
+	struct rodent *r, *r1;
+	struct kevent kev;
+	int error;
+
+	if (!output_running) {
+		if ((okq = kqueue()) == -1)
+			logerr(1, "cannot create output kqueue");
+		EV_SET(&kev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+		if (kevent(okq, &kev, 1, NULL, 0, NULL) == -1)
+			logerr(1, "cannot register output kevent");
+		output_running = true;
+		error = r_thread_create(&output_thread, r_output_worker, NULL);
+		if (error != 0) {
+			errno = error;
+			logerr(1, "cannot start output stage");
 		}
-		break;
 	}
+	workers_running = opt_threads;
+	TAILQ_FOREACH_SAFE(r, &rodents, next, r1)
+		if (r->threaded && !r->running && r_start_worker(r) != 0)
+			r_deinit(r);
+}
 
-	if ( ie->type != EV_SYN ||
-	    (ie->code != SYN_REPORT && ie->code != SYN_DROPPED))
-		return (0);
+/* Release a probed device which has never been attached */
+static void
+r_free(struct rodent *r)
+{
+	close(r->mfd);
+	moused_dev_destroy(r->md);
+	r_output_destroy(&r->out);
+	free(r);
+}
 
-	/*
-	 * assembly full package
-	 */
+static struct rodent *
+r_init(const char *path)
+{
+	struct rodent *r;
 
-	ietime.tv_sec = ie->time.tv_sec;
-	ietime.tv_nsec = ie->time.tv_usec * 1000;
-
-	if (!tphw->cap_pressure && ev->st.id != 0)
-		ev->st.p = MAX(tpinfo->min_pressure_hi, tpinfo->tap_threshold);
-	if (tphw->cap_touch && ev->st.id == 0)
-		ev->st.p = 0;
-
-	act->obutton = act->button;
-	act->button = butmapev[ev->buttons & MOUSE_SYS_STDBUTTONS];
-	act->button |= (ev->buttons & ~MOUSE_SYS_STDBUTTONS);
-
-	if (type == DEVICE_TYPE_TOUCHPAD) {
-		if (debug > 1)
-			debug("absolute data %d,%d,%d,%d", ev->st.x, ev->st.y,
-			    ev->st.p, ev->st.w);
-		switch (r_gestures(tp, ev->st.x, ev->st.y, ev->st.p, ev->st.w,
-		    ev->nfingers, &ietime, act)) {
-		case GEST_IGNORE:
-			ev->dx = 0;
-			ev->dy = 0;
-			ev->dz = 0;
-			ev->acc_dx = ev->acc_dy = 0;
-			debug("gesture IGNORE");
-			break;
-		case GEST_ACCUMULATE:	/* Revertable pointer movement. */
-			ev->acc_dx += ev->dx;
-			ev->acc_dy += ev->dy;
-			debug("gesture ACCUMULATE %d,%d", ev->dx, ev->dy);
-			ev->dx = 0;
-			ev->dy = 0;
-			break;
-		case GEST_MOVE:		/* Pointer movement. */
-			ev->dx += ev->acc_dx;
-			ev->dy += ev->acc_dy;
-			ev->acc_dx = ev->acc_dy = 0;
-			debug("gesture MOVE %d,%d", ev->dx, ev->dy);
-			break;
-		case GEST_VSCROLL:	/* Vertical scrolling. */
-			if (tpinfo->natural_scroll)
-				ev->dz = -ev->dy;
-			else
-				ev->dz = ev->dy;
-			ev->dx = -ev->acc_dx;
-			ev->dy = -ev->acc_dy;
-			ev->acc_dx = ev->acc_dy = 0;
-			debug("gesture VSCROLL %d", ev->dz);
-			break;
-		case GEST_HSCROLL:	/* Horizontal scrolling. */
-/*
-			if (ev.dx != 0) {
-				if (tpinfo->natural_scroll)
-					act->button |= (ev.dx > 0)
-					    ? MOUSE_BUTTON6DOWN
-					    : MOUSE_BUTTON7DOWN;
-				else
-					act->button |= (ev.dx > 0)
-					    ? MOUSE_BUTTON7DOWN
-					    : MOUSE_BUTTON6DOWN;
-			}
-*/
-			ev->dx = -ev->acc_dx;
-			ev->dy = -ev->acc_dy;
-			ev->acc_dx = ev->acc_dy = 0;
-			debug("gesture HSCROLL %d", ev->dw);
-			break;
-		}
+	r = r_probe(path);
+	if (r != NULL && r_attach(r) != 0) {
+		r_free(r);
+		r = NULL;
 	}
 
-	debug("assembled full packet %d,%d,%d", ev->dx, ev->dy, ev->dz);
-	act->dx = ev->dx;
-	act->dy = ev->dy;
-	act->dz = ev->dz;
-	ev->dx = ev->dy = ev->dz = ev->dw = 0;
+	return (r);
+}
+
+static int
+r_select_evdev(const struct dirent *dp)
+{
+	return (fnmatch("event[0-9]*", dp->d_name, 0) == 0);
+}
+
+/* Order nodes by unit number so that event2 goes before event10 */
+static int
+r_compare_evdev(const struct dirent **a, const struct dirent **b)
+{
+	long ua, ub;
 
-	/* has something changed? */
-	act->flags = ((act->dx || act->dy || act->dz) ? MOUSE_POSCHANGED : 0)
-	    | (act->obutton ^ act->button);
+	ua = strtol((*a)->d_name + 5, NULL, 10);
+	ub = strtol((*b)->d_name + 5, NULL, 10);
 
-	return (act->flags);
+	return (ua < ub ? -1 : ua > ub);
 }
 
+/* Spawn helper thread.  Signals are left to the main thread. */
 static int
-r_protocol_sysmouse(uint8_t *pBuf, mousestatus_t *act)
-{
-	static int butmapmsc[8] = { /* sysmouse */
-	    0,
-	    MOUSE_BUTTON3DOWN,
-	    MOUSE_BUTTON2DOWN,
-	    MOUSE_BUTTON2DOWN | MOUSE_BUTTON3DOWN,
-	    MOUSE_BUTTON1DOWN,
-	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON3DOWN,
-	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN,
-	    MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN | MOUSE_BUTTON3DOWN
-	};
+r_thread_create(pthread_t *thread, void *(*func)(void *), void *arg)
+{
+	sigset_t set, oset;
+	int error;
 
-	debug("%02x %02x %02x %02x %02x %02x %02x %02x", pBuf[0], pBuf[1],
-	    pBuf[2], pBuf[3], pBuf[4], pBuf[5], pBuf[6], pBuf[7]);
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	error = pthread_create(thread, NULL, func, arg);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
 
-	if ((pBuf[0] & MOUSE_SYS_SYNCMASK) != MOUSE_SYS_SYNC)
-		return (0);
+	return (error);
+}
 
-	act->button = butmapmsc[(~pBuf[0]) & MOUSE_SYS_STDBUTTONS];
-	act->dx =    (signed char)(pBuf[1]) + (signed char)(pBuf[3]);
-	act->dy = - ((signed char)(pBuf[2]) + (signed char)(pBuf[4]));
-	act->dz = ((signed char)(pBuf[5] << 1) + (signed char)(pBuf[6] << 1)) >> 1;
-	act->button |= ((~pBuf[7] & MOUSE_SYS_EXTBUTTONS) << 3);
+static void *
+r_probe_worker(void *arg)
+{
+	struct probe_job *job = arg;
+	char path[80];
+	int i;
 
-	/* has something changed? */
-	act->flags = ((act->dx || act->dy || act->dz) ? MOUSE_POSCHANGED : 0)
-	    | (act->obutton ^ act->button);
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+		snprintf(path, sizeof(path), "/dev/input/%s",
+		    job->names[i]->d_name);
+		job->result[i] = r_probe(path);
+	}
 
-	return (act->flags);
+	return (NULL);
 }
 
+/*
+ * Probe all evdev nodes concurrently on a small thread pool.  Probing
+ * is dominated by ioctls and quirk matching, attaching is cheap and is
+ * done afterwards from the main thread in unit number order, so the
+ * registry contents do not depend on thread scheduling.
+ */
 static void
-r_vscroll_detect(struct rodent *r, struct scroll *sc, mousestatus_t *act)
+r_init_all(void)
 {
-	mousestatus_t newaction;
-
-	/* Allow middle button drags to scroll up and down */
-	if (act->button == MOUSE_BUTTON2DOWN) {
-		if (sc->state == SCROLL_NOTSCROLLING) {
-			sc->state = SCROLL_PREPARE;
-			sc->movement = sc->hmovement = 0;
-			debug("PREPARING TO SCROLL");
-		}
+	struct probe_job job;
+	pthread_t threads[MAX_PROBE_THREADS];
+	long ncpu;
+	int i, nthreads;
+
+	memset(&job, 0, sizeof(job));
+	job.count = scandir("/dev/input", &job.names, r_select_evdev,
+	    r_compare_evdev);
+	if (job.count == -1)
+		logerr(1, "Failed to open /dev/input");
+	if (job.count == 0) {
+		free(job.names);
 		return;
 	}
+	job.result = calloc(job.count, sizeof(struct rodent *));
+	if (job.result == NULL)
+		logerr(1, "Failed to allocate probe results");
+	atomic_init(&job.next, 0);
 
-	/* This isn't a middle button down... move along... */
-	switch (sc->state) {
-	case SCROLL_SCROLLING:
-		/*
-		 * We were scrolling, someone let go of button 2.
-		 * Now turn autoscroll off.
-		 */
-		sc->state = SCROLL_NOTSCROLLING;
-		debug("DONE WITH SCROLLING / %d", sc->state);
-		break;
-	case SCROLL_PREPARE:
-		newaction = *act;
-
-		/* We were preparing to scroll, but we never moved... */
-		r_timestamp(act, &r->btstate, &r->e3b, &r->drift);
-		r_statetrans(r, act, &newaction,
-			     A(newaction.button & MOUSE_BUTTON1DOWN,
-			       act->button & MOUSE_BUTTON3DOWN));
-
-		/* Send middle down */
-		newaction.button = MOUSE_BUTTON2DOWN;
-		r_click(&newaction, &r->btstate);
-
-		/* Send middle up */
-		r_timestamp(&newaction, &r->btstate, &r->e3b, &r->drift);
-		newaction.obutton = newaction.button;
-		newaction.button = act->button;
-		r_click(&newaction, &r->btstate);
-		break;
-	default:
-		break;
-	}
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = MIN(MIN(ncpu, MAX_PROBE_THREADS), job.count);
+	/* The calling thread takes part in probing too */
+	for (i = 0; i < nthreads - 1; i++)
+		if (r_thread_create(&threads[i], r_probe_worker, &job) != 0)
+			break;
+	nthreads = i;
+	r_probe_worker(&job);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < job.count; i++) {
+		if (job.result[i] != NULL && r_attach(job.result[i]) != 0)
+			r_free(job.result[i]);
+		free(job.names[i]);
+	}
+	free(job.result);
+	free(job.names);
 }
 
 static void
-r_vscroll(struct scroll *sc, mousestatus_t *act)
+r_deinit(struct rodent *r)
 {
-	switch (sc->state) {
-	case SCROLL_PREPARE:
-		/* Middle button down, waiting for movement threshold */
-		if (act->dy == 0 && act->dx == 0)
-			break;
-		if (sc->enable_vert) {
-			sc->movement += act->dy;
-			if (sc->movement < -sc->threshold) {
-				sc->state = SCROLL_SCROLLING;
-			} else if (sc->movement > sc->threshold) {
-				sc->state = SCROLL_SCROLLING;
-			}
-		}
-		if (sc->enable_hor) {
-			sc->hmovement += act->dx;
-			if (sc->hmovement < -sc->threshold) {
-				sc->state = SCROLL_SCROLLING;
-			} else if (sc->hmovement > sc->threshold) {
-				sc->state = SCROLL_SCROLLING;
-			}
-		}
-		if (sc->state == SCROLL_SCROLLING)
-			sc->movement = sc->hmovement = 0;
-		break;
-	case SCROLL_SCROLLING:
-		if (sc->enable_vert) {
-			sc->movement += act->dy;
-			debug("SCROLL: %d", sc->movement);
-			if (sc->movement < -sc->speed) {
-				/* Scroll down */
-				act->dz = -1;
-				sc->movement = 0;
-			}
-			else if (sc->movement > sc->speed) {
-				/* Scroll up */
-				act->dz = 1;
-				sc->movement = 0;
-			}
-		}
-		if (sc->enable_hor) {
-			sc->hmovement += act->dx;
-			debug("HORIZONTAL SCROLL: %d", sc->hmovement);
+	struct kevent ke[1];
+	int i;
 
-			if (sc->hmovement < -sc->speed) {
-				act->dz = -2;
-				sc->hmovement = 0;
-			}
-			else if (sc->hmovement > sc->speed) {
-				act->dz = 2;
-				sc->hmovement = 0;
-			}
+	if (r == NULL)
+		return;
+	/* Stop the worker first, it owns the rest of the state */
+	if (r->threaded && r->running) {
+		atomic_store(&r->stop, true);
+		/* The worker may sleep on a full ring */
+		pthread_mutex_lock(&r->out.lock);
+		pthread_cond_broadcast(&r->out.room);
+		pthread_mutex_unlock(&r->out.lock);
+		EV_SET(ke, WORKER_STOP, EVFILT_USER, 0, NOTE_TRIGGER, 0, r);
+		kevent(r->kq, ke, 1, NULL, 0, NULL);
+		pthread_join(r->worker, NULL);
+	}
+	r_unregister(r);
+	if (r->threaded) {
+		EV_SET(ke, r->mfd, EVFILT_USER, EV_DELETE, 0, 0, r);
+		kevent(kfd, ke, 1, NULL, 0, NULL);
+		/* Device and timer events go away along with the kqueue */
+		close(r->kq);
+		close(r->mfd);
+	} else if (r->mfd != -1) {
+		EV_SET(ke, r->mfd, EVFILT_READ, EV_DELETE, 0, 0, r);
+		kevent(kfd, ke, 1, NULL, 0, NULL);
+		EV_SET(ke, r->mfd, EVFILT_USER, EV_DELETE, 0, 0, r);
+		kevent(kfd, ke, 1, NULL, 0, NULL);
+		/* Timers may have never been added, delete them one by one */
+		for (i = 0; i < MOUSED_TIMER_CNT; i++) {
+			EV_SET(ke, TIMER_IDENT(r, i), EVFILT_TIMER, EV_DELETE,
+			    0, 0, r);
+			kevent(kfd, ke, 1, NULL, 0, NULL);
 		}
-
-		/* Don't move while scrolling */
-		act->dx = act->dy = 0;
-		break;
-	default:
-		break;
+		close(r->mfd);
 	}
+	debug("destroy device: port: %s  model: %s", r->dev.path, r->dev.name);
+	moused_dev_destroy(r->md);
+	r_output_destroy(&r->out);
+	free(r);
 }
 
-static bool
-r_drift (struct drift *drift, mousestatus_t *act)
+static void
+r_deinit_all(void)
 {
-	struct timespec tmp;
+	while (!TAILQ_EMPTY(&rodents))
+		r_deinit(TAILQ_FIRST(&rodents));
+}
 
-	/* X or/and Y movement only - possibly drift */
-	tssub(&drift->current_ts, &drift->last_activity, &tmp);
-	if (tscmp(&tmp, &drift->after_ts, >)) {
-		tssub(&drift->current_ts, &drift->since, &tmp);
-		if (tscmp(&tmp, &drift->time_ts, <)) {
-			drift->last.x += act->dx;
-			drift->last.y += act->dy;
-		} else {
-			/* discard old accumulated steps (drift) */
-			if (tscmp(&tmp, &drift->twotime_ts, >))
-				drift->previous.x = drift->previous.y = 0;
-			else
-				drift->previous = drift->last;
-			drift->last.x = act->dx;
-			drift->last.y = act->dy;
-			drift->since = drift->current_ts;
-		}
-		if (abs(drift->last.x) + abs(drift->last.y) > drift->distance){
-			/* real movement, pass all accumulated steps */
-			act->dx = drift->previous.x + drift->last.x;
-			act->dy = drift->previous.y + drift->last.y;
-			/* and reset accumulators */
-			tsclr(&drift->since);
-			drift->last.x = drift->last.y = 0;
-			/* drift_previous will be cleared at next movement*/
-			drift->last_activity = drift->current_ts;
-		} else {
-			return (true);	/* don't pass current movement to
-					 * console driver */
-		}
+/* Pass finished action to the console driver or the wheel device */
+static void
+r_output_write(const struct output_entry *ent)
+{
+	if (ent->wheel) {
+		r_wheel_write(&ent->mw);
+		return;
 	}
-	return (false);
+	if (replay != NULL) {
+		replay_print(replay_out, &replay->clock, &ent->mi);
+		return;
+	}
+	if (paused)
+		return;
+	if (debug < 2)
+		ioctl(cfd, CONS_MOUSECTL, &ent->mi);
+	if (state != NULL)
+		state_publish(state, &ent->mi);
 }
 
-static int
-r_statetrans(struct rodent *r, mousestatus_t *a1, mousestatus_t *a2, int trans)
+/*
+ * Pass wheel movement to the uinput device.  The report goes in a single
+ * write so reports of several devices do not interleave.
+ */
+static void
+r_wheel_write(const struct moused_wheel *mw)
 {
-	struct e3bstate *e3b = &r->e3b;
-	bool changed;
-	int flags;
+	struct input_event ie[5];
+	int n;
 
-	a2->dx = a1->dx;
-	a2->dy = a1->dy;
-	a2->dz = a1->dz;
-	a2->obutton = a2->button;
-	a2->button = a1->button;
-	a2->flags = a1->flags;
-	changed = false;
+	if (paused || debug >= 2)
+		return;
+	memset(ie, 0, sizeof(ie));
+	n = 0;
+	if (mw->dz != 0) {
+		ie[n].type = EV_REL;
+		ie[n].code = REL_WHEEL;
+		ie[n++].value = mw->dz;
+	}
+	if (mw->hires_dz != 0) {
+		ie[n].type = EV_REL;
+		ie[n].code = REL_WHEEL_HI_RES;
+		ie[n++].value = mw->hires_dz;
+	}
+	if (mw->dw != 0) {
+		ie[n].type = EV_REL;
+		ie[n].code = REL_HWHEEL;
+		ie[n++].value = mw->dw;
+	}
+	if (mw->hires_dw != 0) {
+		ie[n].type = EV_REL;
+		ie[n].code = REL_HWHEEL_HI_RES;
+		ie[n++].value = mw->hires_dw;
+	}
+	ie[n].type = EV_SYN;
+	ie[n++].code = SYN_REPORT;
+	if (write(wfd, ie, n * sizeof(ie[0])) == -1)
+		debug("cannot write wheel report: %s", strerror(errno));
+}
 
-	if (!e3b->enabled)
+/* Append entry to the ring, fails if the ring is full */
+static bool
+r_output_push(struct output_ring *ring, const struct output_entry *ent)
+{
+	u_int head, depth;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	depth = head - atomic_load(&ring->tail);
+	if (depth == OUTPUT_RING_SIZE)
 		return (false);
+	ring->buf[head & (OUTPUT_RING_SIZE - 1)] = *ent;
+	atomic_store(&ring->head, head + 1);
 
-	if (debug > 2)
-		debug("state:%d, trans:%d -> state:%d",
-		    e3b->mouse_button_state, trans,
-		    states[e3b->mouse_button_state].s[trans]);
-	/*
-	 * Avoid re-ordering button and movement events. While a button
-	 * event is deferred, throw away up to BUTTON2_MAXMOVE movement
-	 * events to allow for mouse jitter. If more movement events
-	 * occur, then complete the deferred button events immediately.
-	 */
-	if ((a2->dx != 0 || a2->dy != 0) &&
-	    S_DELAYED(states[e3b->mouse_button_state].s[trans])) {
-		if (++e3b->mouse_move_delayed > BUTTON2_MAXMOVE) {
-			e3b->mouse_move_delayed = 0;
-			e3b->mouse_button_state =
-			    states[e3b->mouse_button_state].s[A_TIMEOUT];
-			changed = true;
-		} else
-			a2->dx = a2->dy = 0;
-	} else
-		e3b->mouse_move_delayed = 0;
-	if (e3b->mouse_button_state != states[e3b->mouse_button_state].s[trans])
-		changed = true;
-	if (changed)
-		clock_gettime(CLOCK_MONOTONIC_FAST,
-		   &e3b->mouse_button_state_ts);
-	e3b->mouse_button_state = states[e3b->mouse_button_state].s[trans];
-	a2->button &= ~(MOUSE_BUTTON1DOWN | MOUSE_BUTTON2DOWN |
-	    MOUSE_BUTTON3DOWN);
-	a2->button &= states[e3b->mouse_button_state].mask;
-	a2->button |= states[e3b->mouse_button_state].buttons;
-	flags = a2->flags & MOUSE_POSCHANGED;
-	flags |= a2->obutton ^ a2->button;
-	if (flags & MOUSE_BUTTON2DOWN) {
-		a2->flags = flags & MOUSE_BUTTON2DOWN;
-		r_timestamp(a2, &r->btstate, e3b, &r->drift);
-	}
-	a2->flags = flags;
+	atomic_fetch_add_explicit(&ring->stats.queued, 1,
+	    memory_order_relaxed);
+	if (depth + 1 > atomic_load_explicit(&ring->stats.maxdepth,
+	    memory_order_relaxed))
+		atomic_store_explicit(&ring->stats.maxdepth, depth + 1,
+		    memory_order_relaxed);
 
-	return (changed);
+	return (true);
 }
 
-static char *
-skipspace(char *s)
+/* Move merged motion into the ring, true if nothing is left behind */
+static bool
+r_output_unstash(struct output_ring *ring)
 {
-	while(isspace(*s))
-		++s;
-	return (s);
-}
+	struct output_entry ent;
 
-static bool
-r_installmap(char *arg, struct btstate *bt)
-{
-	u_long pbutton;
-	u_long lbutton;
-	char *s;
-
-	while (*arg) {
-		arg = skipspace(arg);
-		s = arg;
-		while (isdigit(*arg))
-			++arg;
-		arg = skipspace(arg);
-		if ((arg <= s) || (*arg != '='))
-			return (false);
-		lbutton = strtoul(s, NULL, 10);
-
-		arg = skipspace(++arg);
-		s = arg;
-		while (isdigit(*arg))
-			++arg;
-		if ((arg <= s) || (!isspace(*arg) && (*arg != '\0')))
-			return (false);
-		pbutton = strtoul(s, NULL, 10);
-
-		if (lbutton == 0 || lbutton > MOUSE_MAXBUTTON)
-			return (false);
-		if (pbutton == 0 || pbutton > MOUSE_MAXBUTTON)
-			return (false);
-		bt->p2l[pbutton - 1] = 1 << (lbutton - 1);
-		bt->mstate[lbutton - 1] = &bt->bstate[pbutton - 1];
-	}
+	if (!ring->stashed)
+		return (true);
+	ent.wheel = false;
+	ent.mi = ring->stash;
+	if (r_output_push(ring, &ent))
+		ring->stashed = false;
 
-	return (true);
+	return (!ring->stashed);
 }
 
-static char *
-r_installzmap(char **argv, int argc, int* idx, struct btstate *bt)
+/*
+ * Wait for the output stage to make room in the ring.  The producer sleeps
+ * until r_output_flush() drains the ring or r_deinit() asks the worker to
+ * stop, false is returned in the latter case.  Replay has no output thread
+ * and drains the ring in place.
+ */
+static bool
+r_output_wait(struct rodent *r)
 {
-	char *arg, *errstr;
-	u_long i, j;
+	struct output_ring *ring = &r->out;
+	bool stop;
 
-	arg = argv[*idx];
-	++*idx;
-	if (strcmp(arg, "x") == 0) {
-		bt->zmap[0] = MOUSE_XAXIS;
-		return (NULL);
-	}
-	if (strcmp(arg, "y") == 0) {
-		bt->zmap[0] = MOUSE_YAXIS;
-		return (NULL);
-	}
-	i = strtoul(arg, NULL, 10);
-	/*
-	 * Use button i for negative Z axis movement and
-	 * button (i + 1) for positive Z axis movement.
-	 */
-	if (i == 0 || i >= MOUSE_MAXBUTTON) {
-		asprintf(&errstr, "invalid argument `%s'", arg);
-		return (errstr);
-	}
-	bt->zmap[0] = i;
-	bt->zmap[1] = i + 1;
-	debug("optind: %d, optarg: '%s'", *idx, arg);
-	for (j = 1; j < ZMAP_MAXBUTTON; ++j) {
-		if ((*idx >= argc) || !isdigit(*argv[*idx]))
-			break;
-		i = strtoul(argv[*idx], NULL, 10);
-		if (i == 0 || i >= MOUSE_MAXBUTTON) {
-			asprintf(&errstr, "invalid argument `%s'", argv[*idx]);
-			return (errstr);
-		}
-		bt->zmap[j] = i;
-		++*idx;
+	if (!output_running) {
+		r_output_flush(r);
+		return (true);
 	}
-	if ((bt->zmap[2] != 0) && (bt->zmap[3] == 0))
-		bt->zmap[3] = bt->zmap[2] + 1;
-
-	return (NULL);
+	r_output_kick(r);
+	pthread_mutex_lock(&ring->lock);
+	/* Publish the wait before looking at the ring, see r_output_flush */
+	atomic_store(&ring->stalled, true);
+	while (!(stop = atomic_load(&r->stop)) &&
+	    atomic_load(&ring->head) - atomic_load(&ring->tail) ==
+	    OUTPUT_RING_SIZE)
+		pthread_cond_wait(&ring->room, &ring->lock);
+	pthread_mutex_unlock(&ring->lock);
+
+	return (!stop);
 }
 
 static void
-r_map(mousestatus_t *act1, mousestatus_t *act2, struct btstate *bt)
+r_output_destroy(struct output_ring *ring)
 {
-	int pb;
-	int pbuttons;
-	int lbuttons;
-
-	pbuttons = act1->button;
-	lbuttons = 0;
-
-	act2->obutton = act2->button;
-	if (pbuttons & bt->wmode) {
-		pbuttons &= ~bt->wmode;
-		act1->dz = act1->dy;
-		act1->dx = 0;
-		act1->dy = 0;
-	}
-	act2->dx = act1->dx;
-	act2->dy = act1->dy;
-	act2->dz = act1->dz;
-
-	switch (bt->zmap[0]) {
-	case 0:	/* do nothing */
-		break;
-	case MOUSE_XAXIS:
-		if (act1->dz != 0) {
-			act2->dx = act1->dz;
-			act2->dz = 0;
-		}
-		break;
-	case MOUSE_YAXIS:
-		if (act1->dz != 0) {
-			act2->dy = act1->dz;
-			act2->dz = 0;
-		}
-		break;
-	default:	/* buttons */
-		pbuttons &= ~(bt->zmap[0] | bt->zmap[1]
-			    | bt->zmap[2] | bt->zmap[3]);
-		if ((act1->dz < -1) && bt->zmap[2]) {
-			pbuttons |= bt->zmap[2];
-			bt->zstate[2].count = 1;
-		} else if (act1->dz < 0) {
-			pbuttons |= bt->zmap[0];
-			bt->zstate[0].count = 1;
-		} else if ((act1->dz > 1) && bt->zmap[3]) {
-			pbuttons |= bt->zmap[3];
-			bt->zstate[3].count = 1;
-		} else if (act1->dz > 0) {
-			pbuttons |= bt->zmap[1];
-			bt->zstate[1].count = 1;
-		}
-		act2->dz = 0;
-		break;
-	}
-
-	for (pb = 0; (pb < MOUSE_MAXBUTTON) && (pbuttons != 0); ++pb) {
-		lbuttons |= (pbuttons & 1) ? bt->p2l[pb] : 0;
-		pbuttons >>= 1;
-	}
-	act2->button = lbuttons;
-
-	act2->flags =
-	    ((act2->dx || act2->dy || act2->dz) ? MOUSE_POSCHANGED : 0)
-	    | (act2->obutton ^ act2->button);
+	pthread_cond_destroy(&ring->room);
+	pthread_mutex_destroy(&ring->lock);
 }
 
+/*
+ * Queue entry for the output stage.  If the console lags behind and
+ * the ring fills up, consecutive motions are merged into a single stashed
+ * entry which goes out as soon as there is room.  Button transitions and
+ * wheel reports are never merged nor dropped, the producer waits for room
+ * instead.
+ */
 static void
-r_timestamp(mousestatus_t *act, struct btstate *bt, struct e3bstate *e3b,
-    struct drift *drift)
-{
-	struct timespec ts;
-	struct timespec ts1;
-	struct timespec ts2;
-	int button;
-	int mask;
-	int i;
-
-	mask = act->flags & MOUSE_BUTTONS;
-#if 0
-	if (mask == 0)
-		return;
-#endif
-
-	clock_gettime(CLOCK_MONOTONIC_FAST, &ts1);
-	drift->current_ts = ts1;
-
-	/* double click threshold */
-	ts = tssubms(&ts1, bt->clickthreshold);
-	debug("ts:  %jd %ld", (intmax_t)ts.tv_sec, ts.tv_nsec);
-
-	/* 3 button emulation timeout */
-	ts2 = tssubms(&ts1, e3b->button2timeout);
-
-	button = MOUSE_BUTTON1DOWN;
-	for (i = 0; (i < MOUSE_MAXBUTTON) && (mask != 0); ++i) {
-		if (mask & 1) {
-			if (act->button & button) {
-				/* the button is down */
-				debug("  :  %jd %ld",
-				    (intmax_t)bt->bstate[i].ts.tv_sec,
-				    bt->bstate[i].ts.tv_nsec);
-				if (tscmp(&ts, &bt->bstate[i].ts, >)) {
-					bt->bstate[i].count = 1;
-				} else {
-					++bt->bstate[i].count;
-				}
-				bt->bstate[i].ts = ts1;
-			} else {
-				/* the button is up */
-				bt->bstate[i].ts = ts1;
-			}
+r_output_queue(struct rodent *r, const struct output_entry *ent)
+{
+	struct output_ring *ring = &r->out;
+	const struct mouse_info *mi = &ent->mi;
+
+	while (!r_output_unstash(ring) || !r_output_push(ring, ent)) {
+		if (ent->wheel || mi->operation != MOUSE_MOTION_EVENT) {
+			atomic_fetch_add_explicit(&ring->stats.stalls, 1,
+			    memory_order_relaxed);
+			if (!r_output_wait(r))
+				return;
+			continue;
+		}
+		if (ring->stashed) {
+			ring->stash.u.data.x += mi->u.data.x;
+			ring->stash.u.data.y += mi->u.data.y;
+			ring->stash.u.data.z += mi->u.data.z;
+			ring->stash.u.data.buttons = mi->u.data.buttons;
+			atomic_fetch_add_explicit(&ring->stats.coalesced, 1,
+			    memory_order_relaxed);
 		} else {
-			if (act->button & button) {
-				/* the button has been down */
-				if (tscmp(&ts2, &bt->bstate[i].ts, >)) {
-					bt->bstate[i].count = 1;
-					bt->bstate[i].ts = ts1;
-					act->flags |= button;
-					debug("button %d timeout", i + 1);
-				}
-			} else {
-				/* the button has been up */
-			}
+			ring->stash = *mi;
+			ring->stashed = true;
 		}
-		button <<= 1;
-		mask >>= 1;
+		/* Ask for a wakeup, then recheck to not miss it */
+		atomic_store(&ring->stalled, true);
+		r_output_unstash(ring);
+		break;
 	}
+	r_output_kick(r);
 }
 
-static bool
-r_timeout(struct e3bstate *e3b)
+static void
+r_output(void *arg, const struct mouse_info *mi)
 {
-	struct timespec ts;
-	struct timespec ts1;
+	struct output_entry ent;
 
-	if (states[e3b->mouse_button_state].timeout)
-		return (true);
-	clock_gettime(CLOCK_MONOTONIC_FAST, &ts1);
-	ts = tssubms(&ts1, e3b->button2timeout);
-	return (tscmp(&ts, &e3b->mouse_button_state_ts, >));
+	ent.wheel = false;
+	ent.mi = *mi;
+	r_output_queue(arg, &ent);
 }
 
+/* Wheel reports share the ring to stay in order with buttons and motion */
 static void
-r_move(mousestatus_t *act, struct accel *acc)
+r_wheel(void *arg, const struct moused_wheel *mw)
 {
-	struct mouse_info mouse;
+	struct output_entry ent;
 
-	bzero(&mouse, sizeof(mouse));
-	if (acc->is_exponential) {
-		expoacc(acc, act->dx, act->dy, act->dz,
-		    &mouse.u.data.x, &mouse.u.data.y, &mouse.u.data.z);
-	} else {
-		linacc(acc, act->dx, act->dy, act->dz,
-		    &mouse.u.data.x, &mouse.u.data.y, &mouse.u.data.z);
-	}
-	mouse.operation = MOUSE_MOTION_EVENT;
-	mouse.u.data.buttons = act->button;
-	if (debug < 2 && !paused)
-		ioctl(cfd, CONS_MOUSECTL, &mouse);
+	ent.wheel = true;
+	ent.mw = *mw;
+	r_output_queue(arg, &ent);
 }
 
+/* Wake up the output stage unless it has been kicked already */
 static void
-r_click(mousestatus_t *act, struct btstate *bt)
+r_output_kick(struct rodent *r)
 {
-	struct mouse_info mouse;
-	int button;
-	int mask;
-	int i;
+	struct kevent kev;
 
-	mask = act->flags & MOUSE_BUTTONS;
-	if (mask == 0)
+	/* Replay has no output thread, actions go out at their virtual time */
+	if (replay != NULL) {
+		r_output_flush(r);
 		return;
-
-	button = MOUSE_BUTTON1DOWN;
-	for (i = 0; (i < MOUSE_MAXBUTTON) && (mask != 0); ++i) {
-		if (mask & 1) {
-			debug("mstate[%d]->count:%d", i, bt->mstate[i]->count);
-			if (act->button & button) {
-				/* the button is down */
-				mouse.u.event.value = bt->mstate[i]->count;
-			} else {
-				/* the button is up */
-				mouse.u.event.value = 0;
-			}
-			mouse.operation = MOUSE_BUTTON_EVENT;
-			mouse.u.event.id = button;
-			if (debug < 2 && !paused)
-				ioctl(cfd, CONS_MOUSECTL, &mouse);
-			debug("button %d  count %d", i + 1,
-			    mouse.u.event.value);
-		}
-		button <<= 1;
-		mask >>= 1;
 	}
+	if (!output_running || atomic_exchange(&output_pending, true))
+		return;
+	EV_SET(&kev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	kevent(okq, &kev, 1, NULL, 0, NULL);
 }
 
-static enum gesture
-r_gestures(struct tpad *tp, int x0, int y0, int z, int w, int nfingers,
-    struct timespec *time, mousestatus_t *ms)
+/*
+ * Drain queued entries to the console and the wheel device.  Called by
+ * the output stage with output_lock held, or in place by replay.
+ */
+static void
+r_output_flush(struct rodent *r)
 {
-	struct tpstate *gest = &tp->gest;
-	const struct tpcaps *tphw = &tp->hw;
-	const struct tpinfo *tpinfo = &tp->info;
-	int tap_timeout = tpinfo->tap_timeout;
+	struct output_ring *ring = &r->out;
+	struct kevent kev;
+	u_int head, tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	do {
+		head = atomic_load(&ring->head);
+		while (tail != head) {
+			r_output_write(
+			    &ring->buf[tail & (OUTPUT_RING_SIZE - 1)]);
+			atomic_store(&ring->tail, ++tail);
+		}
+		/* Producer of the replay can be resumed right here */
+	} while (!output_running && ring->stashed && r_output_unstash(ring));
 
 	/*
-	 * Check pressure to detect a real wanted action on the
-	 * touchpad.
+	 * Wake the producer sleeping on a full ring or let it move its
+	 * stashed motion into the ring.  Tail is stored before stalled is
+	 * looked at, so a producer which raised the flag later sees the room
+	 * itself.
 	 */
-	if (z >= tpinfo->min_pressure_hi ||
-	    (gest->fingerdown && z >= tpinfo->min_pressure_lo)) {
-		/* XXX Verify values? */
-		bool two_finger_scroll = tpinfo->two_finger_scroll;
-		bool three_finger_drag = tpinfo->three_finger_drag;
-		int max_width = tpinfo->max_width;
-		int max_pressure = tpinfo->max_pressure;
-		int margin_top = tpinfo->margin_top;
-		int margin_right = tpinfo->margin_right;
-		int margin_bottom = tpinfo->margin_bottom;
-		int margin_left = tpinfo->margin_left;
-		int vscroll_hor_area = tpinfo->vscroll_hor_area * tphw->res_x;
-		int vscroll_ver_area = tpinfo->vscroll_ver_area * tphw->res_y;;
-
-		int max_x = tphw->max_x;
-		int max_y = tphw->max_y;
-		int min_x = tphw->min_x;
-		int min_y = tphw->min_y;
-
-		int dx, dy;
-		int start_x, start_y;
-		int tap_max_delta_x, tap_max_delta_y;
-		int prev_nfingers;
-
-		/* Palm detection. */
-		if (nfingers == 1 &&
-		    ((tphw->cap_width && w > max_width) ||
-		     (tphw->cap_pressure && z > max_pressure))) {
-			/*
-			 * We consider the packet irrelevant for the current
-			 * action when:
-			 *  - there is a single active touch
-			 *  - the width isn't comprised in:
-			 *    [0; max_width]
-			 *  - the pressure isn't comprised in:
-			 *    [min_pressure; max_pressure]
-			 *
-			 *  Note that this doesn't terminate the current action.
-			 */
-			debug("palm detected! (%d)", z);
-			return(GEST_IGNORE);
-		}
-
-		/*
-		 * Limit the coordinates to the specified margins because
-		 * this area isn't very reliable.
-		 */
-		if (margin_left != 0 && x0 <= min_x + margin_left)
-			x0 = min_x + margin_left;
-		else if (margin_right != 0 && x0 >= max_x - margin_right)
-			x0 = max_x - margin_right;
-		if (margin_bottom != 0 && y0 <= min_y + margin_bottom)
-			y0 = min_y + margin_bottom;
-		else if (margin_top != 0 && y0 >= max_y - margin_top)
-			y0 = max_y - margin_top;
-
-		debug("packet: [%d, %d], %d, %d", x0, y0, z, w);
+	if (atomic_exchange(&ring->stalled, false)) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->room);
+		pthread_mutex_unlock(&ring->lock);
+		if (r->threaded) {
+			EV_SET(&kev, WORKER_RESUME, EVFILT_USER, 0,
+			    NOTE_TRIGGER, 0, r);
+			kevent(r->kq, &kev, 1, NULL, 0, NULL);
+		} else
+			r_notify(r);
+	}
+}
 
-		/*
-		 * If the action is just beginning, init the structure and
-		 * compute tap timeout.
-		 */
-		if (!gest->fingerdown) {
-			debug("----");
+/*
+ * Output stage thread.  It drains rings of all devices whenever one of
+ * them is kicked, so neither the main thread nor device workers wait for
+ * a lagging console driver until their ring fills up.
+ */
+static void *
+r_output_worker(void *arg __unused)
+{
+	struct kevent ke;
+	struct rodent *r;
 
-			/* Reset pressure peak. */
-			gest->zmax = 0;
+	for (;;) {
+		if (kevent(okq, NULL, 0, &ke, 1, NULL) == -1)
+			logerr(1, "output stage failed to wait for events");
+		/* Clear before draining so that later pushes kick us again */
+		atomic_store(&output_pending, false);
+		pthread_mutex_lock(&output_lock);
+		TAILQ_FOREACH(r, &rodents, next)
+			r_output_flush(r);
+		pthread_mutex_unlock(&output_lock);
+	}
 
-			/* Reset fingers count. */
-			gest->fingers_nb = 0;
+	return (NULL);
+}
 
-			/* Reset virtual scrolling state. */
-			gest->in_vscroll = 0;
+/* Wake up the main thread unless it has been notified already */
+static void
+r_notify(struct rodent *r)
+{
+	struct kevent kev;
 
-			/* Compute tap timeout. */
-			if (tap_timeout != 0)
-				gest->taptimeout = tsaddms(time, tap_timeout);
-			else
-				tsclr(&gest->taptimeout);
+	/* Replayed device is not attached to the main kqueue */
+	if (r->kq == -1 || atomic_exchange(&r->notified, true))
+		return;
+	EV_SET(&kev, r->mfd, EVFILT_USER, 0, NOTE_TRIGGER, 0, r);
+	kevent(kfd, &kev, 1, NULL, 0, NULL);
+}
 
-			gest->fingerdown = true;
+/*
+ * Report output stage counters, requested with SIGINFO or with the "stats"
+ * control command.  The report goes to log if fp is NULL.
+ */
+static void
+r_output_stats(FILE *fp)
+{
+	struct output_stats *st;
+	struct rodent *r;
+	char buf[256];
 
-			gest->start_x = x0;
-			gest->start_y = y0;
-		}
+	TAILQ_FOREACH(r, &rodents, next) {
+		st = &r->out.stats;
+		snprintf(buf, sizeof(buf), "%s: output queue depth %u "
+		    "(max %u), %lu queued, %lu coalesced, %lu stalls, "
+		    "%lu jitter suppressed", r->dev.path,
+		    atomic_load(&r->out.head) - atomic_load(&r->out.tail),
+		    atomic_load(&st->maxdepth), atomic_load(&st->queued),
+		    atomic_load(&st->coalesced), atomic_load(&st->stalls),
+		    moused_dev_suppressed(r->md));
+		if (fp != NULL)
+			fprintf(fp, "%s\n", buf);
+		else if (background)
+			syslog(LOG_DAEMON | LOG_INFO, "%s", buf);
+		else
+			warnx("%s", buf);
+	}
+}
 
-		prev_nfingers = gest->prev_nfingers;
+/* Write trace rings of all devices in the dump format of trace.h */
+static int
+r_trace_dump(FILE *fp)
+{
+	struct rodent *r;
 
-		gest->prev_x = x0;
-		gest->prev_y = y0;
-		gest->prev_nfingers = nfingers;
+	if (trace_write_header(fp) != 0)
+		return (-1);
+	TAILQ_FOREACH(r, &rodents, next)
+		if (trace_write(fp, r->dev.path, r->dev.name,
+		    moused_dev_trace(r->md)) != 0)
+			return (-1);
 
-		start_x = gest->start_x;
-		start_y = gest->start_y;
+	return (0);
+}
 
-		/* Process ClickPad softbuttons */
-		if (tphw->is_clickpad && ms->button & MOUSE_BUTTON1DOWN) {
-			int y_ok, center_bt, center_x, right_bt, right_x;
-			y_ok = tpinfo->softbuttons_y < 0
-			    ? start_y < min_y - tpinfo->softbuttons_y
-			    : start_y > max_y - tpinfo->softbuttons_y;
+/*
+ * Ask the main thread to save the recording of a device after an input
+ * anomaly.  Called from the device processing code, so it only raises
+ * a flag.
+ */
+static void
+r_record_anomaly(struct rodent *r)
+{
+	atomic_store(&r->anomaly, true);
+	r_notify(r);
+}
 
-			center_bt = MOUSE_BUTTON2DOWN;
-			center_x = min_x + tpinfo->softbutton2_x;
-			right_bt = MOUSE_BUTTON3DOWN;
-			right_x = min_x + tpinfo->softbutton3_x;
+/* Save recording after an anomaly, at most once per RECORD_INTERVAL */
+static void
+r_record_check(struct rodent *r)
+{
+	struct timespec now;
 
-			if (center_x > 0 && right_x > 0 && center_x > right_x) {
-				center_bt = MOUSE_BUTTON3DOWN;
-				center_x = min_x + tpinfo->softbutton3_x;
-				right_bt = MOUSE_BUTTON2DOWN;
-				right_x = min_x + tpinfo->softbutton2_x;
-			}
+	if (!atomic_exchange(&r->anomaly, false))
+		return;
+	clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+	if (r->rec_last != 0 && now.tv_sec - r->rec_last < RECORD_INTERVAL)
+		return;
+	r->rec_last = now.tv_sec;
+	logwarnx("input anomaly on %s", r->dev.path);
+	r_record_save(r, NULL);
+}
 
-			if (right_x > 0 && start_x > right_x && y_ok)
-				ms->button = (ms->button &
-				    ~MOUSE_BUTTON1DOWN) | right_bt;
-			else if (center_x > 0 && start_x > center_x && y_ok)
-				ms->button = (ms->button &
-				    ~MOUSE_BUTTON1DOWN) | center_bt;
-		}
+/* Write flight recorder of a device to RECORD_FILE */
+static void
+r_record_save(struct rodent *r, FILE *reply)
+{
+	char path[PATH_MAX];
+	const char *base;
+	FILE *fp;
+	int error;
+
+	base = strrchr(r->dev.path, '/');
+	base = base != NULL ? base + 1 : r->dev.path;
+	snprintf(path, sizeof(path), RECORD_FILE, base);
+	fp = fopen(path, "we");
+	if (fp == NULL) {
+		logwarn("cannot create %s", path);
+		return;
+	}
+	error = record_write(fp, r->dev.path,
+	    r->dev.iftype == MOUSED_IF_EVDEV ? &r->caps : NULL, &r->rec);
+	if (fclose(fp) != 0 && error == 0)
+		error = errno;
+	if (error != 0) {
+		errno = error;
+		logwarn("cannot write %s", path);
+		return;
+	}
+	if (reply != NULL)
+		fprintf(reply, "%s\n", path);
+	else
+		logwarnx("input recording of %s saved to %s",
+		    r->dev.path, path);
+}
 
-		/* If in tap-hold or three fingers, add the recorded button. */
-		if (gest->in_taphold || (nfingers == 3 && three_finger_drag))
-			ms->button |= gest->tap_button;
+/* Save recordings of all devices, requested with SIGINFO */
+static void
+r_record_save_all(FILE *reply)
+{
+	struct rodent *r;
 
-		/*
-		 * For tap, we keep the maximum number of fingers and the
-		 * pressure peak.
-		 */
-		gest->fingers_nb = MAX(nfingers, gest->fingers_nb);
-		gest->zmax = MAX(z, gest->zmax);
+	TAILQ_FOREACH(r, &rodents, next)
+		r_record_save(r, reply);
+}
 
-		dx = abs(x0 - start_x);
-		dy = abs(y0 - start_y);
+/*
+ * Replayed input goes through a pipe and r_process() like device input
+ * does, the flight recorder included.
+ */
+static int
+r_replay_input(void *arg, const struct record_entry *re, bool evdev)
+{
+	struct rodent *r = arg;
+	struct input_event ie;
+	struct kevent kev;
 
-		/*
-		 * A scrolling action must not conflict with a tap action.
-		 * Here are the conditions to consider a scrolling action:
-		 *  - the action in a configurable area
-		 *  - one of the following:
-		 *     . the distance between the last packet and the
-		 *       first should be above a configurable minimum
-		 *     . tap timed out
-		 */
-		if (!gest->in_taphold && !ms->button &&
-		    (!gest->in_vscroll || two_finger_scroll) &&
-		    (tscmp(time, &gest->taptimeout, >) ||
-		    ((gest->fingers_nb == 2 || !two_finger_scroll) &&
-		    (dx >= tpinfo->vscroll_min_delta * tphw->res_x ||
-		     dy >= tpinfo->vscroll_min_delta * tphw->res_y)))) {
-			/*
-			 * Handle two finger scrolling.
-			 * Note that we don't rely on fingers_nb
-			 * as that keeps the maximum number of fingers.
-			 */
-			if (two_finger_scroll) {
-				if (nfingers == 2) {
-					gest->in_vscroll += dy ? 2 : 0;
-					gest->in_vscroll += dx ? 1 : 0;
-				}
-			} else {
-				/* Check for horizontal scrolling. */
-				if ((vscroll_hor_area > 0 &&
-				     start_y <= min_y + vscroll_hor_area) ||
-				    (vscroll_hor_area < 0 &&
-				     start_y >= max_y + vscroll_hor_area))
-					gest->in_vscroll += 2;
-
-				/* Check for vertical scrolling. */
-				if ((vscroll_ver_area > 0 &&
-				     start_x <= min_x + vscroll_ver_area) ||
-				    (vscroll_ver_area < 0 &&
-				     start_x >= max_x + vscroll_ver_area))
-					gest->in_vscroll += 1;
-			}
-			/* Avoid conflicts if area overlaps. */
-			if (gest->in_vscroll >= 3)
-				gest->in_vscroll = (dx > dy) ? 2 : 1;
-		}
-		/*
-		 * Reset two finger scrolling when the number of fingers
-		 * is different from two or any button is pressed.
-		 */
-		if (two_finger_scroll && gest->in_vscroll != 0 &&
-		    (nfingers != 2 || ms->button))
-			gest->in_vscroll = 0;
-
-		debug("virtual scrolling: %s "
-			"(direction=%d, dx=%d, dy=%d, fingers=%d)",
-			gest->in_vscroll != 0 ? "YES" : "NO",
-			gest->in_vscroll, dx, dy, gest->fingers_nb);
-
-		/* Workaround cursor jump on finger set changes */
-		if (prev_nfingers != nfingers)
-			return (GEST_IGNORE);
-
-		switch (gest->in_vscroll) {
-		case 1:
-			return (GEST_VSCROLL);
-		case 2:
-			return (GEST_HSCROLL);
-		default:
-			/* NO-OP */;
-		}
+	if (evdev) {
+		ie.time = re->time;
+		ie.type = re->ev.type;
+		ie.code = re->ev.code;
+		ie.value = re->ev.value;
+		write(replay_pipe, &ie, sizeof(ie));
+	} else
+		write(replay_pipe, re->packet, MOUSE_SYS_PACKETSIZE);
+	EV_SET(&kev, r->mfd, EVFILT_READ, 0, 0, 0, r);
 
-		/* Max delta is disabled for multi-fingers tap. */
-		if (gest->fingers_nb == 1 &&
-		    tscmp(time, &gest->taptimeout, <=)) {
-			tap_max_delta_x = tpinfo->tap_max_delta * tphw->res_x;
-			tap_max_delta_y = tpinfo->tap_max_delta * tphw->res_y;
-
-			debug("dx=%d, dy=%d, deltax=%d, deltay=%d",
-			    dx, dy, tap_max_delta_x, tap_max_delta_y);
-			if (dx > tap_max_delta_x || dy > tap_max_delta_y) {
-				debug("not a tap");
-				tsclr(&gest->taptimeout);
-			}
-		}
+	return (r_process(r, &kev));
+}
 
-		if (tscmp(time, &gest->taptimeout, <=))
-			return (gest->fingers_nb > 1 ?
-			    GEST_IGNORE : GEST_ACCUMULATE);
-		else
-			return (GEST_MOVE);
+/*
+ * Feed a recording saved by the flight recorder through the pipeline and
+ * print the resulting console actions to stdout, so the output of a
+ * changed pipeline can be compared against a known good one with diff(1).
+ * Time is taken from the recording, timers expire on that virtual clock
+ * in the replay driver shared with the regression tests of tests/.
+ * Events still go through a pipe and read(2) like device input do, the
+ * rate they are processed at is reported to stderr.
+ */
+static int
+r_replay(const char *file)
+{
+	struct record_entry *ent;
+	struct evdev_caps caps;
+	struct moused_device dev;
+	struct quirks *q;
+	struct rodent *r;
+	struct replay rp;
+	struct timespec start, end;
+	char *out;
+	size_t outlen, count, i;
+	double elapsed;
+	bool evdev;
+	int err, p[2];
+	FILE *fp;
+
+	fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+	if (fp == NULL) {
+		warn("cannot open %s", file);
+		return (1);
+	}
+	memset(&dev, 0, sizeof(dev));
+	err = record_read(fp, dev.path, sizeof(dev.path), &caps, &evdev,
+	    &ent, &count);
+	if (fp != stdin)
+		fclose(fp);
+	if (err == 0 && count == 0) {
+		free(ent);
+		err = ENODATA;
+	}
+	if (err != 0) {
+		errno = err;
+		warn("cannot read %s", file);
+		return (1);
 	}
 
-	/*
-	 * Handle a case when clickpad pressure drops before than
-	 * button up event when surface is released after click.
-	 * It interferes with softbuttons.
-	 */
-	if (tphw->is_clickpad && tpinfo->softbuttons_y != 0)
-		ms->button &= ~MOUSE_BUTTON1DOWN;
+	if (evdev) {
+		dev.iftype = MOUSED_IF_EVDEV;
+		dev.type = moused_identify(&caps);
+		err = r_init_dev_evdev(&caps, &dev);
+	} else {
+		dev.iftype = MOUSED_IF_SYSMOUSE;
+		dev.type = MOUSED_TYPE_MOUSE;
+		dev.mode.protocol = MOUSE_PROTO_SYSMOUSE;
+		dev.mode.packetsize = MOUSE_SYS_PACKETSIZE;
+		dev.mode.level = 1;
+		strlcpy(dev.name, dev.path, sizeof(dev.name));
+	}
+	if (err != 0 || (dev.type != MOUSED_TYPE_MOUSE &&
+	    dev.type != MOUSED_TYPE_POINTINGSTICK &&
+	    dev.type != MOUSED_TYPE_TOUCHPAD)) {
+		warnx("unsupported device type: %s %s in %s",
+		    r_if(dev.iftype), r_name(dev.type), file);
+		free(ent);
+		return (1);
+	}
+	if (pipe2(p, O_NONBLOCK | O_CLOEXEC) == -1 ||
+	    (replay_out = open_memstream(&out, &outlen)) == NULL) {
+		warn("cannot set replay up");
+		free(ent);
+		return (1);
+	}
+
+	/* Start the clock before the device, e3b state is timestamped */
+	replay_init(&rp, &ent[0]);
+	q = quirks_fetch_for_device(quirks, &dev);
+	r = r_alloc(&dev, evdev ? &caps : NULL, q, &rp.clock);
+	quirks_unref(q);
+	if (r == NULL) {
+		warn("cannot set %s up", dev.path);
+		fclose(replay_out);
+		free(out);
+		free(ent);
+		return (1);
+	}
+	r->mfd = p[0];
+	r->clock = &rp.clock;
+	replay_pipe = p[1];
+	rp.md = r->md;
+	rp.input = r_replay_input;
+	rp.arg = r;
+	replay = &rp;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		if (replay_feed(&rp, &ent[i], evdev) != 0)
+			break;
+	replay_finish(&rp);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	fclose(replay_out);
+	fwrite(out, 1, outlen, stdout);
+	timespecsub(&end, &start, &end);
+	elapsed = end.tv_sec + end.tv_nsec / 1e9;
+	fprintf(stderr, "%zu events replayed in %.3f s, %.0f events/s\n",
+	    i, elapsed, elapsed > 0 ? i / elapsed : 0);
+	if (dev.type == MOUSED_TYPE_TOUCHPAD)
+		fprintf(stderr, "%lu reports suppressed as jitter\n",
+		    moused_dev_suppressed(r->md));
+
+	free(out);
+	free(ent);
+	close(p[1]);
+	r_free(r);
 
-	gest->prev_nfingers = 0;
+	return (0);
+}
 
-	if (gest->fingerdown) {
-		/*
-		 * An action is currently taking place but the pressure
-		 * dropped under the minimum, putting an end to it.
-		 */
+/* Save trace rings to a file, requested with SIGUSR2 */
+static void
+r_trace_save(void)
+{
+	FILE *fp;
+	int fd;
 
-		gest->fingerdown = false;
-
-		/* Check for tap. */
-		debug("zmax=%d fingers=%d", gest->zmax, gest->fingers_nb);
-		if (!gest->in_vscroll && gest->zmax >= tpinfo->tap_threshold &&
-		    tscmp(time, &gest->taptimeout, <=)) {
-			/*
-			 * We have a tap if:
-			 *   - the maximum pressure went over tap_threshold
-			 *   - the action ended before tap_timeout
-			 *
-			 * To handle tap-hold, we must delay any button push to
-			 * the next action.
-			 */
-			if (gest->in_taphold) {
-				/*
-				 * This is the second and last tap of a
-				 * double tap action, not a tap-hold.
-				 */
-				gest->in_taphold = false;
-
-				/*
-				 * For double-tap to work:
-				 *   - no button press is emitted (to
-				 *     simulate a button release)
-				 *   - PSM_FLAGS_FINGERDOWN is set to
-				 *     force the next packet to emit a
-				 *     button press)
-				 */
-				debug("button RELEASE: %d", gest->tap_button);
-				gest->fingerdown = true;
-
-				/* Schedule button press on next event */
-				gest->idletimeout = 0;
-			} else {
-				/*
-				 * This is the first tap: we set the
-				 * tap-hold state and notify the button
-				 * down event.
-				 */
-				gest->in_taphold = true;
-				gest->idletimeout = tpinfo->taphold_timeout;
-				gest->taptimeout = tsaddms(time, tap_timeout);
-
-				switch (gest->fingers_nb) {
-				case 3:
-					gest->tap_button =
-					    MOUSE_BUTTON2DOWN;
-					break;
-				case 2:
-					gest->tap_button =
-					    MOUSE_BUTTON3DOWN;
-					break;
-				default:
-					gest->tap_button =
-					    MOUSE_BUTTON1DOWN;
-				}
-				debug("button PRESS: %d", gest->tap_button);
-				ms->button |= gest->tap_button;
-			}
-		} else {
-			/*
-			 * Not enough pressure or timeout: reset
-			 * tap-hold state.
-			 */
-			if (gest->in_taphold) {
-				debug("button RELEASE: %d", gest->tap_button);
-				gest->in_taphold = false;
-			} else {
-				debug("not a tap-hold");
-			}
-		}
-	} else if (!gest->fingerdown && gest->in_taphold) {
-		/*
-		 * For a tap-hold to work, the button must remain down at
-		 * least until timeout (where the in_taphold flags will be
-		 * cleared) or during the next action.
-		 */
-		if (tscmp(time, &gest->taptimeout, <=)) {
-			ms->button |= gest->tap_button;
-		} else {
-			debug("button RELEASE: %d", gest->tap_button);
-			gest->in_taphold = false;
-		}
+	fd = open(TRACE_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		logwarn("cannot create %s", TRACE_FILE);
+		if (fd != -1)
+			close(fd);
+		return;
 	}
-
-	return (GEST_IGNORE);
+	if ((r_trace_dump(fp) | fclose(fp)) != 0)
+		logwarn("cannot write %s", TRACE_FILE);
+	else
+		debug("trace saved to %s", TRACE_FILE);
 }
@@ -37,6 +37,8 @@
 #include <kenv.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -80,7 +82,7 @@ struct quirk_array {
  * already know which type yields which value.
  */
 struct property {
-	size_t refcount;
+	atomic_size_t refcount;	/* shared by quirks of concurrent lookups */
 	struct list link; /* struct sections.properties */
 
 	enum quirk id;
@@ -177,6 +179,7 @@ struct section {
 struct quirks {
 	size_t refcount;
 	struct list link; /* struct quirks_context.quirks */
+	struct quirks_context *ctx; /* set once linked */
 
 	/* These are not ref'd, just a collection of pointers */
 	struct property **properties;
@@ -203,6 +206,7 @@ struct quirks_context {
 
 	/* list of quirks handed to moused, just for bookkeeping */
 	struct list quirks;
+	pthread_mutex_t quirks_lock; /* protects quirks */
 };
 
 MOUSED_ATTRIBUTE_PRINTF(3, 0)
@@ -304,6 +308,7 @@ quirk_get_name(enum quirk q)
 	case MOUSED_DRIFT_DISTANCE:			return "MousedDriftDistance";
 	case MOUSED_DRIFT_TIME:				return "MousedDriftTime";
 	case MOUSED_DRIFT_AFTER:			return "MousedDriftAfter";
+	case MOUSED_DEBOUNCE_TIME:			return "MousedDebounceTime";
 	case MOUSED_EMULATE_THIRD_BUTTON:		return "MousedEmulateThirdButton";
 	case MOUSED_EMULATE_THIRD_BUTTON_TIMEOUT:	return "MousedEmulateThirdButtonTimeout";
 	case MOUSED_EXPONENTIAL_ACCEL:			return "MousedExponentialAccel";
@@ -316,6 +321,10 @@ quirk_get_name(enum quirk q)
 	case MOUSED_HOR_VIRTUAL_SCROLL_ENABLE:		return "MousedHorVirtualScrollEnable";
 	case MOUSED_VIRTUAL_SCROLL_SPEED:		return "MousedVirtualScrollSpeed";
 	case MOUSED_VIRTUAL_SCROLL_THRESHOLD:		return "MousedVirtualScrollThreshold";
+	case MOUSED_KINETIC_SCROLL:			return "MousedKineticScroll";
+	case MOUSED_KINETIC_SCROLL_FRICTION:		return "MousedKineticScrollFriction";
+	case MOUSED_KINETIC_SCROLL_MIN_SPEED:		return "MousedKineticScrollMinSpeed";
+	case MOUSED_KINETIC_SCROLL_WINDOW:		return "MousedKineticScrollWindow";
 	case MOUSED_WMODE:				return "MousedWMode";
 
 	case MOUSED_TWO_FINGER_SCROLL:			return "MousedTwoFingerScroll";
@@ -331,6 +340,14 @@ quirk_get_name(enum quirk q)
 	case MOUSED_VSCROLL_MIN_DELTA:			return "MousedVScrollMinDelta";
 	case MOUSED_VSCROLL_HOR_AREA:			return "MousedVScrollHorArea";
 	case MOUSED_VSCROLL_VER_AREA:			return "MousedVScrollVerArea";
+	case MOUSED_SWIPE3_BUTTONS:			return "MousedSwipe3Buttons";
+	case MOUSED_SWIPE4_BUTTONS:			return "MousedSwipe4Buttons";
+	case MOUSED_SWIPE_DISTANCE:			return "MousedSwipeDistance";
+	case MOUSED_PINCH_BUTTONS:			return "MousedPinchButtons";
+	case MOUSED_PINCH_DISTANCE:			return "MousedPinchDistance";
+	case MOUSED_HYSTERESIS:				return "MousedHysteresis";
+	case MOUSED_SMOOTHING_CUTOFF:			return "MousedSmoothingCutoff";
+	case MOUSED_SMOOTHING_BETA:			return "MousedSmoothingBeta";
 
 
 	default:
@@ -535,6 +552,36 @@ strv_parse_hex(const char *str, size_t index, void *data)
 	return !parse_hex(str, &product[index]); /* 0 for success */
 }
 
+static int
+strv_parse_uint(const char *str, size_t index, void *data)
+{
+	struct quirk_array *array = data;
+
+	if (!safe_atou(str, &array->data.u[index]))
+		return 1;
+	array->nelements = index + 1;
+
+	return 0; /* 0 for success */
+}
+
+/**
+ * Parse a semicolon-separated list of unsigned integers, e.g. "8;9;0".
+ */
+static bool
+parse_uint_array(const char *value, struct quirk_array *array)
+{
+	size_t nelems = 0;
+	char **strs = strv_from_string(value, ";", &nelems);
+	int rc;
+
+	array->nelements = 0;
+	rc = strv_for_each_n((const char**)strs, ARRAY_LENGTH(array->data.u),
+			     strv_parse_uint, array);
+	strv_free(strs);
+
+	return rc == 0 && nelems > 0 && array->nelements == nelems;
+}
+
 /**
  * Parse a MatchFooBar=banana line.
  *
@@ -954,6 +1001,13 @@ parse_moused(struct quirks_context *ctx,
 		p->type = PT_UINT;
 		p->value.u = v;
 		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_DEBOUNCE_TIME))) {
+		p->id = MOUSED_DEBOUNCE_TIME;
+		if (!safe_atou(value, &v))
+			goto out;
+		p->type = PT_UINT;
+		p->value.u = v;
+		rc = true;
 	} else if (streq(key, quirk_get_name(MOUSED_EMULATE_THIRD_BUTTON))) {
 		p->id = MOUSED_EMULATE_THIRD_BUTTON;
 		if (!parse_boolean_property(value, &b))
@@ -1032,6 +1086,34 @@ parse_moused(struct quirks_context *ctx,
 		p->type = PT_UINT;
 		p->value.u = v;
 		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_KINETIC_SCROLL))) {
+		p->id = MOUSED_KINETIC_SCROLL;
+		if (!parse_boolean_property(value, &b))
+			goto out;
+		p->type = PT_BOOL;
+		p->value.b = b;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_KINETIC_SCROLL_FRICTION))) {
+		p->id = MOUSED_KINETIC_SCROLL_FRICTION;
+		if (!safe_atod(value, &d))
+			goto out;
+		p->type = PT_DOUBLE;
+		p->value.d = d;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_KINETIC_SCROLL_MIN_SPEED))) {
+		p->id = MOUSED_KINETIC_SCROLL_MIN_SPEED;
+		if (!safe_atod(value, &d))
+			goto out;
+		p->type = PT_DOUBLE;
+		p->value.d = d;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_KINETIC_SCROLL_WINDOW))) {
+		p->id = MOUSED_KINETIC_SCROLL_WINDOW;
+		if (!safe_atou(value, &v))
+			goto out;
+		p->type = PT_UINT;
+		p->value.u = v;
+		rc = true;
 	} else if (streq(key, quirk_get_name(MOUSED_WMODE))) {
 		p->id = MOUSED_WMODE;
 		if (!safe_atou(value, &v))
@@ -1130,6 +1212,59 @@ parse_moused(struct quirks_context *ctx,
 		p->type = PT_DOUBLE;
 		p->value.d = d;
 		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_SWIPE3_BUTTONS))) {
+		p->id = MOUSED_SWIPE3_BUTTONS;
+		if (!parse_uint_array(value, &p->value.array))
+			goto out;
+		p->type = PT_UINT_ARRAY;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_SWIPE4_BUTTONS))) {
+		p->id = MOUSED_SWIPE4_BUTTONS;
+		if (!parse_uint_array(value, &p->value.array))
+			goto out;
+		p->type = PT_UINT_ARRAY;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_SWIPE_DISTANCE))) {
+		p->id = MOUSED_SWIPE_DISTANCE;
+		if (!safe_atod(value, &d))
+			goto out;
+		p->type = PT_DOUBLE;
+		p->value.d = d;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_PINCH_BUTTONS))) {
+		p->id = MOUSED_PINCH_BUTTONS;
+		if (!parse_uint_array(value, &p->value.array))
+			goto out;
+		p->type = PT_UINT_ARRAY;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_PINCH_DISTANCE))) {
+		p->id = MOUSED_PINCH_DISTANCE;
+		if (!safe_atod(value, &d))
+			goto out;
+		p->type = PT_DOUBLE;
+		p->value.d = d;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_HYSTERESIS))) {
+		p->id = MOUSED_HYSTERESIS;
+		if (!safe_atod(value, &d))
+			goto out;
+		p->type = PT_DOUBLE;
+		p->value.d = d;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_SMOOTHING_CUTOFF))) {
+		p->id = MOUSED_SMOOTHING_CUTOFF;
+		if (!safe_atod(value, &d))
+			goto out;
+		p->type = PT_DOUBLE;
+		p->value.d = d;
+		rc = true;
+	} else if (streq(key, quirk_get_name(MOUSED_SMOOTHING_BETA))) {
+		p->id = MOUSED_SMOOTHING_BETA;
+		if (!safe_atod(value, &d))
+			goto out;
+		p->type = PT_DOUBLE;
+		p->value.d = d;
+		rc = true;
 	} else {
 		qlog_error(ctx, "Unknown key %s in %s\n", key, s->name);
 	}
@@ -1404,6 +1539,7 @@ quirks_init_subsystem(const char *data_path,
 	assert(data_path);
 
 	ctx->refcount = 1;
+	pthread_mutex_init(&ctx->quirks_lock, NULL);
 	ctx->log_handler = log_handler;
 	ctx->log_type = log_type;
 	list_init(&ctx->quirks);
@@ -1455,6 +1591,7 @@ quirks_context_unref(struct quirks_context *ctx)
 		section_destroy(s);
 	}
 
+	pthread_mutex_destroy(&ctx->quirks_lock);
 	free(ctx->dmi);
 	free(ctx->dt);
 	free(ctx);
@@ -1497,7 +1634,11 @@ quirks_unref(struct quirks *q)
 		property_cleanup(p);
 	}
 
-	list_remove(&q->link);
+	if (q->ctx) {
+		pthread_mutex_lock(&q->ctx->quirks_lock);
+		list_remove(&q->link);
+		pthread_mutex_unlock(&q->ctx->quirks_lock);
+	}
 	free(q->properties);
 	free(q);
 
@@ -1506,7 +1647,7 @@ quirks_unref(struct quirks *q)
 
 static inline void
 match_fill_name(struct match *m,
-		struct device *device)
+		struct moused_device *device)
 {
 	if (device->name[0] == 0)
 		return;
@@ -1518,7 +1659,7 @@ match_fill_name(struct match *m,
 
 static inline void
 match_fill_uniq(struct match *m,
-		struct device *device)
+		struct moused_device *device)
 {
 	if (device->uniq[0] == 0)
 		return;
@@ -1530,7 +1671,7 @@ match_fill_uniq(struct match *m,
 
 static inline void
 match_fill_bus_vid_pid(struct match *m,
-		       struct device *device)
+		       struct moused_device *device)
 {
 	m->product[0] = device->id.product;
 	m->product[1] = 0;
@@ -1569,28 +1710,28 @@ match_fill_bus_vid_pid(struct match *m,
 
 static inline void
 match_fill_udev_type(struct match *m,
-		     struct device *device)
+		     struct moused_device *device)
 {
 	switch (device->type) {
-	case DEVICE_TYPE_MOUSE:
+	case MOUSED_TYPE_MOUSE:
 		m->udev_type |= UDEV_MOUSE;
 		break;
-	case DEVICE_TYPE_POINTINGSTICK:
+	case MOUSED_TYPE_POINTINGSTICK:
 		m->udev_type |= UDEV_MOUSE | UDEV_POINTINGSTICK;
 		break;
-	case DEVICE_TYPE_TOUCHPAD:
+	case MOUSED_TYPE_TOUCHPAD:
 		m->udev_type |= UDEV_TOUCHPAD;
 		break;
-	case DEVICE_TYPE_TABLET:
+	case MOUSED_TYPE_TABLET:
 		m->udev_type |= UDEV_TABLET;
 		break;
-	case DEVICE_TYPE_TABLET_PAD:
+	case MOUSED_TYPE_TABLET_PAD:
 		m->udev_type |= UDEV_TABLET_PAD;
 		break;
-	case DEVICE_TYPE_KEYBOARD:
+	case MOUSED_TYPE_KEYBOARD:
 		m->udev_type |= UDEV_KEYBOARD;
 		break;
-	case DEVICE_TYPE_JOYSTICK:
+	case MOUSED_TYPE_JOYSTICK:
 		m->udev_type |= UDEV_JOYSTICK;
 		break;
 	default:
@@ -1614,7 +1755,7 @@ match_fill_dmi_dt(struct match *m, char *dmi, char *dt)
 }
 
 static struct match *
-match_new(struct device *device,
+match_new(struct moused_device *device,
 	  char *dmi, char *dt)
 {
 	struct match *m = zalloc(sizeof *m);
@@ -1722,7 +1863,7 @@ quirk_match_section(struct quirks_context *ctx,
 		    struct quirks *q,
 		    struct section *s,
 		    struct match *m,
-		    struct device *device)
+		    struct moused_device *device)
 {
 	uint32_t matched_flags = 0x0;
 
@@ -1812,7 +1953,7 @@ quirk_match_section(struct quirks_context *ctx,
 
 struct quirks *
 quirks_fetch_for_device(struct quirks_context *ctx,
-			struct device *device)
+			struct moused_device *device)
 {
 	struct section *s;
 	struct match *m;
@@ -1836,7 +1977,11 @@ quirks_fetch_for_device(struct quirks_context *ctx,
 		return NULL;
 	}
 
+	/* Matching only reads the context, lookups may run concurrently */
+	q->ctx = ctx;
+	pthread_mutex_lock(&ctx->quirks_lock);
 	list_insert(&ctx->quirks, &q->link);
+	pthread_mutex_unlock(&ctx->quirks_lock);
 
 	return steal(&q);
 }
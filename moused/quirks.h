@@ -120,6 +120,7 @@ enum quirk {
 	MOUSED_DRIFT_DISTANCE,
 	MOUSED_DRIFT_TIME,
 	MOUSED_DRIFT_AFTER,
+	MOUSED_DEBOUNCE_TIME,
 	MOUSED_EMULATE_THIRD_BUTTON,
 	MOUSED_EMULATE_THIRD_BUTTON_TIMEOUT,
 	MOUSED_EXPONENTIAL_ACCEL,
@@ -132,6 +133,10 @@ enum quirk {
 	MOUSED_HOR_VIRTUAL_SCROLL_ENABLE,
 	MOUSED_VIRTUAL_SCROLL_SPEED,
 	MOUSED_VIRTUAL_SCROLL_THRESHOLD,
+	MOUSED_KINETIC_SCROLL,
+	MOUSED_KINETIC_SCROLL_FRICTION,
+	MOUSED_KINETIC_SCROLL_MIN_SPEED,
+	MOUSED_KINETIC_SCROLL_WINDOW,
 	MOUSED_WMODE,
 
 	/* Touchpad parameters from psm(4) driver */
@@ -149,6 +154,18 @@ enum quirk {
 	MOUSED_VSCROLL_HOR_AREA,
 	MOUSED_VSCROLL_VER_AREA,
 
+	/* Multitouch gestures */
+	MOUSED_SWIPE3_BUTTONS,
+	MOUSED_SWIPE4_BUTTONS,
+	MOUSED_SWIPE_DISTANCE,
+	MOUSED_PINCH_BUTTONS,
+	MOUSED_PINCH_DISTANCE,
+
+	/* Touchpad jitter filter */
+	MOUSED_HYSTERESIS,
+	MOUSED_SMOOTHING_CUTOFF,
+	MOUSED_SMOOTHING_BETA,
+
 	_MOUSED_LAST_OPTION_ /* Guard: do not modify */
 };
 
@@ -222,13 +239,14 @@ quirks_context_ref(struct quirks_context *ctx);
 
 /**
  * Fetch the quirks for a given device. If no quirks are defined, this
- * function returns NULL.
+ * function returns NULL. It may be called from several threads at once,
+ * as may quirks_unref().
  *
  * @return A new quirks struct, use quirks_unref() to release
  */
 struct quirks *
 quirks_fetch_for_device(struct quirks_context *ctx,
-			struct device *device);
+			struct moused_device *device);
 
 /**
  * Reduce the refcount by one. When the refcount reaches zero, the
@@ -0,0 +1,174 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "record.h"
+
+/*
+ * Write out the last RECORD_SECONDS of device input.  Evdev recordings
+ * start with the capability description of evdev-caps.h followed by
+ * evemu(1) style "E: time type code value" lines, sysmouse recordings
+ * consist of "S: time byte..." lines.  caps is NULL for sysmouse.
+ */
+int
+record_write(FILE *fp, const char *path, const struct evdev_caps *caps,
+    struct record_ring *rr)
+{
+	struct record_entry *ent, *re;
+	uint_fast64_t first, seq, i;
+	time_t since;
+	int j;
+
+	ent = malloc(sizeof(rr->ent));
+	if (ent == NULL)
+		return (ENOMEM);
+
+	/* Entries overwritten while copying are not trusted */
+	seq = atomic_load_explicit(&rr->seq, memory_order_acquire);
+	memcpy(ent, rr->ent, sizeof(rr->ent));
+	atomic_thread_fence(memory_order_acquire);
+	first = atomic_load_explicit(&rr->seq, memory_order_relaxed);
+	first = first >= RECORD_SIZE ? first - RECORD_SIZE + 1 : 0;
+	if (first > seq)
+		first = seq;
+
+	/* Count time back from the last entry, the clock may be unknown */
+	if (seq != first) {
+		since = ent[(seq - 1) & (RECORD_SIZE - 1)].time.tv_sec -
+		    RECORD_SECONDS;
+		while (first < seq &&
+		    ent[first & (RECORD_SIZE - 1)].time.tv_sec < since)
+			first++;
+	}
+
+	fprintf(fp, "# moused recording of %s, %ju entries\n", path,
+	    (uintmax_t)(seq - first));
+	if (caps != NULL)
+		evdev_caps_write(fp, caps);
+	for (i = first; i < seq; i++) {
+		re = &ent[i & (RECORD_SIZE - 1)];
+		if (caps != NULL) {
+			fprintf(fp, "E: %jd.%06ld %04x %04x %d\n",
+			    (intmax_t)re->time.tv_sec, re->time.tv_usec,
+			    re->ev.type, re->ev.code, re->ev.value);
+			continue;
+		}
+		fprintf(fp, "S: %jd.%06ld", (intmax_t)re->time.tv_sec,
+		    re->time.tv_usec);
+		for (j = 0; j < RECORD_PACKETSIZE; j++)
+			fprintf(fp, " %02x", re->packet[j]);
+		fprintf(fp, "\n");
+	}
+
+	free(ent);
+	return (ferror(fp) ? EIO : 0);
+}
+
+/*
+ * Read a recording written by record_write() back.  The device path is
+ * taken from the heading comment, caps are only meaningful if *evdev is
+ * set.  The returned entry array is to be freed by the caller.
+ */
+int
+record_read(FILE *fp, char *path, size_t pathlen, struct evdev_caps *caps,
+    bool *evdev, struct record_entry **entp, size_t *countp)
+{
+	struct record_entry *ent, *re;
+	char line[256], name[256];
+	intmax_t sec;
+	long usec;
+	size_t count, size;
+	u_int type, code, packet[RECORD_PACKETSIZE];
+	int value, c, j, err;
+
+	*path = '\0';
+	if ((c = fgetc(fp)) != EOF) {
+		ungetc(c, fp);
+		if (c == '#' && fgets(line, sizeof(line), fp) != NULL &&
+		    sscanf(line, "# moused recording of %255[^,],", name) == 1)
+			strlcpy(path, name, pathlen);
+	}
+	err = evdev_caps_read(fp, caps);
+	if (err != 0)
+		return (err);
+
+	*evdev = caps->name[0] != '\0';
+	ent = NULL;
+	count = size = 0;
+	err = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (count == 0)
+			*evdev = line[0] == 'E';
+		if (count == size) {
+			size = size == 0 ? RECORD_SIZE : size * 2;
+			re = reallocarray(ent, size, sizeof(*ent));
+			if (re == NULL) {
+				err = ENOMEM;
+				break;
+			}
+			ent = re;
+		}
+		re = &ent[count];
+		memset(re, 0, sizeof(*re));
+		if (*evdev && sscanf(line, "E: %jd.%ld %x %x %d", &sec, &usec,
+		    &type, &code, &value) == 5) {
+			re->ev.type = type;
+			re->ev.code = code;
+			re->ev.value = value;
+		} else if (!*evdev && sscanf(line,
+		    "S: %jd.%ld %x %x %x %x %x %x %x %x", &sec, &usec,
+		    &packet[0], &packet[1], &packet[2], &packet[3],
+		    &packet[4], &packet[5], &packet[6], &packet[7]) ==
+		    RECORD_PACKETSIZE + 2) {
+			for (j = 0; j < RECORD_PACKETSIZE; j++)
+				re->packet[j] = packet[j];
+		} else {
+			err = EFTYPE;
+			break;
+		}
+		re->time.tv_sec = sec;
+		re->time.tv_usec = usec;
+		count++;
+	}
+	if (err == 0 && ferror(fp))
+		err = EIO;
+	if (err != 0) {
+		free(ent);
+		return (err);
+	}
+
+	*entp = ent;
+	*countp = count;
+	return (0);
+}
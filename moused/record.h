@@ -0,0 +1,123 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <dev/evdev/input.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "evdev-caps.h"
+
+#define	RECORD_SECONDS	10	/* Length of written out recordings */
+/*
+ * Input rate the ring holds RECORD_SECONDS of: a 1 kHz mouse reporting
+ * X, Y and SYN_REPORT.  Busier devices get a shorter recording.
+ */
+#define	RECORD_RATE	3000	/* events per second */
+#define	RECORD_SIZE	32768	/* Entries per device, must be a power of 2 */
+#define	RECORD_PACKETSIZE	8	/* == MOUSE_SYS_PACKETSIZE */
+
+_Static_assert(RECORD_SIZE >= RECORD_SECONDS * RECORD_RATE,
+    "RECORD_SIZE does not hold RECORD_SECONDS at RECORD_RATE");
+_Static_assert((RECORD_SIZE & (RECORD_SIZE - 1)) == 0,
+    "RECORD_SIZE must be a power of 2");
+
+struct record_entry {
+	struct timeval	time;
+	union {
+		struct {
+			uint16_t	type;
+			uint16_t	code;
+			int32_t		value;
+		} ev;				/* evdev event */
+		uint8_t	packet[RECORD_PACKETSIZE];	/* sysmouse packet */
+	};
+};
+
+/*
+ * Flight recorder of raw device input.  Like the trace ring it has a
+ * single writer, the thread reading the device, and is preallocated with
+ * the device, so recording never allocates memory nor takes locks.
+ */
+struct record_ring {
+	atomic_uint_fast64_t seq;	/* entries ever recorded */
+	struct record_entry ent[RECORD_SIZE];
+};
+
+static inline struct record_entry *
+record_next(struct record_ring *rr, uint_fast64_t *seq)
+{
+	*seq = atomic_load_explicit(&rr->seq, memory_order_relaxed);
+	return (&rr->ent[*seq & (RECORD_SIZE - 1)]);
+}
+
+static inline void
+record_event(struct record_ring *rr, const struct input_event *ie)
+{
+	struct record_entry *re;
+	uint_fast64_t seq;
+
+	re = record_next(rr, &seq);
+	re->time = ie->time;
+	re->ev.type = ie->type;
+	re->ev.code = ie->code;
+	re->ev.value = ie->value;
+	atomic_store_explicit(&rr->seq, seq + 1, memory_order_release);
+}
+
+static inline void
+record_packet(struct record_ring *rr, const uint8_t *packet)
+{
+	struct record_entry *re;
+	struct timespec ts;
+	uint_fast64_t seq;
+
+	re = record_next(rr, &seq);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	TIMESPEC_TO_TIMEVAL(&re->time, &ts);
+	memcpy(re->packet, packet, RECORD_PACKETSIZE);
+	atomic_store_explicit(&rr->seq, seq + 1, memory_order_release);
+}
+
+int	record_write(FILE *fp, const char *path, const struct evdev_caps *caps,
+	    struct record_ring *rr);
+int	record_read(FILE *fp, char *path, size_t pathlen,
+	    struct evdev_caps *caps, bool *evdev, struct record_entry **entp,
+	    size_t *countp);
+
+#endif
@@ -0,0 +1,186 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mouse.h>
+#include <sys/time.h>
+
+#include <dev/evdev/input.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util-time.h"
+#include "libmoused.h"
+#include "record.h"
+#include "replay.h"
+
+static void	replay_arm(struct replay *rp);
+static void	replay_timers(struct replay *rp, const struct timespec *until);
+
+/*
+ * Start the clock at the first entry.  The device is created afterwards
+ * with rp->clock as its current time, e3b state is timestamped.
+ */
+void
+replay_init(struct replay *rp, const struct record_entry *first)
+{
+	memset(rp, 0, sizeof(*rp));
+	TIMEVAL_TO_TIMESPEC(&first->time, &rp->clock);
+}
+
+/*
+ * Arm the timers the device asks for, the way moused arms its kqueue
+ * timers: one-shot timers anew after every event, periodic ones once and
+ * until the device stops asking.  Timeouts of 0 expire right away.
+ */
+static void
+replay_arm(struct replay *rp)
+{
+	bool expired;
+	int i;
+
+	for (;;) {
+		moused_dev_timeouts(rp->md, rp->timeout);
+		expired = false;
+		for (i = 0; i < MOUSED_TIMER_CNT; i++) {
+			if (rp->timeout[i] == 0)
+				expired = true;
+			if (MOUSED_TIMER_PERIODIC(i)) {
+				if (rp->timeout[i] > 0 &&
+				    (rp->armed & (1 << i)) == 0) {
+					rp->timer[i] = tsaddms(&rp->clock,
+					    rp->timeout[i]);
+					rp->armed |= 1 << i;
+				} else if (rp->timeout[i] <= 0)
+					rp->armed &= ~(1 << i);
+				continue;
+			}
+			if (rp->timeout[i] <= 0)
+				continue;
+			rp->timer[i] = tsaddms(&rp->clock, rp->timeout[i]);
+			rp->armed |= 1 << i;
+		}
+		if (!expired)
+			break;
+		for (i = 0; i < MOUSED_TIMER_CNT; i++)
+			if (rp->timeout[i] == 0)
+				moused_dev_expire(rp->md, i, &rp->clock);
+	}
+}
+
+/* Expire timers which are due before until, earliest first */
+static void
+replay_timers(struct replay *rp, const struct timespec *until)
+{
+	int i, id;
+
+	for (;;) {
+		id = -1;
+		for (i = 0; i < MOUSED_TIMER_CNT; i++)
+			if ((rp->armed & (1 << i)) != 0 && (id == -1 ||
+			    timespeccmp(&rp->timer[i], &rp->timer[id], <)))
+				id = i;
+		if (id == -1 || timespeccmp(&rp->timer[id], until, >))
+			break;
+		rp->clock = rp->timer[id];
+		if (!MOUSED_TIMER_PERIODIC(id))
+			rp->armed &= ~(1 << id);
+		moused_dev_expire(rp->md, id, &rp->clock);
+		replay_arm(rp);
+		/* Periodic timers keep running */
+		if ((rp->armed & (1 << id)) != 0 && MOUSED_TIMER_PERIODIC(id))
+			rp->timer[id] = tsaddms(&rp->clock, rp->timeout[id]);
+	}
+}
+
+/*
+ * Pass a recorded entry to the device after the timers due before it,
+ * input cancels one-shot timers.  Returns -1 if rp->input has failed.
+ */
+int
+replay_feed(struct replay *rp, const struct record_entry *re, bool evdev)
+{
+	struct input_event ie;
+	struct timespec ts;
+	int i;
+
+	TIMEVAL_TO_TIMESPEC(&re->time, &ts);
+	replay_timers(rp, &ts);
+	rp->clock = ts;
+	for (i = 0; i < MOUSED_TIMER_CNT; i++)
+		if (!MOUSED_TIMER_PERIODIC(i))
+			rp->armed &= ~(1 << i);
+	if (rp->input != NULL) {
+		if (rp->input(rp->arg, re, evdev) != 0)
+			return (-1);
+	} else if (evdev) {
+		memset(&ie, 0, sizeof(ie));
+		ie.time = re->time;
+		ie.type = re->ev.type;
+		ie.code = re->ev.code;
+		ie.value = re->ev.value;
+		moused_dev_event(rp->md, &ie, &rp->clock);
+	} else
+		moused_dev_packet(rp->md, re->packet, &rp->clock);
+	replay_arm(rp);
+
+	return (0);
+}
+
+/* Let pending timeouts of the last events expire */
+void
+replay_finish(struct replay *rp)
+{
+	struct timespec ts;
+
+	ts = tsaddms(&rp->clock, 1000);
+	replay_timers(rp, &ts);
+}
+
+/* Print a console action of the replayed device, stamped with ts */
+void
+replay_print(FILE *fp, const struct timespec *ts, const struct mouse_info *mi)
+{
+	fprintf(fp, "%jd.%06ld ", (intmax_t)ts->tv_sec, ts->tv_nsec / 1000);
+	switch (mi->operation) {
+	case MOUSE_MOTION_EVENT:
+		fprintf(fp, "motion %d %d %d buttons 0x%x\n",
+		    mi->u.data.x, mi->u.data.y, mi->u.data.z,
+		    mi->u.data.buttons);
+		break;
+	case MOUSE_BUTTON_EVENT:
+		fprintf(fp, "button 0x%x count %d\n",
+		    mi->u.event.id, mi->u.event.value);
+		break;
+	default:
+		fprintf(fp, "operation %d\n", mi->operation);
+		break;
+	}
+}
@@ -0,0 +1,70 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <sys/types.h>
+#include <sys/mouse.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "libmoused.h"
+#include "record.h"
+
+/*
+ * Passes a recorded entry to the pipeline instead of replay_feed() doing
+ * it directly, returns -1 to stop the replay.
+ */
+typedef int replay_input_t(void *arg, const struct record_entry *re,
+    bool evdev);
+
+/*
+ * Recording driven through a pipeline on the virtual clock of the
+ * recording.  Shared by "moused -R" and the regression harness of tests/,
+ * so both expire timers and print console actions the same way.
+ */
+struct replay {
+	struct moused_dev *md;
+	struct timespec	clock;			/* time of the replayed event */
+	struct timespec	timer[MOUSED_TIMER_CNT];	/* deadlines */
+	int		timeout[MOUSED_TIMER_CNT];
+	u_int		armed;			/* running timers */
+	replay_input_t	*input;			/* NULL feeds md directly */
+	void		*arg;
+};
+
+void	replay_init(struct replay *rp, const struct record_entry *first);
+int	replay_feed(struct replay *rp, const struct record_entry *re,
+	    bool evdev);
+void	replay_finish(struct replay *rp);
+void	replay_print(FILE *fp, const struct timespec *ts,
+	    const struct mouse_info *mi);
+
+#endif
@@ -0,0 +1,145 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/consio.h>
+#include <sys/mman.h>
+#include <sys/mouse.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "state.h"
+
+struct state {
+	struct state_header *sh;
+	size_t size;
+	char name[];
+};
+
+/*
+ * Create the shared memory segment.  It is writable by the owner only,
+ * everyone may map it for reading.
+ */
+struct state *
+state_open(const char *name, u_int ring_size)
+{
+	struct state *st;
+	size_t size;
+	int fd, error;
+
+	if (ring_size > STATE_RING_MAX || !powerof2(ring_size)) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	size = sizeof(struct state_header) +
+	    ring_size * sizeof(struct state_action);
+	st = malloc(sizeof(struct state) + strlen(name) + 1);
+	if (st == NULL)
+		return (NULL);
+	strcpy(st->name, name);
+	st->size = size;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		free(st);
+		return (NULL);
+	}
+	if (ftruncate(fd, size) == -1 || (st->sh = mmap(NULL, size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		error = errno;
+		close(fd);
+		shm_unlink(name);
+		free(st);
+		errno = error;
+		return (NULL);
+	}
+	close(fd);
+
+	st->sh->magic = STATE_MAGIC;
+	st->sh->version = STATE_VERSION;
+	st->sh->size = size;
+	st->sh->ring_size = ring_size;
+
+	return (st);
+}
+
+/* Fold a console action into the published state */
+void
+state_publish(struct state *st, const struct mouse_info *mi)
+{
+	struct state_header *sh = st->sh;
+	struct state_action *sa;
+	struct timespec ts;
+	u_int seq;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	seq = atomic_load_explicit(&sh->seq, memory_order_relaxed);
+	atomic_store_explicit(&sh->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	sh->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (mi->operation == MOUSE_MOTION_EVENT) {
+		sh->x += mi->u.data.x;
+		sh->y += mi->u.data.y;
+		sh->z += mi->u.data.z;
+		sh->buttons = mi->u.data.buttons;
+	}
+	if (sh->ring_size != 0) {
+		sa = &sh->ring[sh->actions & (sh->ring_size - 1)];
+		sa->ts = sh->ts;
+		sa->operation = mi->operation;
+		if (mi->operation == MOUSE_MOTION_EVENT) {
+			sa->x = mi->u.data.x;
+			sa->y = mi->u.data.y;
+			sa->z = mi->u.data.z;
+			sa->buttons = mi->u.data.buttons;
+		} else {
+			sa->x = mi->u.event.id;
+			sa->y = mi->u.event.value;
+			sa->z = 0;
+			sa->buttons = sh->buttons;
+		}
+	}
+	sh->actions++;
+
+	atomic_store_explicit(&sh->seq, seq + 2, memory_order_release);
+}
+
+void
+state_close(struct state *st)
+{
+	if (st == NULL)
+		return;
+	munmap(st->sh, st->size);
+	shm_unlink(st->name);
+	free(st);
+}
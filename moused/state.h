@@ -0,0 +1,84 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <sys/types.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define	STATE_MAGIC	0x4d534453	/* "MSDS" */
+#define	STATE_VERSION	1
+#define	STATE_RING_MAX	4096	/* Largest ring of actions */
+
+/* Console action as published in the ring */
+struct state_action {
+	uint64_t	ts;	/* CLOCK_MONOTONIC, nanoseconds */
+	int32_t		operation;	/* MOUSE_MOTION_EVENT etc. */
+	int32_t		x;	/* motion or button id */
+	int32_t		y;	/* motion or click count */
+	int32_t		z;
+	int32_t		buttons;
+	uint32_t	pad;
+};
+
+/*
+ * Processed pointer state published in a shared memory segment.  The
+ * daemon is the only writer.  Readers map the segment read-only and
+ * take consistent snapshots without system calls using the seqlock:
+ * load seq with acquire semantics, retry while it is odd, copy the
+ * fields, issue an acquire fence and retry if seq has changed.
+ * The optional ring of actions follows the header, ring_size entries
+ * long, the slot of the action number n is n & (ring_size - 1).
+ * Readers compare actions with their last seen value to find new
+ * entries and the number of entries lost to overwrites.
+ */
+struct state_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	size;	/* size of the segment */
+	uint32_t	ring_size;	/* power of 2, 0 if there is no ring */
+	atomic_uint	seq;	/* odd while an update is in progress */
+	int32_t		buttons;	/* current button state */
+	int64_t		x;	/* accumulated motion */
+	int64_t		y;
+	int64_t		z;
+	uint64_t	ts;	/* time of the last update, nanoseconds */
+	uint64_t	actions;	/* actions published */
+	struct state_action ring[];
+};
+
+struct state;
+struct mouse_info;
+
+struct state *state_open(const char *name, u_int ring_size);
+void	state_publish(struct state *st, const struct mouse_info *mi);
+void	state_close(struct state *st);
+
+#endif
@@ -0,0 +1,109 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef COMPAT_SYS_BITSTRING_H
+#define COMPAT_SYS_BITSTRING_H
+
+#include <stdlib.h>
+
+/* Word sized like the FreeBSD one, evdev ioctls fill it directly */
+typedef	unsigned long	bitstr_t;
+
+#define	_BITSTR_BITS	(sizeof(bitstr_t) * 8)
+#define	_bit_idx(bit)	((bit) / _BITSTR_BITS)
+#define	_bit_mask(bit)	(1UL << ((bit) % _BITSTR_BITS))
+
+#define	bitstr_size(nbits)	(howmany(nbits, _BITSTR_BITS) * sizeof(bitstr_t))
+#define	bit_decl(name, nbits)	((name)[howmany(nbits, _BITSTR_BITS)])
+
+static inline bitstr_t *
+bit_alloc(int nbits)
+{
+	return (calloc(howmany(nbits, _BITSTR_BITS), sizeof(bitstr_t)));
+}
+
+static inline int
+bit_test(const bitstr_t *bitstr, int bit)
+{
+	return ((bitstr[_bit_idx(bit)] & _bit_mask(bit)) != 0);
+}
+
+static inline void
+bit_set(bitstr_t *bitstr, int bit)
+{
+	bitstr[_bit_idx(bit)] |= _bit_mask(bit);
+}
+
+static inline void
+bit_clear(bitstr_t *bitstr, int bit)
+{
+	bitstr[_bit_idx(bit)] &= ~_bit_mask(bit);
+}
+
+static inline void
+bit_nset(bitstr_t *bitstr, int start, int stop)
+{
+	for (; start <= stop; start++)
+		bit_set(bitstr, start);
+}
+
+static inline void
+bit_nclear(bitstr_t *bitstr, int start, int stop)
+{
+	for (; start <= stop; start++)
+		bit_clear(bitstr, start);
+}
+
+static inline void
+bit_ffs_at(bitstr_t *bitstr, int start, int nbits, int *result)
+{
+	for (; start < nbits; start++) {
+		if (bit_test(bitstr, start)) {
+			*result = start;
+			return;
+		}
+	}
+	*result = -1;
+}
+
+static inline void
+bit_ffs(bitstr_t *bitstr, int nbits, int *result)
+{
+	bit_ffs_at(bitstr, 0, nbits, result);
+}
+
+static inline void
+bit_count(bitstr_t *bitstr, int start, int nbits, int *result)
+{
+	int count;
+
+	for (count = 0; start < nbits; start++)
+		count += bit_test(bitstr, start);
+	*result = count;
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef COMPAT_SYS_MOUSE_H
+#define COMPAT_SYS_MOUSE_H
+
+/* Subset of the FreeBSD definitions used by libmoused */
+typedef struct mousestatus {
+	int	flags;
+	int	button;
+	int	obutton;
+	int	dx;
+	int	dy;
+	int	dz;
+} mousestatus_t;
+
+typedef struct mousemode {
+	int	protocol;
+	int	rate;
+	int	resolution;
+	int	accelfactor;
+	int	level;
+	int	packetsize;
+	unsigned char syncmask[2];
+} mousemode_t;
+
+#define	MOUSE_MAXBUTTON		31
+#define	MOUSE_BUTTON1DOWN	0x0001
+#define	MOUSE_BUTTON2DOWN	0x0002
+#define	MOUSE_BUTTON3DOWN	0x0004
+#define	MOUSE_BUTTON4DOWN	0x0008
+#define	MOUSE_BUTTON5DOWN	0x0010
+#define	MOUSE_BUTTON6DOWN	0x0020
+#define	MOUSE_BUTTON7DOWN	0x0040
+#define	MOUSE_BUTTON8DOWN	0x0080
+#define	MOUSE_STDBUTTONS	0x0007
+#define	MOUSE_EXTBUTTONS	0x7ffffff8
+#define	MOUSE_BUTTONS		(MOUSE_STDBUTTONS | MOUSE_EXTBUTTONS)
+#define	MOUSE_POSCHANGED	0x80000000
+
+#define	MOUSE_PROTO_SYSMOUSE	11
+
+#define	MOUSE_SYS_PACKETSIZE	8
+#define	MOUSE_SYS_SYNCMASK	0xf8
+#define	MOUSE_SYS_SYNC		0x80
+#define	MOUSE_SYS_STDBUTTONS	0x07
+#define	MOUSE_SYS_EXTBUTTONS	0x7f
+
+#define	MOUSE_RES_UNKNOWN	(-1)
+#define	MOUSE_RES_DEFAULT	0
+#define	MOUSE_RES_LOW		(-2)
+#define	MOUSE_RES_MEDIUMLOW	(-3)
+#define	MOUSE_RES_MEDIUMHIGH	(-4)
+#define	MOUSE_RES_HIGH		(-5)
+
+#endif
@@ -0,0 +1,171 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark of the touchpad gesture recognizer.  r_gestures() is
+ * static, so the library source is included rather than linked.  A
+ * clickpad is fed pseudo-random strokes with one to three fingers, some
+ * of them with the button pressed, and the time per call is reported
+ * together with a hash of the recognized gestures and buttons.  The hash
+ * depends only on the configuration, so it must not change when the
+ * recognizer is merely made faster.
+ */
+
+#include <err.h>
+#include <unistd.h>
+
+#include "../libmoused.c"
+
+#define	GESTURES_STROKES	200000
+#define	GESTURES_PACKETS	20	/* per stroke, one more lifts */
+
+static moused_log_handler	log_none;
+
+static void	usage(void) __dead2;
+static void	gestures_output(void *arg, const struct mouse_info *mi);
+
+int
+main(int argc, char *argv[])
+{
+	const char *config_file = CONFDIR "/moused.conf";
+	const char *quirks_path = QUIRKSDIR;
+	struct quirks_context *quirks;
+	struct quirks *q;
+	struct moused_dev *md;
+	struct evdev_caps caps;
+	struct moused_device dev;
+	struct timespec now, start, end;
+	mousestatus_t ms;
+	enum gesture g;
+	u_long calls, hash;
+	u_int seed;
+	double elapsed;
+	int c, s, i, x0, y0, nfingers;
+
+	while ((c = getopt(argc, argv, "c:q:")) != -1) {
+		switch (c) {
+		case 'c':
+			config_file = optarg;
+			break;
+		case 'q':
+			quirks_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	/* 100x75 mm clickpad at 40 units/mm */
+	memset(&dev, 0, sizeof(dev));
+	dev.iftype = MOUSED_IF_EVDEV;
+	dev.type = MOUSED_TYPE_TOUCHPAD;
+	strlcpy(dev.name, "Benchmark Touchpad", sizeof(dev.name));
+	memset(&caps, 0, sizeof(caps));
+	bit_set(caps.abs_bits, ABS_X);
+	bit_set(caps.abs_bits, ABS_Y);
+	bit_set(caps.abs_bits, ABS_PRESSURE);
+	bit_set(caps.key_bits, BTN_TOUCH);
+	bit_set(caps.key_bits, BTN_TOOL_FINGER);
+	bit_set(caps.key_bits, BTN_LEFT);
+	bit_set(caps.prop_bits, INPUT_PROP_BUTTONPAD);
+	caps.absinfo[ABS_X].maximum = 4000;
+	caps.absinfo[ABS_X].resolution = 40;
+	caps.absinfo[ABS_Y].maximum = 3000;
+	caps.absinfo[ABS_Y].resolution = 40;
+	caps.absinfo[ABS_PRESSURE].maximum = 255;
+
+	moused_log_init(log_none, false);
+	quirks = quirks_init_subsystem(quirks_path, config_file, log_none,
+	    QLOG_CUSTOM_LOG_PRIORITIES);
+	if (quirks == NULL)
+		errx(1, "cannot open configuration file %s", config_file);
+	q = quirks_fetch_for_device(quirks, &dev);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	md = moused_dev_create(&dev, &caps, q, NULL, gestures_output, NULL,
+	    &now);
+	if (md == NULL)
+		err(1, "cannot set the touchpad up");
+
+	calls = hash = 0;
+	seed = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (s = 0; s < GESTURES_STROKES; s++) {
+		seed = seed * 1103515245 + 12345;
+		x0 = seed % 4000;
+		seed = seed * 1103515245 + 12345;
+		y0 = seed % 3000;
+		nfingers = 1 + (s % 5 == 0) + (s % 11 == 0);
+		for (i = 0; i < GESTURES_PACKETS; i++) {
+			memset(&ms, 0, sizeof(ms));
+			now = tsaddms(&now, 8);
+			if (i > GESTURES_PACKETS / 2 && s % 3 == 0)
+				ms.button = MOUSE_BUTTON1DOWN;
+			g = r_gestures(&md->tp, x0 + i * (s & 15),
+			    y0 + i * (s % 7), 60, 0, nfingers, NULL, &now, &ms);
+			hash = hash * 31 + g * 7 + ms.button;
+			calls++;
+		}
+		memset(&ms, 0, sizeof(ms));
+		now = tsaddms(&now, 8);
+		g = r_gestures(&md->tp, x0, y0, 0, 0, 0, NULL, &now, &ms);
+		hash = hash * 31 + g + ms.button;
+		calls++;
+		now = tsaddms(&now, 400);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	timespecsub(&end, &start, &end);
+	elapsed = end.tv_sec + end.tv_nsec / 1e9;
+	printf("%s: %lu calls, %.1f ns/call, hash %lx\n", config_file, calls,
+	    elapsed * 1e9 / calls, hash);
+
+	moused_dev_destroy(md);
+	quirks_unref(q);
+	quirks_context_unref(quirks);
+
+	return (0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: gestures [-c config-file] [-q quirks-path]\n");
+	exit(1);
+}
+
+static void
+log_none(int log_pri __unused, int errnum __unused, const char *fmt __unused,
+    va_list ap __unused)
+{
+}
+
+static void
+gestures_output(void *arg __unused, const struct mouse_info *mi __unused)
+{
+}
@@ -0,0 +1,280 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Startup benchmark of device probing.  moused probes evdev nodes on a
+ * small thread pool in r_init_all(), this harness does the same with N
+ * simulated devices, once serially and once with the pool, and reports
+ * the time of both.  Probing a real node is dominated by open(2) and the
+ * EVIOCG* ioctls, which are stood in for by a sleep of -l microseconds,
+ * the rest is the device independent part of r_probe(): identification,
+ * quirk lookup and pipeline setup.  Devices alternate between a mouse,
+ * a touchpad and a pointing stick, so lookups take different paths.
+ */
+
+#include <sys/types.h>
+#include <sys/mouse.h>
+#include <sys/time.h>
+
+#include <dev/evdev/input.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "evdev-caps.h"
+#include "quirks.h"
+#include "libmoused.h"
+
+#define	PROBE_DEVICES	64
+#define	PROBE_THREADS	8	/* MAX_PROBE_THREADS of moused */
+#define	PROBE_LATENCY	2000	/* us of ioctls per device */
+
+struct probe_job {
+	struct quirks_context *quirks;
+	struct moused_dev **result;
+	int count;
+	u_int latency;
+	atomic_int next;	/* next device to be taken by a worker */
+};
+
+static moused_log_handler	log_none;
+
+static void	usage(void) __dead2;
+static void	probe_caps(int unit, struct evdev_caps *caps);
+static struct moused_dev *probe_one(struct probe_job *job, int unit);
+static void	*probe_worker(void *arg);
+static double	probe_run(struct probe_job *job, int nthreads);
+static void	probe_output(void *arg, const struct mouse_info *mi);
+
+int
+main(int argc, char *argv[])
+{
+	const char *config_file = CONFDIR "/moused.conf";
+	const char *quirks_path = QUIRKSDIR;
+	struct probe_job job;
+	double serial, threaded;
+	long val;
+	char *end;
+	int c, nthreads;
+
+	memset(&job, 0, sizeof(job));
+	job.count = PROBE_DEVICES;
+	job.latency = PROBE_LATENCY;
+	nthreads = PROBE_THREADS;
+	while ((c = getopt(argc, argv, "c:j:l:n:q:")) != -1) {
+		switch (c) {
+		case 'c':
+			config_file = optarg;
+			break;
+		case 'j':
+		case 'l':
+		case 'n':
+			errno = 0;
+			val = strtol(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || val < (c != 'l') ||
+			    val > 100000)
+				errx(1, "invalid -%c value: %s", c, optarg);
+			if (c == 'j')
+				nthreads = val;
+			else if (c == 'l')
+				job.latency = val;
+			else
+				job.count = val;
+			break;
+		case 'q':
+			quirks_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	moused_log_init(log_none, false);
+	job.quirks = quirks_init_subsystem(quirks_path, config_file, log_none,
+	    QLOG_CUSTOM_LOG_PRIORITIES);
+	if (job.quirks == NULL)
+		errx(1, "cannot open configuration file %s", config_file);
+	job.result = calloc(job.count, sizeof(struct moused_dev *));
+	if (job.result == NULL)
+		err(1, "cannot allocate probe results");
+
+	/* Untimed round, so that the serial one does not pay for cold caches */
+	probe_run(&job, 1);
+	serial = probe_run(&job, 1);
+	threaded = probe_run(&job, nthreads);
+	printf("%d devices, %u us latency: serial %.1f ms, "
+	    "%d threads %.1f ms, speedup %.2f\n", job.count, job.latency,
+	    serial * 1e3, nthreads, threaded * 1e3,
+	    threaded > 0 ? serial / threaded : 0);
+
+	free(job.result);
+	quirks_context_unref(job.quirks);
+
+	return (0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: probe [-c config-file] [-j threads] "
+	    "[-l latency-us] [-n devices] [-q quirks-path]\n");
+	exit(1);
+}
+
+static void
+log_none(int log_pri __unused, int errnum __unused, const char *fmt __unused,
+    va_list ap __unused)
+{
+}
+
+/* Capabilities of a simulated device, the kind depends on the unit */
+static void
+probe_caps(int unit, struct evdev_caps *caps)
+{
+	memset(caps, 0, sizeof(*caps));
+	caps->id.bustype = BUS_I8042;
+	bit_set(caps->key_bits, BTN_LEFT);
+	bit_set(caps->key_bits, BTN_RIGHT);
+	switch (unit % 3) {
+	case 0:
+		snprintf(caps->name, sizeof(caps->name), "Probe Mouse %d",
+		    unit);
+		caps->id.bustype = BUS_USB;
+		bit_set(caps->rel_bits, REL_X);
+		bit_set(caps->rel_bits, REL_Y);
+		bit_set(caps->rel_bits, REL_WHEEL);
+		bit_set(caps->key_bits, BTN_MIDDLE);
+		break;
+	case 1:
+		/* Matches the quirks of the installed touchpad file */
+		strlcpy(caps->name, "SynPS/2 Synaptics TouchPad",
+		    sizeof(caps->name));
+		bit_set(caps->abs_bits, ABS_X);
+		bit_set(caps->abs_bits, ABS_Y);
+		bit_set(caps->abs_bits, ABS_PRESSURE);
+		bit_set(caps->key_bits, BTN_TOUCH);
+		bit_set(caps->key_bits, BTN_TOOL_FINGER);
+		caps->absinfo[ABS_X].maximum = 4000;
+		caps->absinfo[ABS_X].resolution = 40;
+		caps->absinfo[ABS_Y].maximum = 3000;
+		caps->absinfo[ABS_Y].resolution = 40;
+		caps->absinfo[ABS_PRESSURE].maximum = 255;
+		break;
+	default:
+		snprintf(caps->name, sizeof(caps->name),
+		    "Probe TrackPoint %d", unit);
+		bit_set(caps->rel_bits, REL_X);
+		bit_set(caps->rel_bits, REL_Y);
+		bit_set(caps->key_bits, BTN_MIDDLE);
+		bit_set(caps->prop_bits, INPUT_PROP_POINTING_STICK);
+		break;
+	}
+}
+
+/* Device independent part of r_probe() of moused */
+static struct moused_dev *
+probe_one(struct probe_job *job, int unit)
+{
+	struct evdev_caps caps;
+	struct moused_device dev;
+	struct moused_dev *md;
+	struct quirks *q;
+
+	if (job->latency != 0)
+		usleep(job->latency);
+	probe_caps(unit, &caps);
+	memset(&dev, 0, sizeof(dev));
+	snprintf(dev.path, sizeof(dev.path), "/dev/input/event%d", unit);
+	dev.iftype = MOUSED_IF_EVDEV;
+	dev.type = moused_identify(&caps);
+	strlcpy(dev.name, caps.name, sizeof(dev.name));
+	dev.id = caps.id;
+	q = quirks_fetch_for_device(job->quirks, &dev);
+	md = moused_dev_create(&dev, &caps, q, NULL, probe_output, NULL,
+	    NULL);
+	quirks_unref(q);
+
+	return (md);
+}
+
+static void *
+probe_worker(void *arg)
+{
+	struct probe_job *job = arg;
+	int i;
+
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->count)
+		job->result[i] = probe_one(job, i);
+
+	return (NULL);
+}
+
+/* Probe all devices on nthreads threads, the calling one included */
+static double
+probe_run(struct probe_job *job, int nthreads)
+{
+	pthread_t threads[nthreads];
+	struct timespec start, end;
+	int i, n;
+
+	atomic_init(&job->next, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < nthreads - 1; n++)
+		if (pthread_create(&threads[n], NULL, probe_worker, job) != 0)
+			break;
+	probe_worker(job);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < job->count; i++) {
+		if (job->result[i] == NULL)
+			errx(1, "cannot set /dev/input/event%d up", i);
+		moused_dev_destroy(job->result[i]);
+		job->result[i] = NULL;
+	}
+	timespecsub(&end, &start, &end);
+
+	return (end.tv_sec + end.tv_nsec / 1e9);
+}
+
+static void
+probe_output(void *arg __unused, const struct mouse_info *mi __unused)
+{
+}
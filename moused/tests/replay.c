@@ -0,0 +1,248 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Regression harness of libmoused.  A recording of the flight recorder is
+ * fed through the pipeline with the replay driver of "moused -R", so both
+ * expire timers on the virtual clock of the recording and print console
+ * actions in the same format.  Unlike moused it passes entries to the
+ * library directly and builds on hosts other than FreeBSD with the headers
+ * of compat/.  The replay can be repeated to measure the processing rate,
+ * which is reported to stderr.
+ */
+
+#include <sys/types.h>
+#include <sys/consio.h>
+#include <sys/mouse.h>
+#include <sys/time.h>
+
+#include <dev/evdev/input.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "evdev-caps.h"
+#include "quirks.h"
+#include "libmoused.h"
+#include "record.h"
+#include "replay.h"
+
+static FILE	*out;		/* console actions, NULL discards them */
+
+static moused_log_handler	log_warn_va;
+
+static void	usage(void) __dead2;
+static void	replay_output(void *arg, const struct mouse_info *mi);
+static int	replay_pass(struct replay *rp,
+		    const struct moused_device *dev, struct evdev_caps *caps,
+		    struct quirks *q,
+		    const struct record_entry *ent, size_t count, bool evdev);
+
+int
+main(int argc, char *argv[])
+{
+	const char *config_file = CONFDIR "/moused.conf";
+	const char *quirks_path = QUIRKSDIR;
+	struct quirks_context *quirks;
+	struct quirks *q;
+	struct record_entry *ent;
+	struct evdev_caps caps;
+	struct moused_device dev;
+	struct replay rp;
+	struct timespec start, end;
+	size_t count, packets, i;
+	u_long passes, pass;
+	double elapsed;
+	bool evdev;
+	char *end_arg;
+	int c, error;
+	FILE *fp;
+
+	passes = 1;
+	while ((c = getopt(argc, argv, "c:n:q:")) != -1) {
+		switch (c) {
+		case 'c':
+			config_file = optarg;
+			break;
+		case 'n':
+			errno = 0;
+			passes = strtoul(optarg, &end_arg, 10);
+			if (errno != 0 || *end_arg != '\0' || passes == 0)
+				errx(1, "invalid number of passes: %s", optarg);
+			break;
+		case 'q':
+			quirks_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	fp = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "r");
+	if (fp == NULL)
+		err(1, "cannot open %s", argv[optind]);
+	memset(&dev, 0, sizeof(dev));
+	error = record_read(fp, dev.path, sizeof(dev.path), &caps, &evdev,
+	    &ent, &count);
+	if (fp != stdin)
+		fclose(fp);
+	if (error == 0 && count == 0)
+		error = ENODATA;
+	if (error != 0) {
+		errno = error;
+		err(1, "cannot read %s", argv[optind]);
+	}
+
+	/* Same device setup as in r_replay() of moused */
+	if (evdev) {
+		dev.iftype = MOUSED_IF_EVDEV;
+		dev.type = moused_identify(&caps);
+		strlcpy(dev.name, caps.name, sizeof(dev.name));
+		dev.id = caps.id;
+		strlcpy(dev.uniq, caps.uniq, sizeof(dev.uniq));
+	} else {
+		dev.iftype = MOUSED_IF_SYSMOUSE;
+		dev.type = MOUSED_TYPE_MOUSE;
+		dev.mode.protocol = MOUSE_PROTO_SYSMOUSE;
+		dev.mode.packetsize = MOUSE_SYS_PACKETSIZE;
+		dev.mode.level = 1;
+		strlcpy(dev.name, dev.path, sizeof(dev.name));
+	}
+	if (dev.type != MOUSED_TYPE_MOUSE &&
+	    dev.type != MOUSED_TYPE_POINTINGSTICK &&
+	    dev.type != MOUSED_TYPE_TOUCHPAD)
+		errx(1, "unsupported device type %d in %s", dev.type,
+		    argv[optind]);
+
+	moused_log_init(log_warn_va, false);
+	quirks = quirks_init_subsystem(quirks_path, config_file, log_warn_va,
+	    QLOG_CUSTOM_LOG_PRIORITIES);
+	if (quirks == NULL)
+		errx(1, "cannot open configuration file %s", config_file);
+	q = quirks_fetch_for_device(quirks, &dev);
+
+	packets = 0;
+	for (i = 0; i < count; i++)
+		if (!evdev || (ent[i].ev.type == EV_SYN &&
+		    ent[i].ev.code == SYN_REPORT))
+			packets++;
+
+	/* Actions of the first pass are printed, the rest is for timing */
+	out = stdout;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pass = 0; pass < passes; pass++) {
+		if (replay_pass(&rp, &dev, &caps, q, ent, count, evdev) != 0)
+			err(1, "cannot set %s up", dev.path);
+		if (pass == 0 && dev.type == MOUSED_TYPE_TOUCHPAD)
+			fprintf(stderr, "%s: %lu reports suppressed as jitter\n",
+			    argv[optind], moused_dev_suppressed(rp.md));
+		moused_dev_destroy(rp.md);
+		out = NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	timespecsub(&end, &start, &end);
+	elapsed = end.tv_sec + end.tv_nsec / 1e9;
+	fprintf(stderr, "%s: %zu events, %zu packets in %.3f s, "
+	    "%.0f packets/s\n", argv[optind], count * passes,
+	    packets * passes, elapsed,
+	    elapsed > 0 ? packets * passes / elapsed : 0);
+
+	quirks_unref(q);
+	quirks_context_unref(quirks);
+	free(ent);
+
+	return (0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: replay [-c config-file] [-n passes] "
+	    "[-q quirks-path] recording\n");
+	exit(1);
+}
+
+static void
+log_warn_va(int log_pri, int errnum, const char *fmt, va_list ap)
+{
+	char buf[256];
+	size_t len;
+
+	if (log_pri > LOG_ERR)
+		return;
+
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	len = strlen(buf);
+	if (len != 0 && buf[len - 1] == '\n')
+		buf[len - 1] = '\0';
+	if (errnum != 0)
+		warnx("%s: %s", buf, strerror(errnum));
+	else
+		warnx("%s", buf);
+}
+
+static void
+replay_output(void *arg, const struct mouse_info *mi)
+{
+	struct replay *rp = arg;
+
+	if (out != NULL)
+		replay_print(out, &rp->clock, mi);
+}
+
+/* Replay the whole recording through a fresh device context */
+static int
+replay_pass(struct replay *rp, const struct moused_device *dev,
+    struct evdev_caps *caps, struct quirks *q,
+    const struct record_entry *ent, size_t count, bool evdev)
+{
+	size_t i;
+
+	replay_init(rp, &ent[0]);
+	rp->md = moused_dev_create(dev, evdev ? caps : NULL, q, NULL,
+	    replay_output, rp, &rp->clock);
+	if (rp->md == NULL)
+		return (-1);
+
+	for (i = 0; i < count; i++)
+		replay_feed(rp, &ent[i], evdev);
+	replay_finish(rp);
+
+	return (0);
+}
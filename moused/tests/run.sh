@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Replay every recording of corpus/ and compare the console actions with
+# the expected output next to it.  A recording is replayed with the
+# configuration file of the same name if there is one, ../moused.conf
+# otherwise, and always with the quirks of ../quirks.
+#
+#	run.sh [-u] [-n passes]
+#
+# -u rewrites the expected output instead of comparing, -n repeats each
+# replay and reports packets/s over all passes.
+
+cd "$(dirname "$0")" || exit 1
+
+update=false
+passes=1
+while getopts "n:u" opt; do
+	case $opt in
+	n)	passes=$OPTARG ;;
+	u)	update=true ;;
+	*)	echo "usage: run.sh [-u] [-n passes]" >&2; exit 2 ;;
+	esac
+done
+
+out=$(mktemp) || exit 1
+trap 'rm -f "$out"' EXIT
+
+failed=0
+for rec in corpus/*.rec; do
+	name=${rec%.rec}
+	conf=../moused.conf
+	[ -f "$name.conf" ] && conf=$name.conf
+	if ! ./replay -c "$conf" -n "$passes" "$rec" > "$out"; then
+		echo "FAIL: $rec: replay failed"
+		failed=$((failed + 1))
+		continue
+	fi
+	if $update; then
+		cp "$out" "$name.out"
+	elif ! diff -u "$name.out" "$out"; then
+		echo "FAIL: $rec"
+		failed=$((failed + 1))
+	fi
+done
+
+if [ $failed -ne 0 ]; then
+	echo "$failed recording(s) failed"
+	exit 1
+fi
+exit 0
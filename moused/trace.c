@@ -0,0 +1,215 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmoused.h"
+#include "trace.h"
+#include "util-evdev.h"
+
+static const char * const timer_names[MOUSED_TIMER_CNT] = {
+	[MOUSED_TIMER_E3B] = "e3b",
+	[MOUSED_TIMER_GESTURE] = "gesture",
+	[MOUSED_TIMER_KINETIC] = "kinetic",
+	[MOUSED_TIMER_DEBOUNCE] = "debounce",
+};
+
+/* Must match enum gesture of libmoused.c */
+static const char * const gesture_names[] = {
+	"IGNORE",
+	"ACCUMULATE",
+	"MOVE",
+	"VSCROLL",
+	"HSCROLL",
+};
+
+int
+trace_write_header(FILE *fp)
+{
+	struct trace_header th;
+
+	memset(&th, 0, sizeof(th));
+	memcpy(th.magic, TRACE_MAGIC, sizeof(th.magic));
+	th.version = TRACE_VERSION;
+	th.entsize = sizeof(struct trace_entry);
+
+	return (fwrite(&th, sizeof(th), 1, fp) == 1 ? 0 : -1);
+}
+
+/*
+ * Write out trace ring of a device.  The ring is copied first and the
+ * entries which the writer could have overwritten meanwhile are dropped.
+ */
+int
+trace_write(FILE *fp, const char *path, const char *name,
+    struct trace_ring *tr)
+{
+	struct trace_device td;
+	struct trace_entry *ent;
+	uint_fast64_t first, seq, i;
+	int error = 0;
+
+	ent = malloc(sizeof(tr->ent));
+	if (ent == NULL)
+		return (-1);
+
+	seq = atomic_load_explicit(&tr->seq, memory_order_acquire);
+	memcpy(ent, tr->ent, sizeof(tr->ent));
+	atomic_thread_fence(memory_order_acquire);
+	first = atomic_load_explicit(&tr->seq, memory_order_relaxed);
+	/* The slot of entry being recorded now may be torn as well */
+	first = first >= TRACE_SIZE ? first - TRACE_SIZE + 1 : 0;
+	if (first > seq)
+		first = seq;
+
+	memset(&td, 0, sizeof(td));
+	strlcpy(td.path, path, sizeof(td.path));
+	strlcpy(td.name, name, sizeof(td.name));
+	td.count = seq - first;
+	if (fwrite(&td, sizeof(td), 1, fp) != 1)
+		error = -1;
+	for (i = first; i < seq && error == 0; i++)
+		if (fwrite(&ent[i & (TRACE_SIZE - 1)], sizeof(*ent), 1,
+		    fp) != 1)
+			error = -1;
+
+	free(ent);
+	return (error);
+}
+
+static void
+trace_decode_entry(FILE *out, const struct trace_entry *te)
+{
+	const int32_t *a = te->arg;
+	const char *type, *code, *name;
+	int i;
+
+	fprintf(out, "%6ju.%06ju ", (uintmax_t)(te->ts / 1000000000),
+	    (uintmax_t)(te->ts % 1000000000 / 1000));
+
+	switch (te->point) {
+	case TRACE_EVENT:
+		type = libevdev_event_type_get_name(a[0]);
+		code = libevdev_event_code_get_name(a[0], a[1]);
+		if (type != NULL && code != NULL)
+			fprintf(out, "event    %s %s %d\n", type, code, a[2]);
+		else
+			fprintf(out, "event    0x%02x 0x%04x %d\n",
+			    a[0], a[1], a[2]);
+		break;
+	case TRACE_SYSMOUSE:
+		fprintf(out, "sysmouse");
+		for (i = 0; i < 8; i++)
+			fprintf(out, " %02x",
+			    ((uint32_t)a[i / 4] >> (i % 4 * 8)) & 0xff);
+		fprintf(out, "\n");
+		break;
+	case TRACE_TIMER:
+		fprintf(out, "timer    %s\n",
+		    a[0] >= 0 && a[0] < (int32_t)nitems(timer_names) ?
+		    timer_names[a[0]] : "UNKNOWN");
+		break;
+	case TRACE_ABS:
+		fprintf(out, "abs      x %d y %d pressure %d width %d\n",
+		    a[0], a[1], a[2], a[3]);
+		break;
+	case TRACE_GESTURE:
+		name = a[0] >= 0 && a[0] < (int32_t)nitems(gesture_names) ?
+		    gesture_names[a[0]] : "UNKNOWN";
+		fprintf(out, "gesture  %s dx %d dy %d %s %d\n", name, a[1], a[2],
+		    strcmp(name, "HSCROLL") == 0 ? "dw" : "dz", a[3]);
+		break;
+	case TRACE_E3B:
+		fprintf(out, "e3b      state %d event %d -> state %d\n",
+		    a[0], a[1], a[2]);
+		break;
+	case TRACE_BUTTONS:
+		fprintf(out, "buttons  flags %08x buttons %08x obuttons %08x\n",
+		    a[0], a[1], a[2]);
+		break;
+	case TRACE_ACTION:
+		fprintf(out, "action   buttons %08x dx %d dy %d dz %d\n",
+		    a[0], a[1], a[2], a[3]);
+		break;
+	case TRACE_MOTION:
+		fprintf(out, "motion   x %d y %d z %d buttons %08x\n",
+		    a[0], a[1], a[2], a[3]);
+		break;
+	case TRACE_CLICK:
+		fprintf(out, "click    button %08x count %d\n", a[0], a[1]);
+		break;
+	case TRACE_WHEEL:
+		fprintf(out, "wheel    dz %d dw %d hi-res dz %d dw %d\n",
+		    a[0], a[1], a[2], a[3]);
+		break;
+	default:
+		fprintf(out, "unknown  %u %d %d %d %d\n",
+		    te->point, a[0], a[1], a[2], a[3]);
+		break;
+	}
+}
+
+/* Turn a binary trace dump into human readable text */
+int
+trace_decode(FILE *in, FILE *out)
+{
+	struct trace_header th;
+	struct trace_device td;
+	struct trace_entry te;
+	uint32_t i;
+
+	if (fread(&th, sizeof(th), 1, in) != 1 ||
+	    memcmp(th.magic, TRACE_MAGIC, sizeof(th.magic)) != 0 ||
+	    th.version != TRACE_VERSION ||
+	    th.entsize != sizeof(struct trace_entry)) {
+		errno = EFTYPE;
+		return (-1);
+	}
+
+	while (fread(&td, sizeof(td), 1, in) == 1) {
+		td.path[sizeof(td.path) - 1] = '\0';
+		td.name[sizeof(td.name) - 1] = '\0';
+		fprintf(out, "# %s: %s, %u entries\n",
+		    td.path, td.name, td.count);
+		for (i = 0; i < td.count; i++) {
+			if (fread(&te, sizeof(te), 1, in) != 1) {
+				errno = EFTYPE;
+				return (-1);
+			}
+			trace_decode_entry(out, &te);
+		}
+	}
+
+	return (ferror(in) ? -1 : 0);
+}
@@ -0,0 +1,117 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <sys/types.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define	TRACE_SIZE	1024	/* Entries per device, must be a power of 2 */
+#define	TRACE_MAGIC	"MSDTRACE"
+#define	TRACE_VERSION	1
+
+enum trace_point {
+	TRACE_NONE,
+	TRACE_EVENT,		/* evdev event: type, code, value */
+	TRACE_SYSMOUSE,		/* sysmouse packet: bytes 0-3, bytes 4-7 */
+	TRACE_TIMER,		/* timer expiration: 0 = E3B, 1 = gesture,
+				   2 = kinetic scroll, 3 = debounce */
+	TRACE_ABS,		/* touchpad state: x, y, pressure, width */
+	TRACE_GESTURE,		/* gesture decision: gesture, dx, dy,
+				   dz|dw in 1/120 of a line */
+	TRACE_E3B,		/* E3B transition: state, event, new state */
+	TRACE_BUTTONS,		/* decoded action: flags, button, obutton */
+	TRACE_ACTION,		/* mapped action: button, dx, dy, dz */
+	TRACE_MOTION,		/* console motion: x, y, z, buttons */
+	TRACE_CLICK,		/* console button: id, click count */
+	TRACE_WHEEL,		/* wheel output: dz, dw, hi-res dz, dw */
+};
+
+struct trace_entry {
+	uint64_t	ts;	/* CLOCK_MONOTONIC, nanoseconds */
+	uint32_t	point;
+	int32_t		arg[4];
+	uint32_t	pad;
+};
+
+/*
+ * Per-device ring of most recent pipeline trace points.  There is a
+ * single writer, the thread processing the device, so recording is an
+ * unlocked store into the next slot.  Dumps may run concurrently and
+ * use the sequence number to drop entries overwritten while copying.
+ */
+struct trace_ring {
+	atomic_uint_fast64_t seq;	/* entries ever recorded */
+	struct trace_entry ent[TRACE_SIZE];
+};
+
+/* Dump file layout: header, then a device record and entries per device */
+struct trace_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	entsize;
+};
+
+struct trace_device {
+	char		path[80];
+	char		name[80];
+	uint32_t	count;
+	uint32_t	pad;
+};
+
+static inline void
+trace(struct trace_ring *tr, enum trace_point point,
+    int32_t a0, int32_t a1, int32_t a2, int32_t a3)
+{
+	uint_fast64_t seq;
+	struct trace_entry *te;
+	struct timespec ts;
+
+	seq = atomic_load_explicit(&tr->seq, memory_order_relaxed);
+	te = &tr->ent[seq & (TRACE_SIZE - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	te->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	te->point = point;
+	te->arg[0] = a0;
+	te->arg[1] = a1;
+	te->arg[2] = a2;
+	te->arg[3] = a3;
+	atomic_store_explicit(&tr->seq, seq + 1, memory_order_release);
+}
+
+int	trace_write_header(FILE *fp);
+int	trace_write(FILE *fp, const char *path, const char *name,
+	    struct trace_ring *tr);
+int	trace_decode(FILE *in, FILE *out);
+
+#endif
@@ -112,6 +112,26 @@ libevdev_event_type_get_max(unsigned int type)
 	return ev_max[type];
 }
 
+const char *
+libevdev_event_type_get_name(unsigned int type)
+{
+	if (type > EV_MAX)
+		return NULL;
+
+	return ev_map[type];
+}
+
+const char *
+libevdev_event_code_get_name(unsigned int type, unsigned int code)
+{
+	int max = libevdev_event_type_get_max(type);
+
+	if (max == -1 || code > (unsigned int)max)
+		return NULL;
+
+	return event_type_map[type][code];
+}
+
 int
 libevdev_event_code_from_name(unsigned int type, const char *name)
 {
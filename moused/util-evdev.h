@@ -29,6 +29,8 @@
 
 int libevdev_event_code_from_name(unsigned int type, const char *name);
 int libevdev_event_type_get_max(unsigned int type);
+const char *libevdev_event_type_get_name(unsigned int type);
+const char *libevdev_event_code_get_name(unsigned int type, unsigned int code);
 int libevdev_event_type_from_name(const char *name);
 int libevdev_property_from_name(const char *name);
 
@@ -0,0 +1,67 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2025 Vladimir Kondratyev <wulf@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef UTIL_TIME_H
+#define UTIL_TIME_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <time.h>
+
+/* Operations on timespecs shared by moused and libmoused */
+#define	tsclr(tvp)		timespecclear(tvp)
+#define	tscmp(tvp, uvp, cmp)	timespeccmp(tvp, uvp, cmp)
+#define	tssub(tvp, uvp, vvp)	timespecsub(tvp, uvp, vvp)
+#define	msec2ts(msec)	(struct timespec) {			\
+	.tv_sec = (msec) / 1000,				\
+	.tv_nsec = (msec) % 1000 * 1000000,			\
+}
+
+static inline struct timespec
+tsaddms(struct timespec *tsp, u_int ms)
+{
+	struct timespec ret;
+
+	ret = msec2ts(ms);
+	timespecadd(tsp, &ret, &ret);
+
+	return (ret);
+}
+
+static inline struct timespec
+tssubms(struct timespec *tsp, u_int ms)
+{
+	struct timespec ret;
+
+	ret = msec2ts(ms);
+	timespecsub(tsp, &ret, &ret);
+
+	return (ret);
+}
+
+#endif